@@ -0,0 +1,459 @@
+//
+// libvm.c
+// Public interface for embedding the virtual memory manager
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+#include "../util/util.h"
+#include "../vm/vm.h"
+#include "../vad/vad.h"
+#include "../pt/pt.h"
+#include "../prefetch/prefetch.h"
+#include "../platform/platform.h"
+#include "../numa/numa.h"
+#include "libvm.h"
+
+#define SIZE_TO_PAGES(x)            (((x) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+//
+// Turn an address and size into the page range [start, end) it touches,
+// failing if any of it falls outside the managed VA.
+//
+static BOOL vaToPageRange(addressSpace* space, PVOID address, ULONG64 size, ULONG64* start, ULONG64* end) {
+    ULONG_PTR base = (ULONG_PTR) space->vaStart;
+    ULONG_PTR va = (ULONG_PTR) address;
+
+    if (size == 0 || va < base || va >= base + space->virtualAddressSize) {
+        return FALSE;
+    }
+
+    *start = (va - base) / PAGE_SIZE;
+    *end = SIZE_TO_PAGES(va - base + size);
+
+    return *end <= space->numPtes;
+}
+
+static PVOID pageToVa(addressSpace* space, ULONG64 page) {
+    return (PVOID) ((ULONG_PTR) space->vaStart + page * PAGE_SIZE);
+}
+
+//
+// Fold a node into its successor's neighbours when they belong to the same
+// reservation and ended up with the same state and advice.
+//
+static VOID coalesce(addressSpace* space, vad* node) {
+    vad* next;
+
+    while ((next = vadNext(space->vadRoot, node)) != NULL &&
+           next->startPage == node->endPage &&
+           next->allocationBase == node->allocationBase &&
+           next->state == node->state &&
+           next->advice == node->advice) {
+
+        vadRemove(&space->vadRoot, next);
+        vadRemove(&space->vadRoot, node);
+        node->endPage = next->endPage;
+        vadInsert(&space->vadRoot, node);
+        free(next);
+    }
+}
+
+//
+// Whether all of [start, end) is committed, in pieces of one reservation.
+//
+// The caller holds lockVad.
+//
+static BOOL isCommitted(addressSpace* space, ULONG64 start, ULONG64 end) {
+    vad* first = vadFind(space->vadRoot, start);
+    vad* node = first;
+
+    if (first == NULL || first->state != VAD_COMMITTED) {
+        return FALSE;
+    }
+
+    while (node->endPage < end) {
+        vad* next = vadNext(space->vadRoot, node);
+        if (next == NULL || next->startPage != node->endPage ||
+            next->allocationBase != first->allocationBase ||
+            next->state != VAD_COMMITTED) {
+            return FALSE;
+        }
+        node = next;
+    }
+
+    return TRUE;
+}
+
+//
+// Move [start, end) into the given state and/or advice (VAD_UNCHANGED leaves
+// that attribute alone).  The range has to lie within a single reservation,
+// just like VirtualAlloc/VirtualFree.
+//
+// The caller holds lockVad and lockPTE.
+//
+static BOOL setRange(addressSpace* space, ULONG64 start, ULONG64 end, ULONG state, ULONG advice) {
+    vad* first = vadFind(space->vadRoot, start);
+    vad* node = first;
+
+    if (first == NULL) {
+        return FALSE;
+    }
+
+    // Make sure the whole range is covered by pieces of one reservation
+    while (node->endPage < end) {
+        vad* next = vadNext(space->vadRoot, node);
+        if (next == NULL || next->startPage != node->endPage ||
+            next->allocationBase != first->allocationBase) {
+            return FALSE;
+        }
+        node = next;
+    }
+
+    // Cut the pieces at the range boundaries, then update all of them
+    if (first->startPage < start) {
+        first = vadSplit(&space->vadRoot, first, start);
+    }
+
+    node = first;
+    while (TRUE) {
+        if (node->endPage > end) {
+            vadSplit(&space->vadRoot, node, end);
+        }
+        if (state != VAD_UNCHANGED) {
+            node->state = state;
+        }
+        if (advice != VAD_UNCHANGED) {
+            node->advice = advice;
+        }
+        if (node->endPage == end) {
+            break;
+        }
+        node = vadNext(space->vadRoot, node);
+    }
+
+    // Merge back with whatever now matches on either side
+    vad* previous = start ? vadFind(space->vadRoot, start - 1) : NULL;
+    if (previous && previous->allocationBase == first->allocationBase) {
+        first = previous;
+    }
+    for (node = first; node != NULL && node->startPage <= end; node = vadNext(space->vadRoot, node)) {
+        coalesce(space, node);
+    }
+
+    return TRUE;
+}
+
+PVOID vmReserve(addressSpace* space, PVOID address, ULONG64 size) {
+    vmInstance* vm = space->vm;
+    ULONG64 start;
+    ULONG64 end;
+
+    acquireLock(&space->lockVad, USER);
+
+    if (address == NULL) {
+        start = vadFindGap(space->vadRoot, SIZE_TO_PAGES(size), space->numPtes);
+        end = start + SIZE_TO_PAGES(size);
+        if (size == 0 || start == space->numPtes) {
+            releaseLock(&space->lockVad, USER);
+            return NULL;
+        }
+    } else if (vaToPageRange(space, address, size, &start, &end) == FALSE ||
+               vadFirstOverlap(space->vadRoot, start, end) != NULL) {
+        releaseLock(&space->lockVad, USER);
+        return NULL;
+    }
+
+    vad* node = malloc(sizeof(vad));
+    ASSERT(node);
+    node->startPage = start;
+    node->endPage = end;
+    node->allocationBase = start;
+    node->state = VAD_RESERVED;
+    node->advice = VAD_ADVICE_NORMAL;
+
+    acquireLockPTE(vm, NULL, USER);
+    vadInsert(&space->vadRoot, node);
+    releaseLock(&vm->lockPTE, USER);
+
+    releaseLock(&space->lockVad, USER);
+
+    return pageToVa(space, start);
+}
+
+BOOL vmCommit(addressSpace* space, PVOID address, ULONG64 size) {
+    vmInstance* vm = space->vm;
+    ULONG64 start;
+    ULONG64 end;
+    BOOL committed;
+
+    if (vaToPageRange(space, address, size, &start, &end) == FALSE) {
+        return FALSE;
+    }
+
+    // Pages are demand zero, committing them is pure bookkeeping
+    acquireLock(&space->lockVad, USER);
+    acquireLockPTE(vm, NULL, USER);
+    committed = setRange(space, start, end, VAD_COMMITTED, VAD_UNCHANGED);
+    releaseLock(&vm->lockPTE, USER);
+    releaseLock(&space->lockVad, USER);
+
+    return committed;
+}
+
+BOOL vmDecommit(addressSpace* space, PVOID address, ULONG64 size) {
+    vmInstance* vm = space->vm;
+    ULONG64 start;
+    ULONG64 end;
+    BOOL decommitted;
+
+    if (vaToPageRange(space, address, size, &start, &end) == FALSE) {
+        return FALSE;
+    }
+
+    acquireLock(&space->lockVad, USER);
+    acquireLockPTE(vm, NULL, USER);
+    decommitted = setRange(space, start, end, VAD_RESERVED, VAD_UNCHANGED);
+    if (decommitted) {
+        decommitPtes(space, start, end);
+    }
+    releaseLock(&vm->lockPTE, USER);
+    releaseLock(&space->lockVad, USER);
+
+    // Frames came back, let anyone starved for pages retry
+    if (decommitted) {
+        SetEvent(vm->eventRedoFault);
+    }
+
+    return decommitted;
+}
+
+BOOL vmRelease(addressSpace* space, PVOID address) {
+    vmInstance* vm = space->vm;
+    ULONG64 start;
+    ULONG64 end;
+
+    if (vaToPageRange(space, address, PAGE_SIZE, &start, &end) == FALSE) {
+        return FALSE;
+    }
+
+    acquireLock(&space->lockVad, USER);
+
+    // Like VirtualFree, releasing takes the address the reservation started at
+    vad* node = vadFind(space->vadRoot, start);
+    if (node == NULL || node->allocationBase != start) {
+        releaseLock(&space->lockVad, USER);
+        return FALSE;
+    }
+
+    acquireLockPTE(vm, NULL, USER);
+    while (node != NULL && node->allocationBase == start) {
+        vad* next = vadNext(space->vadRoot, node);
+
+        if (node->state == VAD_COMMITTED) {
+            decommitPtes(space, node->startPage, node->endPage);
+        }
+        vadRemove(&space->vadRoot, node);
+        free(node);
+
+        node = next;
+    }
+    releaseLock(&vm->lockPTE, USER);
+
+    releaseLock(&space->lockVad, USER);
+
+    SetEvent(vm->eventRedoFault);
+
+    return TRUE;
+}
+
+BOOL vmAdvise(addressSpace* space, PVOID address, ULONG64 size, ULONG advice) {
+    vmInstance* vm = space->vm;
+    ULONG64 start;
+    ULONG64 end;
+    BOOL advised = TRUE;
+
+    if (vaToPageRange(space, address, size, &start, &end) == FALSE) {
+        return FALSE;
+    }
+
+    switch (advice) {
+
+    case VM_ADVISE_NORMAL:
+    case VM_ADVISE_SEQUENTIAL:
+    case VM_ADVISE_RANDOM:
+
+        //
+        // Access patterns stick to the range - the fault path reads them to
+        // decide on read-ahead and the trimmer to pick its victims.
+        //
+
+        acquireLock(&space->lockVad, USER);
+        acquireLockPTE(vm, NULL, USER);
+        advised = setRange(space, start, end, VAD_UNCHANGED,
+                           advice == VM_ADVISE_SEQUENTIAL ? VAD_ADVICE_SEQUENTIAL :
+                           advice == VM_ADVISE_RANDOM ? VAD_ADVICE_RANDOM : VAD_ADVICE_NORMAL);
+        releaseLock(&vm->lockPTE, USER);
+        releaseLock(&space->lockVad, USER);
+        break;
+
+    case VM_ADVISE_WILLNEED:
+
+        // Only pages out on the pagefile have anything worth reading early
+        queuePrefetch(space, start, end, STANDBY_PRIORITY_WILLNEED);
+        break;
+
+    case VM_ADVISE_DONTNEED:
+
+        // Contents are thrown away, the next touch sees a fresh zero page
+        acquireLock(&space->lockVad, USER);
+        advised = isCommitted(space, start, end);
+        if (advised) {
+            acquireLockPTE(vm, NULL, USER);
+            decommitPtes(space, start, end);
+            releaseLock(&vm->lockPTE, USER);
+        }
+        releaseLock(&space->lockVad, USER);
+        if (advised) {
+            SetEvent(vm->eventRedoFault);
+        }
+        break;
+
+    case VM_ADVISE_FREE:
+
+        // Contents survive until the frame is repurposed but never get written
+        acquireLock(&space->lockVad, USER);
+        advised = isCommitted(space, start, end);
+        if (advised) {
+            acquireLockPTE(vm, NULL, USER);
+            discardPtes(space, start, end);
+            releaseLock(&vm->lockPTE, USER);
+        }
+        releaseLock(&space->lockVad, USER);
+        if (advised) {
+            SetEvent(vm->eventRedoFault);
+        }
+        break;
+
+    default:
+        advised = FALSE;
+        break;
+    }
+
+    return advised;
+}
+
+threadInfo* vmAttachThread(vmInstance* vm) {
+    threadInfo* info = initialize(sizeof(threadInfo));
+
+    info->index = InterlockedIncrement(&vm->nextThreadIndex) - 1;
+    info->vm = vm;
+
+    // Wherever the thread is now, it can be put elsewhere afterwards
+    info->node = vm->platform->simulated ? 0 : numaCurrentNode() % vm->nodeCount;
+    info->transferVa = vm->platform->reserve(vm, TRANSFER_WINDOW_PAGES);
+    ASSERT(info->transferVa);
+
+    info->latency = initialize(sizeof(faultLatency));
+    LIST_ENTRY* entry = &info->latency->entry;
+    acquireLock(&vm->lockLatency, USER);
+    entry->Flink = &vm->headLatency;
+    entry->Blink = vm->headLatency.Blink;
+    vm->headLatency.Blink->Flink = entry;
+    vm->headLatency.Blink = entry;
+    releaseLock(&vm->lockLatency, USER);
+
+    return info;
+}
+
+VOID vmDetachThread(threadInfo* info) {
+    vmInstance* vm = info->vm;
+
+    // Keep what this thread saw for the instance totals
+    LIST_ENTRY* entry = &info->latency->entry;
+    acquireLock(&vm->lockLatency, USER);
+    entry->Blink->Flink = entry->Flink;
+    entry->Flink->Blink = entry->Blink;
+    latencyMerge(vm->retiredLatency, info->latency);
+    releaseLock(&vm->lockLatency, USER);
+
+    transferFlush(info);
+    vm->platform->release(vm, info->transferVa);
+    free(info->latency);
+    free(info);
+}
+
+//
+// Fault latency across every thread that ever attached, live ones included
+//
+VOID vmGetFaultLatency(vmInstance* vm, faultLatency* merged) {
+    memset(merged, 0, sizeof(faultLatency));
+
+    acquireLock(&vm->lockLatency, USER);
+    latencyMerge(merged, vm->retiredLatency);
+    for (LIST_ENTRY* entry = vm->headLatency.Flink; entry != &vm->headLatency; entry = entry->Flink) {
+        latencyMerge(merged, CONTAINING_RECORD(entry, faultLatency, entry));
+    }
+    releaseLock(&vm->lockLatency, USER);
+}
+
+//
+// The estimated miss ratio curve at MRC_POINTS multiples of the pool as it
+// is now, and the number of references behind it - 0 if nothing has been
+// tracked yet or vmConfig.mrcSamples turned tracking off
+//
+ULONG64 vmGetMissRatioCurve(vmInstance* vm, mrcPoint* points) {
+    return mrcCurve(&vm->mrc, vm->physicalPageCount, points);
+}
+
+//
+// The fraction of faulting references that would still miss with a pool
+// of this many frames
+//
+double vmEstimateMissRatio(vmInstance* vm, ULONG64 pages) {
+    return mrcMissRatio(&vm->mrc, pages);
+}
+
+//
+// Resolve a fault on va, waiting for pages if we have to.  Returns FALSE if
+// va is not in a committed range so the caller can raise its own error.
+//
+BOOL vmResolveFault(threadInfo* info, PVOID va) {
+    addressSpace* space = vmFindAddressSpace(info->vm, va);
+    BOOL status;
+
+    if (space == NULL) {
+        return FALSE;
+    }
+
+    do {
+        status = pageFaultHandler(space, va, info);
+    } while (status == REDO);
+
+    return status == SUCCESS;
+}
+
+LONG vmExceptionFilter(threadInfo* info, EXCEPTION_POINTERS* pointers) {
+    EXCEPTION_RECORD* record = pointers->ExceptionRecord;
+
+    if (record->ExceptionCode != EXCEPTION_ACCESS_VIOLATION || record->NumberParameters < 2) {
+        return EXCEPTION_CONTINUE_SEARCH;
+    }
+
+    // ExceptionInformation[1] is the address that faulted
+    if (vmResolveFault(info, (PVOID) record->ExceptionInformation[1])) {
+        return EXCEPTION_CONTINUE_EXECUTION;
+    }
+
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+
+//
+// Run one queued trim, write or prefetch task on the calling thread - for
+// a service thread with nothing better to do.  It must not be inside a
+// fault.  Returns FALSE when nothing was queued.
+//
+BOOL vmHelpBackground(vmInstance* vm) {
+    return schedulerHelp(&vm->sched, TASK_PRIORITY_LOW);
+}
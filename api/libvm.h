@@ -0,0 +1,64 @@
+//
+// libvm.h
+// Public interface for embedding the virtual memory manager
+//
+// A service creates an instance with vmCreate, gives each tenant an address
+// space with vmCreateAddressSpace, carves those up with vmReserve/vmCommit,
+// and resolves faults on them by attaching each of its threads and wrapping
+// accesses with vmExceptionFilter :
+//
+//     threadInfo* info = vmAttachThread(vm);
+//
+//     __try {
+//         *p = value;
+//     } __except (vmExceptionFilter(info, GetExceptionInformation())) {
+//         // p was not committed
+//     }
+//
+
+#ifndef LIBVM_H
+#define LIBVM_H
+
+#include <windows.h>
+#include "../vm/vm.h"
+#include "../pool/pool.h"
+#include "../snap/snap.h"
+
+//
+// Hints for vmAdvise, modelled on madvise :
+//
+// NORMAL/SEQUENTIAL/RANDOM stick to the range.  SEQUENTIAL reads ahead of
+// hard faults and puts the pages first in each trim batch, RANDOM turns
+// read-ahead off and makes the pages the trimmer's last choice.
+//
+// WILLNEED starts paging the range in asynchronously.  DONTNEED throws the
+// contents away right now.  FREE lets the pages be reclaimed without ever
+// being written to the pagefile - until then their contents are still there.
+// Both fail unless the whole range is committed, in one reservation.
+//
+#define VM_ADVISE_NORMAL            0
+#define VM_ADVISE_WILLNEED          1
+#define VM_ADVISE_DONTNEED          2
+#define VM_ADVISE_FREE              3
+#define VM_ADVISE_SEQUENTIAL        4
+#define VM_ADVISE_RANDOM            5
+
+//
+// Function declarations
+//
+PVOID vmReserve(addressSpace* space, PVOID address, ULONG64 size);
+BOOL vmCommit(addressSpace* space, PVOID address, ULONG64 size);
+BOOL vmDecommit(addressSpace* space, PVOID address, ULONG64 size);
+BOOL vmRelease(addressSpace* space, PVOID address);
+BOOL vmAdvise(addressSpace* space, PVOID address, ULONG64 size, ULONG advice);
+
+threadInfo* vmAttachThread(vmInstance* vm);
+VOID vmDetachThread(threadInfo* info);
+BOOL vmResolveFault(threadInfo* info, PVOID va);
+LONG vmExceptionFilter(threadInfo* info, EXCEPTION_POINTERS* pointers);
+BOOL vmHelpBackground(vmInstance* vm);
+VOID vmGetFaultLatency(vmInstance* vm, faultLatency* merged);
+ULONG64 vmGetMissRatioCurve(vmInstance* vm, mrcPoint* points);
+double vmEstimateMissRatio(vmInstance* vm, ULONG64 pages);
+
+#endif // LIBVM_H
@@ -0,0 +1,547 @@
+//
+// bench.c
+// Benchmark report
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+#include "../vm/vm.h"
+#include "../util/util.h"
+#include "../pt/pt.h"
+#include "../list/list.h"
+#include "../diskWrite/diskWrite.h"
+#include "bench.h"
+
+static VOID writeSummary(FILE* out, const char* name, const latencySummary* summary, BOOL last) {
+    fprintf(out, "      \"%s\": { \"count\": %llu, \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu }%s\n",
+            name,
+            summary->count,
+            summary->p50,
+            summary->p99,
+            summary->p999,
+            summary->max,
+            last ? "" : ",");
+}
+
+static VOID writeStartup(FILE* out, const startupTimes* startup) {
+    fprintf(out, "{ ");
+    for (ULONG p = 0; p < STARTUP_PHASES; p++) {
+        fprintf(out, "\"%s\": %llu, ", latencyStartupName(p), startup->us[p]);
+    }
+    fprintf(out, "\"total\": %llu }", startup->totalUs);
+}
+
+// Which PFN layout this was built with, see VM_COMPACT_PFN
+static VOID writeLayout(FILE* out) {
+    fprintf(out, "    \"pfnLayout\": \"%s\",\n", VM_COMPACT_PFN ? "compact" : "standard");
+    fprintf(out, "    \"pfnBytes\": %u,\n", (ULONG) sizeof(pfn));
+}
+
+static VOID writeKernel(FILE* out) {
+    BOOL stream;
+    ULONG kernel = pageKernelCurrent(&stream);
+
+    fprintf(out, "    \"pageKernel\": \"%s\",\n", pageKernelGet(kernel)->name);
+    fprintf(out, "    \"pageStream\": %s,\n", stream ? "true" : "false");
+}
+
+static double perSecond(ULONG64 count, ULONG64 elapsedMs) {
+    return elapsedMs ? count * 1000.0 / elapsedMs : 0;
+}
+
+//
+// One JSON object per run so results can be collected and compared by
+// scripts - the configuration that produced it first, then the numbers.
+//
+VOID benchWriteJson(FILE* out, const vmConfig* config, const benchResult* result) {
+    const workloadConfig* workload = &config->workload;
+    ULONG64 faults = result->hardFaults + result->softFaults + result->demandZeroFaults;
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\n");
+    fprintf(out, "    \"virtualAddressSize\": %llu,\n", config->virtualAddressSize);
+    fprintf(out, "    \"physicalPages\": %llu,\n", config->physicalPages);
+    fprintf(out, "    \"diskSizeInPages\": %llu,\n", config->diskSizeInPages);
+    fprintf(out, "    \"trimBatchSize\": %llu,\n", config->trimBatchSize);
+    fprintf(out, "    \"writeBatchSize\": %llu,\n", config->writeBatchSize);
+    fprintf(out, "    \"workerThreads\": %u,\n", config->workerThreads);
+    fprintf(out, "    \"writerThreads\": %u,\n", config->writerThreads);
+    fprintf(out, "    \"fibersPerThread\": %u,\n", config->fibersPerThread);
+    fprintf(out, "    \"largePages\": %llu,\n", config->largePages);
+    fprintf(out, "    \"numaNodes\": %u,\n", config->numaNodes);
+    fprintf(out, "    \"snapshotAt\": %llu,\n", config->snapshotAt);
+    fprintf(out, "    \"addressSpaces\": %u,\n", config->addressSpaces);
+    writeLayout(out);
+    writeKernel(out);
+    fprintf(out, "    \"userThreads\": %u,\n", config->userThreads);
+    fprintf(out, "    \"accessesPerThread\": %llu\n", config->accessesPerThread);
+    fprintf(out, "  },\n");
+    fprintf(out, "  \"workload\": {\n");
+    fprintf(out, "    \"pattern\": \"%s\",\n", workloadPatternName(workload->pattern));
+    fprintf(out, "    \"zipfSkew\": %.4f,\n", workload->zipfSkew);
+    fprintf(out, "    \"stridePages\": %llu,\n", workload->stridePages);
+    fprintf(out, "    \"hotSetPages\": %llu,\n", workload->hotSetPages);
+    fprintf(out, "    \"phaseAccesses\": %llu,\n", workload->phaseAccesses);
+    fprintf(out, "    \"writePercent\": %u,\n", workload->writePercent);
+    fprintf(out, "    \"seed\": %llu\n", workload->seed);
+    fprintf(out, "  },\n");
+    fprintf(out, "  \"results\": {\n");
+    fprintf(out, "    \"elapsedMs\": %llu,\n", result->elapsedMs);
+    fprintf(out, "    \"accesses\": %llu,\n", result->accesses);
+    fprintf(out, "    \"reads\": %llu,\n", result->reads);
+    fprintf(out, "    \"writes\": %llu,\n", result->writes);
+    fprintf(out, "    \"hardFaults\": %llu,\n", result->hardFaults);
+    fprintf(out, "    \"softFaults\": %llu,\n", result->softFaults);
+    fprintf(out, "    \"demandZeroFaults\": %llu,\n", result->demandZeroFaults);
+    fprintf(out, "    \"largeFaults\": %llu,\n", result->largeFaults);
+    fprintf(out, "    \"largePromotions\": %llu,\n", result->largePromotions);
+    fprintf(out, "    \"largeDemotions\": %llu,\n", result->largeDemotions);
+    fprintf(out, "    \"localFaults\": %llu,\n", result->localFaults);
+    fprintf(out, "    \"remoteFaults\": %llu,\n", result->remoteFaults);
+    fprintf(out, "    \"remoteAccesses\": %llu,\n", result->remoteAccesses);
+    fprintf(out, "    \"snapshotPages\": %llu,\n", result->snapshotPages);
+    fprintf(out, "    \"sharedFaults\": %llu,\n", result->sharedFaults);
+    fprintf(out, "    \"sharedCopies\": %llu,\n", result->sharedCopies);
+    fprintf(out, "    \"accessesPerSecond\": %.1f,\n", perSecond(result->accesses, result->elapsedMs));
+    fprintf(out, "    \"hardFaultsPerSecond\": %.1f,\n", perSecond(result->hardFaults, result->elapsedMs));
+    fprintf(out, "    \"softFaultsPerSecond\": %.1f,\n", perSecond(result->softFaults, result->elapsedMs));
+    fprintf(out, "    \"faultRate\": %.6f,\n", result->accesses ? (double) faults / result->accesses : 0);
+
+    // Latencies are in nanoseconds
+    fprintf(out, "    \"faultLatency\": {\n");
+    for (ULONG k = 0; k < FAULT_KINDS; k++) {
+        writeSummary(out, latencyKindName(k), &result->faultKinds[k], FALSE);
+    }
+    fprintf(out, "      \"phases\": {\n");
+    for (ULONG p = 0; p < FAULT_PHASES; p++) {
+        fprintf(out, "  ");
+        writeSummary(out, latencyPhaseName(p), &result->faultPhases[p], p + 1 == FAULT_PHASES);
+    }
+    fprintf(out, "      }\n");
+    fprintf(out, "    },\n");
+
+    fprintf(out, "    \"startupUs\": ");
+    writeStartup(out, &result->startup);
+    fprintf(out, ",\n");
+
+    // Estimated miss ratio with other pool sizes, empty when not tracked
+    fprintf(out, "    \"mrcReferences\": %llu,\n", result->mrcReferences);
+    fprintf(out, "    \"missRatioCurve\": [");
+    for (ULONG p = 0; result->mrcReferences != 0 && p < MRC_POINTS; p++) {
+        fprintf(out, "%s\n      { \"pages\": %llu, \"missRatio\": %.6f }",
+                p ? "," : "",
+                result->mrc[p].pages,
+                result->mrc[p].missRatio);
+    }
+    fprintf(out, result->mrcReferences != 0 ? "\n    ]\n" : "]\n");
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+}
+
+//
+// Creating and destroying instances over and over, for how long startup
+// takes at a given pool size and where that time goes.  Every run is
+// reported, then the minimum and mean of each phase.
+//
+VOID benchWriteStartupJson(FILE* out, const vmConfig* config, const startupTimes* runs, ULONG count) {
+    startupTimes minimum;
+    startupTimes mean;
+
+    memset(&mean, 0, sizeof(startupTimes));
+    memset(&minimum, 0xFF, sizeof(startupTimes));
+
+    for (ULONG r = 0; r < count; r++) {
+        for (ULONG p = 0; p < STARTUP_PHASES; p++) {
+            minimum.us[p] = min(minimum.us[p], runs[r].us[p]);
+            mean.us[p] += runs[r].us[p];
+        }
+        minimum.totalUs = min(minimum.totalUs, runs[r].totalUs);
+        mean.totalUs += runs[r].totalUs;
+    }
+    for (ULONG p = 0; count != 0 && p < STARTUP_PHASES; p++) {
+        mean.us[p] /= count;
+    }
+    if (count != 0) {
+        mean.totalUs /= count;
+    } else {
+        memset(&minimum, 0, sizeof(startupTimes));
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\n");
+    fprintf(out, "    \"virtualAddressSize\": %llu,\n", config->virtualAddressSize);
+    fprintf(out, "    \"physicalPages\": %llu,\n", config->physicalPages);
+    fprintf(out, "    \"diskSizeInPages\": %llu,\n", config->diskSizeInPages);
+    fprintf(out, "    \"addressSpaces\": %u\n", config->addressSpaces);
+    fprintf(out, "  },\n");
+
+    // In microseconds
+    fprintf(out, "  \"startup\": {\n");
+    fprintf(out, "    \"runs\": [");
+    for (ULONG r = 0; r < count; r++) {
+        fprintf(out, "%s\n      ", r ? "," : "");
+        writeStartup(out, &runs[r]);
+    }
+    fprintf(out, count != 0 ? "\n    ],\n" : "],\n");
+    fprintf(out, "    \"min\": ");
+    writeStartup(out, &minimum);
+    fprintf(out, ",\n    \"mean\": ");
+    writeStartup(out, &mean);
+    fprintf(out, "\n  }\n");
+    fprintf(out, "}\n");
+}
+
+static double nanosecondsPer(ULONG64 ticks, ULONG64 count) {
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceFrequency(&frequency);
+    return count ? ticks * 1e9 / frequency.QuadPart / count : 0;
+}
+
+//
+// Time the list operations paging is built on against the free list of an
+// instance nothing has run on yet, so every frame is on it.  The frames
+// are moved the way trimming and writing move them, taken out of the
+// middle the way rescues take them and then walked, by which time they
+// are scattered.  Everything ends up back on the free list.
+//
+VOID benchLists(vmInstance* vm, ULONG64 rounds, listBenchResult* result) {
+    ULONG64 pages = vm->physicalPageCount;
+    ULONG64 random = 0x9E3779B97F4A7C15ULL;
+    ULONG64 moveTicks = 0;
+    ULONG64 removeTicks = 0;
+    ULONG64 walkTicks = 0;
+    ULONG64 links = 0;
+    ULONG64 start;
+    pfn* page;
+
+    memset(result, 0, sizeof(listBenchResult));
+    result->pages = pages;
+    result->rounds = rounds;
+
+    acquireLock(&vm->lockFreeList, USER);
+    acquireLock(&vm->lockModifiedList, USER);
+
+    for (ULONG64 r = 0; r < rounds; r++) {
+        // Statuses are set by hand so the gauges are left alone
+        start = latencyNow();
+        while ((page = freeListRemove(vm, 0)) != NULL) {
+            page->status = MODIFIED;
+            linkAdd(vm, page, &vm->headModifiedList);
+        }
+        while ((page = linkRemoveHead(vm, &vm->headModifiedList)) != NULL) {
+            page->status = FREE;
+            freeListAdd(vm, page);
+        }
+        moveTicks += latencyNow() - start;
+
+        start = latencyNow();
+        for (ULONG64 i = 0; i < pages; i++) {
+            random ^= random << 13;
+            random ^= random >> 7;
+            random ^= random << 17;
+            page = frameNumber2pfn(vm, vm->physicalPageNumbers[random % pages]);
+            linkRemovePFN(vm, page);
+            freeListAdd(vm, page);
+        }
+        removeTicks += latencyNow() - start;
+
+        start = latencyNow();
+        for (ULONG n = 0; n < vm->nodeCount; n++) {
+            links += linkCount(vm, &vm->headFreeList[n]);
+        }
+        walkTicks += latencyNow() - start;
+    }
+
+    releaseLock(&vm->lockModifiedList, USER);
+    releaseLock(&vm->lockFreeList, USER);
+
+    ASSERT(links == pages * rounds);
+
+    result->moveNs = nanosecondsPer(moveTicks, 2 * pages * rounds);
+    result->removeNs = nanosecondsPer(removeTicks, pages * rounds);
+    result->walkNs = nanosecondsPer(walkTicks, links);
+}
+
+VOID benchWriteListJson(FILE* out, const vmConfig* config, const listBenchResult* result) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\n");
+    fprintf(out, "    \"physicalPages\": %llu,\n", config->physicalPages);
+    writeLayout(out);
+    fprintf(out, "    \"rounds\": %llu\n", result->rounds);
+    fprintf(out, "  },\n");
+
+    // Nanoseconds per page
+    fprintf(out, "  \"lists\": {\n");
+    fprintf(out, "    \"pages\": %llu,\n", result->pages);
+    fprintf(out, "    \"moveNs\": %.2f,\n", result->moveNs);
+    fprintf(out, "    \"removeNs\": %.2f,\n", result->removeNs);
+    fprintf(out, "    \"walkNs\": %.2f\n", result->walkNs);
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+}
+
+// Reads one ULONG64 from every cache line, returning the time per line
+static double readVictim(volatile ULONG64* victim) {
+    ULONG64 start = latencyNow();
+
+    for (ULONG64 i = 0; i < PAGE_BENCH_VICTIM_BYTES / sizeof(ULONG64); i += 64 / sizeof(ULONG64)) {
+        (VOID) victim[i];
+    }
+    return nanosecondsPer(latencyNow() - start, PAGE_BENCH_VICTIM_BYTES / 64);
+}
+
+//
+// Zero and copy pages pages with every kernel the machine has, through the
+// cache and streaming, into results.  Returns how many results there are.
+// The buffers are bigger than the cache when pages is, so every kernel
+// sees cold sources like the pipeline does.
+//
+ULONG benchPageKernels(ULONG64 pages, pageBenchResult* results, double* victimBaselineNs) {
+    PUCHAR from = initializeLazy(pages * PAGE_SIZE);
+    PUCHAR to = initializeLazy(pages * PAGE_SIZE);
+    volatile ULONG64* victim = initializeLazy(PAGE_BENCH_VICTIM_BYTES);
+    ULONG64 batches = max(1, pages / PAGE_BENCH_BATCH_PAGES);
+    ULONG count = 0;
+
+    // Fault everything in first so no kernel pays for it
+    memset(from, 1, pages * PAGE_SIZE);
+    memset(to, 1, pages * PAGE_SIZE);
+    readVictim(victim);
+
+    *victimBaselineNs = 0;
+    for (ULONG64 b = 0; b < batches; b++) {
+        readVictim(victim);
+        *victimBaselineNs += readVictim(victim) / batches;
+    }
+
+    for (ULONG k = 0; k < PAGE_KERNELS; k++) {
+        const pageKernel* kernel = pageKernelGet(k);
+
+        if (pageKernelSupported(k) == FALSE) {
+            continue;
+        }
+
+        // memset and memcpy have no say in how they store
+        for (ULONG s = 0; s < (k == PAGE_KERNEL_SCALAR ? 1 : 2); s++) {
+            pageBenchResult* result = &results[count++];
+            ULONG64 start;
+
+            result->kernel = k;
+            result->stream = s != 0;
+
+            start = latencyNow();
+            for (ULONG64 p = 0; p < pages; p++) {
+                kernel->zero(to + p * PAGE_SIZE, result->stream);
+            }
+            result->zeroNs = nanosecondsPer(latencyNow() - start, pages);
+
+            start = latencyNow();
+            for (ULONG64 p = 0; p < pages; p++) {
+                kernel->copy(to + p * PAGE_SIZE, from + p * PAGE_SIZE, result->stream);
+            }
+            result->copyNs = nanosecondsPer(latencyNow() - start, pages);
+
+            result->victimNs = 0;
+            for (ULONG64 b = 0; b < batches; b++) {
+                ULONG64 first = (b * PAGE_BENCH_BATCH_PAGES) % pages;
+                ULONG64 batch = min(PAGE_BENCH_BATCH_PAGES, pages - first);
+
+                readVictim(victim);
+                for (ULONG64 p = first; p < first + batch; p++) {
+                    kernel->copy(to + p * PAGE_SIZE, from + p * PAGE_SIZE, result->stream);
+                }
+                result->victimNs += readVictim(victim) / batches;
+            }
+        }
+    }
+
+    freeLazy(from);
+    freeLazy(to);
+    freeLazy((PVOID) victim);
+    return count;
+}
+
+VOID benchWritePageJson(FILE* out, ULONG64 pages, const pageBenchResult* results, ULONG count, double victimBaselineNs) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\n");
+    fprintf(out, "    \"pages\": %llu,\n", pages);
+    fprintf(out, "    \"batchPages\": %u,\n", PAGE_BENCH_BATCH_PAGES);
+    fprintf(out, "    \"victimBytes\": %u,\n", PAGE_BENCH_VICTIM_BYTES);
+    fprintf(out, "    \"best\": \"%s\"\n", pageKernelGet(pageKernelBest())->name);
+    fprintf(out, "  },\n");
+
+    // Nanoseconds per page, and per line of the working set
+    fprintf(out, "  \"victimBaselineNs\": %.2f,\n", victimBaselineNs);
+    fprintf(out, "  \"kernels\": [");
+    for (ULONG r = 0; r < count; r++) {
+        fprintf(out, "%s\n    { \"kernel\": \"%s\", \"stream\": %s, \"zeroNs\": %.1f, \"copyNs\": %.1f, \"victimNs\": %.2f }",
+                r ? "," : "",
+                pageKernelGet(results[r].kernel)->name,
+                results[r].stream ? "true" : "false",
+                results[r].zeroNs,
+                results[r].copyNs,
+                results[r].victimNs);
+    }
+    fprintf(out, count != 0 ? "\n  ]\n" : "]\n");
+    fprintf(out, "}\n");
+}
+
+//
+// Put pages frames of a new instance straight on the modified list, as if
+// trimmed, wake the writer and time how long the writers take to get them
+// all to standby.  The frames have no PTE, nothing but the writers looks
+// at them before the instance is destroyed.
+//
+static BOOL benchWriterRun(const vmConfig* config, ULONG64 pages, writerBenchResult* result) {
+    vmInstance* vm = vmCreate(config);
+    LONG64 written;
+    ULONG64 start;
+    pfn* page;
+
+    if (vm == NULL) {
+        return FALSE;
+    }
+
+    memset(result, 0, sizeof(writerBenchResult));
+    result->writers = config->writerThreads;
+    result->pages = min(pages, min(vm->physicalPageCount, config->diskSizeInPages - 1));
+
+    acquireLockPTE(vm, NULL, USER);
+    acquireLock(&vm->lockFreeList, USER);
+    acquireLock(&vm->lockModifiedList, USER);
+    for (ULONG64 i = 0; i < result->pages; i++) {
+        page = freeListRemove(vm, 0);
+        page->priority = STANDBY_PRIORITY_NORMAL;
+        pageSetStatus(vm, page, MODIFIED);
+        linkAdd(vm, page, &vm->headModifiedList);
+    }
+    releaseLock(&vm->lockModifiedList, USER);
+    releaseLock(&vm->lockFreeList, USER);
+    releaseLock(&vm->lockPTE, USER);
+
+    written = statsRead(&vm->stats, STAT_PAGES_WRITTEN);
+    start = latencyNow();
+    writersSignal(vm);
+
+    while (statsRead(&vm->stats, STAT_PAGES_WRITTEN) - written < (LONG64) result->pages) {
+        result->peakActive = max(result->peakActive, (ULONG) vm->writersActive);
+        Sleep(0);
+    }
+
+    result->ms = latencyMicroseconds(latencyNow() - start) / 1000.0;
+    result->pagesPerSecond = result->ms != 0 ? result->pages * 1000.0 / result->ms : 0;
+
+    vmDestroy(vm);
+    return TRUE;
+}
+
+//
+// Sweep the writer count from 1 to config->writerThreads.  Returns how
+// many results there are.
+//
+ULONG benchWriters(const vmConfig* config, ULONG64 pages, writerBenchResult* results) {
+    ULONG count = 0;
+
+    for (ULONG w = 1; w <= config->writerThreads; w++) {
+        vmConfig sized = *config;
+
+        sized.writerThreads = w;
+        if (benchWriterRun(&sized, pages, &results[count]) == FALSE) {
+            break;
+        }
+        count++;
+    }
+    return count;
+}
+
+//
+// Sweep the fibers per thread from none up to maxFibers.  Returns how many
+// results there are.
+//
+ULONG benchFibers(const vmConfig* config, ULONG maxFibers, fiberBenchResult* results) {
+    ULONG count = 0;
+
+    for (ULONG fibers = 0; fibers <= maxFibers && count < FIBER_BENCH_RUNS; fibers = fibers ? fibers * 2 : 1) {
+        vmConfig sized = *config;
+        fiberBenchResult* result = &results[count];
+        benchResult run;
+
+        sized.fibersPerThread = fibers;
+        sized.accessesPerThread = max(config->accessesPerThread / max(fibers, 1), 1);
+        if (full_virtual_memory_test(&sized, &run) == FALSE) {
+            break;
+        }
+
+        result->fibers = fibers;
+        result->tasks = config->userThreads * max(fibers, 1);
+        result->accesses = run.accesses;
+        result->elapsedMs = run.elapsedMs;
+        result->accessesPerSecond = perSecond(run.accesses, run.elapsedMs);
+        result->hardFaults = run.hardFaults;
+        result->hard = run.faultKinds[FAULT_HARD];
+        result->parks = run.fiberParks;
+        result->switches = run.fiberSwitches;
+        count++;
+    }
+    return count;
+}
+
+VOID benchWriteFiberJson(FILE* out, const vmConfig* config, const fiberBenchResult* results, ULONG count) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\n");
+    fprintf(out, "    \"virtualAddressSize\": %llu,\n", config->virtualAddressSize);
+    fprintf(out, "    \"physicalPages\": %llu,\n", config->physicalPages);
+    fprintf(out, "    \"workerThreads\": %u,\n", config->workerThreads);
+    fprintf(out, "    \"pattern\": \"%s\",\n", workloadPatternName(config->workload.pattern));
+    fprintf(out, "    \"userThreads\": %u,\n", config->userThreads);
+    fprintf(out, "    \"accessesPerThread\": %llu\n", config->accessesPerThread);
+    fprintf(out, "  },\n");
+
+    // Latencies are in nanoseconds
+    fprintf(out, "  \"fibers\": [");
+    for (ULONG r = 0; r < count; r++) {
+        fprintf(out, "%s\n    { \"fibersPerThread\": %u, \"tasks\": %u, \"accesses\": %llu, \"elapsedMs\": %llu, "
+                "\"accessesPerSecond\": %.1f, \"hardFaults\": %llu, \"hardP50\": %llu, \"hardP99\": %llu, "
+                "\"parks\": %llu, \"switches\": %llu }",
+                r ? "," : "",
+                results[r].fibers,
+                results[r].tasks,
+                results[r].accesses,
+                results[r].elapsedMs,
+                results[r].accessesPerSecond,
+                results[r].hardFaults,
+                results[r].hard.p50,
+                results[r].hard.p99,
+                results[r].parks,
+                results[r].switches);
+    }
+    fprintf(out, count != 0 ? "\n  ]\n" : "]\n");
+    fprintf(out, "}\n");
+}
+
+VOID benchWriteWriterJson(FILE* out, const vmConfig* config, const writerBenchResult* results, ULONG count) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\n");
+    fprintf(out, "    \"physicalPages\": %llu,\n", config->physicalPages);
+    fprintf(out, "    \"diskSizeInPages\": %llu,\n", config->diskSizeInPages);
+    fprintf(out, "    \"writeBatchSize\": %llu,\n", config->writeBatchSize);
+    fprintf(out, "    \"writeBuffers\": %u,\n", WRITE_BUFFERS);
+    writeKernel(out);
+    fprintf(out, "    \"writerThreads\": %u\n", config->writerThreads);
+    fprintf(out, "  },\n");
+
+    fprintf(out, "  \"writers\": [");
+    for (ULONG r = 0; r < count; r++) {
+        fprintf(out, "%s\n    { \"writers\": %u, \"peakActive\": %u, \"pages\": %llu, \"ms\": %.2f, \"pagesPerSecond\": %.0f }",
+                r ? "," : "",
+                results[r].writers,
+                results[r].peakActive,
+                results[r].pages,
+                results[r].ms,
+                results[r].pagesPerSecond);
+    }
+    fprintf(out, count != 0 ? "\n  ]\n" : "]\n");
+    fprintf(out, "}\n");
+}
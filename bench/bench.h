@@ -0,0 +1,85 @@
+//
+// bench.h
+// Benchmark report declarations
+//
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <windows.h>
+#include "../vm/vm.h"
+#include "workload.h"
+#include "../pagecopy/pagecopy.h"
+
+//
+// List operations on the PFN database, in nanoseconds per page
+//
+typedef struct {
+    ULONG64 pages;
+    ULONG64 rounds;
+    double moveNs;                  // Off the head of one list onto the tail of another
+    double removeNs;                // Out of the middle of a list and back onto its tail
+    double walkNs;                  // Following one link
+} listBenchResult;
+
+//
+// The page kernels, each through the cache and around it.  After every
+// batch of copies a working set that was warm before it is read again, so
+// what the copies pushed out of the cache shows up as time.
+//
+#define PAGE_BENCH_VICTIM_BYTES     (512 * 1024)
+#define PAGE_BENCH_BATCH_PAGES      128
+
+typedef struct {
+    ULONG kernel;
+    BOOL stream;
+    double zeroNs;                  // Per page
+    double copyNs;
+    double victimNs;                // Per line of the working set read after a batch
+} pageBenchResult;
+
+//
+// A modified backlog drained by 1 up to writerThreads writers, in a fresh
+// instance each time
+//
+typedef struct {
+    ULONG writers;                  // Allowed to run
+    ULONG peakActive;               // Most seen running at once
+    ULONG64 pages;
+    double ms;
+    double pagesPerSecond;
+} writerBenchResult;
+
+//
+// The built-in test with each thread running its users one per fiber, at
+// every power of two from plain threads up to a most fibers per thread.
+// The accesses are split between the users so every run makes as many,
+// each in a fresh instance.
+//
+#define FIBER_BENCH_RUNS            12
+
+typedef struct {
+    ULONG fibers;                   // Per thread, 0 for plain threads
+    ULONG tasks;                    // Users in all
+    ULONG64 accesses;
+    ULONG64 elapsedMs;
+    double accessesPerSecond;
+    ULONG64 hardFaults;
+    latencySummary hard;            // Fault latency as a user sees it, parked time included
+    ULONG64 parks;
+    ULONG64 switches;
+} fiberBenchResult;
+
+ULONG benchPageKernels(ULONG64 pages, pageBenchResult* results, double* victimBaselineNs);
+VOID benchWritePageJson(FILE* out, ULONG64 pages, const pageBenchResult* results, ULONG count, double victimBaselineNs);
+ULONG benchWriters(const vmConfig* config, ULONG64 pages, writerBenchResult* results);
+VOID benchWriteWriterJson(FILE* out, const vmConfig* config, const writerBenchResult* results, ULONG count);
+ULONG benchFibers(const vmConfig* config, ULONG maxFibers, fiberBenchResult* results);
+VOID benchWriteFiberJson(FILE* out, const vmConfig* config, const fiberBenchResult* results, ULONG count);
+VOID benchLists(vmInstance* vm, ULONG64 rounds, listBenchResult* result);
+VOID benchWriteListJson(FILE* out, const vmConfig* config, const listBenchResult* result);
+VOID benchWriteJson(FILE* out, const vmConfig* config, const benchResult* result);
+VOID benchWriteStartupJson(FILE* out, const vmConfig* config, const startupTimes* runs, ULONG count);
+
+#endif // BENCH_H
@@ -0,0 +1,181 @@
+//
+// workload.c
+// Access pattern generators for the benchmark driver
+//
+
+#include <math.h>
+#include <string.h>
+#include <windows.h>
+#include "../vm/vm.h"
+#include "workload.h"
+
+#define CHUNKS_PER_PAGE             (PAGE_SIZE / sizeof(ULONG_PTR))
+
+// Prime, so ranks are scattered over the space instead of the hottest pages sitting together
+#define ZIPF_SCATTER                2654435761ULL
+
+static const char* patternNames[WORKLOAD_PATTERNS] = {
+    "uniform",
+    "zipf",
+    "sequential",
+    "strided",
+    "hotset"
+};
+
+VOID workloadDefaultConfig(workloadConfig* config) {
+    config->pattern = DEFAULT_WORKLOAD_PATTERN;
+    config->zipfSkew = DEFAULT_ZIPF_SKEW;
+    config->stridePages = DEFAULT_STRIDE_PAGES;
+    config->hotSetPages = DEFAULT_HOT_SET_PAGES;
+    config->phaseAccesses = DEFAULT_PHASE_ACCESSES;
+    config->writePercent = DEFAULT_WRITE_PERCENT;
+    config->seed = DEFAULT_WORKLOAD_SEED;
+}
+
+BOOL workloadParsePattern(const char* name, ULONG* pattern) {
+    for (ULONG p = 0; p < WORKLOAD_PATTERNS; p++) {
+        if (strcmp(name, patternNames[p]) == 0) {
+            *pattern = p;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+const char* workloadPatternName(ULONG pattern) {
+    return pattern < WORKLOAD_PATTERNS ? patternNames[pattern] : "unknown";
+}
+
+//
+// splitmix64 turns (seed, thread) into well spread xorshift seeds
+//
+static ULONG64 splitmix(ULONG64 x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static ULONG64 nextRandom(workloadStream* stream) {
+    ULONG64 x = stream->random;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    stream->random = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double nextUnit(workloadStream* stream) {
+    return (nextRandom(stream) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double zeta(ULONG64 n, double theta) {
+    double sum = 0;
+    for (ULONG64 i = 1; i <= n; i++) {
+        sum += 1.0 / pow((double) i, theta);
+    }
+    return sum;
+}
+
+static ULONG64 nextZipfPage(workloadStream* stream) {
+    const workloadShape* shape = stream->shape;
+    double u = nextUnit(stream);
+    double uz = u * shape->zipfZetaN;
+    ULONG64 rank;
+
+    if (uz < 1.0) {
+        rank = 0;
+    } else if (uz < 1.0 + pow(0.5, shape->config.zipfSkew)) {
+        rank = 1;
+    } else {
+        rank = (ULONG64) (shape->numPages * pow(shape->zipfEta * u - shape->zipfEta + 1, shape->zipfAlpha));
+        rank = min(rank, shape->numPages - 1);
+    }
+
+    return (rank * ZIPF_SCATTER) % shape->numPages;
+}
+
+//
+// zeta(numPages) takes a pow per page, so it is worked out here once for
+// all the threads rather than by each of them
+//
+VOID workloadPrepare(workloadShape* shape, const workloadConfig* config, ULONG64 numPages) {
+    memset(shape, 0, sizeof(workloadShape));
+    shape->config = *config;
+    shape->numPages = numPages;
+
+    if (config->pattern == WORKLOAD_ZIPF) {
+        double theta = config->zipfSkew;
+
+        shape->zipfZeta2 = zeta(2, theta);
+        shape->zipfZetaN = zeta(numPages, theta);
+        shape->zipfAlpha = 1.0 / (1.0 - theta);
+        shape->zipfEta = (1.0 - pow(2.0 / numPages, 1.0 - theta)) / (1.0 - shape->zipfZeta2 / shape->zipfZetaN);
+    }
+}
+
+VOID workloadStart(workloadStream* stream, const workloadShape* shape, ULONG index, ULONG count) {
+    memset(stream, 0, sizeof(workloadStream));
+    stream->shape = shape;
+
+    // xorshift state can never be 0
+    stream->random = splitmix(shape->config.seed * 0x100000001B3ULL + index) | 1;
+
+    // Scanning threads start evenly spread so they don't walk in lockstep
+    stream->cursor = shape->numPages * index / count;
+}
+
+//
+// Returns the byte offset of the next access and whether it is a write
+//
+ULONG64 workloadNext(workloadStream* stream, BOOL* write) {
+    const workloadShape* shape = stream->shape;
+    const workloadConfig* config = &shape->config;
+    ULONG64 page;
+    ULONG64 chunk;
+
+    switch (config->pattern) {
+
+    case WORKLOAD_ZIPF:
+        page = nextZipfPage(stream);
+        chunk = nextRandom(stream) % CHUNKS_PER_PAGE;
+        break;
+
+    case WORKLOAD_SEQUENTIAL:
+    case WORKLOAD_STRIDED:
+
+        //
+        // Scans touch every chunk of a page before moving on, the way a copy
+        // or a checksum would.
+        //
+
+        page = stream->cursor;
+        chunk = stream->cursorOffset;
+        if (++stream->cursorOffset == CHUNKS_PER_PAGE) {
+            stream->cursorOffset = 0;
+            stream->cursor += config->pattern == WORKLOAD_STRIDED ? config->stridePages : 1;
+            stream->cursor %= shape->numPages;
+        }
+        break;
+
+    case WORKLOAD_HOT_SET: {
+        ULONG64 hotPages = min(config->hotSetPages, shape->numPages);
+        ULONG64 phase = stream->issued / config->phaseAccesses;
+
+        page = (phase * hotPages + nextRandom(stream) % hotPages) % shape->numPages;
+        chunk = nextRandom(stream) % CHUNKS_PER_PAGE;
+        break;
+    }
+
+    default:
+        page = nextRandom(stream) % shape->numPages;
+        chunk = nextRandom(stream) % CHUNKS_PER_PAGE;
+        break;
+    }
+
+    *write = config->writePercent >= 100 || nextRandom(stream) % 100 < config->writePercent;
+    stream->writes += *write;
+    stream->issued++;
+
+    return page * PAGE_SIZE + chunk * sizeof(ULONG_PTR);
+}
@@ -0,0 +1,110 @@
+//
+// workload.h
+// Access pattern generators for the benchmark driver
+//
+
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <windows.h>
+#include "../mrc/mrc.h"
+#include "../latency/latency.h"
+
+//
+// Access patterns.  Every generator hands out 8 byte aligned offsets into
+// an address space of a given number of pages.
+//
+#define WORKLOAD_UNIFORM            0   // Any page, equally likely
+#define WORKLOAD_ZIPF               1   // Few pages get most accesses, see zipfSkew
+#define WORKLOAD_SEQUENTIAL         2   // Each thread scans its slice of the space and wraps
+#define WORKLOAD_STRIDED            3   // Like sequential, but jumping stridePages at a time
+#define WORKLOAD_HOT_SET            4   // Uniform within hotSetPages, the set moves every phaseAccesses
+
+#define WORKLOAD_PATTERNS           5
+
+#define DEFAULT_WORKLOAD_PATTERN    WORKLOAD_UNIFORM
+#define DEFAULT_WORKLOAD_SEED       1
+#define DEFAULT_ZIPF_SKEW           0.99
+#define DEFAULT_STRIDE_PAGES        7
+#define DEFAULT_HOT_SET_PAGES       256
+#define DEFAULT_PHASE_ACCESSES      (64 * 1024)
+#define DEFAULT_WRITE_PERCENT       100
+
+typedef struct {
+    ULONG pattern;
+    double zipfSkew;                // 0 is uniform, approaching 1 gets ever more skewed
+    ULONG64 stridePages;
+    ULONG64 hotSetPages;
+    ULONG64 phaseAccesses;          // Per thread
+    ULONG writePercent;             // The rest of the accesses are reads
+    ULONG64 seed;                   // Same seed, same addresses - every thread gets its own stream
+} workloadConfig;
+
+//
+// A workload over spaces of a given size, worked out once and then only
+// read by every thread running it
+//
+typedef struct {
+    workloadConfig config;
+    ULONG64 numPages;
+
+    // Zipf constants (Gray et al., "Quickly generating billion-record synthetic databases")
+    double zipfZeta2;
+    double zipfZetaN;
+    double zipfAlpha;
+    double zipfEta;
+} workloadShape;
+
+//
+// One thread's view of a workload.  Nothing in here is written by anyone
+// else so threads never contend on the generator.
+//
+typedef struct {
+    const workloadShape* shape;
+    ULONG64 random;                 // xorshift state
+    ULONG64 cursor;                 // Next page for the scans
+    ULONG64 cursorOffset;           // Next offset within that page
+    ULONG64 issued;
+    ULONG64 writes;
+} workloadStream;
+
+//
+// What a benchmark run did
+//
+typedef struct {
+    ULONG64 elapsedMs;
+    ULONG64 accesses;
+    ULONG64 reads;
+    ULONG64 writes;
+    ULONG64 hardFaults;             // Read back from the pagefile
+    ULONG64 softFaults;             // Rescued from the modified or standby list
+    ULONG64 demandZeroFaults;
+    latencySummary faultKinds[FAULT_KINDS];
+    latencySummary faultPhases[FAULT_PHASES];
+    ULONG64 mrcReferences;          // References the miss ratio curve was estimated from
+    mrcPoint mrc[MRC_POINTS];
+    startupTimes startup;           // Creating the instance the run used
+    ULONG64 fiberSwitches;          // Only with config.fibersPerThread set
+    ULONG64 fiberParks;             // Times a fiber waited on a read
+    ULONG64 largeFaults;            // Only with config.largePages set
+    ULONG64 largePromotions;
+    ULONG64 largeDemotions;
+    ULONG64 localFaults;            // Mapped a frame on the faulting thread's node
+    ULONG64 remoteFaults;
+    ULONG64 remoteAccesses;         // Only the simulator counts hits
+    ULONG64 snapshotPages;          // Only with config.snapshotAt set
+    ULONG64 sharedFaults;
+    ULONG64 sharedCopies;
+} benchResult;
+
+//
+// Function declarations
+//
+VOID workloadDefaultConfig(workloadConfig* config);
+BOOL workloadParsePattern(const char* name, ULONG* pattern);
+const char* workloadPatternName(ULONG pattern);
+VOID workloadPrepare(workloadShape* shape, const workloadConfig* config, ULONG64 numPages);
+VOID workloadStart(workloadStream* stream, const workloadShape* shape, ULONG index, ULONG count);
+ULONG64 workloadNext(workloadStream* stream, BOOL* write);
+
+#endif // WORKLOAD_H
@@ -9,40 +9,42 @@
 #include "../util/util.h"
 #include "../vm/vm.h"
 #include "disk.h"
+#include "../platform/platform.h"
+#include "../pagecopy/pagecopy.h"
+#include "../api/libvm.h"
+#include "../fiber/fiber.h"
 
-// Global disk variables
-ULONG64 diskBytes;
-PVOID disk;
-boolean* isFull;
-ULONG64 diskIndex;
-volatile LONG64 numFreeDiskSlots;
-
-VOID initializeDisk() {
-    // diskBytes = VIRTUAL_ADDRESS_SIZE - (NUMBER_OF_PHYSICAL_PAGES - 2) * PAGE_SIZE;
-    diskBytes = VIRTUAL_ADDRESS_SIZE;
-    numFreeDiskSlots = diskBytes;
-    disk = initialize(diskBytes);
-    isFull = initialize(diskBytes / PAGE_SIZE);
-    isFull[0] = TRUE;
-    diskIndex = 1;
+VOID initializeDisk(vmInstance* vm) {
+    ULONG64 slots = vm->config.diskSizeInPages;
+
+    // A simulated pagefile only needs its slots accounted for
+    if (vm->platform->simulated == FALSE) {
+        vm->disk = initializeLazy(slots * PAGE_SIZE);
+    }
+    vm->isFull = initializeLazy(slots * sizeof(boolean));
+
+    // Slot 0 is never handed out so a zeroed disk PTE can mean "demand zero"
+    vm->isFull[0] = TRUE;
+    vm->numFreeDiskSlots = slots - 1;
+    vm->diskIndex = 1;
 }
 
-ULONG64 findFreeDiskSlot() {
+ULONG64 findFreeDiskSlot(vmInstance* vm) {
     boolean full = TRUE;
-    ULONG64 startIndex = diskIndex;
-    ULONG64 currentIndex = diskIndex;
+    ULONG64 slots = vm->config.diskSizeInPages;
+    ULONG64 startIndex = vm->diskIndex;
+    ULONG64 currentIndex = vm->diskIndex;
 
     // Look for a free slot - search through all slots once
     do {
         // Wrap around logic
-        if (currentIndex >= diskBytes / PAGE_SIZE) {
+        if (currentIndex >= slots) {
             currentIndex = 0;  // Reset to 0, not 1 b/c there's a ++ to current index
         }
 
-        full = isFull[currentIndex];
+        full = vm->isFull[currentIndex];
         if (!full) {
-            diskIndex = currentIndex;
-            // Update global diskIndex
+            vm->diskIndex = currentIndex;
             break;
         }
 
@@ -53,34 +55,141 @@ ULONG64 findFreeDiskSlot() {
     // If we've checked all slots and they're all full, return FALSE
     if (full) return 0;
 
-    isFull[diskIndex] = TRUE;
-    InterlockedIncrement64(&numFreeDiskSlots);
-  //  ASSERT(numFreeDiskSlots < VIRTUAL_ADDRESS_SIZE);
-    ULONG64 returnIndex = diskIndex;
+    vm->isFull[vm->diskIndex] = TRUE;
+    InterlockedDecrement64(&vm->numFreeDiskSlots);
+    ASSERT(vm->numFreeDiskSlots >= 0);
+    ULONG64 returnIndex = vm->diskIndex;
 
-    diskIndex++;
-    if (diskIndex >= diskBytes / PAGE_SIZE) {
-        diskIndex = 1;
+    vm->diskIndex++;
+    if (vm->diskIndex >= slots) {
+        vm->diskIndex = 1;
     }
 
     return returnIndex;
 }
 
-void readFromDisk(ULONG64 readIndex, ULONG64 frameNumber, threadInfo* info) {
+VOID freeDiskSlot(vmInstance* vm, ULONG64 slot) {
+    ASSERT(slot != 0 && slot < vm->config.diskSizeInPages);
+    ASSERT(vm->isFull[slot]);
+    vm->isFull[slot] = FALSE;
+    InterlockedIncrement64(&vm->numFreeDiskSlots);
+}
+
+BOOL diskReservationInitialize(diskReservation* reserve, ULONG64 capacity) {
+    reserve->slots = malloc(capacity * sizeof(ULONG64));
+    reserve->capacity = capacity;
+    reserve->next = 0;
+    reserve->count = 0;
+    return reserve->slots != NULL;
+}
+
+VOID diskReservationFree(diskReservation* reserve) {
+    ASSERT(reserve->next == reserve->count);
+    free(reserve->slots);
+}
+
+//
+// Hand out the next slot set aside, setting aside a new run once they are
+// used up.  Returns 0 when the pagefile is full.  The caller holds the PTE
+// lock.
+//
+ULONG64 reservedDiskSlot(vmInstance* vm, diskReservation* reserve) {
+    if (reserve->next == reserve->count) {
+        reserve->next = 0;
+        reserve->count = 0;
+        while (reserve->count < reserve->capacity) {
+            ULONG64 slot = findFreeDiskSlot(vm);
+            if (slot == 0) {
+                break;
+            }
+            reserve->slots[reserve->count++] = slot;
+        }
+        if (reserve->count == 0) {
+            return 0;
+        }
+    }
+    return reserve->slots[reserve->next++];
+}
+
+//
+// Give back whatever was set aside and not handed out, so a writer going
+// idle never sits on slots another one could use.  The caller holds the
+// PTE lock.
+//
+VOID releaseDiskReservation(vmInstance* vm, diskReservation* reserve) {
+    while (reserve->next < reserve->count) {
+        freeDiskSlot(vm, reserve->slots[reserve->next++]);
+    }
+}
+
+//
+// Fill a frame from a pagefile slot but leave the slot allocated, the page
+// still has a valid copy out there (eg. it was read ahead onto standby).
+//
+void copyFromDisk(ULONG64 readIndex, ULONG64 frameNumber, threadInfo* info) {
+    info->vm->platform->readPage(readIndex, frameNumber, info);
+}
+
+//
+// How the real platform reads a page in
+//
+void diskRead(ULONG64 readIndex, ULONG64 frameNumber, threadInfo* info) {
+    vmInstance* vm = info->vm;
+
     // reverse write to disk
-    PVOID diskAddress = (PVOID) ((ULONG64) disk + readIndex * PAGE_SIZE);
-
-    BOOL b;
-    b = MapUserPhysicalPages(info->transferVa, 1, &frameNumber);
-    ASSERT(b);
-
-    // Copy from mapped page to malloced disk
-    memcpy(info->transferVa, diskAddress, PAGE_SIZE);
-
-    b = MapUserPhysicalPages(info->transferVa, 1, NULL);
-    ASSERT(b);
-    
-    isFull[readIndex] = FALSE;
-    InterlockedDecrement64(&numFreeDiskSlots);
-    ASSERT(numFreeDiskSlots >= 0);
-}
\ No newline at end of file
+    PVOID diskAddress = (PVOID) ((ULONG64) vm->disk + readIndex * PAGE_SIZE);
+
+    // Copy from the pagefile to the mapped page
+    pageCopy(transferMap(info, frameNumber), diskAddress);
+}
+
+//
+// Queue a read for the read task and park the calling fiber until it has
+// been copied in.  Only a fiber can call this.
+//
+VOID readParked(vmInstance* vm, ULONG64 diskIndex, ULONG64 frameNumber) {
+    pageRead read;
+
+    read.diskIndex = diskIndex;
+    read.frameNumber = frameNumber;
+    read.done = FALSE;
+    do {
+        read.next = vm->reads;
+    } while (InterlockedCompareExchangePointer((PVOID volatile*) &vm->reads, &read, read.next) != read.next);
+
+    taskSignal(&vm->sched, &vm->taskRead);
+    fiberPark(&read.done);
+}
+
+//
+// Take every queued read at once, so a read can never be taken twice
+// while another is being queued.  The next link is read before done is
+// set - the fiber can be gone from its stack frame right after.
+//
+static VOID readTask(task* work) {
+    threadInfo* info = (threadInfo*) work->context;
+    pageRead* read = InterlockedExchangePointer((PVOID volatile*) &info->vm->reads, NULL);
+
+    while (read != NULL) {
+        pageRead* next = read->next;
+
+        copyFromDisk(read->diskIndex, read->frameNumber, info);
+        InterlockedExchange(&read->done, TRUE);
+        read = next;
+    }
+}
+
+VOID readerStart(vmInstance* vm) {
+
+    // Reading in needs a transfer VA just like a faulting thread
+    threadInfo* info = vmAttachThread(vm);
+
+    vm->reads = NULL;
+    taskInitialize(&vm->taskRead, "read", readTask, info, TASK_PRIORITY_HIGH, TASK_ANY_WORKER);
+}
+
+// Only once the workers are gone
+VOID readerStop(vmInstance* vm) {
+    ASSERT(vm->reads == NULL);
+    vmDetachThread((threadInfo*) vm->taskRead.context);
+}
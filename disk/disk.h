@@ -10,19 +10,44 @@
 #include "../vm/vm.h"
 
 //
-// Global disk variables
+// Pagefile slots set aside by one writer, taken as a run so its batches
+// land in neighbouring slots instead of interleaving with the other
+// writers'.  Only that writer hands them out, under the PTE lock like
+// every other slot.
 //
-extern ULONG64 diskBytes;
-extern PVOID disk;
-extern boolean* isFull;
-extern ULONG64 diskIndex;
-extern volatile LONG64 numFreeDiskSlots;
+typedef struct {
+    ULONG64* slots;
+    ULONG64 capacity;
+    ULONG64 next;                   // Next one handed out
+    ULONG64 count;                  // Set aside, including those handed out
+} diskReservation;
+
+//
+// A read a fiber hands the read task instead of doing it itself, so the
+// thread can run its other fibers meanwhile.  It lives on the fiber's
+// stack until done is set.
+//
+struct _pageRead {
+    pageRead* next;
+    ULONG64 diskIndex;
+    ULONG64 frameNumber;
+    volatile LONG done;
+};
 
 //
 // Function declarations
 //
-VOID initializeDisk(void);
-ULONG64 findFreeDiskSlot(void);
-void readFromDisk(ULONG64 diskIndex, ULONG64 frameNumber, threadInfo* info);
+VOID initializeDisk(vmInstance* vm);
+ULONG64 findFreeDiskSlot(vmInstance* vm);
+VOID freeDiskSlot(vmInstance* vm, ULONG64 slot);
+BOOL diskReservationInitialize(diskReservation* reserve, ULONG64 capacity);
+VOID diskReservationFree(diskReservation* reserve);
+ULONG64 reservedDiskSlot(vmInstance* vm, diskReservation* reserve);
+VOID releaseDiskReservation(vmInstance* vm, diskReservation* reserve);
+void diskRead(ULONG64 diskIndex, ULONG64 frameNumber, threadInfo* info);
+void copyFromDisk(ULONG64 diskIndex, ULONG64 frameNumber, threadInfo* info);
+VOID readParked(vmInstance* vm, ULONG64 diskIndex, ULONG64 frameNumber);
+VOID readerStart(vmInstance* vm);
+VOID readerStop(vmInstance* vm);
 
-#endif // DISK_MANAGER_H
\ No newline at end of file
+#endif // DISK_MANAGER_H
@@ -5,6 +5,63 @@
 #ifndef DISKWRITE_H
 #define DISKWRITE_H
 
-VOID threadWriteToDisk(LPVOID lpParameter);
+#include <windows.h>
+#include "../vm/vm.h"
+#include "../disk/disk.h"
+
+//
+// One batch on its way through the writer, and the transfer buffer its
+// pages are mapped in.  The pipeline has WRITE_BUFFERS of these, the
+// simulator one.
+//
+typedef struct {
+    pfn** pages;
+    ULONG_PTR* frameNumbers;
+    ULONG64* diskIndexes;
+    ULONG64 count;
+    ULONG64 mapped;                 // Pages of the buffer with a frame left in them
+    PVOID transferVa;
+} writer;
+
+//
+// A transfer buffer of a pipeline and the tasks that take its batch
+// through the copy and publish stages
+//
+typedef struct {
+    writer write;
+    writePipeline* pipeline;
+    ULONG slot;                     // Its bit in the pipeline's freeBuffers
+    task copy;
+    task publish;
+} writeBuffer;
+
+//
+// One modified writer - its gather task, the buffers its batches go round
+// in and the slots it has set aside.  Only the gather task touches the
+// reservation and active.
+//
+struct _writePipeline {
+    vmInstance* vm;
+    ULONG index;
+    task gather;
+    volatile BOOL active;           // Woken and not yet out of work
+    volatile LONG freeBuffers;      // A bit per buffer not in flight
+    diskReservation reserve;
+    writeBuffer buffers[WRITE_BUFFERS];
+};
+
+BOOL writerInitialize(writer* write, vmInstance* vm, PVOID transferVa);
+VOID writerFree(writer* write);
+ULONG64 writeBatchLimit(vmInstance* vm);
+ULONG64 writeGather(vmInstance* vm, writer* write, diskReservation* reserve);
+VOID writeCopy(vmInstance* vm, writer* write);
+ULONG64 writePublish(vmInstance* vm, writer* write);
+ULONG64 writeBatch(vmInstance* vm, writer* write, diskReservation* reserve);
+VOID diskWritePages(vmInstance* vm, PVOID va, ULONG64* diskIndexes, ULONG64 count);
+VOID writersStart(vmInstance* vm);
+VOID writersStop(vmInstance* vm);
+VOID writersSignal(vmInstance* vm);
+VOID writesHold(vmInstance* vm);
+VOID writesResume(vmInstance* vm);
 
 #endif //DISKWRITE_H
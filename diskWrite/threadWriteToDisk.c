@@ -11,111 +11,399 @@
 #include "diskWrite.h"
 #include "../list/list.h"
 #include "../pt/pt.h"
+#include "../trace/trace.h"
+#include "../platform/platform.h"
+#include "../pagecopy/pagecopy.h"
 
 //
 // threadWriteToDisk.c
 //
 
-HANDLE eventStartDiskWrite; // these need to be initialized already
-HANDLE eventSystemStart;
-HANDLE eventSystemShutdown;
-
-PVOID diskTransferVa;
-
 // user thread sets trim event, wait on WaitingForPagesEvent--> wakes up trimmer, trimmer does work, trimmer sets mod write event
 // --> mod writer wakes up, does work, sets waiting for pages event --> user thread wakes up
 
 
-void threadWriteToDisk(LPVOID lpParameter) {
+BOOL writerInitialize(writer* write, vmInstance* vm, PVOID transferVa) {
+    ULONG64 batchSize = writeBatchLimit(vm);
+
+    write->pages = malloc(batchSize * sizeof(pfn*));
+    write->frameNumbers = malloc(batchSize * sizeof(ULONG_PTR));
+    write->diskIndexes = malloc(batchSize * sizeof(ULONG64));
+    write->count = 0;
+    write->mapped = 0;
+    write->transferVa = transferVa;
+
+    return write->pages && write->frameNumbers && write->diskIndexes;
+}
+
+VOID writerFree(writer* write) {
+    free(write->pages);
+    free(write->frameNumbers);
+    free(write->diskIndexes);
+}
+
+ULONG64 writeBatchLimit(vmInstance* vm) {
+    return vm->config.writeBatchSize * WRITE_BATCH_SCALE;
+}
+
+//
+// How the real platform writes a batch out - copy the frames mapped at the
+// transfer buffer into their slots
+//
+VOID diskWritePages(vmInstance* vm, PVOID va, ULONG64* diskIndexes, ULONG64 count) {
+    for (ULONG64 j = 0; j < count; j++) {
+        PVOID sourceAddr = (PVOID)((ULONG64)va + j * PAGE_SIZE);
+        PVOID destAddr = (PVOID)((ULONG64)vm->disk + diskIndexes[j] * PAGE_SIZE);
+
+        // Check if addresses look reasonable
+        ASSERT(sourceAddr != NULL && destAddr != NULL);
 
-    // initialize whatever datastructures the thread needs
+        pageCopy(destAddr, sourceAddr);
+    }
+}
 
+//
+// First stage - claim a batch off the modified list, give each page a
+// slot and map the batch at the buffer.  Claimed pages stay MODIFIED but
+// are on no list, with the writing bit set, until they are published, and
+// the batch counts as in flight until then.  Returns how many were
+// claimed, 0 when there was nothing to write, no free slot to write it to
+// or the pool is giving frames back.
+//
+ULONG64 writeGather(vmInstance* vm, writer* write, diskReservation* reserve) {
+    ULONG64 batchSize;
     ULONG64 writeIndex;
-    pfn* pages[BATCH_SIZE];
-    ULONG_PTR frameNumbers[BATCH_SIZE];
-    ULONG64 diskAddresses[BATCH_SIZE];
+    ULONG64 i;
+
+    //
+    // Spread the modified list over the buffers - a long list goes out in
+    // big batches, fewer map calls and lock round trips per page, and a
+    // short one in small batches that reach standby sooner.  The gauge
+    // counts pages already claimed too, near enough.
+    //
+    batchSize = (ULONG64) max(statsRead(&vm->stats, STAT_MODIFIED_PAGES), 0) / WRITE_BUFFERS;
+    batchSize = min(max(batchSize, vm->config.writeBatchSize), writeBatchLimit(vm));
+
+    TRACE_BEGIN("writeGather");
+    acquireLockPTE(vm, NULL, WRITER);
+    if (vm->writesHeld) {
+        releaseLock(&vm->lockPTE, WRITER);
+        write->count = 0;
+        TRACE_END("writeGather", "pages", 0);
+        return 0;
+    }
+    acquireLock(&vm->lockModifiedList, WRITER);
 
-    int i;
+    for (i = 0; i < batchSize; i++) {
+        if (isEmpty(&vm->headModifiedList)) break;
 
-    WaitForSingleObject(eventSystemStart, INFINITE);
+        writeIndex = reservedDiskSlot(vm, reserve);
+        if (writeIndex == 0) {
+            break;
+        }
 
-    // allows for clean shutdown of thread at the end of simulation
-    HANDLE events[2];
-    events[0] = eventStartDiskWrite;
-    events[1] = eventSystemShutdown;
+        write->diskIndexes[i] = writeIndex;
+        write->pages[i] = linkRemoveHead(vm, &vm->headModifiedList);
+        write->frameNumbers[i] = pfn2frameNumber(vm, write->pages[i]);
+        write->pages[i]->diskIndex = writeIndex;
+        write->pages[i]->writing = 1;
+    }
+    releaseLock(&vm->lockModifiedList, WRITER);
+
+    //
+    // Mapped before the PTE lock goes - after that a frame can be rescued,
+    // freed and handed back to the host.  Whatever the buffer held before
+    // is simply mapped over, so there is no unmap call per batch.
+    //
+    if (i != 0) {
+        BOOL b = vm->platform->map(vm, write->transferVa, i, write->frameNumbers);
+        ASSERT(b);
+        write->mapped = max(write->mapped, i);
+        InterlockedIncrement(&vm->writesInFlight);
+    }
+    releaseLock(&vm->lockPTE, WRITER);
 
-    while (TRUE) {
+    write->count = i;
+    TRACE_END("writeGather", "pages", i);
+    return i;
+}
 
-        if (WaitForMultipleObjects(2, events, FALSE, INFINITE) == 1) {
-            // shutdown, free datastructures, return (killing the thread)
-            return;
+//
+// Second stage - copy the batch to its slots holding no paging lock.
+// Pages faulted back in meanwhile may be copied half changed, publishing
+// throws those copies away.  The frames stay with the pool while the
+// batch is in flight.
+//
+VOID writeCopy(vmInstance* vm, writer* write) {
+    TRACE_BEGIN("writeCopy");
+    vm->platform->writePages(vm, write->transferVa, write->diskIndexes, write->count);
+    TRACE_END("writeCopy", "pages", write->count);
+}
+
+//
+// Last stage - put the pages on standby.  A page rescued, decommitted or
+// discarded since it was claimed lost its writing bit, and may since have
+// been claimed again for another slot, so its copy is dropped and the slot
+// freed.  The batch is no longer in flight after this.  Returns how many
+// went to standby.
+//
+ULONG64 writePublish(vmInstance* vm, writer* write) {
+    ULONG64 written = 0;
+
+    TRACE_BEGIN("writePublish");
+    acquireLockPTE(vm, NULL, WRITER);
+    acquireLock(&vm->lockStandbyList, WRITER);
+    for (ULONG64 j = 0; j < write->count; j++) {
+        pfn* page = write->pages[j];
+
+        if (page->writing && page->diskIndex == write->diskIndexes[j]) {
+            page->writing = 0;
+            standbyAdd(vm, page, page->priority);
+            written++;
+        } else {
+            freeDiskSlot(vm, write->diskIndexes[j]);
         }
+    }
+    releaseLock(&vm->lockStandbyList, WRITER);
+    releaseLock(&vm->lockPTE, WRITER);
+    InterlockedDecrement(&vm->writesInFlight);
+    statsAdd(&vm->stats, STAT_PAGES_WRITTEN, written);
+    TRACE_END("writePublish", "pages", written);
 
+    return written;
+}
 
-        // do your work
-        acquireLockPTE(NULL, WRITER);
-        acquireLock(&lockModifiedList, WRITER);
+//
+// Write one batch straight through all three stages, for a platform with
+// no background threads.  Nothing stays set aside afterwards.  Returns how
+// many went to standby.
+//
+ULONG64 writeBatch(vmInstance* vm, writer* write, diskReservation* reserve) {
+    ULONG64 written = 0;
 
+    if (writeGather(vm, write, reserve) != 0) {
+        writeCopy(vm, write);
+        written = writePublish(vm, write);
+    }
 
-        for (i = 0; i < BATCH_SIZE; i++) {
-            if (isEmpty(&headModifiedList)) break;
+    acquireLockPTE(vm, NULL, WRITER);
+    releaseDiskReservation(vm, reserve);
+    releaseLock(&vm->lockPTE, WRITER);
 
-            writeIndex = findFreeDiskSlot();
-            if (writeIndex == 0) {
-                break;
-            }
+    return written;
+}
 
-            diskAddresses[i] = (ULONG64) disk + writeIndex * PAGE_SIZE;
-            pages[i] = linkRemoveHead(&headModifiedList);
-            if (pages[i] == NULL) {
-                i--;
-                break;
-            }
-            frameNumbers[i] = pfn2frameNumber(pages[i]);
-            pages[i]->diskIndex = writeIndex;
+//
+// Whether the writer at index has work worth running for - the first
+// always has.  Each one after it needs another WRITE_BUFFERS batches of
+// backlog, and the writers before it to have their whole queue depth of
+// batches in flight already, or they can keep up on their own.
+//
+static BOOL writerWanted(vmInstance* vm, ULONG index) {
+    LONG64 modified = statsRead(&vm->stats, STAT_MODIFIED_PAGES);
+    LONG inFlight = InterlockedOr(&vm->writesInFlight, 0);
+
+    return index == 0 ||
+           (modified >= (LONG64) (index * WRITE_BUFFERS * vm->config.writeBatchSize) &&
+            inFlight >= (LONG) (index * WRITE_BUFFERS));
+}
+
+// A buffer not in flight, NULL when all of them are
+static writeBuffer* takeBuffer(writePipeline* pipeline) {
+    LONG free = pipeline->freeBuffers;
+
+    while (free != 0) {
+        ULONG slot = 0;
+        while ((free & (1 << slot)) == 0) {
+            slot++;
+        }
+
+        LONG seen = InterlockedCompareExchange(&pipeline->freeBuffers, free & ~(1 << slot), free);
+        if (seen == free) {
+            return &pipeline->buffers[slot];
+        }
+        free = seen;
+    }
+    return NULL;
+}
+
+static VOID returnBuffer(writeBuffer* buffer) {
+    InterlockedOr(&buffer->pipeline->freeBuffers, 1 << buffer->slot);
+}
+
+//
+// The gather stage.  Once woken it keeps claiming batches while there is a
+// backlog for it and a buffer to put it in, so while one batch is copied
+// the next is already being mapped.  Out of buffers it stays active and is
+// signalled again as each one comes back.
+//
+static VOID writeGatherTask(task* work) {
+    writePipeline* pipeline = (writePipeline*) work->context;
+    vmInstance* vm = pipeline->vm;
+    ULONG next = pipeline->index + 1;
+    writeBuffer* buffer;
+
+    if (pipeline->active == FALSE) {
+        pipeline->active = TRUE;
+        InterlockedIncrement(&vm->writersActive);
+    }
+
+    while (writerWanted(vm, pipeline->index)) {
+        if ((buffer = takeBuffer(pipeline)) == NULL) {
+            return;
         }
-        releaseLock(&lockModifiedList, WRITER);
+        if (writeGather(vm, &buffer->write, &pipeline->reserve) == 0) {
+            returnBuffer(buffer);
+            break;
+        }
+
+        // Stays on this worker unless another one is idle enough to steal it
+        taskSignal(&vm->sched, &buffer->copy);
 
-        // If all the disk slots are full or the modified list is (somehow) empty then return and release PTE lock
-        if (i <= 0) {
-            releaseLock(&lockPTE, WRITER);
-            SetEvent(eventRedoFault);
-            continue;
+        //
+        // Every buffer of this writer is in flight, so it cannot go
+        // any faster - if the backlog is deep enough the next writer
+        // takes some of it
+        //
+        if (next < vm->config.writerThreads && pipeline->freeBuffers == 0 && writerWanted(vm, next)) {
+            taskSignal(&vm->sched, &vm->writers[next].gather);
         }
+    }
+
+    acquireLockPTE(vm, NULL, WRITER);
+    releaseDiskReservation(vm, &pipeline->reserve);
+    releaseLock(&vm->lockPTE, WRITER);
+
+    pipeline->active = FALSE;
+    InterlockedDecrement(&vm->writersActive);
+
+    // signal whoever is waiting on your work, if applicable
+    SetEvent(vm->eventRedoFault); // might be the trimmer setting the mod writer event, or the mod writer setting the waiting-for-pages event for the users
+}
+
+static VOID writeCopyTask(task* work) {
+    writeBuffer* buffer = (writeBuffer*) work->context;
+    vmInstance* vm = buffer->pipeline->vm;
+
+    writeCopy(vm, &buffer->write);
+    taskSignal(&vm->sched, &buffer->publish);
+}
+
+static VOID writePublishTask(task* work) {
+    writeBuffer* buffer = (writeBuffer*) work->context;
+    writePipeline* pipeline = buffer->pipeline;
+    vmInstance* vm = pipeline->vm;
+
+    writePublish(vm, &buffer->write);
+    returnBuffer(buffer);
+
+    // Standby pages for whoever is waiting on them
+    SetEvent(vm->eventRedoFault);
+
+    // A gather that ran out of buffers has one again
+    if (pipeline->active) {
+        taskSignal(&vm->sched, &pipeline->gather);
+    }
+}
+
+//
+// Set up every writer with its share of the transfer buffers.  Each gather
+// task prefers a worker of its own so several writers spread out; the copy
+// and publish of a batch stay where it was gathered.  Only the first
+// writer is signalled by anyone else.
+//
+VOID writersStart(vmInstance* vm) {
+    ULONG count = vm->config.writerThreads;
+    ULONG64 limit = writeBatchLimit(vm);
+
+    vm->writers = initialize(count * sizeof(writePipeline));
+    vm->writersActive = 0;
 
+    for (ULONG w = 0; w < count; w++) {
+        writePipeline* pipeline = &vm->writers[w];
         BOOL b;
 
-        // Map page contents from their frame number spots to transfer va
-        b = MapUserPhysicalPages(diskTransferVa, i, frameNumbers);
+        pipeline->vm = vm;
+        pipeline->index = w;
+        pipeline->active = FALSE;
+        pipeline->freeBuffers = (1 << WRITE_BUFFERS) - 1;
+        taskInitialize(&pipeline->gather, "writeGatherTask", writeGatherTask, pipeline, TASK_PRIORITY_NORMAL, w);
+
+        b = diskReservationInitialize(&pipeline->reserve, limit);
         ASSERT(b);
 
-        acquireLock(&lockStandbyList, WRITER);
-        for (int j = 0; j < i; j++) {
-            PVOID sourceAddr = (PVOID)((ULONG64)diskTransferVa + j * PAGE_SIZE);
-            PVOID destAddr = (PVOID)diskAddresses[j];
+        for (ULONG k = 0; k < WRITE_BUFFERS; k++) {
+            writeBuffer* buffer = &pipeline->buffers[k];
+            ULONG64 index = (ULONG64) w * WRITE_BUFFERS + k;
+            PVOID transferVa = (PVOID)((ULONG64)vm->diskTransferVa + index * limit * PAGE_SIZE);
+
+            b = writerInitialize(&buffer->write, vm, transferVa);
+            ASSERT(b);
+            buffer->pipeline = pipeline;
+            buffer->slot = k;
+            taskInitialize(&buffer->copy, "writeCopyTask", writeCopyTask, buffer, TASK_PRIORITY_NORMAL, TASK_ANY_WORKER);
+            taskInitialize(&buffer->publish, "writePublishTask", writePublishTask, buffer, TASK_PRIORITY_HIGH, TASK_ANY_WORKER);
+        }
+    }
+}
 
-            // Check if addresses look reasonable
-            ASSERT(sourceAddr != NULL && destAddr != NULL);
+//
+// Free every writer once the workers are gone.  Frames left in the buffers
+// are unmapped, and batches still in flight and slots still set aside are
+// dropped along with everything else.
+//
+VOID writersStop(vmInstance* vm) {
+    for (ULONG w = 0; w < vm->config.writerThreads; w++) {
+        writePipeline* pipeline = &vm->writers[w];
 
-            memcpy(destAddr, sourceAddr, PAGE_SIZE);
+        for (ULONG k = 0; k < WRITE_BUFFERS; k++) {
+            writer* write = &pipeline->buffers[k].write;
 
-            // something here for rescue before write or between steps
-            pages[j]->status = STANDBY;
-            linkAdd(pages[j], &headStandbyList);
+            if (write->mapped != 0) {
+                BOOL unmapped = vm->platform->map(vm, write->transferVa, write->mapped, NULL);
+                ASSERT(unmapped);
+            }
+            writerFree(write);
         }
-        releaseLock(&lockStandbyList, WRITER);
-        releaseLock(&lockPTE, WRITER);
 
-        // Unmap the pages
-        b = MapUserPhysicalPages(diskTransferVa, i, NULL);
-        ASSERT(b);
+        acquireLockPTE(vm, NULL, WRITER);
+        releaseDiskReservation(vm, &pipeline->reserve);
+        releaseLock(&vm->lockPTE, WRITER);
+        diskReservationFree(&pipeline->reserve);
+    }
+
+    free(vm->writers);
+}
+
+// Pages went on the modified list - wake the first writer
+VOID writersSignal(vmInstance* vm) {
+    taskSignal(&vm->sched, &vm->writers[0].gather);
+}
 
-        // signal whoever is waiting on your work, if applicable
-        SetEvent(eventRedoFault); // might be the trimmer setting the mod writer event, or the mod writer setting the waiting-for-pages event for the users
+//
+// Keep the writers from claiming new batches and wait for the ones in
+// flight to be published.  Once it returns no transfer buffer has a frame
+// the caller took off the lists since in it that can still be copied.
+//
+VOID writesHold(vmInstance* vm) {
+    acquireLockPTE(vm, NULL, USER);
+    vm->writesHeld = TRUE;
+    releaseLock(&vm->lockPTE, USER);
+
+    while (InterlockedOr(&vm->writesInFlight, 0) != 0) {
+        Sleep(1);
     }
+}
+
+VOID writesResume(vmInstance* vm) {
+    acquireLockPTE(vm, NULL, USER);
+    vm->writesHeld = FALSE;
+    releaseLock(&vm->lockPTE, USER);
 
-    // We want the thread to run forever, so we should not exit the while loop
-    DebugBreak();
+    // The simulator writes inline, with no pipeline to wake
+    if (vm->writers != NULL) {
+        writersSignal(vm);
+    }
 }
 
 /*
@@ -0,0 +1,141 @@
+//
+// fiber.c
+// Many user tasks per thread on fibers
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+#include "../util/util.h"
+#include "../trace/trace.h"
+#include "fiber.h"
+
+// The pool running on this thread, NULL on any other thread
+static __declspec(thread) fiberPool* current;
+
+//
+// A fiber routine must never return, that would end the thread - a
+// finished task goes back to the home fiber for good instead
+//
+static VOID CALLBACK fiberStart(PVOID parameter) {
+    fiberTask* self = (fiberTask*) parameter;
+    fiberPool* pool = self->pool;
+
+    self->run(self->context);
+
+    self->done = TRUE;
+    pool->live--;
+    SwitchToFiber(pool->home);
+}
+
+BOOL fiberRunning(VOID) {
+    return current != NULL && current->running != NULL;
+}
+
+//
+// Give the thread to the other fibers until *flag is nonzero
+//
+VOID fiberPark(volatile LONG* flag) {
+    fiberPool* pool = current;
+
+    ASSERT(fiberRunning());
+
+    if (*flag != 0) {
+        return;
+    }
+    pool->running->waitingOn = flag;
+    pool->parks++;
+    SwitchToFiber(pool->home);
+}
+
+//
+// Let the other fibers run before this one goes on
+//
+VOID fiberYield(VOID) {
+    ASSERT(fiberRunning());
+
+    SwitchToFiber(current->home);
+}
+
+static VOID deleteFibers(fiberPool* pool, ULONG count) {
+    for (ULONG t = 0; t < count; t++) {
+        DeleteFiber(pool->tasks[t].fiber);
+    }
+    free(pool->tasks);
+    pool->tasks = NULL;
+}
+
+//
+// Run count fibers on the calling thread, each calling run with its own
+// context, until every one of them has returned.  Fibers go round in
+// turn, skipping the ones still waiting.  With all of them waiting the
+// thread runs a background task if there is one, since that is usually
+// what they are waiting on, and otherwise gives up its time slice.
+// Returns FALSE if the fibers could not be created.
+//
+BOOL fiberPoolRun(fiberPool* pool, ULONG count, fiberRoutine run, PVOID* contexts, scheduler* help) {
+    ULONG created;
+
+    ASSERT(current == NULL);
+
+    memset(pool, 0, sizeof(fiberPool));
+    pool->home = ConvertThreadToFiber(NULL);
+    if (pool->home == NULL) {
+        printf ("fiberPoolRun : could not convert thread to fiber (%u)\n", GetLastError());
+        return FALSE;
+    }
+    pool->tasks = initialize(count * sizeof(fiberTask));
+    pool->count = count;
+    pool->help = help;
+
+    for (created = 0; created < count; created++) {
+        fiberTask* task = &pool->tasks[created];
+
+        task->pool = pool;
+        task->run = run;
+        task->context = contexts[created];
+        task->fiber = CreateFiber(FIBER_STACK_SIZE, fiberStart, task);
+        if (task->fiber == NULL) {
+            printf ("fiberPoolRun : could only create %u of %u fibers (%u)\n", created, count, GetLastError());
+            deleteFibers(pool, created);
+            ConvertFiberToThread();
+            return FALSE;
+        }
+    }
+
+    current = pool;
+    pool->live = count;
+
+    while (pool->live != 0) {
+        BOOL ran = FALSE;
+
+        for (ULONG t = 0; t < count; t++) {
+            fiberTask* task = &pool->tasks[t];
+
+            if (task->done || (task->waitingOn != NULL && *task->waitingOn == 0)) {
+                continue;
+            }
+            task->waitingOn = NULL;
+
+            pool->running = task;
+            pool->switches++;
+            TRACE_FIBER(t + 1);
+            SwitchToFiber(task->fiber);
+            TRACE_FIBER(0);
+            pool->running = NULL;
+            ran = TRUE;
+        }
+
+        if (ran == FALSE) {
+            pool->idle++;
+            if (help == NULL || schedulerHelp(help, TASK_PRIORITY_HIGH) == FALSE) {
+                Sleep(0);
+            }
+        }
+    }
+
+    current = NULL;
+    deleteFibers(pool, count);
+    ConvertFiberToThread();
+    return TRUE;
+}
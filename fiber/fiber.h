@@ -0,0 +1,56 @@
+//
+// fiber.h
+// Many user tasks per thread on fibers
+//
+
+#ifndef FIBER_H
+#define FIBER_H
+
+#include <windows.h>
+#include "../sched/sched.h"
+
+//
+// A thread running a fiber pool switches to another of its fibers whenever
+// the one running has to wait for a page to be read in, instead of blocking
+// the thread.  Fibers are cooperative - one only gives the thread up when it
+// parks or yields, and it never does either holding a paging lock, so the
+// locks work exactly as they do between plain threads.
+//
+#define DEFAULT_FIBERS_PER_THREAD   0   // Plain threads
+#define MAX_FIBERS_PER_THREAD       1024
+#define FIBER_STACK_SIZE            (64 * 1024)
+
+typedef struct _fiberPool fiberPool;
+
+typedef VOID (*fiberRoutine)(PVOID context);
+
+typedef struct {
+    fiberPool* pool;
+    PVOID fiber;
+    fiberRoutine run;
+    PVOID context;
+    volatile LONG* waitingOn;       // Runnable once this is nonzero, NULL when it is already
+    BOOL done;
+} fiberTask;
+
+struct _fiberPool {
+    PVOID home;                     // The thread's own fiber, which picks what runs next
+    fiberTask* tasks;
+    ULONG count;
+    ULONG live;                     // Not done yet
+    fiberTask* running;
+    scheduler* help;                // Background work to run while every fiber waits, or NULL
+    ULONG64 switches;
+    ULONG64 parks;
+    ULONG64 idle;                   // Rounds every fiber was waiting
+};
+
+//
+// Function declarations
+//
+BOOL fiberPoolRun(fiberPool* pool, ULONG count, fiberRoutine run, PVOID* contexts, scheduler* help);
+BOOL fiberRunning(VOID);
+VOID fiberPark(volatile LONG* flag);
+VOID fiberYield(VOID);
+
+#endif // FIBER_H
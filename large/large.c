@@ -0,0 +1,580 @@
+//
+// large.c
+// Large frames for densely used regions
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+#include "../util/util.h"
+#include "../vm/vm.h"
+#include "large.h"
+#include "../pt/pt.h"
+#include "../list/list.h"
+#include "../trace/trace.h"
+#include "../platform/platform.h"
+#include "../api/libvm.h"
+
+static int compareFrames(const void* a, const void* b) {
+    ULONG_PTR x = *(const ULONG_PTR*) a;
+    ULONG_PTR y = *(const ULONG_PTR*) b;
+
+    return x < y ? -1 : x > y;
+}
+
+//
+// Take up to config.largePages large frames out of the free list.  Only
+// runs of frames the host happened to hand over in order can be used, so
+// there may be fewer than asked for.
+//
+VOID largeFramesInitialize(vmInstance* vm) {
+    ULONG64 wanted = vm->config.largePages;
+    ULONG64 count = vm->physicalPageCount;
+    PULONG_PTR sorted;
+
+    vm->largeFree = 0;
+    vm->largeSplitCount = 0;
+    vm->largeCapacity = 0;
+    vm->promoteHead = 0;
+    vm->promoteTail = 0;
+    vm->promoteSpace = NULL;
+    vm->largeWanted = FALSE;
+    if (wanted == 0) {
+        return;
+    }
+
+    vm->largeFrames = initialize(wanted * sizeof(ULONG64));
+    vm->largeSplit = initialize(wanted * sizeof(ULONG64));
+    sorted = initialize(count * sizeof(ULONG_PTR));
+    memcpy(sorted, vm->physicalPageNumbers, count * sizeof(ULONG_PTR));
+    qsort(sorted, count, sizeof(ULONG_PTR), compareFrames);
+
+    acquireLock(&vm->lockFreeList, USER);
+    for (ULONG64 i = 0; i + LARGE_PAGE_PAGES <= count && vm->largeFree < wanted; i++) {
+        ULONG_PTR base = sorted[i];
+
+        if (base % LARGE_PAGE_PAGES != 0 || sorted[i + LARGE_PAGE_PAGES - 1] != base + LARGE_PAGE_PAGES - 1) {
+            continue;
+        }
+        for (ULONG64 j = 0; j < LARGE_PAGE_PAGES; j++) {
+            pfn* page = frameNumber2pfn(vm, base + j);
+
+            linkRemovePFN(vm, page);
+            pageSetStatus(vm, page, LARGE_FREE);
+        }
+        vm->largeFrames[vm->largeFree++] = base;
+        i += LARGE_PAGE_PAGES - 1;
+    }
+    releaseLock(&vm->lockFreeList, USER);
+
+    free(sorted);
+    vm->largeCapacity = vm->largeFree;
+    if (vm->largeCapacity < wanted) {
+        printf ("largeFramesInitialize : only %llu of %llu large frames are contiguous\n", vm->largeCapacity, wanted);
+    }
+}
+
+VOID largeFramesFree(vmInstance* vm) {
+    free(vm->largeFrames);
+    free(vm->largeSplit);
+    vm->largeFrames = NULL;
+    vm->largeSplit = NULL;
+}
+
+//
+// A free large frame on node if there is one, any other otherwise.  There
+// has to be one.
+//
+static ULONG64 takeLargeFrame(vmInstance* vm, ULONG node) {
+    ULONG64 last = vm->largeFree - 1;
+    ULONG64 base = vm->largeFrames[last];
+
+    for (ULONG64 i = vm->largeFree; i-- != 0; ) {
+        if (frameNumber2pfn(vm, vm->largeFrames[i])->node == node) {
+            base = vm->largeFrames[i];
+            vm->largeFrames[i] = vm->largeFrames[last];
+            break;
+        }
+    }
+    vm->largeFree = last;
+    return base;
+}
+
+//
+// Put a large frame back with the free ones.  None of its frames may be on
+// a list.
+//
+static VOID giveLargeFrame(vmInstance* vm, ULONG64 base) {
+    for (ULONG64 i = 0; i < LARGE_PAGE_PAGES; i++) {
+        pfn* page = frameNumber2pfn(vm, base + i);
+
+        pfnSetPte(page, NULL, NULL);
+        page->diskIndex = 0;
+        pageSetStatus(vm, page, LARGE_FREE);
+    }
+    vm->largeFrames[vm->largeFree++] = base;
+}
+
+static VOID setTransition(pte* x, ULONG64 frameNumber) {
+    pte entry;
+
+    entry.zero = 0;
+    entry.transition.transition = TRANSITION;
+    entry.transition.frameNumber = frameNumber;
+    *x = entry;
+}
+
+static BOOL inTransition(pte* x, ULONG64 frameNumber) {
+    return x->valid.valid == INVALID && x->transition.transition == TRANSITION && x->transition.frameNumber == frameNumber;
+}
+
+//
+// A READING frame whose PTE was taken away while the PTE lock was dropped.
+// A snapshot hands it on to a prototype, contents and all, and it goes to
+// the modified list as if it had been trimmed.  Otherwise nobody wants it.
+//
+static VOID largeOrphan(vmInstance* vm, ULONG64 frameNumber) {
+    pfn* page = frameNumber2pfn(vm, frameNumber);
+    pte* owner = pfnPte(vm, page);
+
+    if (owner == NULL || inTransition(owner, frameNumber) == FALSE) {
+        freePage(vm, page);
+        return;
+    }
+
+    page->priority = STANDBY_PRIORITY_NORMAL;
+    acquireLock(&vm->lockModifiedList, USER);
+    pageSetStatus(vm, page, MODIFIED);
+    linkAdd(vm, page, &vm->headModifiedList);
+    releaseLock(&vm->lockModifiedList, USER);
+
+    // The trim task passes it on to the writer along with its own
+    taskSignal(&vm->sched, &vm->taskTrim);
+}
+
+//
+// Give the PTE at index the frame, as part of a large page
+//
+static VOID activateLarge(addressSpace* space, ULONG64 index, ULONG64 frameNumber) {
+    vmInstance* vm = space->vm;
+    pfn* page = frameNumber2pfn(vm, frameNumber);
+    pte entry;
+
+    page->diskIndex = 0;
+    pfnSetPte(page, space, space->ptes + index);
+    pageSetStatus(vm, page, ACTIVE);
+
+    entry.zero = 0;
+    entry.large.valid = VALID;
+    entry.large.frameNumber = frameNumber;
+    entry.large.large = 1;
+    space->ptes[index] = entry;
+}
+
+//
+// Keep count of the pages mapped in x's region, and queue the region to be
+// promoted once all of them are
+//
+VOID largeResident(addressSpace* space, pte* x, LONG delta) {
+    vmInstance* vm = space->vm;
+    ULONG64 region;
+
+    if (space->regionActive == NULL) {
+        return;
+    }
+
+    region = (x - space->ptes) / LARGE_PAGE_PAGES;
+    space->regionActive[region] += (USHORT) delta;
+    ASSERT(space->regionActive[region] <= LARGE_PAGE_PAGES);
+
+    // With no free large frame, a split one may be put back together for it
+    if (delta <= 0 || space->regionActive[region] != LARGE_PAGE_PAGES || (vm->largeFree == 0 && vm->largeSplitCount == 0)) {
+        return;
+    }
+    if (vm->promoteTail - vm->promoteHead < PROMOTE_QUEUE_SIZE) {
+        pageRange* request = &vm->promoteQueue[vm->promoteTail % PROMOTE_QUEUE_SIZE];
+        request->space = space;
+        request->startPage = region * LARGE_PAGE_PAGES;
+        request->endPage = request->startPage + LARGE_PAGE_PAGES;
+        request->priority = 0;
+        vm->promoteTail++;
+    }
+    taskSignal(&vm->sched, &vm->taskPromote);
+}
+
+//
+// A demand zero fault on a region none of whose pages were ever touched
+// maps all of it with a large frame.  x is demand zero in a committed
+// range.  Returns FALSE to leave the fault to a small frame.
+//
+// The frame is zeroed with the PTE lock dropped, the way readInFlight in
+// pt/pt.c reads a page in : every PTE of the region is in transition
+// pointing at its frame, which is READING, so faults on the region wait
+// and a decommit, discard or snapshot just takes PTEs away.  If one did,
+// x is left invalid for the caller to retry the fault, and the frames go
+// back to the large ones - unless a snapshot took one over, which splits
+// the large frame.
+//
+// Called and returns with the PTE lock held.
+//
+BOOL largeFault(addressSpace* space, pte* x, threadInfo* info) {
+    vmInstance* vm = space->vm;
+    ULONG64 first = (ULONG64) (x - space->ptes) & ~((ULONG64) LARGE_PAGE_PAGES - 1);
+    ULONG_PTR frames[LARGE_PAGE_PAGES];
+    ULONG64 base;
+    ULONG64 kept = 0;
+    ULONG64 taken = 0;
+    vad* range;
+
+    if (space->regionActive == NULL || first + LARGE_PAGE_PAGES > space->numPtes) {
+        return FALSE;
+    }
+    if (space->regionActive[first / LARGE_PAGE_PAGES] != 0) {
+        return FALSE;
+    }
+
+    // The whole region has to be one committed range
+    range = vadFind(space->vadRoot, first);
+    if (range == NULL || range->state != VAD_COMMITTED || range->endPage < first + LARGE_PAGE_PAGES) {
+        return FALSE;
+    }
+    // Pages out on the pagefile or in transition still have contents
+    for (ULONG64 i = 0; i < LARGE_PAGE_PAGES; i++) {
+        if (space->ptes[first + i].zero != 0) {
+            return FALSE;
+        }
+    }
+    // Have the promote task put a split one together for next time
+    if (vm->largeFree == 0) {
+        if (vm->largeSplitCount != 0) {
+            vm->largeWanted = TRUE;
+            taskSignal(&vm->sched, &vm->taskPromote);
+        }
+        return FALSE;
+    }
+
+    TRACE_BEGIN("largeFault");
+    base = takeLargeFrame(vm, info->node);
+    for (ULONG64 i = 0; i < LARGE_PAGE_PAGES; i++) {
+        pfn* page = frameNumber2pfn(vm, base + i);
+
+        pfnSetPte(page, space, space->ptes + first + i);
+        page->diskIndex = 0;
+        pageSetStatus(vm, page, READING);
+        setTransition(space->ptes + first + i, base + i);
+    }
+    releaseLock(&vm->lockPTE, USER);
+
+    for (ULONG64 i = 0; i < LARGE_PAGE_PAGES; i++) {
+        vm->platform->zeroPage(base + i, info);
+    }
+
+    acquireLockPTE(vm, NULL, USER);
+    for (ULONG64 i = 0; i < LARGE_PAGE_PAGES; i++) {
+        if (inTransition(space->ptes + first + i, base + i)) {
+            kept++;
+        }
+    }
+
+    if (kept == LARGE_PAGE_PAGES) {
+        for (ULONG64 i = 0; i < LARGE_PAGE_PAGES; i++) {
+            frames[i] = base + i;
+            activateLarge(space, first + i, base + i);
+        }
+        BOOL b = vm->platform->map(vm, pte2va(space, space->ptes + first), LARGE_PAGE_PAGES, frames);
+        ASSERT(b);
+
+        InterlockedAdd64(&space->activeCount, LARGE_PAGE_PAGES);
+        space->regionActive[first / LARGE_PAGE_PAGES] = LARGE_PAGE_PAGES;
+        statsAdd(&vm->stats, STAT_PAGES_ACTIVATED, LARGE_PAGE_PAGES);
+        statsAdd(&vm->stats, STAT_LARGE_FAULTS, 1);
+        TRACE_END("largeFault", "page", first);
+        return TRUE;
+    }
+
+    // The PTEs still waiting on it go back to demand zero
+    for (ULONG64 i = 0; i < LARGE_PAGE_PAGES; i++) {
+        if (inTransition(space->ptes + first + i, base + i)) {
+            space->ptes[first + i].zero = 0;
+        }
+    }
+    for (ULONG64 i = 0; i < LARGE_PAGE_PAGES; i++) {
+        pte* owner = pfnPte(vm, frameNumber2pfn(vm, base + i));
+
+        if (owner != NULL && inTransition(owner, base + i)) {
+            taken++;
+        }
+    }
+    if (taken == 0) {
+        giveLargeFrame(vm, base);
+    } else {
+        for (ULONG64 i = 0; i < LARGE_PAGE_PAGES; i++) {
+            largeOrphan(vm, base + i);
+        }
+        vm->largeSplit[vm->largeSplitCount++] = base;
+        statsAdd(&vm->stats, STAT_LARGE_DEMOTIONS, 1);
+    }
+    TRACE_END("largeFault", "cancelled", 1);
+    return TRUE;
+}
+
+//
+// Split the large page x is in back into small pages.  Each PTE already has
+// a frame of its own and stays mapped, so only the large bits go.
+//
+VOID largeDemote(addressSpace* space, pte* x) {
+    vmInstance* vm = space->vm;
+    ULONG64 first = (ULONG64) (x - space->ptes) & ~((ULONG64) LARGE_PAGE_PAGES - 1);
+
+    for (ULONG64 i = 0; i < LARGE_PAGE_PAGES; i++) {
+        ASSERT(space->ptes[first + i].valid.valid == VALID && space->ptes[first + i].large.large);
+        space->ptes[first + i].large.large = 0;
+    }
+
+    // Kept so largeReclaim can put it back together once its frames are free
+    ASSERT(space->ptes[first].valid.frameNumber % LARGE_PAGE_PAGES == 0);
+    vm->largeSplit[vm->largeSplitCount++] = space->ptes[first].valid.frameNumber;
+    statsAdd(&vm->stats, STAT_LARGE_DEMOTIONS, 1);
+}
+
+//
+// A large page decommitted in full gives its frame straight back to the
+// large ones, rather than being split up onto the free list.  x is the
+// first PTE of the region.
+//
+VOID largeRelease(addressSpace* space, pte* x) {
+    vmInstance* vm = space->vm;
+    ULONG64 first = x - space->ptes;
+    ULONG64 base = x->valid.frameNumber;
+
+    ASSERT(first % LARGE_PAGE_PAGES == 0 && base % LARGE_PAGE_PAGES == 0);
+    BOOL b = vm->platform->map(vm, pte2va(space, x), LARGE_PAGE_PAGES, NULL);
+    ASSERT(b);
+
+    for (ULONG64 i = 0; i < LARGE_PAGE_PAGES; i++) {
+        ASSERT(space->ptes[first + i].large.large && space->ptes[first + i].valid.frameNumber == base + i);
+        space->ptes[first + i].zero = 0;
+    }
+    giveLargeFrame(vm, base);
+
+    InterlockedAdd64(&space->activeCount, -LARGE_PAGE_PAGES);
+    space->regionActive[first / LARGE_PAGE_PAGES] = 0;
+}
+
+//
+// Put split large frames whose every frame has come back to the free list
+// together again.  The pool lock comes first, so no frame is on its way on
+// to or off the free list without it - under it and the PTE lock a FREE
+// frame is on the free list.  Frames the pool gave back to the host are
+// not FREE, and keep theirs from ever coming back.
+//
+static VOID largeReclaim(vmInstance* vm) {
+    ULONG64 reclaimed = 0;
+
+    acquireLock(&vm->lockPool, USER);
+    acquireLockPTE(vm, NULL, USER);
+    acquireLock(&vm->lockFreeList, USER);
+
+    vm->largeWanted = FALSE;
+    for (ULONG64 s = 0; s < vm->largeSplitCount; ) {
+        ULONG64 base = vm->largeSplit[s];
+        ULONG64 i = 0;
+
+        while (i < LARGE_PAGE_PAGES && frameNumber2pfn(vm, base + i)->status == FREE) {
+            i++;
+        }
+        if (i != LARGE_PAGE_PAGES) {
+            s++;
+            continue;
+        }
+
+        for (i = 0; i < LARGE_PAGE_PAGES; i++) {
+            linkRemovePFN(vm, frameNumber2pfn(vm, base + i));
+        }
+        giveLargeFrame(vm, base);
+        vm->largeSplit[s] = vm->largeSplit[--vm->largeSplitCount];
+        reclaimed++;
+    }
+
+    releaseLock(&vm->lockFreeList, USER);
+    releaseLock(&vm->lockPTE, USER);
+    releaseLock(&vm->lockPool, USER);
+
+    if (reclaimed != 0) {
+        TRACE_INSTANT("largeReclaim", "frames", reclaimed);
+    }
+}
+
+//
+// Copy a region whose pages are all mapped into a large frame.  Regions
+// that lost a page since they were queued are left alone.
+//
+// The copy is made with the PTE lock dropped.  Meanwhile the region is
+// unmapped and each PTE is in transition pointing at its own frame, which
+// is READING, just as largeFault does with the frames it zeroes.  If any
+// PTE was taken away, what is left of the region is mapped again as it
+// was and the large frame goes back unused.
+//
+// Called and returns with the PTE lock held.
+//
+static VOID largePromote(threadInfo* info, addressSpace* space, ULONG64 first) {
+    vmInstance* vm = space->vm;
+    ULONG_PTR small[LARGE_PAGE_PAGES];
+    ULONG_PTR frames[LARGE_PAGE_PAGES];
+    PVOID batch[LARGE_PAGE_PAGES];
+    PVOID va = pte2va(space, space->ptes + first);
+    ULONG64 base;
+    ULONG64 kept = 0;
+
+    if (vm->largeFree == 0) {
+        return;
+    }
+    for (ULONG64 i = 0; i < LARGE_PAGE_PAGES; i++) {
+        pte* x = space->ptes + first + i;
+        if (x->valid.valid != VALID || x->large.large) {
+            return;
+        }
+    }
+
+    // Stay on the node the region's pages were faulted in on
+    base = takeLargeFrame(vm, frameNumber2pfn(vm, space->ptes[first].valid.frameNumber)->node);
+    BOOL b = vm->platform->map(vm, va, LARGE_PAGE_PAGES, NULL);
+    ASSERT(b);
+
+    // Not active meanwhile, so a page of it decommitted and faulted in again counts on its own
+    for (ULONG64 i = 0; i < LARGE_PAGE_PAGES; i++) {
+        small[i] = space->ptes[first + i].valid.frameNumber;
+        pageSetStatus(vm, frameNumber2pfn(vm, small[i]), READING);
+        setTransition(space->ptes + first + i, small[i]);
+    }
+    InterlockedAdd64(&space->activeCount, -LARGE_PAGE_PAGES);
+    space->regionActive[first / LARGE_PAGE_PAGES] = 0;
+    releaseLock(&vm->lockPTE, USER);
+
+    for (ULONG64 i = 0; i < LARGE_PAGE_PAGES; i++) {
+        vm->platform->copyPage(small[i], base + i, info);
+    }
+
+    acquireLockPTE(vm, NULL, USER);
+    for (ULONG64 i = 0; i < LARGE_PAGE_PAGES; i++) {
+        if (inTransition(space->ptes + first + i, small[i])) {
+            kept++;
+        }
+    }
+
+    if (kept == LARGE_PAGE_PAGES) {
+        for (ULONG64 i = 0; i < LARGE_PAGE_PAGES; i++) {
+            freePage(vm, frameNumber2pfn(vm, small[i]));
+            frames[i] = base + i;
+            activateLarge(space, first + i, base + i);
+        }
+
+        b = vm->platform->map(vm, va, LARGE_PAGE_PAGES, frames);
+        ASSERT(b);
+
+        InterlockedAdd64(&space->activeCount, LARGE_PAGE_PAGES);
+        space->regionActive[first / LARGE_PAGE_PAGES] = LARGE_PAGE_PAGES;
+        statsAdd(&vm->stats, STAT_LARGE_PROMOTIONS, 1);
+        return;
+    }
+
+    kept = 0;
+    for (ULONG64 i = 0; i < LARGE_PAGE_PAGES; i++) {
+        pte* x = space->ptes + first + i;
+
+        if (inTransition(x, small[i])) {
+            pageSetStatus(vm, frameNumber2pfn(vm, small[i]), ACTIVE);
+            x->zero = 0;
+            x->valid.valid = VALID;
+            x->valid.frameNumber = small[i];
+            batch[kept] = pte2va(space, x);
+            frames[kept] = small[i];
+            kept++;
+            InterlockedIncrement64(&space->activeCount);
+            largeResident(space, x, 1);
+        } else {
+            largeOrphan(vm, small[i]);
+        }
+    }
+    if (kept != 0) {
+        b = vm->platform->mapScatter(vm, batch, kept, frames);
+        ASSERT(b);
+    }
+    vm->largeFrames[vm->largeFree++] = base;
+}
+
+//
+// Promote the region at the head of the queue.  Returns FALSE when the
+// queue is empty.
+//
+BOOL promoteNext(vmInstance* vm, threadInfo* info) {
+    pageRange request;
+
+    // Only a glance without the locks - largeReclaim looks again under them
+    if ((vm->promoteHead != vm->promoteTail || vm->largeWanted) && vm->largeFree == 0 && vm->largeSplitCount != 0) {
+        largeReclaim(vm);
+    }
+
+    acquireLockPTE(vm, NULL, USER);
+    if (vm->promoteHead == vm->promoteTail) {
+        releaseLock(&vm->lockPTE, USER);
+        return FALSE;
+    }
+    request = vm->promoteQueue[vm->promoteHead % PROMOTE_QUEUE_SIZE];
+    vm->promoteHead++;
+
+    // Cancelled when its space went away
+    if (request.space != NULL) {
+        TRACE_BEGIN("promote");
+        vm->promoteSpace = request.space;
+        largePromote(info, request.space, request.startPage);
+        vm->promoteSpace = NULL;
+        TRACE_END("promote", "page", request.startPage);
+    }
+    releaseLock(&vm->lockPTE, USER);
+    return TRUE;
+}
+
+//
+// Drop the regions queued against a space that is going away and wait out
+// one the task is already copying.
+//
+VOID cancelPromote(addressSpace* space) {
+    vmInstance* vm = space->vm;
+
+    while (TRUE) {
+        acquireLockPTE(vm, NULL, USER);
+        for (ULONG64 i = vm->promoteHead; i != vm->promoteTail; i++) {
+            if (vm->promoteQueue[i % PROMOTE_QUEUE_SIZE].space == space) {
+                vm->promoteQueue[i % PROMOTE_QUEUE_SIZE].space = NULL;
+            }
+        }
+        BOOL busy = vm->promoteSpace == space;
+        releaseLock(&vm->lockPTE, USER);
+
+        if (busy == FALSE) {
+            return;
+        }
+        Sleep(0);
+    }
+}
+
+static VOID promoteTask(task* work) {
+    threadInfo* info = (threadInfo*) work->context;
+
+    while (promoteNext(info->vm, info)) {
+    }
+}
+
+VOID promoteStart(vmInstance* vm) {
+
+    // Copying into a large frame needs a transfer VA just like a faulting thread
+    threadInfo* info = vmAttachThread(vm);
+
+    taskInitialize(&vm->taskPromote, "promote", promoteTask, info, TASK_PRIORITY_LOW, TASK_ANY_WORKER);
+}
+
+// Only once the workers are gone
+VOID promoteStop(vmInstance* vm) {
+    vmDetachThread((threadInfo*) vm->taskPromote.context);
+}
@@ -0,0 +1,50 @@
+//
+// large.h
+// Large frames for densely used regions
+//
+
+#ifndef LARGE_H
+#define LARGE_H
+
+#include <windows.h>
+#include "../vm/vm.h"
+
+//
+// A region gets a large frame in one of two ways.  A demand zero fault on
+// a region that was never touched takes one and maps the whole region with
+// a single call.  A region whose pages all came in one at a time is queued
+// once the last of them is mapped, and the promote task copies it into a
+// large frame.  Either way every one of its PTEs gets the large bit.
+//
+// The trimmer passes large pages over, a region at a time, and only splits
+// one back into small pages when that is all it has left to trim.  So does
+// discard, and decommit for a large page it only takes part of - one it
+// takes in full goes straight back to the large frames.  Splitting is only
+// bookkeeping - the frames stay where they are, as small pages - and the
+// split large frame is remembered.  Once all of its frames are back on the
+// free list, the promote task puts it together again when it has a region
+// and no free large frame to copy it into, or a large fault found none.
+//
+// The frames of a free large frame are LARGE_FREE and on no list, so the
+// pool never gives them back to the host.
+//
+// Everything here is done under the PTE lock, but the zeroing and the copy
+// drop it, with the region's PTEs in transition and its frames READING
+// meanwhile.
+//
+
+//
+// Function declarations
+//
+VOID largeFramesInitialize(vmInstance* vm);
+VOID largeFramesFree(vmInstance* vm);
+BOOL largeFault(addressSpace* space, pte* x, threadInfo* info);
+VOID largeResident(addressSpace* space, pte* x, LONG delta);
+VOID largeDemote(addressSpace* space, pte* x);
+VOID largeRelease(addressSpace* space, pte* x);
+BOOL promoteNext(vmInstance* vm, threadInfo* info);
+VOID cancelPromote(addressSpace* space);
+VOID promoteStart(vmInstance* vm);
+VOID promoteStop(vmInstance* vm);
+
+#endif // LARGE_H
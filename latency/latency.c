@@ -0,0 +1,132 @@
+//
+// latency.c
+// Fault latency histograms
+//
+
+#include <windows.h>
+#include "latency.h"
+
+static const char* kindNames[FAULT_KINDS] = {
+    "valid",
+    "rescue",
+    "demandZero",
+    "hard",
+    "starved"
+};
+
+static const char* phaseNames[FAULT_PHASES] = {
+    "lockWait",
+    "frame",
+    "contents",
+    "map"
+};
+
+static const char* startupNames[STARTUP_PHASES] = {
+    "frames",
+    "pfn",
+    "disk",
+    "freeList",
+    "threads",
+    "spaces"
+};
+
+static ULONG bucketOf(ULONG64 value) {
+    unsigned long msb;
+
+    if (value < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return (ULONG) value;
+    }
+
+    _BitScanReverse64(&msb, value);
+    ULONG shift = msb - HISTOGRAM_SUB_BUCKET_BITS;
+
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (ULONG) ((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+// The largest value that lands in a bucket
+static ULONG64 bucketTop(ULONG bucket) {
+    if (bucket < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    ULONG shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    ULONG64 sub = bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+
+    return ((sub + 1) << shift) - 1;
+}
+
+VOID histogramRecord(histogram* h, ULONG64 value) {
+    h->counts[bucketOf(value)]++;
+    h->total++;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+VOID histogramMerge(histogram* into, const histogram* from) {
+    for (ULONG b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        into->counts[b] += from->counts[b];
+    }
+    into->total += from->total;
+    into->max = max(into->max, from->max);
+}
+
+ULONG64 histogramPercentile(const histogram* h, double percentile) {
+    ULONG64 rank = (ULONG64) (h->total * percentile / 100.0 + 0.5);
+    ULONG64 seen = 0;
+
+    if (h->total == 0) {
+        return 0;
+    }
+    rank = max(rank, 1);
+
+    for (ULONG b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank) {
+            return min(bucketTop(b), h->max);
+        }
+    }
+    return h->max;
+}
+
+VOID latencyMerge(faultLatency* into, const faultLatency* from) {
+    for (ULONG k = 0; k < FAULT_KINDS; k++) {
+        histogramMerge(&into->kinds[k], &from->kinds[k]);
+    }
+    for (ULONG p = 0; p < FAULT_PHASES; p++) {
+        histogramMerge(&into->phases[p], &from->phases[p]);
+    }
+}
+
+//
+// A histogram kept in units of nsPerUnit nanoseconds, summarized in ns
+//
+VOID latencySummarizeScaled(const histogram* h, latencySummary* summary, double nsPerUnit) {
+    summary->count = h->total;
+    summary->p50 = (ULONG64) (histogramPercentile(h, 50) * nsPerUnit);
+    summary->p99 = (ULONG64) (histogramPercentile(h, 99) * nsPerUnit);
+    summary->p999 = (ULONG64) (histogramPercentile(h, 99.9) * nsPerUnit);
+    summary->max = (ULONG64) (h->max * nsPerUnit);
+}
+
+//
+// Histograms are kept in performance counter ticks, summaries are in ns
+//
+VOID latencySummarize(const histogram* h, latencySummary* summary) {
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    latencySummarizeScaled(h, summary, 1e9 / frequency.QuadPart);
+}
+
+const char* latencyKindName(ULONG kind) {
+    return kindNames[kind];
+}
+
+const char* latencyPhaseName(ULONG phase) {
+    return phaseNames[phase];
+}
+
+const char* latencyStartupName(ULONG phase) {
+    return startupNames[phase];
+}
@@ -0,0 +1,109 @@
+//
+// latency.h
+// Fault latency histograms
+//
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <windows.h>
+
+//
+// Log-linear (HDR style) buckets : values below 2 * HISTOGRAM_SUB_BUCKETS
+// get a bucket each, above that every power of two is split into
+// HISTOGRAM_SUB_BUCKETS equal buckets, so any value is recorded to within
+// about 3% over the full 64 bit range.
+//
+#define HISTOGRAM_SUB_BUCKET_BITS   5
+#define HISTOGRAM_SUB_BUCKETS       (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS           ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+    ULONG64 counts[HISTOGRAM_BUCKETS];
+    ULONG64 total;
+    ULONG64 max;
+} histogram;
+
+//
+// How a fault was resolved
+//
+#define FAULT_VALID                 0   // Another thread mapped the page first
+#define FAULT_RESCUE                1   // Taken back off the modified or standby list
+#define FAULT_DEMAND_ZERO           2
+#define FAULT_HARD                  3   // Read back from the pagefile
+#define FAULT_STARVED               4   // No frames, waited and returned REDO
+
+#define FAULT_KINDS                 5
+
+//
+// Where the time inside a fault went
+//
+#define PHASE_LOCK_WAIT             0   // Getting the PTE lock
+#define PHASE_FRAME                 1   // Taking a frame off a list (or rescuing one)
+#define PHASE_CONTENTS              2   // Zeroing it or reading it in
+#define PHASE_MAP                   3   // Mapping it at the faulting address
+
+#define FAULT_PHASES                4
+
+//
+// Where creating an instance spent its time
+//
+#define STARTUP_FRAMES              0   // Getting frames from the platform
+#define STARTUP_PFN                 1   // Committing their PFN entries
+#define STARTUP_DISK                2
+#define STARTUP_FREE_LIST           3
+#define STARTUP_THREADS             4
+#define STARTUP_SPACES              5   // Page tables of the initial spaces
+
+#define STARTUP_PHASES              6
+
+typedef struct {
+    ULONG64 us[STARTUP_PHASES];     // In microseconds
+    ULONG64 totalUs;
+} startupTimes;
+
+//
+// One per attached thread, only ever written by that thread.  Merging
+// reads them while they are being written, which at worst misses a
+// fault or two in flight.
+//
+typedef struct {
+    LIST_ENTRY entry;
+    histogram kinds[FAULT_KINDS];
+    histogram phases[FAULT_PHASES];
+} faultLatency;
+
+typedef struct {
+    ULONG64 count;
+    ULONG64 p50;                    // In nanoseconds, like everything below
+    ULONG64 p99;
+    ULONG64 p999;
+    ULONG64 max;
+} latencySummary;
+
+static inline ULONG64 latencyNow(VOID) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+static inline ULONG64 latencyMicroseconds(ULONG64 ticks) {
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return ticks * 1000000 / frequency.QuadPart;
+}
+
+//
+// Function declarations
+//
+VOID histogramRecord(histogram* h, ULONG64 value);
+VOID histogramMerge(histogram* into, const histogram* from);
+ULONG64 histogramPercentile(const histogram* h, double percentile);
+VOID latencyMerge(faultLatency* into, const faultLatency* from);
+VOID latencySummarize(const histogram* h, latencySummary* summary);
+VOID latencySummarizeScaled(const histogram* h, latencySummary* summary, double nsPerUnit);
+const char* latencyKindName(ULONG kind);
+const char* latencyPhaseName(ULONG phase);
+const char* latencyStartupName(ULONG phase);
+
+#endif // LATENCY_H
@@ -7,43 +7,149 @@
 #include "../vm/vm.h"
 #include "list.h"
 #include "../util/util.h"
+#include "../platform/platform.h"
+#include "../pt/pt.h"
 
-// Global list heads
-LIST_ENTRY headFreeList;
-LIST_ENTRY headModifiedList;
-LIST_ENTRY headStandbyList;
+VOID initializeListHead(LIST_ENTRY* head) {
+    head->Flink = head;
+    head->Blink = head;
+}
+
+VOID initializeListHeads(vmInstance* vm) {
+    initializePfnList(&vm->headModifiedList);
+    for (ULONG n = 0; n < MAX_NUMA_NODES; n++) {
+        initializePfnList(&vm->headFreeList[n]);
+        for (ULONG p = 0; p < STANDBY_PRIORITIES; p++) {
+            initializePfnList(&vm->headStandbyList[n][p]);
+        }
+    }
+}
+
+VOID initializeListLocks(vmInstance* vm) {
+    InitializeCriticalSection(&vm->lockFreeList);
+    InitializeCriticalSection(&vm->lockModifiedList);
+    InitializeCriticalSection(&vm->lockStandbyList);
+    InitializeCriticalSection(&vm->lockPTE);
+
+    lockProfileName(&vm->lockFreeList, "lockFreeList");
+    lockProfileName(&vm->lockModifiedList, "lockModifiedList");
+    lockProfileName(&vm->lockStandbyList, "lockStandbyList");
+    lockProfileName(&vm->lockPTE, "lockPTE");
+}
+
+#if VM_COMPACT_PFN
+
+VOID initializePfnList(pfnListHead* head) {
+    head->first = PFN_LINK_NONE;
+    head->last = PFN_LINK_NONE;
+}
 
-// Global list locks
-CRITICAL_SECTION lockFreeList;
-CRITICAL_SECTION lockModifiedList;
-CRITICAL_SECTION lockStandbyList;
+VOID linkAdd(vmInstance* vm, pfn* page, pfnListHead* head) {
+    ULONG frame = (ULONG) (page - vm->pfnStart);
 
-CRITICAL_SECTION lockPTE;
+    page->flink = PFN_LINK_NONE;
+    page->blink = head->last;
+    if (head->last == PFN_LINK_NONE) {
+        head->first = frame;
+    } else {
+        vm->pfnStart[head->last].flink = frame;
+    }
+    head->last = frame;
+}
+
+pfn* linkRemoveHead(vmInstance* vm, pfnListHead* head) {
+    if (isEmpty(head)) {
+        return NULL;
+    }
 
-VOID initializeListHeads() {
-    headFreeList.Flink = &headFreeList;
-    headFreeList.Blink = &headFreeList;
-    headModifiedList.Flink = &headModifiedList;
-    headModifiedList.Blink = &headModifiedList;
-    headStandbyList.Flink = &headStandbyList;
-    headStandbyList.Blink = &headStandbyList;
+    pfn* page = vm->pfnStart + head->first;
+    head->first = page->flink;
+    if (head->first == PFN_LINK_NONE) {
+        head->last = PFN_LINK_NONE;
+    } else {
+        vm->pfnStart[head->first].blink = PFN_LINK_NONE;
+    }
+    return page;
 }
 
-VOID initializeListLocks() {
-    InitializeCriticalSection(&lockFreeList);
-    InitializeCriticalSection(&lockModifiedList);
-    InitializeCriticalSection(&lockStandbyList);
-    InitializeCriticalSection(&lockPTE);
+//
+// Without a sentinel the ends of a list are in its head, which is found
+// from the status - pages only come off lists of the instance this way
+//
+static pfnListHead* listOf(vmInstance* vm, pfn* page) {
+    switch (page->status) {
+    case FREE:
+        return &vm->headFreeList[page->node];
+    case MODIFIED:
+        return &vm->headModifiedList;
+    case STANDBY:
+        return &vm->headStandbyList[page->node][page->priority];
+    }
+    ASSERT(FALSE);
+    return NULL;
 }
 
-VOID linkAdd(pfn* pfn, LIST_ENTRY* head) {
+pfn* linkRemovePFN(vmInstance* vm, pfn* page) {
+    pfnListHead* head = listOf(vm, page);
+
+    if (page->blink == PFN_LINK_NONE) {
+        head->first = page->flink;
+    } else {
+        vm->pfnStart[page->blink].flink = page->flink;
+    }
+    if (page->flink == PFN_LINK_NONE) {
+        head->last = page->blink;
+    } else {
+        vm->pfnStart[page->flink].blink = page->blink;
+    }
+    return page;
+}
+
+//
+// Move everything on from to the tail of head, leaving from empty
+//
+VOID linkSplice(vmInstance* vm, pfnListHead* from, pfnListHead* head) {
+    if (isEmpty(from)) {
+        return;
+    }
+
+    if (isEmpty(head)) {
+        head->first = from->first;
+    } else {
+        vm->pfnStart[head->last].flink = from->first;
+        vm->pfnStart[from->first].blink = head->last;
+    }
+    head->last = from->last;
+    initializePfnList(from);
+}
+
+ULONG64 linkCount(vmInstance* vm, pfnListHead* head) {
+    ULONG64 count = 0;
+
+    for (ULONG link = head->first; link != PFN_LINK_NONE; link = vm->pfnStart[link].flink) {
+        count++;
+    }
+    return count;
+}
+
+BOOL isEmpty(pfnListHead* head) {
+    return head->first == PFN_LINK_NONE;
+}
+
+#else
+
+VOID initializePfnList(pfnListHead* head) {
+    initializeListHead(head);
+}
+
+VOID linkAdd(vmInstance* vm, pfn* pfn, pfnListHead* head) {
     pfn->entry.Flink = head;
     pfn->entry.Blink = head->Blink;
     head->Blink->Flink = &pfn->entry;
     head->Blink = &pfn->entry;
 }
 
-pfn* linkRemoveHead(LIST_ENTRY* head) {
+pfn* linkRemoveHead(vmInstance* vm, pfnListHead* head) {
 
     if (isEmpty(head)) return NULL;
 
@@ -55,12 +161,183 @@ pfn* linkRemoveHead(LIST_ENTRY* head) {
     return freePage;
 }
 
-pfn* linkRemovePFN(pfn* pfn) {
+pfn* linkRemovePFN(vmInstance* vm, pfn* pfn) {
     pfn->entry.Blink->Flink = pfn->entry.Flink;
     pfn->entry.Flink->Blink = pfn->entry.Blink;
     return pfn;
 }
 
-BOOL isEmpty(LIST_ENTRY* head) {
+//
+// Move everything on from to the tail of head, leaving from empty
+//
+VOID linkSplice(vmInstance* vm, pfnListHead* from, pfnListHead* head) {
+    if (isEmpty(from)) {
+        return;
+    }
+
+    from->Flink->Blink = head->Blink;
+    head->Blink->Flink = from->Flink;
+    from->Blink->Flink = head;
+    head->Blink = from->Blink;
+    initializeListHead(from);
+}
+
+ULONG64 linkCount(vmInstance* vm, pfnListHead* head) {
+    ULONG64 count = 0;
+
+    for (LIST_ENTRY* entry = head->Flink; entry != head; entry = entry->Flink) {
+        count++;
+    }
+    return count;
+}
+
+BOOL isEmpty(pfnListHead* head) {
     return (head->Flink == head);
+}
+
+#endif
+
+//
+// One slice of the pool's frames, linked up by its own thread
+//
+typedef struct {
+    vmInstance* vm;
+    ULONG64 first;
+    ULONG64 count;
+    pfnListHead head[MAX_NUMA_NODES];
+} freeSegment;
+
+static DWORD WINAPI buildSegment(LPVOID lpParameter) {
+    freeSegment* segment = (freeSegment*) lpParameter;
+    vmInstance* vm = segment->vm;
+
+    //
+    // The gauge is bumped once for the whole pool afterwards, so no
+    // thread here needs a stats shard
+    //
+    for (ULONG64 j = segment->first; j < segment->first + segment->count; j++) {
+        pfn* free = vm->pfnStart + vm->physicalPageNumbers[j];
+        pfnSetPte(free, NULL, NULL);
+        free->diskIndex = 0;
+        free->status = FREE;
+        linkAdd(vm, free, &segment->head[free->node]);
+    }
+    return 0;
+}
+
+//
+// Put every frame of a new instance on the free list.  Large pools are
+// split into segments linked up in parallel - each touches a different part
+// of the PFN database - and spliced together in order.
+//
+VOID buildFreeList(vmInstance* vm) {
+    freeSegment segments[STARTUP_MAX_THREADS];
+    HANDLE threads[STARTUP_MAX_THREADS];
+    SYSTEM_INFO system;
+    ULONG64 count = vm->physicalPageCount;
+    ULONG64 segmentCount = 1;
+
+    if (vm->platform->simulated == FALSE) {
+        GetSystemInfo(&system);
+        segmentCount = min(min((ULONG64) system.dwNumberOfProcessors, count / STARTUP_SEGMENT_PAGES), STARTUP_MAX_THREADS);
+        segmentCount = max(segmentCount, 1);
+    }
+
+    for (ULONG64 s = 0; s < segmentCount; s++) {
+        segments[s].vm = vm;
+        segments[s].first = count * s / segmentCount;
+        segments[s].count = count * (s + 1) / segmentCount - segments[s].first;
+        for (ULONG n = 0; n < MAX_NUMA_NODES; n++) {
+            initializePfnList(&segments[s].head[n]);
+        }
+    }
+
+    // The caller's thread takes the first segment itself
+    for (ULONG64 s = 1; s < segmentCount; s++) {
+        threads[s] = CreateThread(NULL, 0, buildSegment, &segments[s], 0, NULL);
+        if (threads[s] == NULL) {
+            buildSegment(&segments[s]);
+        }
+    }
+    buildSegment(&segments[0]);
+
+    for (ULONG64 s = 0; s < segmentCount; s++) {
+        if (s != 0 && threads[s] != NULL) {
+            WaitForSingleObject(threads[s], INFINITE);
+            CloseHandle(threads[s]);
+        }
+        for (ULONG n = 0; n < vm->nodeCount; n++) {
+            linkSplice(vm, &segments[s].head[n], &vm->headFreeList[n]);
+        }
+    }
+
+    statsAdd(&vm->stats, STAT_FREE_PAGES, count);
+}
+
+//
+// Every status change goes through here so the page gauges follow the lists
+//
+static const ULONG statusGauge[] = {
+    0,
+    STAT_FREE_PAGES,
+    STAT_ACTIVE_PAGES,
+    STAT_MODIFIED_PAGES,
+    STAT_STANDBY_PAGES,
+    STAT_READING_PAGES,
+    STAT_LARGE_FREE_PAGES,
+};
+
+VOID pageSetStatus(vmInstance* vm, pfn* page, ULONG status) {
+    // Zero is a frame on no list - not added yet, or given back to the host
+    if (page->status != 0) {
+        statsAdd(&vm->stats, statusGauge[page->status], -1);
+    }
+    if (status != 0) {
+        statsAdd(&vm->stats, statusGauge[status], 1);
+    }
+    page->status = status;
+}
+
+//
+// The caller holds lockFreeList for both of these.  A free frame is taken
+// from node first, and only from the other nodes when it has none.
+//
+VOID freeListAdd(vmInstance* vm, pfn* page) {
+    linkAdd(vm, page, &vm->headFreeList[page->node]);
+}
+
+pfn* freeListRemove(vmInstance* vm, ULONG node) {
+    for (ULONG n = 0; n < vm->nodeCount; n++) {
+        pfn* page = linkRemoveHead(vm, &vm->headFreeList[(node + n) % vm->nodeCount]);
+        if (page != NULL) {
+            return page;
+        }
+    }
+    return NULL;
+}
+
+//
+// The caller holds lockStandbyList for both of these.  Repurposing goes by
+// priority first, so a wanted page on node is never given up for one
+// nobody wants on another - node only goes first within a priority.
+//
+VOID standbyAdd(vmInstance* vm, pfn* page, ULONG priority) {
+    pageSetStatus(vm, page, STANDBY);
+    page->priority = priority;
+    linkAdd(vm, page, &vm->headStandbyList[page->node][priority]);
+    InterlockedIncrement64(&vm->standbyAdded[priority]);
+}
+
+pfn* standbyRemoveLowest(vmInstance* vm, ULONG node) {
+    for (ULONG p = 0; p < STANDBY_PRIORITIES; p++) {
+        for (ULONG n = 0; n < vm->nodeCount; n++) {
+            pfn* page = linkRemoveHead(vm, &vm->headStandbyList[(node + n) % vm->nodeCount][p]);
+            if (page != NULL) {
+                InterlockedIncrement64(&vm->standbyRepurposed[p]);
+                statsAdd(&vm->stats, STAT_PAGES_REPURPOSED, 1);
+                return page;
+            }
+        }
+    }
+    return NULL;
 }
\ No newline at end of file
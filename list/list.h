@@ -9,30 +9,24 @@
 #include <windows.h>
 #include "../vm/vm.h"
 
-//
-// Global list heads
-//
-extern LIST_ENTRY headFreeList;
-extern LIST_ENTRY headModifiedList;
-extern LIST_ENTRY headStandbyList;
-
-//
-// Global list locks
-//
-extern CRITICAL_SECTION lockFreeList;
-extern CRITICAL_SECTION lockModifiedList;
-extern CRITICAL_SECTION lockStandbyList;
-
-extern CRITICAL_SECTION lockPTE;
-
 //
 // Function declarations
 //
-VOID initializeListHeads(void);
-VOID initializeListLocks(void);
-VOID linkAdd(pfn* pfn, LIST_ENTRY* head);
-pfn* linkRemoveHead(LIST_ENTRY* head);
-pfn* linkRemovePFN(pfn* pfn);
-BOOL isEmpty(LIST_ENTRY* head);
+VOID initializeListHead(LIST_ENTRY* head);
+VOID initializeListHeads(vmInstance* vm);
+VOID initializeListLocks(vmInstance* vm);
+VOID initializePfnList(pfnListHead* head);
+VOID linkAdd(vmInstance* vm, pfn* pfn, pfnListHead* head);
+pfn* linkRemoveHead(vmInstance* vm, pfnListHead* head);
+pfn* linkRemovePFN(vmInstance* vm, pfn* pfn);
+VOID linkSplice(vmInstance* vm, pfnListHead* from, pfnListHead* head);
+ULONG64 linkCount(vmInstance* vm, pfnListHead* head);
+VOID buildFreeList(vmInstance* vm);
+BOOL isEmpty(pfnListHead* head);
+VOID pageSetStatus(vmInstance* vm, pfn* page, ULONG status);
+VOID freeListAdd(vmInstance* vm, pfn* page);
+pfn* freeListRemove(vmInstance* vm, ULONG node);
+VOID standbyAdd(vmInstance* vm, pfn* page, ULONG priority);
+pfn* standbyRemoveLowest(vmInstance* vm, ULONG node);
 
 #endif // LIST_H
\ No newline at end of file
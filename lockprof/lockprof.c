@@ -0,0 +1,349 @@
+//
+// lockprof.c
+// Lock contention profiler
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include "lockprof.h"
+
+static __declspec(thread) lockThread* current;
+
+static lockThread* volatile lockThreads;
+
+static volatile BOOL captureStacks;
+
+//
+// Names of the locks alive right now.  A lock gives its slot back when it
+// is deleted, so instances coming and going never run the table out or
+// leave a name behind for whatever gets the lock's memory next.
+//
+static struct {
+    CRITICAL_SECTION* volatile lock;
+    const char* volatile name;
+} lockNames[LOCK_NAMES];
+
+//
+// Time stamp counter ticks are what gets recorded, the first thread to show
+// up remembers where the performance counter was so reports can convert.
+//
+static volatile LONG64 calibrationTsc;
+static LONG64 calibrationQpc;
+
+static lockThread* currentThread(VOID) {
+    lockThread* thread = current;
+
+    if (thread != NULL) {
+        return thread;
+    }
+
+    thread = calloc(1, sizeof(lockThread));
+    if (thread == NULL) {
+        return NULL;
+    }
+    thread->threadId = GetCurrentThreadId();
+
+    if (calibrationTsc == 0) {
+        LARGE_INTEGER qpc;
+        QueryPerformanceCounter(&qpc);
+        if (InterlockedCompareExchange64(&calibrationTsc, ReadTimeStampCounter(), 0) == 0) {
+            calibrationQpc = qpc.QuadPart;
+        }
+    }
+
+    // Push onto the list of threads for the reports, without a lock
+    do {
+        thread->next = lockThreads;
+    } while (InterlockedCompareExchangePointer((PVOID volatile*) &lockThreads, thread, thread->next) != thread->next);
+
+    current = thread;
+    return thread;
+}
+
+static const char* nameOf(CRITICAL_SECTION* lock) {
+    for (ULONG i = 0; i < LOCK_NAMES; i++) {
+        if (lockNames[i].lock == lock) {
+            const char* name = lockNames[i].name;
+            return name != NULL ? name : "?";
+        }
+    }
+    return "?";
+}
+
+static lockSite* findSite(lockThread* thread, CRITICAL_SECTION* lock, const char* file, ULONG line) {
+    ULONG64 hash = ((ULONG_PTR) lock >> 4) ^ ((ULONG_PTR) file >> 3) ^ (line * 0x9E3779B1);
+
+    for (ULONG probe = 0; probe < LOCK_SITES; probe++) {
+        lockSite* site = &thread->sites[(hash + probe) & (LOCK_SITES - 1)];
+
+        if (site->lock == lock && site->line == line && site->file == file) {
+            return site;
+        }
+        if (site->lock == NULL) {
+            site->lock = lock;
+            site->name = nameOf(lock);
+            site->file = file;
+            site->line = line;
+            return site;
+        }
+    }
+    return &thread->overflow;
+}
+
+static VOID recordEvent(lockThread* thread, ULONG type, int typeOfThread, CRITICAL_SECTION* lock,
+                        const char* name, const char* file, ULONG line, ULONG64 now, ULONG64 ticks) {
+    lockEvent* event = &thread->ring[thread->events & (LOCK_RING_SIZE - 1)];
+
+    event->type = type;
+    event->typeOfThread = typeOfThread;
+    event->lock = lock;
+    event->name = name;
+    event->file = file;
+    event->line = line;
+    event->timestamp = now;
+    event->ticks = ticks;
+    event->stackSize = captureStacks ? CaptureStackBackTrace(2, LOCK_STACK_DEPTH, event->stack, NULL) : 0;
+
+    thread->events++;
+}
+
+VOID lockProfileAcquired(CRITICAL_SECTION* lock, int typeOfThread, const char* file, ULONG line,
+                         ULONG64 start, BOOL contended) {
+    ULONG64 now = ReadTimeStampCounter();
+    ULONG64 wait = now - start;
+    lockThread* thread = currentThread();
+
+    if (thread == NULL) {
+        return;
+    }
+
+    lockSite* site = findSite(thread, lock, file, line);
+    site->acquires++;
+    site->contended += contended;
+    site->waitTicks += wait;
+    site->maxWaitTicks = max(site->maxWaitTicks, wait);
+
+    if (thread->heldCount < LOCK_HELD_DEPTH) {
+        heldLock* held = &thread->held[thread->heldCount++];
+        held->lock = lock;
+        held->site = site;
+        held->acquiredAt = now;
+    }
+
+    recordEvent(thread, LOCK_ACQUIRE, typeOfThread, lock, site->name, file, line, now, wait);
+}
+
+VOID lockProfileReleasing(CRITICAL_SECTION* lock, int typeOfThread) {
+    ULONG64 now = ReadTimeStampCounter();
+    lockThread* thread = current;
+
+    if (thread == NULL) {
+        return;
+    }
+
+    // Nearly always the last lock taken, but locks don't have to nest
+    for (ULONG i = thread->heldCount; i-- > 0; ) {
+        heldLock* held = &thread->held[i];
+
+        if (held->lock == lock) {
+            lockSite* site = held->site;
+            ULONG64 hold = now - held->acquiredAt;
+
+            site->holdTicks += hold;
+            site->maxHoldTicks = max(site->maxHoldTicks, hold);
+            recordEvent(thread, LOCK_RELEASE, typeOfThread, lock, site->name, site->file, site->line, now, hold);
+
+            memmove(held, held + 1, (thread->heldCount - i - 1) * sizeof(heldLock));
+            thread->heldCount--;
+            return;
+        }
+    }
+}
+
+VOID lockProfileName(CRITICAL_SECTION* lock, const char* name) {
+    for (ULONG i = 0; i < LOCK_NAMES; i++) {
+        if (InterlockedCompareExchangePointer((PVOID volatile*) &lockNames[i].lock, lock, NULL) == NULL) {
+            lockNames[i].name = name;
+            return;
+        }
+    }
+}
+
+// Before the lock is deleted - sites already recorded keep its name
+VOID lockProfileForget(CRITICAL_SECTION* lock) {
+    for (ULONG i = 0; i < LOCK_NAMES; i++) {
+        if (lockNames[i].lock == lock) {
+            lockNames[i].name = NULL;
+            InterlockedCompareExchangePointer((PVOID volatile*) &lockNames[i].lock, NULL, lock);
+            return;
+        }
+    }
+}
+
+//
+// Stacks make every event an order of magnitude more expensive, so they
+// are only captured on request
+//
+VOID lockProfileCaptureStacks(BOOL capture) {
+    captureStacks = capture;
+}
+
+static double microsecondsPerTick(VOID) {
+    LARGE_INTEGER qpc;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter(&qpc);
+    QueryPerformanceFrequency(&frequency);
+
+    ULONG64 ticks = ReadTimeStampCounter() - calibrationTsc;
+    if (calibrationTsc == 0 || ticks == 0) {
+        return 0;
+    }
+    return (qpc.QuadPart - calibrationQpc) * 1e6 / frequency.QuadPart / ticks;
+}
+
+static int compareSiteKey(const void* a, const void* b) {
+    const lockSite* x = a;
+    const lockSite* y = b;
+
+    if (x->lock != y->lock) {
+        return (ULONG_PTR) x->lock < (ULONG_PTR) y->lock ? -1 : 1;
+    }
+    if (x->file != y->file) {
+        return (ULONG_PTR) x->file < (ULONG_PTR) y->file ? -1 : 1;
+    }
+    return x->line < y->line ? -1 : x->line > y->line;
+}
+
+static int compareWait(const void* a, const void* b) {
+    const lockSite* x = a;
+    const lockSite* y = b;
+
+    return x->waitTicks > y->waitTicks ? -1 : x->waitTicks < y->waitTicks;
+}
+
+static VOID fold(lockSite* into, const lockSite* from) {
+    into->acquires += from->acquires;
+    into->contended += from->contended;
+    into->waitTicks += from->waitTicks;
+    into->maxWaitTicks = max(into->maxWaitTicks, from->maxWaitTicks);
+    into->holdTicks += from->holdTicks;
+    into->maxHoldTicks = max(into->maxHoldTicks, from->maxHoldTicks);
+}
+
+//
+// Collapse entries sharing a key (the whole site, or only the lock when
+// byLock is set) and return how many are left
+//
+static ULONG collapse(lockSite* sites, ULONG count, BOOL byLock) {
+    ULONG out = 0;
+
+    for (ULONG i = 0; i < count; i++) {
+        if (out != 0 && sites[out - 1].lock == sites[i].lock &&
+            (byLock || (sites[out - 1].file == sites[i].file && sites[out - 1].line == sites[i].line))) {
+            fold(&sites[out - 1], &sites[i]);
+        } else {
+            sites[out++] = sites[i];
+        }
+    }
+    return out;
+}
+
+static VOID printSite(FILE* out, const lockSite* site, double us, BOOL withSite) {
+    fprintf(out, "  %-18s", site->name != NULL ? site->name : "?");
+    if (withSite) {
+        const char* file = site->file ? site->file : "(overflow)";
+        const char* slash = strrchr(file, '/') ? strrchr(file, '/') : strrchr(file, '\\');
+        fprintf(out, " %22s:%-5u", slash ? slash + 1 : file, site->line);
+    }
+    fprintf(out, " %10llu acquires %5.1f%% contended  wait %10.1f us (max %8.1f)  hold avg %7.2f us (max %8.1f)\n",
+            site->acquires,
+            site->acquires ? site->contended * 100.0 / site->acquires : 0,
+            site->waitTicks * us,
+            site->maxWaitTicks * us,
+            site->acquires ? site->holdTicks * us / site->acquires : 0,
+            site->maxHoldTicks * us);
+}
+
+//
+// The most contended locks and call sites across every thread, ranked by
+// the total time spent waiting for them
+//
+VOID lockProfileReport(FILE* out, ULONG top) {
+    ULONG threads = 0;
+    ULONG count = 0;
+
+    for (lockThread* thread = lockThreads; thread != NULL; thread = thread->next) {
+        threads++;
+    }
+    if (threads == 0) {
+        return;
+    }
+
+    lockSite* sites = malloc(threads * (LOCK_SITES + 1) * sizeof(lockSite));
+    if (sites == NULL) {
+        return;
+    }
+
+    for (lockThread* thread = lockThreads; thread != NULL; thread = thread->next) {
+        for (ULONG s = 0; s < LOCK_SITES; s++) {
+            if (thread->sites[s].lock != NULL) {
+                sites[count++] = thread->sites[s];
+            }
+        }
+        if (thread->overflow.acquires != 0) {
+            sites[count++] = thread->overflow;
+        }
+    }
+
+    double us = microsecondsPerTick();
+
+    qsort(sites, count, sizeof(lockSite), compareSiteKey);
+    count = collapse(sites, count, FALSE);
+    qsort(sites, count, sizeof(lockSite), compareWait);
+
+    fprintf(out, "lock profile : top call sites by wait across %u threads\n", threads);
+    for (ULONG i = 0; i < min(count, top); i++) {
+        printSite(out, &sites[i], us, TRUE);
+    }
+
+    qsort(sites, count, sizeof(lockSite), compareSiteKey);
+    count = collapse(sites, count, TRUE);
+    qsort(sites, count, sizeof(lockSite), compareWait);
+
+    fprintf(out, "lock profile : top locks by wait\n");
+    for (ULONG i = 0; i < min(count, top); i++) {
+        printSite(out, &sites[i], us, FALSE);
+    }
+
+    free(sites);
+}
+
+//
+// The last events of every thread, oldest first - what the debugger used to
+// be pointed at
+//
+VOID lockProfileDump(FILE* out, ULONG eventsPerThread) {
+    for (lockThread* thread = lockThreads; thread != NULL; thread = thread->next) {
+        ULONG64 last = thread->events;
+        ULONG64 first = last - min(last, min(eventsPerThread, LOCK_RING_SIZE));
+
+        fprintf(out, "thread %u : %llu lock events\n", thread->threadId, last);
+        for (ULONG64 e = first; e < last; e++) {
+            lockEvent* event = &thread->ring[e & (LOCK_RING_SIZE - 1)];
+
+            fprintf(out, "  %llu %s %s %s:%u %llu ticks\n",
+                    event->timestamp,
+                    event->type == LOCK_ACQUIRE ? "acquire" : "release",
+                    event->name != NULL ? event->name : "?",
+                    event->file,
+                    event->line,
+                    event->ticks);
+            for (ULONG f = 0; f < event->stackSize; f++) {
+                fprintf(out, "      %p\n", event->stack[f]);
+            }
+        }
+    }
+}
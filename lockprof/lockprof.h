@@ -0,0 +1,89 @@
+//
+// lockprof.h
+// Lock contention profiler
+//
+
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <stdio.h>
+#include <windows.h>
+
+//
+// Wait and hold times per lock site (lock + file:line of the acquire).
+// Each thread keeps its own site table and event ring, so recording never
+// takes a lock or touches a shared cache line - it is cheap enough to stay
+// on.  Set to 0 to compile it out entirely.
+//
+#define LOCK_PROFILE                1
+
+#define LOCK_SITES                  128     // Per thread, a power of two
+#define LOCK_RING_SIZE              256     // Events kept per thread, a power of two
+#define LOCK_HELD_DEPTH             8       // Locks one thread can hold at once and still be timed
+#define LOCK_STACK_DEPTH            10
+#define LOCK_NAMES                  64      // Named locks alive at once
+
+#define LOCK_ACQUIRE                0
+#define LOCK_RELEASE                1
+
+typedef struct {
+    CRITICAL_SECTION* lock;
+    const char* name;               // Looked up once, so it outlives the lock
+    const char* file;
+    ULONG line;
+    ULONG64 acquires;
+    ULONG64 contended;              // Acquires that found the lock taken
+    ULONG64 waitTicks;
+    ULONG64 maxWaitTicks;
+    ULONG64 holdTicks;
+    ULONG64 maxHoldTicks;
+} lockSite;
+
+typedef struct {
+    ULONG type;
+    int typeOfThread;
+    CRITICAL_SECTION* lock;
+    const char* name;
+    const char* file;
+    ULONG line;
+    ULONG64 timestamp;
+    ULONG64 ticks;                  // Wait for an acquire, hold for a release
+    ULONG stackSize;                // Only with stack capture turned on
+    PVOID stack[LOCK_STACK_DEPTH];
+} lockEvent;
+
+typedef struct {
+    CRITICAL_SECTION* lock;
+    lockSite* site;
+    ULONG64 acquiredAt;
+} heldLock;
+
+//
+// One per thread that ever took a lock.  Only its own thread writes it,
+// reports read it racily.  They are never freed so reports can still see
+// threads that have exited.
+//
+typedef struct _lockThread {
+    struct _lockThread* next;
+    DWORD threadId;
+    lockSite sites[LOCK_SITES];
+    lockSite overflow;              // Everything past a full site table
+    heldLock held[LOCK_HELD_DEPTH];
+    ULONG heldCount;
+    ULONG64 events;                 // Written so far, the ring keeps the last LOCK_RING_SIZE
+    lockEvent ring[LOCK_RING_SIZE];
+} lockThread;
+
+//
+// Function declarations
+//
+VOID lockProfileAcquired(CRITICAL_SECTION* lock, int typeOfThread, const char* file, ULONG line,
+                         ULONG64 start, BOOL contended);
+VOID lockProfileReleasing(CRITICAL_SECTION* lock, int typeOfThread);
+VOID lockProfileName(CRITICAL_SECTION* lock, const char* name);
+VOID lockProfileForget(CRITICAL_SECTION* lock);
+VOID lockProfileCaptureStacks(BOOL capture);
+VOID lockProfileReport(FILE* out, ULONG top);
+VOID lockProfileDump(FILE* out, ULONG eventsPerThread);
+
+#endif // LOCKPROF_H
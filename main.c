@@ -5,16 +5,438 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <windows.h>
 #include "util/util.h"
 #include "user/user.h"
 #include "pt/pt.h"
 #include "disk/disk.h"
 #include "list/list.h"
+#include "bench/bench.h"
+#include "trace/trace.h"
+#include "replay/accessTrace.h"
+#include "sim/sim.h"
 
-VOID
-main (VOID)
+//
+// Every sizing knob can be overridden on the command line so a different
+// configuration no longer needs a recompile, eg.
+//
+//     VM.exe -va 64 -pages 4096 -threads 4
+//
+// and the built-in test doubles as a benchmark driver, eg.
+//
+//     VM.exe -pattern zipf -skew 0.9 -writes 30 -seed 7 -json run.json
+//
+// A run recorded with -record can be replayed on another build or policy
+// with -replay, which takes the threads and spaces from the recording.
+// Either can run on the simulator instead (-simulate 1) to sweep policies
+// and sizes offline, eg.
+//
+//     VM.exe -simulate 1 -pages 2048 -trimbatch 64 -replay run.trace
+//
+// -startup only creates and destroys instances, timing each step of
+// bringing one up, eg.
+//
+//     VM.exe -pages 4194304 -startup 5 -json startup.json
+//
+// and -listbench only times list operations on the PFN database, to
+// compare builds with and without VM_COMPACT_PFN, eg.
+//
+//     VM.exe -simulate 1 -pages 1048576 -listbench 10
+//
+// Pages are zeroed and copied by the best kernel this machine has, which
+// -pagekernel and -pagestream override for comparison, and -pagebench
+// measures every kernel on its own, eg.
+//
+//     VM.exe -pagebench 65536 -json kernels.json
+//
+// -writerbench puts a backlog of pages on the modified list of a fresh
+// instance and times draining it with 1 up to -writers writers, eg.
+//
+//     VM.exe -pages 262144 -writers 8 -writerbench 262144 -json writers.json
+//
+// -fibers runs each thread's share of the accesses as that many users on
+// fibers, which switch to one another while a page is read in, and
+// -fiberbench times the built-in test from plain threads up to that many
+// fibers per thread, eg.
+//
+//     VM.exe -threads 4 -accesses 1048576 -fiberbench 256 -json fibers.json
+//
+// -largepages sets that many 2MB frames aside for regions that are used
+// densely, eg.
+//
+//     VM.exe -pages 65536 -largepages 32 -pattern sequential
+//
+// -numa spreads the frames, user threads and workers over that many of
+// the host's nodes - all of them by default.  Simulated, it makes up the
+// nodes and charges -remotens for each access to a page on another, eg.
+//
+//     VM.exe -simulate 1 -numa 2 -remotens 100 -threads 4
+//
+// -snapshot takes a copy-on-write snapshot of every space once the threads
+// have made that many accesses each, and the pagefile doubles by default
+// to back both, eg.
+//
+//     VM.exe -simulate 1 -snapshot 65536 -writes 50
+//
+
+static VOID usage (VOID)
+{
+    printf ("usage: VM [-va <MB>] [-pages <frames>] [-disk <slots>] [-batch <n>]\n"
+            "          [-trimbatch <n>] [-writebatch <n>] [-threads <n>] [-accesses <n>]\n"
+            "          [-spaces <n>] [-pattern uniform|zipf|sequential|strided|hotset]\n"
+            "          [-skew <0..1>] [-stride <pages>] [-hotset <pages>] [-phase <accesses>]\n"
+            "          [-writes <percent>] [-seed <n>] [-json <file>] [-lockstacks 0|1]\n"
+            "          [-trace <file>] [-stats <file>] [-statsms <ms>]\n"
+            "          [-record <file>] [-replay <file>] [-paced 0|1]\n"
+            "          [-simulate 0|1] [-readns <ns>] [-writens <ns>] [-mrc <samples>]\n"
+            "          [-poolmin <frames>] [-poolmax <frames>] [-startup <runs>]\n"
+            "          [-listbench <rounds>] [-pagebench <pages>] [-writers <n>]\n"
+            "          [-writerbench <pages>] [-workers <n>] [-fibers <n>] [-fiberbench <n>]\n"
+            "          [-pagekernel auto|scalar|sse2|avx2|avx512] [-pagestream 0|1]\n"
+            "          [-largepages <n>] [-numa <nodes>] [-remotens <ns>]\n"
+            "          [-snapshot <accesses>]\n");
+}
+
+static BOOL parseArguments (int argc, char* argv[], vmConfig* config, const char** jsonPath, const char** tracePath,
+                            BOOL* simulated, simCosts* costs, ULONG* startupRuns, ULONG64* listRounds,
+                            ULONG64* benchPages, ULONG64* writerPages, ULONG* maxFibers)
 {
+    BOOL diskGiven = FALSE;
+    BOOL pagesGiven = FALSE;
+
+    vmDefaultConfig(config);
+    simDefaultCosts(costs);
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            return FALSE;
+        }
+
+        const char* argument = argv[i + 1];
+        ULONG64 value = _strtoui64(argument, NULL, 0);
+
+        if (strcmp(argv[i], "-va") == 0) {
+            config->virtualAddressSize = MB(value);
+        } else if (strcmp(argv[i], "-pages") == 0) {
+            config->physicalPages = value;
+            pagesGiven = TRUE;
+        } else if (strcmp(argv[i], "-disk") == 0) {
+            config->diskSizeInPages = value;
+            diskGiven = TRUE;
+        } else if (strcmp(argv[i], "-batch") == 0) {
+            config->trimBatchSize = value;
+            config->writeBatchSize = value;
+        } else if (strcmp(argv[i], "-trimbatch") == 0) {
+            config->trimBatchSize = value;
+        } else if (strcmp(argv[i], "-writebatch") == 0) {
+            config->writeBatchSize = value;
+        } else if (strcmp(argv[i], "-writers") == 0) {
+            config->writerThreads = (ULONG) value;
+        } else if (strcmp(argv[i], "-workers") == 0) {
+            config->workerThreads = (ULONG) value;
+        } else if (strcmp(argv[i], "-fibers") == 0) {
+            config->fibersPerThread = (ULONG) value;
+        } else if (strcmp(argv[i], "-largepages") == 0) {
+            config->largePages = value;
+        } else if (strcmp(argv[i], "-numa") == 0) {
+            config->numaNodes = (ULONG) value;
+        } else if (strcmp(argv[i], "-snapshot") == 0) {
+            config->snapshotAt = value;
+        } else if (strcmp(argv[i], "-threads") == 0) {
+            config->userThreads = (ULONG) value;
+        } else if (strcmp(argv[i], "-accesses") == 0) {
+            config->accessesPerThread = value;
+        } else if (strcmp(argv[i], "-spaces") == 0) {
+            config->addressSpaces = (ULONG) value;
+        } else if (strcmp(argv[i], "-pattern") == 0) {
+            if (workloadParsePattern(argument, &config->workload.pattern) == FALSE) {
+                return FALSE;
+            }
+        } else if (strcmp(argv[i], "-skew") == 0) {
+            config->workload.zipfSkew = strtod(argument, NULL);
+        } else if (strcmp(argv[i], "-stride") == 0) {
+            config->workload.stridePages = value;
+        } else if (strcmp(argv[i], "-hotset") == 0) {
+            config->workload.hotSetPages = value;
+        } else if (strcmp(argv[i], "-phase") == 0) {
+            config->workload.phaseAccesses = value;
+        } else if (strcmp(argv[i], "-writes") == 0) {
+            config->workload.writePercent = (ULONG) value;
+        } else if (strcmp(argv[i], "-seed") == 0) {
+            config->workload.seed = value;
+        } else if (strcmp(argv[i], "-json") == 0) {
+            *jsonPath = argument;
+        } else if (strcmp(argv[i], "-trace") == 0) {
+            *tracePath = argument;
+        } else if (strcmp(argv[i], "-stats") == 0) {
+            config->statsPath = argument;
+        } else if (strcmp(argv[i], "-statsms") == 0) {
+            config->statsIntervalMs = (ULONG) value;
+        } else if (strcmp(argv[i], "-record") == 0) {
+            config->recordPath = argument;
+        } else if (strcmp(argv[i], "-replay") == 0) {
+            config->replayPath = argument;
+        } else if (strcmp(argv[i], "-paced") == 0) {
+            config->replayPaced = value != 0;
+        } else if (strcmp(argv[i], "-simulate") == 0) {
+            *simulated = value != 0;
+        } else if (strcmp(argv[i], "-readns") == 0) {
+            costs->diskReadNs = value;
+        } else if (strcmp(argv[i], "-writens") == 0) {
+            costs->diskWriteNs = value;
+        } else if (strcmp(argv[i], "-remotens") == 0) {
+            costs->remoteNs = value;
+        } else if (strcmp(argv[i], "-poolmin") == 0) {
+            config->poolMinimum = value;
+        } else if (strcmp(argv[i], "-poolmax") == 0) {
+            config->poolMaximum = value;
+        } else if (strcmp(argv[i], "-startup") == 0) {
+            *startupRuns = (ULONG) value;
+        } else if (strcmp(argv[i], "-pagebench") == 0) {
+            *benchPages = value;
+        } else if (strcmp(argv[i], "-pagekernel") == 0) {
+            ULONG kernel = strcmp(argument, "auto") == 0 ? PAGE_KERNEL_AUTO : pageKernelFind(argument);
+            BOOL stream;
+
+            pageKernelCurrent(&stream);
+            if ((kernel == PAGE_KERNEL_AUTO && strcmp(argument, "auto") != 0) ||
+                pageKernelSelect(kernel, stream) == FALSE) {
+                printf ("page kernel %s is not available here\n", argument);
+                return FALSE;
+            }
+        } else if (strcmp(argv[i], "-pagestream") == 0) {
+            pageKernelSelect(pageKernelCurrent(NULL), value != 0);
+        } else if (strcmp(argv[i], "-listbench") == 0) {
+            *listRounds = value;
+        } else if (strcmp(argv[i], "-writerbench") == 0) {
+            *writerPages = value;
+        } else if (strcmp(argv[i], "-fiberbench") == 0) {
+            *maxFibers = (ULONG) value;
+        } else if (strcmp(argv[i], "-mrc") == 0) {
+            config->mrcSamples = (ULONG) value;
+        } else if (strcmp(argv[i], "-lockstacks") == 0) {
+            lockProfileCaptureStacks(value != 0);
+        } else {
+            return FALSE;
+        }
+        i++;
+    }
+
+    if (config->replayPath != NULL) {
+        accessTraceHeader header;
+
+        if (config->recordPath != NULL || accessTraceReadHeader(config->replayPath, &header) == FALSE) {
+            printf ("cannot replay %s\n", config->replayPath);
+            return FALSE;
+        }
+        config->virtualAddressSize = header.virtualAddressSize;
+        config->addressSpaces = header.spaces;
+        config->userThreads = header.threads;
+    }
+
+    //
+    // Keep the default ratios when only the virtual size was changed.  The
+    // pool is shared, so frames stay in proportion to one space while the
+    // pagefile has to cover all of them.
+    //
+
+    if (pagesGiven == FALSE) {
+        config->physicalPages = config->virtualAddressSize / (DEFAULT_PHYSICAL_TO_VIRTUAL_RATIO * PAGE_SIZE);
+    }
+    if (diskGiven == FALSE) {
+        config->diskSizeInPages = config->addressSpaces * (config->virtualAddressSize / PAGE_SIZE);
+        if (config->snapshotAt != 0) {
+            config->diskSizeInPages *= 2;
+        }
+    }
+
+    return TRUE;
+}
+
+static BOOL startup_test (const vmConfig* config, ULONG runs, startupTimes* times)
+{
+    for (ULONG r = 0; r < runs; r++) {
+        vmInstance* vm = vmCreate(config);
+
+        if (vm == NULL) {
+            return FALSE;
+        }
+        times[r] = vm->startup;
+        vmDestroy(vm);
+
+        printf ("startup : run %u took %llu us -", r, times[r].totalUs);
+        for (ULONG p = 0; p < STARTUP_PHASES; p++) {
+            printf (" %s %llu", latencyStartupName(p), times[r].us[p]);
+        }
+        printf ("\n");
+    }
+    return TRUE;
+}
+
+static BOOL list_test (const vmConfig* config, BOOL simulated, const simCosts* costs, ULONG64 rounds,
+                       listBenchResult* result)
+{
+    vmInstance* vm = simulated ? simCreate(config, costs) : vmCreate(config);
+
+    if (vm == NULL) {
+        return FALSE;
+    }
+
+    benchLists(vm, rounds, result);
+
+    if (simulated) {
+        simDestroy(vm);
+    } else {
+        vmDestroy(vm);
+    }
+
+    printf ("listbench : %llu frames, %u byte PFN entries - move %.2f ns, remove %.2f ns, walk %.2f ns per page\n",
+            result->pages,
+            (ULONG) sizeof(pfn),
+            result->moveNs,
+            result->removeNs,
+            result->walkNs);
+    return TRUE;
+}
+
+static BOOL page_test (ULONG64 pages, const char* jsonPath)
+{
+    pageBenchResult results[2 * PAGE_KERNELS];
+    double victimBaselineNs;
+    ULONG count = benchPageKernels(pages, results, &victimBaselineNs);
+
+    printf ("pagebench : a warm %u KB working set reads back at %.2f ns per line untouched\n",
+            PAGE_BENCH_VICTIM_BYTES / 1024,
+            victimBaselineNs);
+    for (ULONG r = 0; r < count; r++) {
+        printf ("pagebench : %-6s %-9s zero %7.1f ns  copy %7.1f ns per page, working set %.2f ns per line after %u copies\n",
+                pageKernelGet(results[r].kernel)->name,
+                results[r].stream ? "streaming" : "cached",
+                results[r].zeroNs,
+                results[r].copyNs,
+                results[r].victimNs,
+                PAGE_BENCH_BATCH_PAGES);
+    }
+
+    FILE* out = stdout;
+    if (jsonPath != NULL) {
+        out = fopen(jsonPath, "w");
+        if (out == NULL) {
+            printf ("could not open %s\n", jsonPath);
+            return FALSE;
+        }
+    }
+
+    benchWritePageJson(out, pages, results, count, victimBaselineNs);
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    return TRUE;
+}
+
+static BOOL writer_test (const vmConfig* config, ULONG64 pages, const char* jsonPath)
+{
+    writerBenchResult results[MAX_WRITER_THREADS];
+    ULONG count = benchWriters(config, pages, results);
+
+    if (count == 0) {
+        return FALSE;
+    }
+
+    for (ULONG r = 0; r < count; r++) {
+        printf ("writerbench : %2u writers (%u ran at once) wrote %llu pages in %.1f ms - %.0f pages/s\n",
+                results[r].writers,
+                results[r].peakActive,
+                results[r].pages,
+                results[r].ms,
+                results[r].pagesPerSecond);
+    }
+
+    FILE* out = stdout;
+    if (jsonPath != NULL) {
+        out = fopen(jsonPath, "w");
+        if (out == NULL) {
+            printf ("could not open %s\n", jsonPath);
+            return FALSE;
+        }
+    }
+
+    benchWriteWriterJson(out, config, results, count);
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    return TRUE;
+}
+
+static BOOL fiber_test (const vmConfig* config, ULONG maxFibers, const char* jsonPath)
+{
+    fiberBenchResult results[FIBER_BENCH_RUNS];
+    ULONG count = benchFibers(config, maxFibers, results);
+
+    if (count == 0) {
+        return FALSE;
+    }
+
+    for (ULONG r = 0; r < count; r++) {
+        printf ("fiberbench : %4u fibers per thread (%5u users) made %llu accesses in %llu ms - %.0f/s, "
+                "hard p50 %llu ns p99 %llu ns, %llu parks\n",
+                results[r].fibers,
+                results[r].tasks,
+                results[r].accesses,
+                results[r].elapsedMs,
+                results[r].accessesPerSecond,
+                results[r].hard.p50,
+                results[r].hard.p99,
+                results[r].parks);
+    }
+
+    FILE* out = stdout;
+    if (jsonPath != NULL) {
+        out = fopen(jsonPath, "w");
+        if (out == NULL) {
+            printf ("could not open %s\n", jsonPath);
+            return FALSE;
+        }
+    }
+
+    benchWriteFiberJson(out, config, results, count);
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    return TRUE;
+}
+
+int
+main (int argc, char* argv[])
+{
+    vmConfig config;
+    benchResult result;
+    const char* jsonPath = NULL;
+    const char* tracePath = NULL;
+    BOOL simulated = FALSE;
+    simCosts costs;
+    ULONG startupRuns = 0;
+    startupTimes* startup = NULL;
+    ULONG64 listRounds = 0;
+    listBenchResult lists;
+    ULONG64 benchPages = 0;
+    ULONG64 writerPages = 0;
+    ULONG maxFibers = 0;
+
+    if (parseArguments(argc, argv, &config, &jsonPath, &tracePath, &simulated, &costs, &startupRuns, &listRounds,
+                       &benchPages, &writerPages, &maxFibers) == FALSE) {
+        usage();
+        return 1;
+    }
+
+    if (tracePath != NULL) {
+        traceStart();
+    }
+
     //
     // Test a simple malloc implementation - we call the operating
     // system to pay the up front cost to reserve and commit everything.
@@ -60,10 +482,85 @@ main (VOID)
     // This is where we can be as creative as we like, the sky's the limit !
     //
 
-    ULONG64 start = GetTickCount64();
-    full_virtual_memory_test ();
-    ULONG64 end = GetTickCount64();
-    printf("Date: %s", "08.05.2025");
-    printf("%llu", end - start);
-    return;
+    if (benchPages != 0) {
+        return page_test (benchPages, jsonPath) ? 0 : 1;
+    }
+
+    // The writers are threads, there are none to time on the simulator
+    if (writerPages != 0) {
+        if (simulated) {
+            printf ("-writerbench needs the real platform\n");
+            return 1;
+        }
+        return writer_test (&config, writerPages, jsonPath) ? 0 : 1;
+    }
+
+    // Fibers only switch on a read the real platform is waiting on
+    if (maxFibers != 0 || config.fibersPerThread != 0) {
+        if (simulated) {
+            printf ("-fibers and -fiberbench need the real platform\n");
+            return 1;
+        }
+        if (maxFibers != 0) {
+            return fiber_test (&config, maxFibers, jsonPath) ? 0 : 1;
+        }
+    }
+
+    if (listRounds != 0) {
+        if (list_test (&config, simulated, &costs, listRounds, &lists) == FALSE) {
+            return 1;
+        }
+    } else if (startupRuns != 0) {
+        startup = malloc(startupRuns * sizeof(startupTimes));
+        if (startup == NULL || startup_test (&config, startupRuns, startup) == FALSE) {
+            return 1;
+        }
+    } else if (simulated) {
+        if (simulate (&config, &costs, &result) == FALSE) {
+            return 1;
+        }
+    } else if (full_virtual_memory_test (&config, &result) == FALSE) {
+        return 1;
+    }
+
+    //
+    // Open in chrome://tracing or ui.perfetto.dev
+    //
+
+    if (tracePath != NULL) {
+        traceStop();
+        if (traceWriteChrome(tracePath) == FALSE) {
+            printf ("could not write %s\n", tracePath);
+        }
+    }
+
+    lockProfileReport(stdout, 10);
+
+    //
+    // The report goes to its own file when asked so the progress output
+    // above doesn't get mixed into it.
+    //
+
+    FILE* out = stdout;
+    if (jsonPath != NULL) {
+        out = fopen(jsonPath, "w");
+        if (out == NULL) {
+            printf ("could not open %s\n", jsonPath);
+            return 1;
+        }
+    }
+
+    if (listRounds != 0) {
+        benchWriteListJson(out, &config, &lists);
+    } else if (startup != NULL) {
+        benchWriteStartupJson(out, &config, startup, startupRuns);
+        free(startup);
+    } else {
+        benchWriteJson(out, &config, &result);
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
 }
\ No newline at end of file
@@ -0,0 +1,353 @@
+//
+// mrc.c
+// Online miss ratio curve estimation
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include "../util/util.h"
+#include "mrc.h"
+
+#define NO_ENTRY                    (-1)
+
+static const ULONG pointEighths[MRC_POINTS] = MRC_POINT_EIGHTHS;
+
+// splitmix64's finalizer, the top bits pick the sample and the bottom the table slot
+static ULONG64 mix(ULONG64 key) {
+    key ^= key >> 30;
+    key *= 0xBF58476D1CE4E5B9ULL;
+    key ^= key >> 27;
+    key *= 0x94D049BB133111EBULL;
+    key ^= key >> 31;
+    return key;
+}
+
+static VOID freeArrays(mrcTracker* mrc) {
+    free(mrc->entries);
+    free(mrc->freeEntries);
+    free(mrc->table);
+    free(mrc->owners);
+    free(mrc->tree);
+    free(mrc->histogram);
+    memset(mrc, 0, sizeof(mrcTracker));
+}
+
+BOOL mrcInitialize(mrcTracker* mrc, ULONG maxSamples, ULONG64 virtualPages) {
+    memset(mrc, 0, sizeof(mrcTracker));
+
+    if (maxSamples == 0) {
+        return TRUE;
+    }
+
+    ULONG capacity = maxSamples + 1;
+    ULONG tableSize = 1;
+    while (tableSize < 2 * capacity) {
+        tableSize <<= 1;
+    }
+
+    mrc->maxSamples = maxSamples;
+    mrc->threshold = MRC_MODULUS;
+    mrc->tableMask = tableSize - 1;
+    mrc->timeSlots = 2 * capacity;
+    mrc->bucketPages = max(1, (virtualPages + MRC_BUCKETS - 1) / MRC_BUCKETS);
+
+    mrc->entries = malloc(capacity * sizeof(mrcEntry));
+    mrc->freeEntries = malloc(capacity * sizeof(ULONG));
+    mrc->table = malloc(tableSize * sizeof(LONG));
+    mrc->owners = malloc(mrc->timeSlots * sizeof(LONG));
+    mrc->tree = calloc(mrc->timeSlots + 1, sizeof(ULONG));
+    mrc->histogram = calloc(MRC_BUCKETS, sizeof(double));
+
+    if (mrc->entries == NULL || mrc->freeEntries == NULL || mrc->table == NULL ||
+        mrc->owners == NULL || mrc->tree == NULL || mrc->histogram == NULL) {
+        freeArrays(mrc);
+        return FALSE;
+    }
+
+    for (ULONG i = 0; i < capacity; i++) {
+        mrc->freeEntries[i] = capacity - 1 - i;
+    }
+    mrc->freeCount = capacity;
+    memset(mrc->table, 0xFF, tableSize * sizeof(LONG));
+    memset(mrc->owners, 0xFF, mrc->timeSlots * sizeof(LONG));
+
+    InitializeCriticalSection(&mrc->lock);
+    lockProfileName(&mrc->lock, "lockMrc");
+    return TRUE;
+}
+
+VOID mrcFree(mrcTracker* mrc) {
+    if (mrc->maxSamples != 0) {
+        lockProfileForget(&mrc->lock);
+        DeleteCriticalSection(&mrc->lock);
+    }
+    freeArrays(mrc);
+}
+
+//
+// Fenwick tree over the time slots, 1-based inside
+//
+static VOID treeAdd(mrcTracker* mrc, ULONG slot, LONG delta) {
+    for (ULONG i = slot + 1; i <= mrc->timeSlots; i += i & (0 - i)) {
+        mrc->tree[i] += delta;
+    }
+}
+
+// Occupied slots up to and including this one
+static ULONG treeCount(mrcTracker* mrc, ULONG slot) {
+    ULONG count = 0;
+
+    for (ULONG i = slot + 1; i != 0; i -= i & (0 - i)) {
+        count += mrc->tree[i];
+    }
+    return count;
+}
+
+//
+// Renumber the occupied slots from 0 in the same order
+//
+static VOID compact(mrcTracker* mrc) {
+    ULONG next = 0;
+
+    for (ULONG slot = 0; slot < mrc->now; slot++) {
+        LONG owner = mrc->owners[slot];
+
+        if (owner != NO_ENTRY) {
+            mrc->owners[slot] = NO_ENTRY;
+            mrc->owners[next] = owner;
+            mrc->entries[owner].time = next++;
+        }
+    }
+
+    memset(mrc->tree, 0, (mrc->timeSlots + 1) * sizeof(ULONG));
+    for (ULONG slot = 0; slot < next; slot++) {
+        treeAdd(mrc, slot, 1);
+    }
+    mrc->now = next;
+}
+
+static ULONG findSlot(mrcTracker* mrc, ULONG64 key, ULONG64 hash) {
+    ULONG slot = (ULONG) hash & mrc->tableMask;
+
+    while (mrc->table[slot] != NO_ENTRY && mrc->entries[mrc->table[slot]].key != key) {
+        slot = (slot + 1) & mrc->tableMask;
+    }
+    return slot;
+}
+
+//
+// Backward shift deletion - pull later entries of the probe run back into
+// the hole unless that would put them before their home slot
+//
+static VOID removeSlot(mrcTracker* mrc, ULONG hole) {
+    ULONG slot = hole;
+
+    while (TRUE) {
+        slot = (slot + 1) & mrc->tableMask;
+        if (mrc->table[slot] == NO_ENTRY) {
+            break;
+        }
+
+        ULONG home = (ULONG) mix(mrc->entries[mrc->table[slot]].key) & mrc->tableMask;
+        BOOL stays = hole <= slot ? (home > hole && home <= slot) : (home > hole || home <= slot);
+
+        if (stays == FALSE) {
+            mrc->table[hole] = mrc->table[slot];
+            hole = slot;
+        }
+    }
+    mrc->table[hole] = NO_ENTRY;
+}
+
+static VOID evict(mrcTracker* mrc, LONG index) {
+    mrcEntry* entry = &mrc->entries[index];
+
+    removeSlot(mrc, findSlot(mrc, entry->key, mix(entry->key)));
+    mrc->owners[entry->time] = NO_ENTRY;
+    treeAdd(mrc, entry->time, -1);
+    mrc->freeEntries[mrc->freeCount++] = index;
+    mrc->samples--;
+}
+
+//
+// Drop the pages with the highest samples until we are back within
+// maxSamples.  Everything recorded so far was at the old rate, so it is
+// scaled down to what the new one would have seen.
+//
+static VOID lowerThreshold(mrcTracker* mrc) {
+    ULONG old = mrc->threshold;
+    ULONG threshold = old;
+
+    while (mrc->samples > mrc->maxSamples && threshold > 1) {
+        threshold -= max(1, threshold / 8);
+
+        for (ULONG slot = 0; slot < mrc->now; slot++) {
+            LONG owner = mrc->owners[slot];
+
+            if (owner != NO_ENTRY && mrc->entries[owner].sample >= threshold) {
+                evict(mrc, owner);
+            }
+        }
+    }
+
+    double scale = (double) threshold / old;
+
+    for (ULONG b = 0; b < MRC_BUCKETS; b++) {
+        mrc->histogram[b] *= scale;
+    }
+    mrc->cold *= scale;
+    mrc->threshold = threshold;
+}
+
+//
+// A reference to the page identified by key.  Unsampled pages - nearly all
+// of them once the threshold has settled - cost a hash and a compare.
+//
+VOID mrcReference(mrcTracker* mrc, ULONG64 key) {
+    ULONG64 hash = mix(key);
+    ULONG sample = (ULONG) (hash >> (64 - MRC_MODULUS_BITS));
+    LONG index;
+
+    if (sample >= mrc->threshold) {
+        return;
+    }
+
+    acquireLock(&mrc->lock, USER);
+
+    // It may have been lowered while we waited
+    if (sample >= mrc->threshold) {
+        releaseLock(&mrc->lock, USER);
+        return;
+    }
+
+    ULONG slot = findSlot(mrc, key, hash);
+    index = mrc->table[slot];
+
+    if (index != NO_ENTRY) {
+        mrcEntry* entry = &mrc->entries[index];
+
+        //
+        // Every sampled page referenced since holds a later slot
+        //
+        ULONG64 distance = mrc->samples - treeCount(mrc, entry->time);
+        ULONG64 pages = distance * MRC_MODULUS / mrc->threshold;
+
+        mrc->histogram[min(pages / mrc->bucketPages, MRC_BUCKETS - 1)] += 1;
+        mrc->owners[entry->time] = NO_ENTRY;
+        treeAdd(mrc, entry->time, -1);
+    } else {
+        ASSERT(mrc->freeCount != 0);
+        index = mrc->freeEntries[--mrc->freeCount];
+        mrc->entries[index].key = key;
+        mrc->entries[index].sample = sample;
+        mrc->table[slot] = index;
+        mrc->samples++;
+        mrc->cold += 1;
+    }
+
+    if (mrc->now == mrc->timeSlots) {
+        compact(mrc);
+    }
+    mrc->entries[index].time = mrc->now;
+    mrc->owners[mrc->now] = index;
+    treeAdd(mrc, mrc->now, 1);
+    mrc->now++;
+
+    if (mrc->samples > mrc->maxSamples) {
+        lowerThreshold(mrc);
+    }
+
+    releaseLock(&mrc->lock, USER);
+}
+
+//
+// Reuse distance d hits in an LRU pool of more than d pages.  Buckets the
+// pool size falls inside count in proportion.
+//
+static double missRatio(mrcTracker* mrc, ULONG64 pages) {
+    double total = mrc->cold;
+    double misses = mrc->cold;
+    ULONG64 width = mrc->bucketPages;
+
+    for (ULONG b = 0; b < MRC_BUCKETS; b++) {
+        ULONG64 low = b * width;
+        ULONG64 high = low + width;
+
+        total += mrc->histogram[b];
+        if (low >= pages) {
+            misses += mrc->histogram[b];
+        } else if (high > pages) {
+            misses += mrc->histogram[b] * (high - pages) / width;
+        }
+    }
+    return total != 0 ? misses / total : 0;
+}
+
+double mrcMissRatio(mrcTracker* mrc, ULONG64 pages) {
+    double ratio;
+
+    if (mrc->maxSamples == 0) {
+        return 0;
+    }
+
+    acquireLock(&mrc->lock, USER);
+    ratio = missRatio(mrc, pages);
+    releaseLock(&mrc->lock, USER);
+    return ratio;
+}
+
+//
+// The curve at MRC_POINTS multiples of a pool of poolPages, and how many
+// references it is estimated from
+//
+ULONG64 mrcCurve(mrcTracker* mrc, ULONG64 poolPages, mrcPoint* points) {
+    double total;
+
+    for (ULONG p = 0; p < MRC_POINTS; p++) {
+        points[p].pages = poolPages * pointEighths[p] / 8;
+        points[p].missRatio = 0;
+    }
+
+    if (mrc->maxSamples == 0) {
+        return 0;
+    }
+
+    acquireLock(&mrc->lock, USER);
+    total = mrc->cold;
+    for (ULONG b = 0; b < MRC_BUCKETS; b++) {
+        total += mrc->histogram[b];
+    }
+    for (ULONG p = 0; p < MRC_POINTS; p++) {
+        points[p].missRatio = missRatio(mrc, points[p].pages);
+    }
+    total = total * MRC_MODULUS / mrc->threshold;
+    releaseLock(&mrc->lock, USER);
+
+    return (ULONG64) total;
+}
+
+//
+// What each pool size would have done with the references the curve saw,
+// next to what the pool as it is did
+//
+VOID mrcPrint(const char* caller, const mrcPoint* points, ULONG64 references) {
+    LONG64 now = (LONG64) (points[MRC_POINT_POOL].missRatio * references);
+
+    if (references == 0) {
+        return;
+    }
+
+    for (ULONG p = 0; p < MRC_POINTS; p++) {
+        LONG64 misses = (LONG64) (points[p].missRatio * references);
+
+        printf ("%s : %10llu frames (%5.3gx) - miss ratio %.4f, about %lld misses (%+lld)\n",
+                caller,
+                points[p].pages,
+                pointEighths[p] / 8.0,
+                points[p].missRatio,
+                misses,
+                misses - now);
+    }
+}
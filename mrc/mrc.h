@@ -0,0 +1,95 @@
+//
+// mrc.h
+// Online miss ratio curve estimation
+//
+
+#ifndef MRC_H
+#define MRC_H
+
+#include <windows.h>
+
+//
+// SHARDS (Waldspurger et al., FAST '15) : a page is sampled when the hash
+// of its identity falls below a threshold out of MRC_MODULUS, so the
+// sample keeps every reference to the pages it covers and the reuse
+// distances between them, scaled up by the sampling rate, estimate those
+// of the whole stream.  The fixed size variant keeps at most maxSamples
+// pages by lowering the threshold - and rescaling the histogram to match -
+// whenever more than that are being tracked.
+//
+#define MRC_MODULUS_BITS            24
+#define MRC_MODULUS                 (1 << MRC_MODULUS_BITS)
+
+#define DEFAULT_MRC_SAMPLES         8192
+
+// Reuse distance histogram buckets, sized to span every virtual page
+#define MRC_BUCKETS                 1024
+
+//
+// The curve is reported at these multiples of the physical pool, in eighths
+//
+#define MRC_POINTS                  12
+#define MRC_POINT_EIGHTHS           { 1, 2, 4, 6, 8, 10, 12, 16, 24, 32, 48, 64 }
+#define MRC_POINT_POOL              4   // The pool as it is
+
+typedef struct {
+    ULONG64 pages;
+    double missRatio;               // References that would miss with this many frames
+} mrcPoint;
+
+typedef struct {
+    ULONG64 key;
+    ULONG sample;                   // Hash value the threshold is compared against
+    ULONG time;                     // Slot of the last reference in the time tree
+} mrcEntry;
+
+typedef struct {
+    //
+    // Read without the lock to turn away unsampled pages, only ever lowered
+    //
+    volatile ULONG threshold;
+    ULONG maxSamples;               // 0 when tracking is off
+
+    CRITICAL_SECTION lock;
+
+    //
+    // Sampled pages, found through an open addressed table of entry indexes
+    //
+    mrcEntry* entries;
+    ULONG* freeEntries;
+    ULONG freeCount;
+    ULONG samples;
+    LONG* table;
+    ULONG tableMask;
+
+    //
+    // Every sampled page holds one time slot, that of its last reference.
+    // The distinct pages referenced since a given slot are the occupied
+    // slots after it, counted with a Fenwick tree.  Slots are handed out in
+    // order and renumbered when they run out.
+    //
+    LONG* owners;
+    ULONG* tree;
+    ULONG timeSlots;
+    ULONG now;
+
+    //
+    // Reuse distances in pages, scaled to the current sampling rate, plus
+    // first references that no pool size would have saved
+    //
+    double* histogram;
+    ULONG64 bucketPages;
+    double cold;
+} mrcTracker;
+
+//
+// Function declarations
+//
+BOOL mrcInitialize(mrcTracker* mrc, ULONG maxSamples, ULONG64 virtualPages);
+VOID mrcFree(mrcTracker* mrc);
+VOID mrcReference(mrcTracker* mrc, ULONG64 key);
+double mrcMissRatio(mrcTracker* mrc, ULONG64 pages);
+ULONG64 mrcCurve(mrcTracker* mrc, ULONG64 poolPages, mrcPoint* points);
+VOID mrcPrint(const char* caller, const mrcPoint* points, ULONG64 references);
+
+#endif // MRC_H
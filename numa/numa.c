@@ -0,0 +1,46 @@
+//
+// numa.c
+// NUMA nodes of the host
+//
+
+#include <stdio.h>
+#include <windows.h>
+#include "../util/util.h"
+#include "numa.h"
+
+ULONG numaHostNodes(VOID) {
+    ULONG highest;
+
+    if (GetNumaHighestNodeNumber(&highest) == FALSE) {
+        return 1;
+    }
+    return highest + 1;
+}
+
+//
+// The node of the processor the calling thread is on right now - it can
+// move unless it is pinned
+//
+ULONG numaCurrentNode(VOID) {
+    PROCESSOR_NUMBER processor;
+    USHORT node;
+
+    GetCurrentProcessorNumberEx(&processor);
+    if (GetNumaProcessorNodeEx(&processor, &node) == FALSE || node == 0xFFFF) {
+        return 0;
+    }
+    return node;
+}
+
+//
+// Keep a thread on the processors of one node.  Returns FALSE, and leaves
+// the thread where it was, when the node has none.
+//
+BOOL numaPinThread(HANDLE thread, ULONG node) {
+    GROUP_AFFINITY affinity;
+
+    if (GetNumaNodeProcessorMaskEx((USHORT) node, &affinity) == FALSE || affinity.Mask == 0) {
+        return FALSE;
+    }
+    return SetThreadGroupAffinity(thread, &affinity, NULL);
+}
@@ -0,0 +1,23 @@
+//
+// numa.h
+// NUMA nodes of the host
+//
+
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <windows.h>
+
+//
+// Thin wrappers over the host's NUMA calls.  Node numbers here are the
+// host's own - an instance folds them into the nodes it uses.
+//
+
+//
+// Function declarations
+//
+ULONG numaHostNodes(VOID);
+ULONG numaCurrentNode(VOID);
+BOOL numaPinThread(HANDLE thread, ULONG node);
+
+#endif // NUMA_H
@@ -0,0 +1,320 @@
+//
+// pagecopy.c
+// Page copy and zero kernels
+//
+
+#include <string.h>
+#include <windows.h>
+#include "../vm/vm.h"
+#include "pagecopy.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define KERNEL_TARGET(isa)
+#else
+#include <cpuid.h>
+#include <immintrin.h>
+#define KERNEL_TARGET(isa)          __attribute__((target(isa)))
+#endif
+
+static VOID zeroScalar(PVOID page, BOOL stream) {
+    memset(page, 0, PAGE_SIZE);
+}
+
+static VOID copyScalar(PVOID to, const VOID* from, BOOL stream) {
+    memcpy(to, from, PAGE_SIZE);
+}
+
+//
+// Four stores per iteration so the loop overhead hides behind them.
+// Streaming stores are weakly ordered - the fence makes them visible
+// before the page is unmapped or handed to anyone else.
+//
+KERNEL_TARGET("sse2")
+static VOID zeroSse2(PVOID page, BOOL stream) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i* to = page;
+
+    if (stream) {
+        for (ULONG i = 0; i < PAGE_SIZE / sizeof(__m128i); i += 4) {
+            _mm_stream_si128(to + i, zero);
+            _mm_stream_si128(to + i + 1, zero);
+            _mm_stream_si128(to + i + 2, zero);
+            _mm_stream_si128(to + i + 3, zero);
+        }
+        _mm_sfence();
+    } else {
+        for (ULONG i = 0; i < PAGE_SIZE / sizeof(__m128i); i += 4) {
+            _mm_store_si128(to + i, zero);
+            _mm_store_si128(to + i + 1, zero);
+            _mm_store_si128(to + i + 2, zero);
+            _mm_store_si128(to + i + 3, zero);
+        }
+    }
+}
+
+KERNEL_TARGET("sse2")
+static VOID copySse2(PVOID to, const VOID* from, BOOL stream) {
+    __m128i* out = to;
+    const __m128i* in = from;
+
+    for (ULONG i = 0; i < PAGE_SIZE / sizeof(__m128i); i += 4) {
+        __m128i a = _mm_load_si128(in + i);
+        __m128i b = _mm_load_si128(in + i + 1);
+        __m128i c = _mm_load_si128(in + i + 2);
+        __m128i d = _mm_load_si128(in + i + 3);
+
+        if (stream) {
+            _mm_stream_si128(out + i, a);
+            _mm_stream_si128(out + i + 1, b);
+            _mm_stream_si128(out + i + 2, c);
+            _mm_stream_si128(out + i + 3, d);
+        } else {
+            _mm_store_si128(out + i, a);
+            _mm_store_si128(out + i + 1, b);
+            _mm_store_si128(out + i + 2, c);
+            _mm_store_si128(out + i + 3, d);
+        }
+    }
+    if (stream) {
+        _mm_sfence();
+    }
+}
+
+KERNEL_TARGET("avx2")
+static VOID zeroAvx2(PVOID page, BOOL stream) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i* to = page;
+
+    if (stream) {
+        for (ULONG i = 0; i < PAGE_SIZE / sizeof(__m256i); i += 4) {
+            _mm256_stream_si256(to + i, zero);
+            _mm256_stream_si256(to + i + 1, zero);
+            _mm256_stream_si256(to + i + 2, zero);
+            _mm256_stream_si256(to + i + 3, zero);
+        }
+        _mm_sfence();
+    } else {
+        for (ULONG i = 0; i < PAGE_SIZE / sizeof(__m256i); i += 4) {
+            _mm256_store_si256(to + i, zero);
+            _mm256_store_si256(to + i + 1, zero);
+            _mm256_store_si256(to + i + 2, zero);
+            _mm256_store_si256(to + i + 3, zero);
+        }
+    }
+}
+
+KERNEL_TARGET("avx2")
+static VOID copyAvx2(PVOID to, const VOID* from, BOOL stream) {
+    __m256i* out = to;
+    const __m256i* in = from;
+
+    for (ULONG i = 0; i < PAGE_SIZE / sizeof(__m256i); i += 4) {
+        __m256i a = _mm256_load_si256(in + i);
+        __m256i b = _mm256_load_si256(in + i + 1);
+        __m256i c = _mm256_load_si256(in + i + 2);
+        __m256i d = _mm256_load_si256(in + i + 3);
+
+        if (stream) {
+            _mm256_stream_si256(out + i, a);
+            _mm256_stream_si256(out + i + 1, b);
+            _mm256_stream_si256(out + i + 2, c);
+            _mm256_stream_si256(out + i + 3, d);
+        } else {
+            _mm256_store_si256(out + i, a);
+            _mm256_store_si256(out + i + 1, b);
+            _mm256_store_si256(out + i + 2, c);
+            _mm256_store_si256(out + i + 3, d);
+        }
+    }
+    if (stream) {
+        _mm_sfence();
+    }
+}
+
+KERNEL_TARGET("avx512f")
+static VOID zeroAvx512(PVOID page, BOOL stream) {
+    __m512i zero = _mm512_setzero_si512();
+    __m512i* to = page;
+
+    if (stream) {
+        for (ULONG i = 0; i < PAGE_SIZE / sizeof(__m512i); i += 4) {
+            _mm512_stream_si512(to + i, zero);
+            _mm512_stream_si512(to + i + 1, zero);
+            _mm512_stream_si512(to + i + 2, zero);
+            _mm512_stream_si512(to + i + 3, zero);
+        }
+        _mm_sfence();
+    } else {
+        for (ULONG i = 0; i < PAGE_SIZE / sizeof(__m512i); i += 4) {
+            _mm512_store_si512(to + i, zero);
+            _mm512_store_si512(to + i + 1, zero);
+            _mm512_store_si512(to + i + 2, zero);
+            _mm512_store_si512(to + i + 3, zero);
+        }
+    }
+}
+
+KERNEL_TARGET("avx512f")
+static VOID copyAvx512(PVOID to, const VOID* from, BOOL stream) {
+    __m512i* out = to;
+    const __m512i* in = from;
+
+    for (ULONG i = 0; i < PAGE_SIZE / sizeof(__m512i); i += 4) {
+        __m512i a = _mm512_load_si512(in + i);
+        __m512i b = _mm512_load_si512(in + i + 1);
+        __m512i c = _mm512_load_si512(in + i + 2);
+        __m512i d = _mm512_load_si512(in + i + 3);
+
+        if (stream) {
+            _mm512_stream_si512(out + i, a);
+            _mm512_stream_si512(out + i + 1, b);
+            _mm512_stream_si512(out + i + 2, c);
+            _mm512_stream_si512(out + i + 3, d);
+        } else {
+            _mm512_store_si512(out + i, a);
+            _mm512_store_si512(out + i + 1, b);
+            _mm512_store_si512(out + i + 2, c);
+            _mm512_store_si512(out + i + 3, d);
+        }
+    }
+    if (stream) {
+        _mm_sfence();
+    }
+}
+
+static const pageKernel kernels[PAGE_KERNELS] = {
+    { "scalar", zeroScalar, copyScalar },
+    { "sse2", zeroSse2, copySse2 },
+    { "avx2", zeroAvx2, copyAvx2 },
+    { "avx512", zeroAvx512, copyAvx512 },
+};
+
+//
+// Read on every page moved, written when a kernel is picked.  A race
+// between two first instances only ever writes the same choice twice.
+//
+static const pageKernel* current;
+static BOOL currentStream;
+static ULONG currentIndex;
+
+static VOID cpuid(ULONG leaf, ULONG subleaf, ULONG registers[4]) {
+#if defined(_MSC_VER)
+    __cpuidex((int*) registers, leaf, subleaf);
+#else
+    __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+// Which register state the OS saves on a context switch
+static ULONG64 enabledState(VOID) {
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    ULONG low;
+    ULONG high;
+    __asm__ volatile ("xgetbv" : "=a" (low), "=d" (high) : "c" (0));
+    return ((ULONG64) high << 32) | low;
+#endif
+}
+
+//
+// The instructions have to be there and the OS has to save the registers
+// they use - XMM and YMM for AVX2, the opmask and ZMM state as well for
+// AVX-512
+//
+BOOL pageKernelSupported(ULONG kernel) {
+    ULONG basic[4];
+    ULONG extended[4];
+
+    if (kernel == PAGE_KERNEL_SCALAR) {
+        return TRUE;
+    }
+    if (kernel >= PAGE_KERNELS) {
+        return FALSE;
+    }
+
+    cpuid(0, 0, basic);
+    ULONG maxLeaf = basic[0];
+
+    cpuid(1, 0, basic);
+    if (kernel == PAGE_KERNEL_SSE2) {
+        return (basic[3] & (1 << 26)) != 0;
+    }
+
+    // OSXSAVE, without it there is no asking which state is saved
+    if ((basic[2] & (1 << 27)) == 0 || maxLeaf < 7) {
+        return FALSE;
+    }
+
+    cpuid(7, 0, extended);
+    ULONG64 state = enabledState();
+
+    if (kernel == PAGE_KERNEL_AVX2) {
+        return (extended[1] & (1 << 5)) != 0 && (state & 0x6) == 0x6;
+    }
+    return (extended[1] & (1 << 16)) != 0 && (state & 0xE6) == 0xE6;
+}
+
+ULONG pageKernelBest(VOID) {
+    ULONG kernel = PAGE_KERNELS - 1;
+
+    while (kernel != PAGE_KERNEL_SCALAR && pageKernelSupported(kernel) == FALSE) {
+        kernel--;
+    }
+    return kernel;
+}
+
+//
+// Pick the kernel for the whole process.  Fails, leaving the choice alone,
+// if this machine cannot run it.
+//
+BOOL pageKernelSelect(ULONG kernel, BOOL stream) {
+    if (kernel == PAGE_KERNEL_AUTO) {
+        kernel = pageKernelBest();
+    }
+    if (pageKernelSupported(kernel) == FALSE) {
+        return FALSE;
+    }
+
+    currentIndex = kernel;
+    currentStream = stream;
+    current = &kernels[kernel];
+    return TRUE;
+}
+
+// Every instance calls this, only the first one without a choice made picks
+VOID pageKernelInitialize(VOID) {
+    if (current == NULL) {
+        pageKernelSelect(PAGE_KERNEL_AUTO, DEFAULT_PAGE_STREAM);
+    }
+}
+
+ULONG pageKernelCurrent(BOOL* stream) {
+    pageKernelInitialize();
+    if (stream != NULL) {
+        *stream = currentStream;
+    }
+    return currentIndex;
+}
+
+const pageKernel* pageKernelGet(ULONG kernel) {
+    return &kernels[kernel];
+}
+
+ULONG pageKernelFind(const char* name) {
+    for (ULONG k = 0; k < PAGE_KERNELS; k++) {
+        if (strcmp(name, kernels[k].name) == 0) {
+            return k;
+        }
+    }
+    return PAGE_KERNEL_AUTO;
+}
+
+VOID pageZero(PVOID page) {
+    current->zero(page, currentStream);
+}
+
+VOID pageCopy(PVOID to, const VOID* from) {
+    current->copy(to, from, currentStream);
+}
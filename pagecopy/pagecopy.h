@@ -0,0 +1,54 @@
+//
+// pagecopy.h
+// Page copy and zero kernels
+//
+
+#ifndef PAGECOPY_H
+#define PAGECOPY_H
+
+#include <windows.h>
+
+//
+// Whole pages are zeroed and copied by one of these, picked once for the
+// process from what CPUID says the machine has.  Every page handed to them
+// is page aligned, so the vector kernels never deal with a ragged edge.
+//
+#define PAGE_KERNEL_SCALAR          0   // The CRT's memset and memcpy
+#define PAGE_KERNEL_SSE2            1
+#define PAGE_KERNEL_AVX2            2
+#define PAGE_KERNEL_AVX512          3
+
+#define PAGE_KERNELS                4
+
+// Whatever is best here, for pageKernelSelect
+#define PAGE_KERNEL_AUTO            PAGE_KERNELS
+
+//
+// The vector kernels store either through the cache or around it.  Pages
+// the pipeline moves are mostly not read again by the CPU moving them - the
+// writer never looks at a page it wrote out, and a faulting thread touches
+// a line or two of a page it zeroed or read in - so by default they stream,
+// which keeps the other 4KB of someone's working set in the cache.
+//
+#define DEFAULT_PAGE_STREAM         TRUE
+
+typedef struct {
+    const char* name;
+    VOID (*zero)(PVOID page, BOOL stream);
+    VOID (*copy)(PVOID to, const VOID* from, BOOL stream);
+} pageKernel;
+
+//
+// Function declarations
+//
+BOOL pageKernelSupported(ULONG kernel);
+ULONG pageKernelBest(VOID);
+BOOL pageKernelSelect(ULONG kernel, BOOL stream);
+VOID pageKernelInitialize(VOID);
+ULONG pageKernelCurrent(BOOL* stream);
+const pageKernel* pageKernelGet(ULONG kernel);
+ULONG pageKernelFind(const char* name);
+VOID pageZero(PVOID page);
+VOID pageCopy(PVOID to, const VOID* from);
+
+#endif // PAGECOPY_H
@@ -0,0 +1,314 @@
+//
+// platform.c
+// The real platform - physical pages and mappings through AWE
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include "../util/util.h"
+#include "../pt/pt.h"
+#include "../disk/disk.h"
+#include "../diskWrite/diskWrite.h"
+#include "../numa/numa.h"
+#include "platform.h"
+
+// Room past installed memory for the frame numbers of device holes
+#define PFN_LIMIT_SLACK_PAGES       (MB(4096ULL) / PAGE_SIZE)
+
+static ULONG64 getMaxFrameNumber(vmInstance* vm) {
+    ULONG64 maxFrameNumber = 0;
+
+    for (ULONG64 i = 0; i < vm->physicalPageCount; ++i) {
+        maxFrameNumber = max(maxFrameNumber, vm->physicalPageNumbers[i]);
+    }
+    return maxFrameNumber;
+}
+
+static int compareFrames(const void* a, const void* b) {
+    ULONG_PTR x = *(const ULONG_PTR*) a;
+    ULONG_PTR y = *(const ULONG_PTR*) b;
+    return x < y ? -1 : x > y;
+}
+
+static VOID commitRange(ULONG_PTR start, ULONG_PTR end) {
+    PVOID z = VirtualAlloc((PVOID) start, end - start, MEM_COMMIT, PAGE_READWRITE);
+    ASSERT(z);
+}
+
+//
+// Commit the PFN entries of these frames a run of PFN pages at a time.
+// Frames close together share PFN pages, so in frame number order they
+// come down to one VirtualAlloc per run of physically contiguous memory
+// instead of one (or two) per frame.
+//
+static VOID commitPfns(vmInstance* vm, PULONG_PTR frames, ULONG64 count) {
+    PULONG_PTR sorted;
+    ULONG_PTR runStart = 0;
+    ULONG_PTR runEnd = 0;
+
+    if (count == 0) {
+        return;
+    }
+
+    sorted = malloc(count * sizeof(ULONG_PTR));
+    ASSERT(sorted);
+    memcpy(sorted, frames, count * sizeof(ULONG_PTR));
+    qsort(sorted, count, sizeof(ULONG_PTR), compareFrames);
+
+    for (ULONG64 i = 0; i < count; i++) {
+        ULONG_PTR first = (ULONG_PTR) (vm->pfnStart + sorted[i]) & ~((ULONG_PTR) PAGE_SIZE - 1);
+        ULONG_PTR end = ((ULONG_PTR) (vm->pfnStart + sorted[i] + 1) + PAGE_SIZE - 1) & ~((ULONG_PTR) PAGE_SIZE - 1);
+
+        if (first <= runEnd && runEnd != 0) {
+            runEnd = max(runEnd, end);
+            continue;
+        }
+        if (runEnd != 0) {
+            commitRange(runStart, runEnd);
+        }
+        runStart = first;
+        runEnd = end;
+    }
+    if (runEnd != 0) {
+        commitRange(runStart, runEnd);
+    }
+
+    free(sorted);
+}
+
+//
+// Frames added to the pool later can be anywhere in physical memory, so
+// the PFN database is reserved to cover all of it - not just the frames we
+// start with.  Reserving costs address space only.
+//
+static ULONG64 getFrameNumberLimit(vmInstance* vm) {
+    ULONGLONG installedKb;
+    ULONG64 limit = getMaxFrameNumber(vm) + 1;
+
+    if (GetPhysicallyInstalledSystemMemory(&installedKb)) {
+        ULONG64 installed = installedKb * 1024 / PAGE_SIZE;
+
+        // Device holes push the highest frames past what is installed
+        limit = max(limit, installed + installed / 4 + PFN_LIMIT_SLACK_PAGES);
+    }
+    return limit;
+}
+
+static VOID commitSparseArray(vmInstance* vm) {
+    PULONG_PTR pages = vm->physicalPageNumbers;
+    vm->pfnLimit = getFrameNumberLimit(vm);
+    vm->pfnStart = VirtualAlloc(NULL,sizeof(pfn) * vm->pfnLimit, MEM_RESERVE,PAGE_READWRITE);
+    ASSERT(vm->pfnStart);
+
+    commitPfns(vm, pages, vm->physicalPageCount);
+}
+
+static BOOL aweAllocateFrames(vmInstance* vm) {
+    BOOL allocated;
+    BOOL privilege;
+    ULONG_PTR physical_page_count;
+    ULONG64 nodeEnd[MAX_NUMA_NODES];
+
+    //
+    // Allocate the physical pages that we will be managing.
+    //
+    // First acquire privilege to do this since physical page control
+    // is typically something the operating system reserves the sole
+    // right to do.
+    //
+
+    privilege = GetPrivilege();
+
+    if (privilege == FALSE) {
+        printf ("vmCreate : could not get privilege\n");
+        return FALSE;
+    }
+
+#if SUPPORT_MULTIPLE_VA_TO_SAME_PAGE
+
+    vm->physical_page_handle = CreateSharedMemorySection();
+
+    if (vm->physical_page_handle == NULL) {
+        printf ("CreateFileMapping2 failed, error %#x\n", GetLastError ());
+        return FALSE;
+    }
+
+#else
+
+    vm->physical_page_handle = GetCurrentProcess ();
+
+#endif
+
+    vm->nodeCount = min(numaHostNodes(), MAX_NUMA_NODES);
+    if (vm->config.numaNodes != 0) {
+        vm->nodeCount = min(vm->nodeCount, vm->config.numaNodes);
+    }
+
+    physical_page_count = 0;
+    vm->physicalPageNumbers = initialize(vm->config.physicalPages * sizeof (ULONG_PTR));
+
+    //
+    // An even share from each node, one after the other in the frame
+    // numbers, so the node of a frame follows from where it is in them
+    //
+    allocated = TRUE;
+    for (ULONG n = 0; n < vm->nodeCount && allocated; n++) {
+        ULONG_PTR share = vm->config.physicalPages * (n + 1) / vm->nodeCount - vm->config.physicalPages * n / vm->nodeCount;
+
+        if (vm->nodeCount == 1) {
+            allocated = AllocateUserPhysicalPages (vm->physical_page_handle,
+                                                   &share,
+                                                   vm->physicalPageNumbers);
+        } else {
+            allocated = AllocateUserPhysicalPagesNuma (vm->physical_page_handle,
+                                                       &share,
+                                                       vm->physicalPageNumbers + physical_page_count,
+                                                       n);
+        }
+        if (allocated) {
+            physical_page_count += share;
+            nodeEnd[n] = physical_page_count;
+        }
+    }
+
+    if (allocated == FALSE) {
+        if (physical_page_count != 0) {
+            FreeUserPhysicalPages (vm->physical_page_handle, &physical_page_count, vm->physicalPageNumbers);
+        }
+        printf ("vmCreate : could not allocate physical pages\n");
+        free(vm->physicalPageNumbers);
+        return FALSE;
+    }
+
+    if (physical_page_count != vm->config.physicalPages) {
+
+        printf ("vmCreate : allocated only %llu pages out of %llu pages requested\n",
+                physical_page_count,
+                vm->config.physicalPages);
+    }
+
+    vm->physicalPageCount = physical_page_count;
+
+    vm->diskTransferVa = reserveAweRegion(vm, vm->config.writerThreads * WRITE_BUFFERS * writeBatchLimit(vm));
+
+    ULONG64 start = latencyNow();
+    commitSparseArray(vm);
+    vm->startup.us[STARTUP_PFN] = latencyMicroseconds(latencyNow() - start);
+
+    ULONG node = 0;
+    for (ULONG64 i = 0; i < vm->physicalPageCount; i++) {
+        while (i == nodeEnd[node]) {
+            node++;
+        }
+        frameNumber2pfn(vm, vm->physicalPageNumbers[i])->node = node;
+    }
+
+    return TRUE;
+}
+
+static VOID aweFreeFrames(vmInstance* vm) {
+    VirtualFree (vm->diskTransferVa, 0, MEM_RELEASE);
+    VirtualFree (vm->pfnStart, 0, MEM_RELEASE);
+
+    FreeUserPhysicalPages (vm->physical_page_handle,
+                           &vm->physicalPageCount,
+                           vm->physicalPageNumbers);
+
+#if SUPPORT_MULTIPLE_VA_TO_SAME_PAGE
+    CloseHandle (vm->physical_page_handle);
+#endif
+
+    free(vm->physicalPageNumbers);
+}
+
+static ULONG64 aweAddFrames(vmInstance* vm, ULONG64 count, PULONG_PTR frames, ULONG node) {
+    ULONG_PTR allocated = count;
+    ULONG64 kept = 0;
+    BOOL b;
+
+    if (vm->nodeCount == 1) {
+        b = AllocateUserPhysicalPages (vm->physical_page_handle, &allocated, frames);
+    } else {
+        b = AllocateUserPhysicalPagesNuma (vm->physical_page_handle, &allocated, frames, node);
+    }
+    if (b == FALSE) {
+        return 0;
+    }
+
+    //
+    // Anything past the end of the PFN database goes straight back
+    //
+    for (ULONG64 i = 0; i < allocated; i++) {
+        if (frames[i] < vm->pfnLimit) {
+            ULONG_PTR frame = frames[i];
+            frames[i] = frames[kept];
+            frames[kept++] = frame;
+        }
+    }
+    commitPfns(vm, frames, kept);
+
+    if (kept != allocated) {
+        ULONG_PTR rejected = allocated - kept;
+        printf ("aweAddFrames : %llu frames are beyond the PFN database\n", (ULONG64) rejected);
+        FreeUserPhysicalPages (vm->physical_page_handle, &rejected, frames + kept);
+    }
+    return kept;
+}
+
+//
+// The PFN entries stay committed, the frames may well come back
+//
+static VOID aweRemoveFrames(vmInstance* vm, ULONG64 count, PULONG_PTR frames) {
+    ULONG_PTR freed = count;
+    BOOL b = FreeUserPhysicalPages (vm->physical_page_handle, &freed, frames);
+    ASSERT(b && freed == count);
+}
+
+static VOID aweRelease(vmInstance* vm, PVOID va) {
+    VirtualFree (va, 0, MEM_RELEASE);
+}
+
+static BOOL aweMap(vmInstance* vm, PVOID va, ULONG64 count, PULONG_PTR frames) {
+    return MapUserPhysicalPages(va, count, frames);
+}
+
+static BOOL aweMapScatter(vmInstance* vm, PVOID* vas, ULONG64 count, PULONG_PTR frames) {
+    return MapUserPhysicalPagesScatter(vas, count, frames);
+}
+
+//
+// Rather than sit idle the waiting thread helps with whatever is queued
+// that makes pages - trimming and writing, never the advisory prefetches
+//
+static VOID aweWaitForPages(vmInstance* vm) {
+    taskSignal(&vm->sched, &vm->taskTrim);
+    if (schedulerHelp(&vm->sched, TASK_PRIORITY_NORMAL)) {
+        return;
+    }
+    WaitForSingleObject(vm->eventRedoFault, INFINITE);
+}
+
+static ULONG64 aweTickCount(vmInstance* vm) {
+    return GetTickCount64();
+}
+
+const vmPlatform awePlatform = {
+    "awe",
+    FALSE,
+    aweAllocateFrames,
+    aweFreeFrames,
+    aweAddFrames,
+    aweRemoveFrames,
+    reserveAweRegion,
+    aweRelease,
+    aweMap,
+    aweMapScatter,
+    zeroAPage,
+    copyAPage,
+    diskRead,
+    diskWritePages,
+    aweWaitForPages,
+    aweTickCount,
+};
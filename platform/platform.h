@@ -0,0 +1,57 @@
+//
+// platform.h
+// What the paging state machines ask of the machine underneath them
+//
+
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+#include <windows.h>
+#include "../vm/vm.h"
+
+//
+// Everything the PTE/PFN state machines need that is not bookkeeping -
+// frames, address space, mapping, page contents and waiting for the
+// background threads.  awePlatform does it for real with AWE; a simulated
+// platform can model the cost of each instead (see sim/).
+//
+struct _vmPlatform {
+    const char* name;
+
+    // No background threads and no real frames, VAs or pagefile contents
+    BOOL simulated;
+
+    // Sets nodeCount and the node of every frame's PFN entry too
+    BOOL (*allocateFrames)(vmInstance* vm);
+    VOID (*freeFrames)(vmInstance* vm);
+
+    //
+    // Resizing a live pool.  addFrames gets up to count more frames on node
+    // with their PFN entries committed and returns how many it got,
+    // removeFrames hands frames that are on no list back to the host.
+    //
+    ULONG64 (*addFrames)(vmInstance* vm, ULONG64 count, PULONG_PTR frames, ULONG node);
+    VOID (*removeFrames)(vmInstance* vm, ULONG64 count, PULONG_PTR frames);
+
+    PVOID (*reserve)(vmInstance* vm, ULONG64 numPages);
+    VOID (*release)(vmInstance* vm, PVOID va);
+
+    // A NULL frames array unmaps
+    BOOL (*map)(vmInstance* vm, PVOID va, ULONG64 count, PULONG_PTR frames);
+    BOOL (*mapScatter)(vmInstance* vm, PVOID* vas, ULONG64 count, PULONG_PTR frames);
+
+    VOID (*zeroPage)(ULONG64 frameNumber, threadInfo* info);
+    VOID (*copyPage)(ULONG64 fromFrame, ULONG64 toFrame, threadInfo* info);
+    VOID (*readPage)(ULONG64 diskIndex, ULONG64 frameNumber, threadInfo* info);
+    // Copy count pages already mapped at va to their pagefile slots
+    VOID (*writePages)(vmInstance* vm, PVOID va, ULONG64* diskIndexes, ULONG64 count);
+
+    // A fault found no frames - get the trimmer and writer going, and help them or wait
+    VOID (*waitForPages)(vmInstance* vm);
+
+    ULONG64 (*tickCount)(vmInstance* vm);
+};
+
+extern const vmPlatform awePlatform;
+
+#endif // PLATFORM_H
@@ -0,0 +1,296 @@
+//
+// pool.c
+// Growing and shrinking the physical pool of a live instance
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+#include "../util/util.h"
+#include "../pt/pt.h"
+#include "../list/list.h"
+#include "../trace/trace.h"
+#include "../platform/platform.h"
+#include "../diskWrite/diskWrite.h"
+#include "pool.h"
+
+//
+// Spaces allowed the whole pool keep being allowed all of it, and nobody
+// keeps a limit the pool can no longer meet
+//
+static VOID resizeLimits(vmInstance* vm, ULONG64 oldCount, ULONG64 newCount) {
+    acquireLock(&vm->lockSpaces, USER);
+    for (ULONG s = 0; s < MAX_ADDRESS_SPACES; s++) {
+        addressSpace* space = vm->spaces[s];
+
+        if (space == NULL) {
+            continue;
+        }
+        if (space->wsMaximum >= oldCount || space->wsMaximum > newCount) {
+            space->wsMaximum = newCount;
+        }
+        space->wsMinimum = min(space->wsMinimum, newCount);
+    }
+    releaseLock(&vm->lockSpaces, USER);
+}
+
+//
+// Add up to pages frames from the host to the free lists, an even share
+// from each node.  Returns how many were added, which can be fewer if the
+// host is short.
+//
+ULONG64 vmGrowPool(vmInstance* vm, ULONG64 pages) {
+    PULONG_PTR frames;
+    PULONG_PTR numbers = NULL;
+    pfnListHead added[MAX_NUMA_NODES];
+    ULONG64 count = 0;
+
+    if (pages == 0) {
+        return 0;
+    }
+
+    frames = malloc(pages * sizeof(ULONG_PTR));
+    if (frames == NULL) {
+        return 0;
+    }
+
+    acquireLock(&vm->lockPool, USER);
+
+    //
+    // Link them up on the side so the free list lock is only held to
+    // splice them on.  Each node's frames are taken off the host before
+    // asking for the next node's - a frame the host has handed over is in
+    // the pool from then on.
+    //
+    for (ULONG n = 0; n < vm->nodeCount; n++) {
+        ULONG64 share = pages * (n + 1) / vm->nodeCount - pages * n / vm->nodeCount;
+        ULONG64 got = vm->platform->addFrames(vm, share, frames + count, n);
+
+        initializePfnList(&added[n]);
+        for (ULONG64 i = count; i < count + got; i++) {
+            pfn* page = frameNumber2pfn(vm, frames[i]);
+
+            page->node = n;
+            pfnSetPte(page, NULL, NULL);
+            page->diskIndex = 0;
+            pageSetStatus(vm, page, FREE);
+            linkAdd(vm, page, &added[n]);
+        }
+        count += got;
+    }
+    if (count != 0) {
+        numbers = realloc(vm->physicalPageNumbers, (vm->physicalPageCount + count) * sizeof(ULONG_PTR));
+        if (numbers == NULL) {
+            for (ULONG64 i = 0; i < count; i++) {
+                pageSetStatus(vm, frameNumber2pfn(vm, frames[i]), 0);
+            }
+            vm->platform->removeFrames(vm, count, frames);
+        }
+    }
+    if (numbers == NULL) {
+        releaseLock(&vm->lockPool, USER);
+        free(frames);
+        return 0;
+    }
+    vm->physicalPageNumbers = numbers;
+    memcpy(numbers + vm->physicalPageCount, frames, count * sizeof(ULONG_PTR));
+
+    acquireLock(&vm->lockFreeList, USER);
+    for (ULONG n = 0; n < vm->nodeCount; n++) {
+        linkSplice(vm, &added[n], &vm->headFreeList[n]);
+    }
+    releaseLock(&vm->lockFreeList, USER);
+
+    acquireLock(&vm->lockSpaces, USER);
+    vm->physicalPageCount += count;
+    releaseLock(&vm->lockSpaces, USER);
+    resizeLimits(vm, vm->physicalPageCount - count, vm->physicalPageCount);
+
+    releaseLock(&vm->lockPool, USER);
+
+    // Faults waiting for frames can have these
+    SetEvent(vm->eventRedoFault);
+    TRACE_INSTANT("poolGrow", "frames", count);
+
+    free(frames);
+    return count;
+}
+
+//
+// Every virtual page has to stay backed by a frame or a pagefile slot
+// (slot 0 is reserved), and trimming needs some frames to work with
+//
+ULONG64 poolFloor(vmInstance* vm) {
+    ULONG64 slots = vm->config.diskSizeInPages - 1;
+    ULONG64 backing = vm->totalPtes > slots ? vm->totalPtes - slots : 0;
+
+    return max(backing, vm->config.trimBatchSize + vm->config.writeBatchSize);
+}
+
+static int compareFrames(const void* a, const void* b) {
+    ULONG_PTR x = *(const ULONG_PTR*) a;
+    ULONG_PTR y = *(const ULONG_PTR*) b;
+    return x < y ? -1 : x > y;
+}
+
+//
+// Give up to pages frames back to the host.  Free frames go first, then
+// standby ones - lowest priority first, just as if they were repurposed -
+// and when neither list has any the trimmer and writer are asked for more.
+// Returns how many were given back.
+//
+ULONG64 vmShrinkPool(vmInstance* vm, ULONG64 pages) {
+    PULONG_PTR frames;
+    ULONG64 taken = 0;
+    ULONG64 oldCount;
+    ULONG attempts = 0;
+    pfn* page;
+
+    acquireLock(&vm->lockPool, USER);
+
+    //
+    // Take the pages off the count up front so no space can be created
+    // that needs them while they are being drained
+    //
+    acquireLock(&vm->lockSpaces, USER);
+    oldCount = vm->physicalPageCount;
+    pages = min(pages, oldCount - min(oldCount, poolFloor(vm)));
+    vm->physicalPageCount -= pages;
+    releaseLock(&vm->lockSpaces, USER);
+
+    frames = pages != 0 ? malloc(pages * sizeof(ULONG_PTR)) : NULL;
+    if (frames == NULL) {
+        acquireLock(&vm->lockSpaces, USER);
+        vm->physicalPageCount += pages;
+        releaseLock(&vm->lockSpaces, USER);
+        releaseLock(&vm->lockPool, USER);
+        return 0;
+    }
+
+    while (taken < pages && attempts < POOL_SHRINK_ATTEMPTS) {
+        ULONG64 before = taken;
+
+        acquireLock(&vm->lockFreeList, USER);
+        // Round the nodes so they shrink evenly
+        while (taken < pages && (page = freeListRemove(vm, (ULONG) (taken % vm->nodeCount))) != NULL) {
+            frames[taken++] = pfn2frameNumber(vm, page);
+        }
+        releaseLock(&vm->lockFreeList, USER);
+
+        acquireLockPTE(vm, NULL, USER);
+        while (taken < pages && (page = standbyRepurpose(vm, (ULONG) (taken % vm->nodeCount))) != NULL) {
+            frames[taken++] = pfn2frameNumber(vm, page);
+        }
+        releaseLockPTE(vm, NULL, USER);
+
+        if (taken != before) {
+            attempts = 0;
+            continue;
+        }
+
+        attempts++;
+        vm->platform->waitForPages(vm);
+        if (vm->platform->simulated == FALSE &&
+            WaitForSingleObject(vm->eventSystemShutdown, POOL_SHRINK_WAIT_MS) != WAIT_TIMEOUT) {
+            break;
+        }
+    }
+
+    //
+    // Frames taken off the free and standby lists are on no list and
+    // behind no PTE, so no fault, trim or prefetch can reach them again.
+    // The only way left to them is a batch a writer claimed before the
+    // frame was rescued and freed, which may still be about to copy it -
+    // once the writes in flight have drained, nothing can, and their PFNs
+    // can be reset and the frames given back with no lock held.
+    //
+    if (taken != 0) {
+        writesHold(vm);
+    }
+    for (ULONG64 i = 0; i < taken; i++) {
+        pageSetStatus(vm, frameNumber2pfn(vm, frames[i]), 0);
+    }
+    if (taken != 0) {
+        vm->platform->removeFrames(vm, taken, frames);
+        writesResume(vm);
+    }
+
+    //
+    // Drop them from the pool's frame numbers
+    //
+    qsort(frames, taken, sizeof(ULONG_PTR), compareFrames);
+
+    ULONG64 kept = 0;
+    for (ULONG64 i = 0; i < oldCount; i++) {
+        ULONG_PTR frame = vm->physicalPageNumbers[i];
+        if (bsearch(&frame, frames, taken, sizeof(ULONG_PTR), compareFrames) == NULL) {
+            vm->physicalPageNumbers[kept++] = frame;
+        }
+    }
+    ASSERT(kept == oldCount - taken);
+
+    acquireLock(&vm->lockSpaces, USER);
+    vm->physicalPageCount += pages - taken;
+    releaseLock(&vm->lockSpaces, USER);
+    resizeLimits(vm, oldCount, kept);
+
+    releaseLock(&vm->lockPool, USER);
+
+    TRACE_INSTANT("poolShrink", "frames", taken);
+
+    free(frames);
+    return taken;
+}
+
+static BOOL worthGrowing(vmInstance* vm, ULONG64 count, ULONG64 step) {
+    // With no curve to go by, spare host memory is reason enough
+    if (vm->mrc.maxSamples == 0) {
+        return TRUE;
+    }
+
+    return mrcMissRatio(&vm->mrc, count) - mrcMissRatio(&vm->mrc, count + step) >= POOL_GROW_MIN_SAVING;
+}
+
+//
+// Follows the host's memory resource notifications.  While memory is low
+// the pool gives back a step at a time down to poolMinimum, while it is
+// plentiful it takes a step at a time up to poolMaximum - but only as long
+// as the miss ratio curve says the extra frames would be used.
+//
+VOID threadPool(LPVOID lpParameter) {
+    vmInstance* vm = (vmInstance*) lpParameter;
+    HANDLE low = CreateMemoryResourceNotification(LowMemoryResourceNotification);
+    HANDLE high = CreateMemoryResourceNotification(HighMemoryResourceNotification);
+    BOOL state;
+
+    TRACE_THREAD_NAME("pool", 0);
+
+    WaitForSingleObject(vm->eventSystemStart, INFINITE);
+
+    while (WaitForSingleObject(vm->eventSystemShutdown, POOL_CHECK_MS) == WAIT_TIMEOUT) {
+        ULONG64 count = vm->physicalPageCount;
+        ULONG64 step = max(1, count / POOL_STEP_DIVISOR);
+
+        if (low != NULL && QueryMemoryResourceNotification(low, &state) && state) {
+            if (count > vm->config.poolMinimum) {
+                vmShrinkPool(vm, min(step, count - vm->config.poolMinimum));
+            }
+            continue;
+        }
+
+        if (high != NULL && QueryMemoryResourceNotification(high, &state) && state &&
+            count < vm->config.poolMaximum) {
+            step = min(step, vm->config.poolMaximum - count);
+            if (worthGrowing(vm, count, step)) {
+                vmGrowPool(vm, step);
+            }
+        }
+    }
+
+    if (low != NULL) {
+        CloseHandle(low);
+    }
+    if (high != NULL) {
+        CloseHandle(high);
+    }
+}
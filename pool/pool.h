@@ -0,0 +1,41 @@
+//
+// pool.h
+// Growing and shrinking the physical pool of a live instance
+//
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <windows.h>
+#include "../vm/vm.h"
+
+// How often the pressure thread looks at the host
+#define POOL_CHECK_MS               500
+
+// Each step moves the pool by this fraction of its size
+#define POOL_STEP_DIVISOR           8
+
+//
+// A shrink gives up after this many waits in a row for the trimmer and
+// writer that free up nothing.  It only ever takes frames off the free and
+// standby lists, so the frames of large frames, free or in use, are never
+// given back - only those of a split one that went back to the free list.
+//
+#define POOL_SHRINK_ATTEMPTS        100
+#define POOL_SHRINK_WAIT_MS         10
+
+//
+// Growing without pressure has to be worth it - with the miss ratio curve
+// on, the next step must save at least this fraction of the references
+//
+#define POOL_GROW_MIN_SAVING        0.01
+
+//
+// Function declarations
+//
+ULONG64 vmGrowPool(vmInstance* vm, ULONG64 pages);
+ULONG64 vmShrinkPool(vmInstance* vm, ULONG64 pages);
+ULONG64 poolFloor(vmInstance* vm);
+VOID threadPool(LPVOID lpParameter);
+
+#endif // POOL_H
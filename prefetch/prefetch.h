@@ -0,0 +1,18 @@
+//
+// prefetch.h
+// Asynchronous page-in declarations
+//
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <windows.h>
+#include "../vm/vm.h"
+
+VOID prefetchStart(vmInstance* vm);
+VOID prefetchStop(vmInstance* vm);
+BOOL prefetchNext(vmInstance* vm, threadInfo* info);
+VOID queuePrefetch(addressSpace* space, ULONG64 startPage, ULONG64 endPage, ULONG priority);
+VOID cancelPrefetch(addressSpace* space);
+
+#endif //PREFETCH_H
@@ -0,0 +1,144 @@
+//
+// threadPrefetch.c
+// Asynchronous page-in task
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+#include "../util/util.h"
+#include "../pt/pt.h"
+#include "../api/libvm.h"
+#include "../trace/trace.h"
+#include "prefetch.h"
+
+//
+// Pages ranges in ahead of their faults - both for VM_ADVISE_WILLNEED and
+// for read-ahead in sequential ranges.  Prefetched pages go to standby, so
+// it is all advisory : if the queue is full or there are no free frames the
+// pages simply get faulted in the normal way later.
+//
+
+VOID queuePrefetch(addressSpace* space, ULONG64 startPage, ULONG64 endPage, ULONG priority) {
+    vmInstance* vm = space->vm;
+
+    if (startPage >= endPage) {
+        return;
+    }
+
+    acquireLock(&vm->lockPrefetch, USER);
+    if (vm->prefetchTail - vm->prefetchHead < PREFETCH_QUEUE_SIZE) {
+        pageRange* request = &vm->prefetchQueue[vm->prefetchTail % PREFETCH_QUEUE_SIZE];
+        request->space = space;
+        request->startPage = startPage;
+        request->endPage = min(endPage, space->numPtes);
+        request->priority = priority;
+        vm->prefetchTail++;
+    }
+    releaseLock(&vm->lockPrefetch, USER);
+
+    taskSignal(&vm->sched, &vm->taskPrefetch);
+}
+
+//
+// Drop everything queued against a space that is going away and wait out
+// a request the task is already working on.
+//
+VOID cancelPrefetch(addressSpace* space) {
+    vmInstance* vm = space->vm;
+
+    while (TRUE) {
+        acquireLock(&vm->lockPrefetch, USER);
+        for (ULONG64 i = vm->prefetchHead; i != vm->prefetchTail; i++) {
+            pageRange* request = &vm->prefetchQueue[i % PREFETCH_QUEUE_SIZE];
+            if (request->space == space) {
+                request->space = NULL;
+            }
+        }
+        BOOL busy = vm->prefetchSpace == space;
+        releaseLock(&vm->lockPrefetch, USER);
+
+        if (busy == FALSE) {
+            return;
+        }
+        Sleep(0);
+    }
+}
+
+//
+// Read in the next queued request.  Returns FALSE once the queue is empty.
+//
+BOOL prefetchNext(vmInstance* vm, threadInfo* info) {
+    pageRange request;
+
+    acquireLock(&vm->lockPrefetch, USER);
+    if (vm->prefetchHead == vm->prefetchTail) {
+        releaseLock(&vm->lockPrefetch, USER);
+        return FALSE;
+    }
+    request = vm->prefetchQueue[vm->prefetchHead % PREFETCH_QUEUE_SIZE];
+    vm->prefetchHead++;
+    vm->prefetchSpace = request.space;
+    releaseLock(&vm->lockPrefetch, USER);
+
+    // Cancelled when its space was destroyed
+    if (request.space == NULL) {
+        return TRUE;
+    }
+
+    //
+    // Take the PTE lock a page at a time so faulting threads are
+    // never stuck behind a long prefetch.
+    //
+
+    TRACE_BEGIN("prefetch");
+
+    BOOL prefetched = FALSE;
+    ULONG64 index;
+    for (index = request.startPage; index < request.endPage; index++) {
+        acquireLockPTE(vm, NULL, USER);
+        BOOL framesLeft = prefetchPage(info, request.space, request.space->ptes + index, request.priority);
+        releaseLock(&vm->lockPTE, USER);
+
+        if (framesLeft == FALSE) {
+            break;
+        }
+        prefetched = TRUE;
+    }
+
+    TRACE_END("prefetch", "pages", index - request.startPage);
+
+    acquireLock(&vm->lockPrefetch, USER);
+    vm->prefetchSpace = NULL;
+    releaseLock(&vm->lockPrefetch, USER);
+
+    // Anyone waiting for pages might be waiting for one of these
+    if (prefetched) {
+        SetEvent(vm->eventRedoFault);
+    }
+    return TRUE;
+}
+
+//
+// Everything queued by the time it runs.  Advisory, so it runs after
+// anything a fault is waiting on.
+//
+static VOID prefetchTask(task* work) {
+    threadInfo* info = (threadInfo*) work->context;
+
+    while (prefetchNext(info->vm, info)) {
+    }
+}
+
+VOID prefetchStart(vmInstance* vm) {
+
+    // Reading in needs a transfer VA just like a faulting thread
+    threadInfo* info = vmAttachThread(vm);
+
+    taskInitialize(&vm->taskPrefetch, "prefetch", prefetchTask, info, TASK_PRIORITY_LOW, TASK_ANY_WORKER);
+}
+
+// Only once the workers are gone
+VOID prefetchStop(vmInstance* vm) {
+    vmDetachThread((threadInfo*) vm->taskPrefetch.context);
+}
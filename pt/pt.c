@@ -10,67 +10,213 @@
 #include "../vm/vm.h"
 #include "pt.h"
 #include "../list/list.h"
+#include "../trace/trace.h"
 #include "../disk/disk.h"
+#include "../prefetch/prefetch.h"
+#include "../platform/platform.h"
+#include "../fiber/fiber.h"
+#include "../large/large.h"
+#include "../snap/snap.h"
 
-pte* va2pte(PVOID va) {
-    ULONG64 index = ((ULONG_PTR)va - (ULONG_PTR) vaStart) / PAGE_SIZE;
-    pte* pte = ptes + index;
+pte* va2pte(addressSpace* space, PVOID va) {
+    ULONG64 index = ((ULONG_PTR)va - (ULONG_PTR) space->vaStart) / PAGE_SIZE;
+    pte* pte = space->ptes + index;
     return pte;
 }
 
-PVOID pte2va (pte* pte) {
-    ULONG64 index = pte - ptes;
-    return (PVOID) (index * PAGE_SIZE + (ULONG_PTR) vaStart);
+PVOID pte2va (addressSpace* space, pte* pte) {
+    ULONG64 index = pte - space->ptes;
+    return (PVOID) (index * PAGE_SIZE + (ULONG_PTR) space->vaStart);
 }
 
-pfn* frameNumber2pfn (ULONG64 frameNumber) {
-    return pfnStart + frameNumber;
+pfn* frameNumber2pfn (vmInstance* vm, ULONG64 frameNumber) {
+    return vm->pfnStart + frameNumber;
 }
 
-ULONG64 pfn2frameNumber (pfn* p) {
-    return (ULONG64) (p - pfnStart);
+ULONG64 pfn2frameNumber (vmInstance* vm, pfn* p) {
+    return (ULONG64) (p - vm->pfnStart);
 }
 
-void activatePage(pfn* page, pte* new) {
-    ULONG64 frameNumber = pfn2frameNumber(page);
-    BOOL b = MapUserPhysicalPages(pte2va(new), 1, &frameNumber);
+//
+// The PTE mapping a page, or the one it was last trimmed or read in for
+//
+pte* pfnPte (vmInstance* vm, pfn* page) {
+#if VM_COMPACT_PFN
+    if (page->pte == PFN_PTE_NONE) {
+        return NULL;
+    }
+    return vm->spaces[page->pte >> PFN_PTE_INDEX_BITS]->ptes + (page->pte & PFN_PTE_INDEX_LIMIT);
+#else
+    return page->pte;
+#endif
+}
+
+VOID pfnSetPte (pfn* page, addressSpace* space, pte* x) {
+#if VM_COMPACT_PFN
+    page->pte = x == NULL ? PFN_PTE_NONE : space->index << PFN_PTE_INDEX_BITS | (ULONG) (x - space->ptes);
+#else
+    page->pte = x;
+#endif
+}
+
+void activatePage(addressSpace* space, pfn* page, pte* new) {
+    vmInstance* vm = space->vm;
+    ULONG64 frameNumber = pfn2frameNumber(vm, page);
+    BOOL b = vm->platform->map(vm, pte2va(space, new), 1, &frameNumber);
     ASSERT(b);
     page->diskIndex = 0;
-    page->pte = new;
-    page->status = ACTIVE;
+    pfnSetPte(page, space, new);
+    pageSetStatus(vm, page, ACTIVE);
     new->valid.valid = VALID;
     new->valid.frameNumber = frameNumber;
-    InterlockedIncrement64(&activeCount);
-    InterlockedIncrement64(&pagesActivated);
-    printf(".");
+    InterlockedIncrement64(&space->activeCount);
+    largeResident(space, new, 1);
+    statsAdd(&vm->stats, STAT_PAGES_ACTIVATED, 1);
 }
 
-pfn* standbyFree(threadInfo* info) {
-    acquireLock(&lockStandbyList, USER);
-    pfn* page = linkRemoveHead(&headStandbyList);
-    releaseLock(&lockStandbyList, USER);
+//
+// Take the least wanted standby page away from its PTE, which goes back to
+// pointing at the page's pagefile slot, preferring one on node.  The caller
+// holds the PTE lock.
+//
+pfn* standbyRepurpose(vmInstance* vm, ULONG node) {
+    acquireLock(&vm->lockStandbyList, USER);
+    pfn* page = standbyRemoveLowest(vm, node);
+    releaseLock(&vm->lockStandbyList, USER);
     if (page == NULL) {
         return NULL;
     }
 
-    // We already have the page table lock
-    page->pte->disk.invalid = INVALID;
-    page->pte->disk.disk = DISK;
-    page->pte->disk.diskIndex = page->diskIndex;
+    pte* x = pfnPte(vm, page);
+    x->disk.invalid = INVALID;
+    x->disk.disk = DISK;
+    x->disk.diskIndex = page->diskIndex;
 
-    ULONG64 frameNumber = pfn2frameNumber(page);
-    BOOL b = MapUserPhysicalPages(info->transferVa, 1, &frameNumber);
-    ASSERT(b);
+    return page;
+}
 
-    // Zero the page content, not the PFN structure
-    memset(info->transferVa, 0, PAGE_SIZE);  // Use transferVa, which points to the mapped page
+pfn* standbyFree(threadInfo* info) {
+    vmInstance* vm = info->vm;
+
+    // We already have the page table lock
+    pfn* page = standbyRepurpose(vm, info->node);
+    if (page == NULL) {
+        return NULL;
+    }
 
-    b = MapUserPhysicalPages(info->transferVa, 1, NULL);
+    // Zero the page content, not the PFN structure
+    vm->platform->zeroPage(pfn2frameNumber(vm, page), info);
 
     return page;
 }
 
-BOOL pageFaultHandler(PVOID arbitrary_va, threadInfo* info) {
+//
+// Hard faults in a range advised as sequential queue the pages after them
+// to be read in before anyone asks.  The caller holds the PTE lock.
+//
+static VOID readAhead(addressSpace* space, pte* x) {
+    ULONG64 index = x - space->ptes;
+    vad* range = vadFind(space->vadRoot, index);
+
+    if (range == NULL || range->advice != VAD_ADVICE_SEQUENTIAL) {
+        return;
+    }
+
+    queuePrefetch(space, index + 1, min(index + 1 + READ_AHEAD_PAGES, range->endPage), STANDBY_PRIORITY_READ_AHEAD);
+}
+
+//
+// Read a page in with the PTE lock dropped, so other faults go on while it
+// is copied.  Meanwhile the PTE is in transition pointing at the frame,
+// which is READING and on no list : a fault on the same page waits for this
+// one, and a decommit or discard just takes the PTE away and leaves the
+// frame to be freed here.  A fiber hands the copy to the read task and lets
+// the thread run its other fibers until it is done.
+//
+// Called and returns with the PTE lock held.  Returns FALSE when the page
+// went away while it was read in, otherwise the slot is left in
+// page->diskIndex for the caller to free or keep.
+//
+static BOOL readInFlight(addressSpace* space, pte* x, pfn* page, threadInfo* info) {
+    vmInstance* vm = space->vm;
+    ULONG64 frameNumber = pfn2frameNumber(vm, page);
+    ULONG64 diskIndex = x->disk.diskIndex;
+    pte entry;
+
+    pfnSetPte(page, space, x);
+    page->diskIndex = diskIndex;
+    pageSetStatus(vm, page, READING);
+
+    entry.zero = 0;
+    entry.transition.transition = TRANSITION;
+    entry.transition.frameNumber = frameNumber;
+    *x = entry;
+    releaseLock(&vm->lockPTE, USER);
+
+    if (fiberRunning()) {
+        readParked(vm, diskIndex, frameNumber);
+    } else {
+        copyFromDisk(diskIndex, frameNumber, info);
+    }
+
+    acquireLockPTE(vm, NULL, USER);
+    ASSERT(page->status == READING);
+
+    if (x->valid.valid == INVALID && x->transition.transition == TRANSITION && x->transition.frameNumber == frameNumber) {
+        return TRUE;
+    }
+
+    freePage(vm, page);
+    return FALSE;
+}
+
+//
+// Read a page x shares with others in from its prototype's slot, which
+// stays with the prototype for the rest of them.  The prototype is the
+// one put in transition meanwhile, so faults on the others wait for this
+// one and the slot is freed only if they all let go of it.  Returns FALSE
+// when x no longer shares the page once it is in.
+//
+static BOOL readShared(addressSpace* space, pte* x, pfn* page, threadInfo* info) {
+    vmInstance* vm = space->vm;
+    ULONG64 protoIndex = x->shared.protoIndex;
+    pte* proto = sharedProto(vm, x);
+
+    if (readInFlight(vm->protoSpace, proto, page, info) == FALSE) {
+        return FALSE;
+    }
+    proto->zero = 0;
+    proto->disk.diskIndex = page->diskIndex;
+
+    if (x->valid.valid == VALID || x->shared.shared == 0 || x->shared.protoIndex != protoIndex) {
+        freePage(vm, page);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+//
+// Someone else is reading the page in - let them finish rather than read
+// it twice.  Drops the PTE lock.
+//
+static VOID waitForRead(vmInstance* vm) {
+    releaseLock(&vm->lockPTE, USER);
+    if (fiberRunning()) {
+        fiberYield();
+    } else {
+        Sleep(0);
+    }
+}
+
+static VOID recordPhase(threadInfo* info, ULONG phase, ULONG64 from, ULONG64 to) {
+    histogramRecord(&info->latency->phases[phase], to - from);
+}
+
+static VOID recordFault(threadInfo* info, ULONG kind, ULONG64 start) {
+    histogramRecord(&info->latency->kinds[kind], latencyNow() - start);
+}
+
+BOOL pageFaultHandler(addressSpace* space, PVOID arbitrary_va, threadInfo* info) {
     //
     // Connect the virtual address now - if that succeeds then
     // we'll be able to access it from now on.
@@ -80,46 +226,403 @@ BOOL pageFaultHandler(PVOID arbitrary_va, threadInfo* info) {
     // IT NEEDS TO BE REPLACED WITH A TRUE MEMORY MANAGEMENT
     // STATE MACHINE !
     //
-    acquireLockPTE(NULL, USER);
-    pte* x = va2pte(arbitrary_va);
+    vmInstance* vm = space->vm;
+    ULONG kind;
+
+    TRACE_BEGIN("fault");
+
+    ULONG64 start = latencyNow();
+    acquireLockPTE(vm, NULL, USER);
+    ULONG64 locked = latencyNow();
+    recordPhase(info, PHASE_LOCK_WAIT, start, locked);
+
+    pte* x = va2pte(space, arbitrary_va);
     if (x->valid.valid == VALID) {
-        releaseLock(&lockPTE, USER);
+        releaseLock(&vm->lockPTE, USER);
+        recordFault(info, FAULT_VALID, start);
+        TRACE_END("fault", "kind", FAULT_VALID);
         return SUCCESS;
     }
-    pfn* page;
+    //
+    // Only a zeroed PTE can belong to a range that was never committed -
+    // decommitting always leaves the PTEs zeroed.
+    //
+    if (x->zero == 0) {
+        vad* range = vadFind(space->vadRoot, x - space->ptes);
+        if (range == NULL || range->state != VAD_COMMITTED) {
+            releaseLock(&vm->lockPTE, USER);
+            TRACE_END("fault", "accessViolation", 1);
+            return ACCESS_VIOLATION;
+        }
+    }
+    //
+    // A page shared with a snapshot is copied below, unless nobody else
+    // shares it any more and it can simply be taken back
+    //
+    boolean shared = x->valid.valid == INVALID && x->shared.shared;
+    if (shared && sharedReading(vm, x)) {
+        waitForRead(vm);
+        TRACE_END("fault", "reading", 1);
+        return REDO;
+    }
+    if (shared && sharedTakeBack(space, x)) {
+        shared = FALSE;
+        statsAdd(&vm->stats, STAT_SHARED_FAULTS, 1);
+    }
+    pfn* page = NULL;
+    ULONG64 framed;
     boolean rescue = x->transition.transition == TRANSITION;
     if (rescue) {
-        page = frameNumber2pfn(x->transition.frameNumber);
+        page = frameNumber2pfn(vm, x->transition.frameNumber);
         // Add NULL check here
         ASSERT(page);
+        if (page->status == READING) {
+            waitForRead(vm);
+            TRACE_END("fault", "reading", 1);
+            return REDO;
+        }
+        TRACE_INSTANT("rescue", "frame", x->transition.frameNumber);
         if (page->status == STANDBY) {
-            ASSERT(isFull[page->diskIndex]);
-            isFull[page->diskIndex] = FALSE;
+            statsAdd(&vm->stats, STAT_STANDBY_RESCUES, 1);
+            InterlockedIncrement64(&vm->standbyRescued[page->priority]);
+            // Pages discarded through VM_ADVISE_FREE never got a pagefile slot
+            if (page->diskIndex != 0) {
+                freeDiskSlot(vm, page->diskIndex);
+            }
+        } else {
+            statsAdd(&vm->stats, STAT_MODIFIED_RESCUES, 1);
+        }
+        // A page the writer has claimed is on no list - it drops its copy
+        // when it finds the bit gone
+        if (page->writing) {
+            page->writing = 0;
+        } else {
+            CRITICAL_SECTION* lockList = page->status == STANDBY ? &vm->lockStandbyList : &vm->lockModifiedList;
+
+            acquireLock(lockList, USER);
+            linkRemovePFN(vm, page);
+            releaseLock(lockList, USER);
+        }
+        // Repurposing hands out frames from any node, so a rescue is as
+        // likely as any fault to land on a remote one
+        statsAdd(&vm->stats, page->node == info->node ? STAT_LOCAL_FAULTS : STAT_REMOTE_FAULTS, 1);
+
+        kind = FAULT_RESCUE;
+        framed = latencyNow();
+        recordPhase(info, PHASE_FRAME, locked, framed);
+    } else if (x->zero == 0 && largeFault(space, x, info)) {
+        // The region lost a PTE while the large frame was zeroed
+        if (x->valid.valid == INVALID) {
+            releaseLock(&vm->lockPTE, USER);
+            TRACE_END("fault", "cancelled", 1);
+            return REDO;
         }
-        linkRemovePFN(page);
+        statsAdd(&vm->stats, STAT_DEMAND_ZERO_FAULTS, 1);
+        statsAdd(&vm->stats, frameNumber2pfn(vm, x->valid.frameNumber)->node == info->node ? STAT_LOCAL_FAULTS : STAT_REMOTE_FAULTS, 1);
+        kind = FAULT_DEMAND_ZERO;
+        framed = latencyNow();
+        recordPhase(info, PHASE_CONTENTS, locked, framed);
     } else {
         // Now we know the pte is in zero or disk format (can't be active b/c it won't be faulted on)
         // Either way, we need a free page
-        acquireLock(&lockFreeList, USER);
-        page = linkRemoveHead(&headFreeList);
-        releaseLock(&lockFreeList, USER);
+        acquireLock(&vm->lockFreeList, USER);
+        page = freeListRemove(vm, info->node);
+        releaseLock(&vm->lockFreeList, USER);
         if (page == NULL){
             page = standbyFree(info);
             if (page == NULL) {
-                releaseLock(&lockPTE, USER);
-                SetEvent(eventStartTrim);
-                WaitForSingleObject(eventRedoFault, INFINITE);
+                releaseLock(&vm->lockPTE, USER);
+                TRACE_INSTANT("signalTrim", NULL, 0);
+                TRACE_BEGIN("waitForPages");
+                vm->platform->waitForPages(vm);
+                TRACE_END("waitForPages", NULL, 0);
+                statsAdd(&vm->stats, STAT_STARVED_FAULTS, 1);
+                recordFault(info, FAULT_STARVED, start);
+                TRACE_END("fault", "kind", FAULT_STARVED);
                 return REDO;
             }
         }
 
-        if (x->disk.disk == DISK) {
-            readFromDisk(x->disk.diskIndex, pfn2frameNumber(page), info);
+        ULONG64 acquired = latencyNow();
+        recordPhase(info, PHASE_FRAME, locked, acquired);
+
+        //
+        // A zeroed PTE is in disk format too, slot 0 is what marks it as
+        // demand zero.  A shared PTE is neither, but its prototype is.
+        //
+        if (shared && sharedOnDisk(vm, x)) {
+            if (readShared(space, x, page, info) == FALSE) {
+                releaseLock(&vm->lockPTE, USER);
+                TRACE_END("fault", "cancelled", 1);
+                return REDO;
+            }
+            sharedCopied(vm, x);
+            statsAdd(&vm->stats, STAT_SHARED_FAULTS, 1);
+            statsAdd(&vm->stats, STAT_HARD_FAULTS, 1);
+            kind = FAULT_HARD;
+        } else if (shared) {
+            kind = sharedCopy(space, x, page, info);
+            statsAdd(&vm->stats, STAT_SHARED_FAULTS, 1);
+        } else if (x->disk.diskIndex != 0) {
+            readAhead(space, x);
+            if (readInFlight(space, x, page, info) == FALSE) {
+                releaseLock(&vm->lockPTE, USER);
+                TRACE_END("fault", "cancelled", 1);
+                return REDO;
+            }
+            freeDiskSlot(vm, page->diskIndex);
+            statsAdd(&vm->stats, STAT_HARD_FAULTS, 1);
+            kind = FAULT_HARD;
         } else {
-            zeroAPage(pfn2frameNumber(page), info);
+            vm->platform->zeroPage(pfn2frameNumber(vm, page), info);
+            statsAdd(&vm->stats, STAT_DEMAND_ZERO_FAULTS, 1);
+            kind = FAULT_DEMAND_ZERO;
         }
+
+        statsAdd(&vm->stats, page->node == info->node ? STAT_LOCAL_FAULTS : STAT_REMOTE_FAULTS, 1);
+        framed = latencyNow();
+        recordPhase(info, PHASE_CONTENTS, acquired, framed);
+    }
+    // A large fault has mapped the whole region already
+    if (page != NULL) {
+        activatePage(space, page, x);
+    }
+    recordPhase(info, PHASE_MAP, framed, latencyNow());
+    releaseLock(&vm->lockPTE, USER);
+    recordFault(info, kind, start);
+    TRACE_END("fault", "kind", kind);
+
+    // PTEs are unique across the spaces, so their addresses name the pages
+    mrcReference(&vm->mrc, (ULONG_PTR) x / sizeof(pte));
+
+    //
+    // The fault rate drives how much of the pool this space gets to keep,
+    // and going over its maximum gets the trimmer after it right away.
+    //
+    InterlockedIncrement64(&space->faults);
+    if ((ULONG64) space->activeCount > space->wsMaximum) {
+        taskSignal(&vm->sched, &vm->taskTrim);
     }
-    activatePage(page, x);
-    releaseLock(&lockPTE, USER);
     return SUCCESS;
-}
\ No newline at end of file
+}
+
+VOID freePage(vmInstance* vm, pfn* page) {
+    pfnSetPte(page, NULL, NULL);
+    page->diskIndex = 0;
+    pageSetStatus(vm, page, FREE);
+
+    acquireLock(&vm->lockFreeList, USER);
+    freeListAdd(vm, page);
+    releaseLock(&vm->lockFreeList, USER);
+}
+
+#define DECOMMIT_BATCH_SIZE         64
+
+//
+// Throw away everything behind the PTEs in [startPage, endPage) right away -
+// frames go straight back to the free list and pagefile slots are released,
+// there is no point in trimming or writing out pages nobody can reach again.
+//
+// The caller holds the PTE lock.
+//
+VOID decommitPtes(addressSpace* space, ULONG64 startPage, ULONG64 endPage) {
+    vmInstance* vm = space->vm;
+    PVOID batch[DECOMMIT_BATCH_SIZE];
+    pfn* pages[DECOMMIT_BATCH_SIZE];
+    ULONG64 count = 0;
+
+    for (ULONG64 index = startPage; index < endPage; index++) {
+        pte* x = space->ptes + index;
+
+        if (x->valid.valid == VALID && x->large.large && index % LARGE_PAGE_PAGES == 0 && index + LARGE_PAGE_PAGES <= endPage) {
+            largeRelease(space, x);
+            index += LARGE_PAGE_PAGES - 1;
+        } else if (x->valid.valid == VALID) {
+            if (x->large.large) {
+                largeDemote(space, x);
+            }
+            pages[count] = frameNumber2pfn(vm, x->valid.frameNumber);
+            batch[count] = pte2va(space, x);
+            count++;
+        } else if (x->transition.transition == TRANSITION) {
+            pfn* page = frameNumber2pfn(vm, x->transition.frameNumber);
+
+            if (page->status == READING) {
+                // The fault reading it in frees the frame once it finds the PTE
+                // gone.  A large frame being zeroed or copied into has no slot.
+                if (page->diskIndex != 0) {
+                    freeDiskSlot(vm, page->diskIndex);
+                }
+                page->diskIndex = 0;
+            } else {
+                if (page->status == STANDBY) {
+                    acquireLock(&vm->lockStandbyList, USER);
+                    linkRemovePFN(vm, page);
+                    releaseLock(&vm->lockStandbyList, USER);
+                    if (page->diskIndex != 0) {
+                        freeDiskSlot(vm, page->diskIndex);
+                    }
+                } else if (page->writing) {
+                    page->writing = 0;
+                } else {
+                    ASSERT(page->status == MODIFIED);
+                    acquireLock(&vm->lockModifiedList, USER);
+                    linkRemovePFN(vm, page);
+                    releaseLock(&vm->lockModifiedList, USER);
+                }
+                freePage(vm, page);
+            }
+        } else if (x->shared.shared) {
+            sharedRelease(vm, x);
+        } else if (x->disk.diskIndex != 0) {
+            freeDiskSlot(vm, x->disk.diskIndex);
+        }
+
+        x->zero = 0;
+
+        // Unmap active pages a batch at a time with a single call
+        if (count == DECOMMIT_BATCH_SIZE || (count != 0 && index + 1 == endPage)) {
+            BOOL b = vm->platform->mapScatter(vm, batch, count, NULL);
+            ASSERT(b);
+
+            for (ULONG64 j = 0; j < count; j++) {
+                InterlockedDecrement64(&space->activeCount);
+                largeResident(space, pfnPte(vm, pages[j]), -1);
+                freePage(vm, pages[j]);
+            }
+            count = 0;
+        }
+    }
+}
+
+//
+// Read a page that is out on the pagefile into a free frame and park it on
+// standby, so the fault that eventually comes for it is a cheap rescue.  The
+// pagefile copy stays valid until then.  Returns FALSE when there are no
+// free frames - prefetching never steals from standby.
+//
+// The caller holds the PTE lock.
+//
+BOOL prefetchPage(threadInfo* info, addressSpace* space, pte* x, ULONG priority) {
+    vmInstance* vm = info->vm;
+    pte entry;
+
+    // Already resident (or demand zero or shared) - nothing to read
+    if (x->valid.valid == VALID || x->transition.transition == TRANSITION || x->disk.diskIndex == 0 || x->shared.shared) {
+        return TRUE;
+    }
+
+    acquireLock(&vm->lockFreeList, USER);
+    pfn* page = freeListRemove(vm, info->node);
+    releaseLock(&vm->lockFreeList, USER);
+    if (page == NULL) {
+        return FALSE;
+    }
+
+    ULONG64 frameNumber = pfn2frameNumber(vm, page);
+    copyFromDisk(x->disk.diskIndex, frameNumber, info);
+
+    pfnSetPte(page, space, x);
+    page->diskIndex = x->disk.diskIndex;
+
+    entry.zero = 0;
+    entry.transition.transition = TRANSITION;
+    entry.transition.frameNumber = frameNumber;
+    *x = entry;
+
+    acquireLock(&vm->lockStandbyList, USER);
+    standbyAdd(vm, page, priority);
+    releaseLock(&vm->lockStandbyList, USER);
+
+    return TRUE;
+}
+
+//
+// VM_ADVISE_FREE - unmap the pages and make them clean standby pages with no
+// pagefile copy.  Touching one again rescues it with its contents intact,
+// but once its frame is repurposed the PTE falls back to demand zero.  Pages
+// waiting on the modified list skip the writer entirely, and all of them go
+// to the lowest standby priority in use so they are repurposed first.
+//
+// The caller holds the PTE lock.
+//
+VOID discardPtes(addressSpace* space, ULONG64 startPage, ULONG64 endPage) {
+    vmInstance* vm = space->vm;
+    PVOID batch[DECOMMIT_BATCH_SIZE];
+    pfn* pages[DECOMMIT_BATCH_SIZE];
+    ULONG64 count = 0;
+
+    for (ULONG64 index = startPage; index < endPage; index++) {
+        pte* x = space->ptes + index;
+
+        if (x->valid.valid == VALID) {
+            if (x->large.large) {
+                largeDemote(space, x);
+            }
+            pages[count] = frameNumber2pfn(vm, x->valid.frameNumber);
+            batch[count] = pte2va(space, x);
+            count++;
+        } else if (x->transition.transition == TRANSITION) {
+            pfn* page = frameNumber2pfn(vm, x->transition.frameNumber);
+
+            //
+            // Still being read in - it goes straight to demand zero, and the
+            // fault reading it frees the frame once it finds the PTE gone
+            //
+            if (page->status == READING) {
+                if (page->diskIndex != 0) {
+                    freeDiskSlot(vm, page->diskIndex);
+                }
+                page->diskIndex = 0;
+                x->zero = 0;
+            } else {
+                if (page->writing) {
+                    page->writing = 0;
+                } else if (page->status == MODIFIED) {
+                    acquireLock(&vm->lockModifiedList, USER);
+                    linkRemovePFN(vm, page);
+                    releaseLock(&vm->lockModifiedList, USER);
+                } else {
+                    acquireLock(&vm->lockStandbyList, USER);
+                    linkRemovePFN(vm, page);
+                    releaseLock(&vm->lockStandbyList, USER);
+                    if (page->diskIndex != 0) {
+                        freeDiskSlot(vm, page->diskIndex);
+                    }
+                }
+                page->diskIndex = 0;
+
+                acquireLock(&vm->lockStandbyList, USER);
+                standbyAdd(vm, page, STANDBY_PRIORITY_DISCARDED);
+                releaseLock(&vm->lockStandbyList, USER);
+            }
+        } else if (x->shared.shared) {
+            // Others keep the page, this one just goes back to demand zero
+            sharedRelease(vm, x);
+            x->zero = 0;
+        } else if (x->disk.diskIndex != 0) {
+            freeDiskSlot(vm, x->disk.diskIndex);
+            x->zero = 0;
+        }
+
+        if (count == DECOMMIT_BATCH_SIZE || (count != 0 && index + 1 == endPage)) {
+            BOOL b = vm->platform->mapScatter(vm, batch, count, NULL);
+            ASSERT(b);
+
+            acquireLock(&vm->lockStandbyList, USER);
+            for (ULONG64 j = 0; j < count; j++) {
+                pte* discarded = pfnPte(vm, pages[j]);
+
+                discarded->transition.invalid = INVALID;
+                discarded->transition.transition = TRANSITION;
+                InterlockedDecrement64(&space->activeCount);
+                largeResident(space, discarded, -1);
+
+                pages[j]->diskIndex = 0;
+                standbyAdd(vm, pages[j], STANDBY_PRIORITY_DISCARDED);
+            }
+            releaseLock(&vm->lockStandbyList, USER);
+            count = 0;
+        }
+    }
+}
@@ -12,13 +12,20 @@
 //
 // Function declarations
 //
-pte* va2pte(PVOID va);
-PVOID pte2va(pte* pte);
-pfn* frameNumber2pfn(ULONG64 frameNumber);
-ULONG64 pfn2frameNumber(pfn* p);
+pte* va2pte(addressSpace* space, PVOID va);
+PVOID pte2va(addressSpace* space, pte* pte);
+pfn* frameNumber2pfn(vmInstance* vm, ULONG64 frameNumber);
+ULONG64 pfn2frameNumber(vmInstance* vm, pfn* p);
+pte* pfnPte(vmInstance* vm, pfn* page);
+VOID pfnSetPte(pfn* page, addressSpace* space, pte* x);
 
-void activatePage(pfn* page, pte* new);
+void activatePage(addressSpace* space, pfn* page, pte* new);
+pfn* standbyRepurpose(vmInstance* vm, ULONG node);
 pfn* standbyFree(threadInfo* info);
-BOOL pageFaultHandler(PVOID arbitrary_va, threadInfo* info);
+BOOL pageFaultHandler(addressSpace* space, PVOID arbitrary_va, threadInfo* info);
+VOID freePage(vmInstance* vm, pfn* page);
+VOID decommitPtes(addressSpace* space, ULONG64 startPage, ULONG64 endPage);
+VOID discardPtes(addressSpace* space, ULONG64 startPage, ULONG64 endPage);
+BOOL prefetchPage(threadInfo* info, addressSpace* space, pte* x, ULONG priority);
 
-#endif // PT_H
\ No newline at end of file
+#endif // PT_H
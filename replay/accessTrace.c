@@ -0,0 +1,377 @@
+//
+// accessTrace.c
+// Recording and replaying the accesses of the user threads
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include "../latency/latency.h"
+#include "../util/util.h"
+#include "accessTrace.h"
+
+#define COPY_CHUNK                  (64 * 1024)
+
+static ULONG encode(PUCHAR out, ULONG64 value) {
+    ULONG length = 0;
+
+    while (value >= 0x80) {
+        out[length++] = (UCHAR) (value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (UCHAR) value;
+    return length;
+}
+
+//
+// Fails on a varint running into limit or past 64 bits, which only a
+// corrupt trace has
+//
+static BOOL decode(PUCHAR* in, PUCHAR limit, ULONG64* value) {
+    ULONG shift = 0;
+    PUCHAR p = *in;
+
+    *value = 0;
+    do {
+        if (p == limit || shift >= 64) {
+            return FALSE;
+        }
+        *value |= (ULONG64) (*p & 0x7F) << shift;
+        shift += 7;
+    } while (*p++ & 0x80);
+
+    *in = p;
+    return TRUE;
+}
+
+accessRecording* accessRecordOpen(const char* path, ULONG threads, ULONG spaces, ULONG64 virtualAddressSize) {
+    LARGE_INTEGER frequency;
+    accessRecording* recording = calloc(1, sizeof(accessRecording));
+
+    if (recording == NULL || strlen(path) + 16 > MAX_PATH) {
+        free(recording);
+        return NULL;
+    }
+
+    recording->threads = calloc(threads, sizeof(accessRecorder));
+    if (recording->threads == NULL) {
+        free(recording);
+        return NULL;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+
+    strcpy(recording->path, path);
+    recording->header.magic = ACCESS_TRACE_MAGIC;
+    recording->header.version = ACCESS_TRACE_VERSION;
+    recording->header.threads = threads;
+    recording->header.spaces = spaces;
+    recording->header.virtualAddressSize = virtualAddressSize;
+    recording->header.frequency = frequency.QuadPart;
+
+    return recording;
+}
+
+accessRecorder* accessRecordThread(accessRecording* recording, ULONG index, ULONG space) {
+    accessRecorder* recorder = &recording->threads[index];
+
+    sprintf(recorder->spillPath, "%s.%u", recording->path, index);
+    recorder->spill = fopen(recorder->spillPath, "w+b");
+    if (recorder->spill == NULL) {
+        printf ("accessRecordThread : could not create %s\n", recorder->spillPath);
+        return NULL;
+    }
+    recorder->space = space;
+    return recorder;
+}
+
+VOID accessRecord(accessRecorder* recorder, ULONG64 offset, BOOL write) {
+    UCHAR record[ACCESS_RECORD_MAX_BYTES];
+    ULONG64 now = latencyNow();
+    LONG64 delta = (LONG64) (offset - recorder->lastOffset) / (LONG64) sizeof(ULONG_PTR);
+    ULONG64 zigzag = ((ULONG64) delta << 1) ^ (ULONG64) (delta >> 63);
+
+    ASSERT(offset % sizeof(ULONG_PTR) == 0);
+
+    if (recorder->records == 0) {
+        recorder->lastTicks = now;
+    }
+
+    ULONG length = encode(record, (zigzag << 1) | (write != FALSE));
+    length += encode(record + length, now - recorder->lastTicks);
+    fwrite(record, 1, length, recorder->spill);
+
+    recorder->lastOffset = offset;
+    recorder->lastTicks = now;
+    recorder->bytes += length;
+    recorder->records++;
+}
+
+//
+// Write the header and stream table and append every thread's spill file.
+// Call it once the recording threads are done.
+//
+BOOL accessRecordClose(accessRecording* recording) {
+    ULONG threads = recording->header.threads;
+    accessTraceStream* streams = calloc(threads, sizeof(accessTraceStream));
+    PUCHAR chunk = malloc(COPY_CHUNK);
+    BOOL ok = streams != NULL && chunk != NULL;
+    FILE* out = NULL;
+
+    if (ok) {
+        out = fopen(recording->path, "wb");
+        ok = out != NULL;
+    }
+
+    if (ok) {
+        ULONG64 offset = sizeof(accessTraceHeader) + threads * sizeof(accessTraceStream);
+
+        for (ULONG t = 0; t < threads; t++) {
+            streams[t].space = recording->threads[t].space;
+            streams[t].offset = offset;
+            streams[t].bytes = recording->threads[t].bytes;
+            streams[t].records = recording->threads[t].records;
+            offset += streams[t].bytes;
+        }
+
+        fwrite(&recording->header, sizeof(accessTraceHeader), 1, out);
+        fwrite(streams, sizeof(accessTraceStream), threads, out);
+    }
+
+    for (ULONG t = 0; t < threads; t++) {
+        accessRecorder* recorder = &recording->threads[t];
+
+        if (recorder->spill == NULL) {
+            continue;
+        }
+
+        if (ok) {
+            size_t length;
+
+            rewind(recorder->spill);
+            while ((length = fread(chunk, 1, COPY_CHUNK, recorder->spill)) != 0) {
+                fwrite(chunk, 1, length, out);
+            }
+        }
+        fclose(recorder->spill);
+        remove(recorder->spillPath);
+    }
+
+    if (out != NULL && fclose(out) != 0) {
+        ok = FALSE;
+    }
+    if (ok == FALSE) {
+        printf ("accessRecordClose : could not write %s\n", recording->path);
+    }
+
+    free(chunk);
+    free(streams);
+    free(recording->threads);
+    free(recording);
+    return ok;
+}
+
+BOOL accessTraceReadHeader(const char* path, accessTraceHeader* header) {
+    FILE* in = fopen(path, "rb");
+
+    if (in == NULL) {
+        return FALSE;
+    }
+
+    BOOL ok = fread(header, sizeof(accessTraceHeader), 1, in) == 1 &&
+              header->magic == ACCESS_TRACE_MAGIC &&
+              header->version == ACCESS_TRACE_VERSION &&
+              header->threads != 0 && header->spaces != 0;
+
+    fclose(in);
+    return ok;
+}
+
+accessReplay* accessReplayOpen(const char* path) {
+    accessReplay* replay = calloc(1, sizeof(accessReplay));
+    accessTraceStream* streams = NULL;
+    LARGE_INTEGER size;
+    LARGE_INTEGER frequency;
+    SYSTEM_INFO system;
+    FILE* in;
+
+    if (replay == NULL) {
+        return NULL;
+    }
+
+    //
+    // The header and stream table are small, read them the ordinary way
+    //
+
+    in = fopen(path, "rb");
+    if (in == NULL || fread(&replay->header, sizeof(accessTraceHeader), 1, in) != 1 ||
+        replay->header.magic != ACCESS_TRACE_MAGIC || replay->header.version != ACCESS_TRACE_VERSION ||
+        replay->header.threads == 0 || replay->header.spaces == 0 || replay->header.virtualAddressSize == 0) {
+        printf ("accessReplayOpen : %s is not an access trace\n", path);
+        goto fail;
+    }
+
+    streams = calloc(replay->header.threads, sizeof(accessTraceStream));
+    replay->threads = calloc(replay->header.threads, sizeof(accessReader));
+    if (streams == NULL || replay->threads == NULL ||
+        fread(streams, sizeof(accessTraceStream), replay->header.threads, in) != replay->header.threads) {
+        printf ("accessReplayOpen : %s is truncated\n", path);
+        goto fail;
+    }
+    fclose(in);
+    in = NULL;
+
+    replay->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (replay->file == INVALID_HANDLE_VALUE || GetFileSizeEx(replay->file, &size) == FALSE) {
+        printf ("accessReplayOpen : could not open %s, error %#x\n", path, GetLastError ());
+        goto fail;
+    }
+    replay->fileSize = size.QuadPart;
+
+    replay->section = CreateFileMapping(replay->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (replay->section == NULL) {
+        printf ("accessReplayOpen : could not map %s, error %#x\n", path, GetLastError ());
+        goto fail;
+    }
+
+    GetSystemInfo(&system);
+    replay->granularity = system.dwAllocationGranularity;
+
+    QueryPerformanceFrequency(&frequency);
+    replay->tickScale = (double) frequency.QuadPart / replay->header.frequency;
+
+    for (ULONG t = 0; t < replay->header.threads; t++) {
+        accessReader* reader = &replay->threads[t];
+
+        if (streams[t].offset + streams[t].bytes > replay->fileSize) {
+            printf ("accessReplayOpen : stream %u runs past the end of %s\n", t, path);
+            goto fail;
+        }
+        if (streams[t].space >= replay->header.spaces) {
+            printf ("accessReplayOpen : stream %u of %s is on space %u of %u\n", t, path, streams[t].space, replay->header.spaces);
+            goto fail;
+        }
+
+        reader->replay = replay;
+        reader->space = streams[t].space;
+        reader->position = streams[t].offset;
+        reader->end = streams[t].offset + streams[t].bytes;
+    }
+
+    free(streams);
+    return replay;
+
+fail:
+    if (in != NULL) {
+        fclose(in);
+    }
+    free(streams);
+    accessReplayClose(replay);
+    return NULL;
+}
+
+accessReader* accessReplayThread(accessReplay* replay, ULONG index) {
+    return &replay->threads[index];
+}
+
+//
+// Make sure the next whole record is mapped, moving the window up to it
+// when it isn't
+//
+static BOOL slideWindow(accessReader* reader) {
+    accessReplay* replay = reader->replay;
+
+    if (reader->view != NULL &&
+        (reader->position + ACCESS_RECORD_MAX_BYTES <= reader->viewEnd || reader->viewEnd >= reader->end)) {
+        return TRUE;
+    }
+
+    if (reader->view != NULL) {
+        UnmapViewOfFile(reader->view);
+    }
+
+    reader->viewStart = reader->position - reader->position % replay->granularity;
+    reader->viewEnd = min(reader->viewStart + ACCESS_REPLAY_WINDOW, replay->fileSize);
+    reader->view = MapViewOfFile(replay->section,
+                                 FILE_MAP_READ,
+                                 (DWORD) (reader->viewStart >> 32),
+                                 (DWORD) reader->viewStart,
+                                 reader->viewEnd - reader->viewStart);
+    return reader->view != NULL;
+}
+
+//
+// The next access of this thread, and how many of this machine's
+// performance counter ticks after the previous one it was made.  Returns
+// FALSE at the end of the stream, or at a record that does not decode to
+// an offset within the space, which marks the reader corrupt.
+//
+BOOL accessReplayNext(accessReader* reader, ULONG64* offset, BOOL* write, ULONG64* delay) {
+    accessReplay* replay = reader->replay;
+    ULONG64 first;
+    ULONG64 ticks;
+
+    if (reader->corrupt || reader->position >= reader->end || slideWindow(reader) == FALSE) {
+        return FALSE;
+    }
+
+    PUCHAR p = reader->view + (reader->position - reader->viewStart);
+    PUCHAR limit = reader->view + (min(reader->end, reader->viewEnd) - reader->viewStart);
+    if (decode(&p, limit, &first) == FALSE || decode(&p, limit, &ticks) == FALSE) {
+        printf ("accessReplayNext : truncated record at %llu in the trace\n", reader->position);
+        reader->corrupt = TRUE;
+        return FALSE;
+    }
+
+    ULONG64 zigzag = first >> 1;
+    LONG64 delta = (LONG64) (zigzag >> 1) ^ -(LONG64) (zigzag & 1);
+    ULONG64 next = reader->lastOffset + delta * sizeof(ULONG_PTR);
+
+    // Going below zero wraps around, past the end just as well
+    if (next >= replay->header.virtualAddressSize) {
+        printf ("accessReplayNext : record at %llu in the trace goes outside the space\n", reader->position);
+        reader->corrupt = TRUE;
+        return FALSE;
+    }
+
+    reader->position = reader->viewStart + (p - reader->view);
+    reader->lastOffset = next;
+    reader->issued++;
+    reader->writes += first & 1;
+
+    *offset = next;
+    *write = (BOOL) (first & 1);
+    *delay = (ULONG64) (ticks * replay->tickScale);
+    return TRUE;
+}
+
+//
+// Whether any thread stopped short at a record it could not replay
+//
+BOOL accessReplayCorrupt(accessReplay* replay) {
+    for (ULONG t = 0; t < replay->header.threads; t++) {
+        if (replay->threads[t].corrupt) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+VOID accessReplayClose(accessReplay* replay) {
+    if (replay->threads != NULL) {
+        for (ULONG t = 0; t < replay->header.threads; t++) {
+            if (replay->threads[t].view != NULL) {
+                UnmapViewOfFile(replay->threads[t].view);
+            }
+        }
+    }
+    if (replay->section != NULL) {
+        CloseHandle(replay->section);
+    }
+    if (replay->file != NULL && replay->file != INVALID_HANDLE_VALUE) {
+        CloseHandle(replay->file);
+    }
+    free(replay->threads);
+    free(replay);
+}
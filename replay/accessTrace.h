@@ -0,0 +1,117 @@
+//
+// accessTrace.h
+// Recording and replaying the accesses of the user threads
+//
+
+#ifndef ACCESS_TRACE_H
+#define ACCESS_TRACE_H
+
+#include <stdio.h>
+#include <windows.h>
+
+//
+// File layout - a header, one accessTraceStream per thread, then each
+// thread's records back to back.  A record is two LEB128 varints:
+//
+//     zigzag(offset - previous offset) / sizeof(ULONG_PTR), shifted left
+//     once with the write bit below it
+//
+//     performance counter ticks since the thread's previous access
+//
+// Offsets are ULONG_PTR aligned within the thread's address space, and both
+// deltas start from zero.  Sequential and clustered accesses mostly take a
+// byte or two each.
+//
+#define ACCESS_TRACE_MAGIC          0x52414D56  // 'VMAR'
+#define ACCESS_TRACE_VERSION        1
+
+#define ACCESS_RECORD_MAX_BYTES     20
+
+// How much of a stream a reader keeps mapped at once
+#define ACCESS_REPLAY_WINDOW        (16 * 1024 * 1024)
+
+typedef struct {
+    ULONG magic;
+    ULONG version;
+    ULONG threads;
+    ULONG spaces;
+    ULONG64 virtualAddressSize;     // Of each space
+    ULONG64 frequency;              // Performance counter ticks per second of the recording
+} accessTraceHeader;
+
+typedef struct {
+    ULONG space;                    // Index of the address space the thread ran on
+    ULONG reserved;
+    ULONG64 offset;                 // From the start of the file
+    ULONG64 bytes;
+    ULONG64 records;
+} accessTraceStream;
+
+//
+// One thread's side of a recording, only touched by that thread.  Records
+// are spilled to a file of its own next to the trace and stitched together
+// when the recording is closed, so nothing is held in memory.
+//
+typedef struct {
+    FILE* spill;
+    char spillPath[MAX_PATH];
+    ULONG space;
+    ULONG64 lastOffset;
+    ULONG64 lastTicks;
+    ULONG64 bytes;
+    ULONG64 records;
+} accessRecorder;
+
+typedef struct {
+    char path[MAX_PATH];
+    accessTraceHeader header;
+    accessRecorder* threads;
+} accessRecording;
+
+typedef struct _accessReplay accessReplay;
+
+//
+// One thread's side of a replay, reading its stream through a window of
+// the file that slides along as it goes.  Traces can be far larger than
+// memory.
+//
+typedef struct {
+    accessReplay* replay;
+    ULONG space;
+    ULONG64 position;               // File offset of the next record
+    ULONG64 end;
+    PUCHAR view;
+    ULONG64 viewStart;              // File offsets the view covers
+    ULONG64 viewEnd;
+    ULONG64 lastOffset;
+    ULONG64 issued;
+    ULONG64 writes;
+    BOOL corrupt;                   // Stopped at a record it could not replay
+} accessReader;
+
+struct _accessReplay {
+    HANDLE file;
+    HANDLE section;
+    ULONG64 fileSize;
+    ULONG64 granularity;            // Views have to start on a multiple of this
+    double tickScale;               // Recorded ticks to ticks on this machine
+    accessTraceHeader header;
+    accessReader* threads;
+};
+
+//
+// Function declarations
+//
+accessRecording* accessRecordOpen(const char* path, ULONG threads, ULONG spaces, ULONG64 virtualAddressSize);
+accessRecorder* accessRecordThread(accessRecording* recording, ULONG index, ULONG space);
+VOID accessRecord(accessRecorder* recorder, ULONG64 offset, BOOL write);
+BOOL accessRecordClose(accessRecording* recording);
+
+BOOL accessTraceReadHeader(const char* path, accessTraceHeader* header);
+accessReplay* accessReplayOpen(const char* path);
+accessReader* accessReplayThread(accessReplay* replay, ULONG index);
+BOOL accessReplayNext(accessReader* reader, ULONG64* offset, BOOL* write, ULONG64* delay);
+BOOL accessReplayCorrupt(accessReplay* replay);
+VOID accessReplayClose(accessReplay* replay);
+
+#endif // ACCESS_TRACE_H
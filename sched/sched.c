@@ -0,0 +1,331 @@
+//
+// sched.c
+// Work-stealing scheduler for the background work
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+#include "../util/util.h"
+#include "../trace/trace.h"
+#include "../numa/numa.h"
+#include "sched.h"
+
+// The worker running on this thread, NULL on any other thread
+static __declspec(thread) worker* current;
+
+VOID taskInitialize(task* work, const char* name, taskRoutine run, PVOID context, ULONG priority, ULONG affinity) {
+    ASSERT(priority < TASK_PRIORITIES);
+
+    work->run = run;
+    work->context = context;
+    work->name = name;
+    work->priority = priority;
+    work->affinity = affinity;
+    work->state = TASK_IDLE;
+}
+
+//
+// A task with a worker of its own goes there.  Otherwise it stays on the
+// worker that signalled it - the stage before it left the batch in that
+// core's cache - or, signalled from outside, goes round the workers.
+//
+static worker* targetOf(scheduler* sched, task* work) {
+    if (work->affinity != TASK_ANY_WORKER) {
+        return &sched->workers[work->affinity % sched->count];
+    }
+    if (current != NULL && current->sched == sched) {
+        return current;
+    }
+    return &sched->workers[(ULONG) InterlockedIncrement(&sched->next) % sched->count];
+}
+
+//
+// Wake the worker a task was pushed to if it is parked, otherwise any
+// parked worker so it can steal the task while its owner is busy
+//
+static VOID unpark(scheduler* sched, worker* target) {
+    ULONG64 parked = (ULONG64) InterlockedOr64(&sched->parked, 0);
+    ULONG w = target->index;
+
+    if (parked == 0) {
+        return;
+    }
+    if ((parked & (1ULL << w)) == 0) {
+        for (w = 0; (parked & (1ULL << w)) == 0; w++) {
+        }
+    }
+    SetEvent(sched->workers[w].event);
+}
+
+static VOID push(scheduler* sched, task* work) {
+    worker* target = targetOf(sched, work);
+    taskDeque* deque = &target->deques[work->priority];
+
+    acquireLock(&target->lock, WORKER);
+    ASSERT(deque->bottom - deque->top < SCHED_DEQUE_SIZE);
+    deque->slots[deque->bottom % SCHED_DEQUE_SIZE] = work;
+    deque->bottom++;
+    releaseLock(&target->lock, WORKER);
+
+    unpark(sched, target);
+}
+
+VOID taskSignal(scheduler* sched, task* work) {
+    LONG state = work->state;
+    LONG seen;
+
+    while (state == TASK_IDLE || state == TASK_RUNNING) {
+        seen = InterlockedCompareExchange(&work->state, state == TASK_IDLE ? TASK_QUEUED : TASK_RERUN, state);
+        if (seen == state) {
+            break;
+        }
+        state = seen;
+    }
+
+    // Without workers it stays queued until someone takes the signal
+    if (state == TASK_IDLE && sched->count != 0 && sched->stopping == FALSE) {
+        push(sched, work);
+    }
+}
+
+//
+// Take back a signal that nobody is going to run - what an instance
+// without workers does instead
+//
+BOOL taskTakeSignal(task* work) {
+    return InterlockedCompareExchange(&work->state, TASK_IDLE, TASK_QUEUED) == TASK_QUEUED;
+}
+
+//
+// The owner takes the newest task, a thief the oldest.  Both peek first so
+// looking through empty deques takes no lock.
+//
+static task* popBottom(worker* owner, ULONG priority) {
+    taskDeque* deque = &owner->deques[priority];
+    task* work = NULL;
+
+    if (deque->bottom == deque->top) {
+        return NULL;
+    }
+
+    acquireLock(&owner->lock, WORKER);
+    if (deque->bottom != deque->top) {
+        deque->bottom--;
+        work = deque->slots[deque->bottom % SCHED_DEQUE_SIZE];
+    }
+    releaseLock(&owner->lock, WORKER);
+    return work;
+}
+
+static task* stealTop(worker* victim, ULONG priority) {
+    taskDeque* deque = &victim->deques[priority];
+    task* work = NULL;
+
+    if (deque->bottom == deque->top) {
+        return NULL;
+    }
+
+    acquireLock(&victim->lock, WORKER);
+    if (deque->bottom != deque->top) {
+        work = deque->slots[deque->top % SCHED_DEQUE_SIZE];
+        deque->top++;
+    }
+    releaseLock(&victim->lock, WORKER);
+    return work;
+}
+
+//
+// The most urgent task there is, down to priority lowest - a worker's own
+// first at each priority, then the others' starting with its neighbour.
+// self is NULL for a thread that is only helping out.
+//
+static task* findTask(scheduler* sched, worker* self, ULONG lowest, BOOL* stolen) {
+    ULONG start = self != NULL ? self->index + 1 : (ULONG) InterlockedIncrement(&sched->next);
+    task* work;
+
+    for (ULONG priority = 0; priority <= lowest; priority++) {
+        if (self != NULL && (work = popBottom(self, priority)) != NULL) {
+            *stolen = FALSE;
+            return work;
+        }
+
+        for (ULONG i = 0; i < sched->count; i++) {
+            worker* victim = &sched->workers[(start + i) % sched->count];
+
+            if (victim != self && (work = stealTop(victim, priority)) != NULL) {
+                *stolen = TRUE;
+                return work;
+            }
+        }
+    }
+    return NULL;
+}
+
+//
+// Only whoever took the task off a deque gets here, so it is not running
+// anywhere else.  Signalled again meanwhile, it goes back on a deque
+// rather than round again here, so anything more urgent gets in first.
+//
+static VOID runTask(scheduler* sched, task* work) {
+    InterlockedExchange(&work->state, TASK_RUNNING);
+
+    TRACE_BEGIN(work->name);
+    work->run(work);
+    TRACE_END(work->name, NULL, 0);
+
+    if (InterlockedCompareExchange(&work->state, TASK_IDLE, TASK_RUNNING) == TASK_RERUN) {
+        InterlockedExchange(&work->state, TASK_QUEUED);
+        push(sched, work);
+    }
+}
+
+static DWORD WINAPI threadWorker(LPVOID lpParameter) {
+    worker* self = (worker*) lpParameter;
+    scheduler* sched = self->sched;
+    LONG64 bit = 1LL << self->index;
+    BOOL stolen;
+    task* work;
+
+    current = self;
+    TRACE_THREAD_NAME("worker", self->index);
+
+    while (sched->stopping == FALSE) {
+        work = findTask(sched, self, TASK_PRIORITY_LOW, &stolen);
+
+        //
+        // Say it is parking before looking one last time, so a push either
+        // shows up in that look or sees the bit and wakes it
+        //
+        if (work == NULL) {
+            InterlockedOr64(&sched->parked, bit);
+            work = findTask(sched, self, TASK_PRIORITY_LOW, &stolen);
+            if (work == NULL && sched->stopping == FALSE) {
+                WaitForSingleObject(self->event, INFINITE);
+            }
+            InterlockedAnd64(&sched->parked, ~bit);
+
+            if (work == NULL) {
+                continue;
+            }
+        }
+
+        self->tasksRun++;
+        if (stolen) {
+            self->tasksStolen++;
+        }
+        runTask(sched, work);
+    }
+    return 0;
+}
+
+//
+// Start the workers, one per processor when workers is 0, spread across
+// nodes.  Tasks can be signalled from here on.
+//
+VOID schedulerStart(scheduler* sched, ULONG workers, ULONG nodes) {
+    if (workers == 0) {
+        SYSTEM_INFO system;
+
+        GetSystemInfo(&system);
+        workers = min((ULONG) system.dwNumberOfProcessors, MAX_WORKER_THREADS);
+    }
+    ASSERT(workers <= MAX_WORKER_THREADS);
+
+    sched->workers = initialize(workers * sizeof(worker));
+    sched->next = 0;
+    sched->parked = 0;
+    sched->stopping = FALSE;
+
+    for (ULONG w = 0; w < workers; w++) {
+        worker* self = &sched->workers[w];
+
+        self->sched = sched;
+        self->index = w;
+        self->event = CreateEvent(NULL, AUTO, FALSE, NULL);
+        InitializeCriticalSection(&self->lock);
+    }
+
+    // Only now can a signal pick a worker
+    sched->count = workers;
+
+    for (ULONG w = 0; w < workers; w++) {
+        sched->workers[w].thread = CreateThread(NULL, 0, threadWorker, &sched->workers[w], 0, NULL);
+        ASSERT(sched->workers[w].thread != NULL);
+        if (nodes > 1) {
+            numaPinThread(sched->workers[w].thread, w % nodes);
+        }
+    }
+}
+
+//
+// Wait for every worker to finish the task it is on.  Whatever is still
+// queued is dropped, and signals from now on only mark their tasks.
+//
+VOID schedulerStop(scheduler* sched) {
+    ULONG count = sched->count;
+
+    sched->stopping = TRUE;
+    for (ULONG w = 0; w < count; w++) {
+        SetEvent(sched->workers[w].event);
+    }
+
+    for (ULONG w = 0; w < count; w++) {
+        worker* self = &sched->workers[w];
+
+        WaitForSingleObject(self->thread, INFINITE);
+        CloseHandle(self->thread);
+    }
+
+    sched->count = 0;
+    for (ULONG w = 0; w < count; w++) {
+        worker* self = &sched->workers[w];
+
+        sched->tasksRun += self->tasksRun;
+        sched->tasksStolen += self->tasksStolen;
+        CloseHandle(self->event);
+        DeleteCriticalSection(&self->lock);
+    }
+
+    free(sched->workers);
+    sched->workers = NULL;
+}
+
+//
+// Run one queued task of at least the given priority on the calling
+// thread, which must hold no paging locks - for a thread that would
+// otherwise sit waiting on the background.  Returns FALSE when there was
+// none.
+//
+BOOL schedulerHelp(scheduler* sched, ULONG priority) {
+    BOOL stolen;
+    task* work;
+
+    if (sched->count == 0 || sched->stopping) {
+        return FALSE;
+    }
+
+    work = findTask(sched, NULL, priority, &stolen);
+    if (work == NULL) {
+        return FALSE;
+    }
+
+    InterlockedIncrement64(&sched->helped);
+    runTask(sched, work);
+    return TRUE;
+}
+
+//
+// Tasks run by the workers so far, how many of those they stole, and how
+// many were run by other threads helping out
+//
+VOID schedulerCounts(scheduler* sched, ULONG64* run, ULONG64* stolen, ULONG64* helped) {
+    *run = sched->tasksRun;
+    *stolen = sched->tasksStolen;
+    *helped = (ULONG64) sched->helped;
+
+    for (ULONG w = 0; w < sched->count; w++) {
+        *run += sched->workers[w].tasksRun;
+        *stolen += sched->workers[w].tasksStolen;
+    }
+}
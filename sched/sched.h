@@ -0,0 +1,108 @@
+//
+// sched.h
+// Work-stealing scheduler for the background work
+//
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <windows.h>
+
+//
+// Trimming, writing and prefetching are tasks run by a few worker threads
+// instead of threads of their own.  Each worker has a deque per priority :
+// it pushes and pops its own tasks at the bottom, so the next stage of a
+// batch runs on the core that has the batch in its cache, and a worker
+// with nothing left steals from the top of someone else's.  Workers with
+// nothing to run or steal park on their own event until a push wakes them.
+//
+#define TASK_PRIORITY_HIGH          0   // Faulting threads are waiting on it
+#define TASK_PRIORITY_NORMAL        1
+#define TASK_PRIORITY_LOW           2   // Advisory, nobody waits on it
+#define TASK_PRIORITIES             3
+
+//
+// A task is only ever in one deque once, so the deques never need to hold
+// more than every task there is
+//
+#define SCHED_DEQUE_SIZE            256
+
+//
+// Workers default to one per processor.  Park masks are 64 bit, so that
+// is as many as there can be.
+//
+#define DEFAULT_WORKER_THREADS      0
+#define MAX_WORKER_THREADS          64
+
+// Pushed to the worker that signals it, or spread round when nobody does
+#define TASK_ANY_WORKER             ((ULONG) -1)
+
+//
+// Signalling a task works like setting an auto-reset event : it runs once
+// however often it was signalled while queued, and once more if it was
+// signalled while running.  No task ever runs twice at the same time.
+//
+#define TASK_IDLE                   0
+#define TASK_QUEUED                 1
+#define TASK_RUNNING                2
+#define TASK_RERUN                  3   // Signalled while running
+
+typedef struct _task task;
+typedef struct _scheduler scheduler;
+
+typedef VOID (*taskRoutine)(task* work);
+
+struct _task {
+    taskRoutine run;
+    PVOID context;
+    const char* name;
+    ULONG priority;
+    ULONG affinity;                 // Worker it is pushed to, TASK_ANY_WORKER for none
+    volatile LONG state;
+};
+
+typedef struct {
+    task* slots[SCHED_DEQUE_SIZE];
+    ULONG64 top;                    // Next stolen
+    ULONG64 bottom;                 // Next pushed, the owner pops below it
+} taskDeque;
+
+typedef struct {
+    scheduler* sched;
+    ULONG index;
+    HANDLE thread;
+    HANDLE event;                   // Set to unpark it
+    CRITICAL_SECTION lock;          // Over its deques
+    taskDeque deques[TASK_PRIORITIES];
+    ULONG64 tasksRun;
+    ULONG64 tasksStolen;
+} worker;
+
+//
+// Everything here but the counters is fixed between schedulerStart and
+// schedulerStop.  An instance without workers - the simulator - only ever
+// marks its tasks queued and takes them back with taskTakeSignal.
+//
+struct _scheduler {
+    worker* workers;
+    ULONG count;
+    volatile LONG next;             // Spreads tasks no worker signalled
+    volatile LONG64 parked;         // A bit per parked worker
+    volatile LONG stopping;
+    volatile LONG64 helped;         // Tasks run by threads that are not workers
+    ULONG64 tasksRun;               // What stopped workers ran
+    ULONG64 tasksStolen;
+};
+
+//
+// Function declarations
+//
+VOID taskInitialize(task* work, const char* name, taskRoutine run, PVOID context, ULONG priority, ULONG affinity);
+VOID taskSignal(scheduler* sched, task* work);
+BOOL taskTakeSignal(task* work);
+VOID schedulerStart(scheduler* sched, ULONG workers, ULONG nodes);
+VOID schedulerStop(scheduler* sched);
+BOOL schedulerHelp(scheduler* sched, ULONG priority);
+VOID schedulerCounts(scheduler* sched, ULONG64* run, ULONG64* stolen, ULONG64* helped);
+
+#endif // SCHED_H
@@ -0,0 +1,544 @@
+//
+// sim.c
+// Discrete-event paging simulator
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+#include "../util/util.h"
+#include "../pt/pt.h"
+#include "../trim/trim.h"
+#include "../diskWrite/diskWrite.h"
+#include "../prefetch/prefetch.h"
+#include "../large/large.h"
+#include "../api/libvm.h"
+#include "../platform/platform.h"
+#include "sim.h"
+
+//
+// The simulator runs the real PTE/PFN state machines - pageFaultHandler,
+// the lists, the pagefile slots, trimBatch and writeBatch - on a platform
+// whose frames, VAs and pagefile are only bookkeeping.  Mapping and I/O
+// cost nothing but time on a simulated clock.
+//
+// Every user thread has its own clock and the one furthest behind always
+// makes the next access, so they run interleaved as they would
+// concurrently.  Trimming, writing and prefetching run on one background
+// clock whenever the fault path signals for them; a fault that runs out of
+// frames waits for the background to catch up.  Lock contention is not
+// modeled.
+//
+// With numaNodes set the frames are split between that many nodes and the
+// threads take turns being on each.  An access to a page on another node
+// costs remoteNs more.
+//
+
+// Fake VAs start here, well clear of anything real
+#define SIM_VA_BASE                 (1ULL << 40)
+
+// A fault retried this often means the pool can never satisfy it
+#define SIM_MAX_REDO                1000
+
+// The pool can be grown to this many times its starting size
+#define SIM_POOL_GROWTH             8
+
+typedef struct {
+    simCosts costs;
+    ULONG64* charge;                // The clock platform calls are charged to
+    ULONG64 background;             // When the background work is next idle
+    ULONG64 backgroundBusy;
+    ULONG64 nextVa;
+    trimmer trim;
+    writer write;
+    diskReservation reserve;
+    threadInfo* worker;             // Reads prefetches in
+} simulator;
+
+typedef struct {
+    threadInfo* info;
+    workloadStream stream;
+    ULONG64 clock;
+    BOOL done;
+} simThread;
+
+static simulator* simOf(vmInstance* vm) {
+    return vm->platformContext;
+}
+
+static VOID charge(vmInstance* vm, ULONG64 ns) {
+    *simOf(vm)->charge += ns;
+}
+
+VOID simDefaultCosts(simCosts* costs) {
+    costs->hitNs = DEFAULT_SIM_HIT_NS;
+    costs->remoteNs = DEFAULT_SIM_REMOTE_NS;
+    costs->faultNs = DEFAULT_SIM_FAULT_NS;
+    costs->mapCallNs = DEFAULT_SIM_MAP_CALL_NS;
+    costs->mapPageNs = DEFAULT_SIM_MAP_PAGE_NS;
+    costs->zeroNs = DEFAULT_SIM_ZERO_NS;
+    costs->copyNs = DEFAULT_SIM_COPY_NS;
+    costs->diskReadNs = DEFAULT_SIM_DISK_READ_NS;
+    costs->diskWriteNs = DEFAULT_SIM_DISK_WRITE_NS;
+}
+
+static BOOL simAllocateFrames(vmInstance* vm) {
+    ULONG64 count = vm->config.physicalPages;
+
+    // Any frame numbers will do, start at 1 so none of them is zero
+    vm->physicalPageNumbers = initialize(count * sizeof(ULONG_PTR));
+    for (ULONG64 i = 0; i < count; i++) {
+        vm->physicalPageNumbers[i] = i + 1;
+    }
+    vm->physicalPageCount = count;
+    vm->pfnLimit = SIM_POOL_GROWTH * count + 1;
+    vm->pfnStart = initializeLazy(vm->pfnLimit * sizeof(pfn));
+
+    // As many nodes as configured, each a run of the frames
+    vm->nodeCount = max(min(vm->config.numaNodes, MAX_NUMA_NODES), 1);
+    for (ULONG64 i = 0; i < count; i++) {
+        vm->pfnStart[i + 1].node = i * vm->nodeCount / count;
+    }
+
+    return TRUE;
+}
+
+//
+// A frame is in the pool exactly when it is on some list, so any other
+// frame number will do
+//
+static ULONG64 simAddFrames(vmInstance* vm, ULONG64 count, PULONG_PTR frames, ULONG node) {
+    ULONG64 added = 0;
+
+    for (ULONG64 frame = 1; frame < vm->pfnLimit && added < count; frame++) {
+        if (vm->pfnStart[frame].status == 0) {
+            frames[added++] = frame;
+        }
+    }
+    return added;
+}
+
+static VOID simRemoveFrames(vmInstance* vm, ULONG64 count, PULONG_PTR frames) {
+}
+
+static VOID simFreeFrames(vmInstance* vm) {
+    freeLazy(vm->pfnStart);
+    free(vm->physicalPageNumbers);
+}
+
+static PVOID simReserve(vmInstance* vm, ULONG64 numPages) {
+    simulator* sim = simOf(vm);
+    ULONG64 va = sim->nextVa;
+
+    // Leave a page between reservations so nothing looks adjacent
+    sim->nextVa += (numPages + 1) * PAGE_SIZE;
+    return (PVOID) va;
+}
+
+static VOID simRelease(vmInstance* vm, PVOID va) {
+}
+
+static BOOL simMap(vmInstance* vm, PVOID va, ULONG64 count, PULONG_PTR frames) {
+    simulator* sim = simOf(vm);
+
+    charge(vm, sim->costs.mapCallNs + count * sim->costs.mapPageNs);
+    return TRUE;
+}
+
+static BOOL simMapScatter(vmInstance* vm, PVOID* vas, ULONG64 count, PULONG_PTR frames) {
+    return simMap(vm, NULL, count, frames);
+}
+
+//
+// Pages are filled through the transfer window as on the real platform,
+// so its map calls - one per page, one per window unmapped - are charged
+//
+static VOID simZeroPage(ULONG64 frameNumber, threadInfo* info) {
+    transferMap(info, frameNumber);
+    charge(info->vm, simOf(info->vm)->costs.zeroNs);
+}
+
+static VOID simCopyPage(ULONG64 fromFrame, ULONG64 toFrame, threadInfo* info) {
+    if (info->transferUsed + 2 > TRANSFER_WINDOW_PAGES) {
+        transferFlush(info);
+    }
+    transferMap(info, toFrame);
+    transferMap(info, fromFrame);
+    charge(info->vm, simOf(info->vm)->costs.copyNs);
+}
+
+static VOID simReadPage(ULONG64 diskIndex, ULONG64 frameNumber, threadInfo* info) {
+    transferMap(info, frameNumber);
+    charge(info->vm, simOf(info->vm)->costs.diskReadNs);
+}
+
+static VOID simWritePages(vmInstance* vm, PVOID va, ULONG64* diskIndexes, ULONG64 count) {
+    charge(vm, count * simOf(vm)->costs.diskWriteNs);
+}
+
+//
+// Run what the background threads would do on a signal, starting no
+// earlier than the clock being charged now
+//
+static VOID runBackground(vmInstance* vm, BOOL trim, BOOL prefetch, BOOL promote) {
+    simulator* sim = simOf(vm);
+    ULONG64* caller = sim->charge;
+    ULONG64 start = max(sim->background, *caller);
+
+    sim->background = start;
+    sim->charge = &sim->background;
+
+    if (trim) {
+        trimBatch(vm, &sim->trim);
+        writeBatch(vm, &sim->write, &sim->reserve);
+    }
+    if (prefetch) {
+        while (prefetchNext(vm, sim->worker)) {
+        }
+    }
+    if (promote) {
+        while (promoteNext(vm, sim->worker)) {
+        }
+    }
+
+    sim->backgroundBusy += sim->background - start;
+    sim->charge = caller;
+}
+
+static VOID simWaitForPages(vmInstance* vm) {
+    simulator* sim = simOf(vm);
+
+    runBackground(vm, TRUE, FALSE, FALSE);
+    *sim->charge = max(*sim->charge, sim->background);
+}
+
+static ULONG64 simTickCount(vmInstance* vm) {
+    return *simOf(vm)->charge / 1000000;
+}
+
+static const vmPlatform simPlatform = {
+    "sim",
+    TRUE,
+    simAllocateFrames,
+    simFreeFrames,
+    simAddFrames,
+    simRemoveFrames,
+    simReserve,
+    simRelease,
+    simMap,
+    simMapScatter,
+    simZeroPage,
+    simCopyPage,
+    simReadPage,
+    simWritePages,
+    simWaitForPages,
+    simTickCount,
+};
+
+//
+// The same call pageFaultHandler makes, made beforehand so each fault's
+// modeled time can go to the right histogram
+//
+static ULONG kindOf(vmInstance* vm, pte* x) {
+    if (x->valid.valid == VALID) {
+        return FAULT_VALID;
+    }
+    // A shared page comes from wherever its prototype has it
+    if (x->shared.shared) {
+        x = sharedProto(vm, x);
+    }
+    if (x->transition.transition == TRANSITION) {
+        return FAULT_RESCUE;
+    }
+    return x->disk.diskIndex != 0 ? FAULT_HARD : FAULT_DEMAND_ZERO;
+}
+
+static VOID fault(vmInstance* vm, simThread* thread, PVOID va, faultLatency* latency) {
+    simulator* sim = simOf(vm);
+    addressSpace* space = thread->info->space;
+    pte* x = va2pte(space, va);
+    ULONG redo = 0;
+    BOOL status;
+
+    do {
+        ULONG kind = kindOf(vm, x);
+        ULONG64 before = thread->clock;
+
+        sim->charge = &thread->clock;
+        thread->clock += sim->costs.faultNs;
+        status = pageFaultHandler(space, va, thread->info);
+        if (status == REDO) {
+            kind = FAULT_STARVED;
+        }
+        histogramRecord(&latency->kinds[kind], thread->clock - before);
+
+        //
+        // Whatever the fault signalled for runs now, in the background
+        //
+
+        BOOL trim = taskTakeSignal(&vm->taskTrim);
+        BOOL prefetch = taskTakeSignal(&vm->taskPrefetch);
+        BOOL promote = taskTakeSignal(&vm->taskPromote);
+        if (trim || prefetch || promote) {
+            runBackground(vm, trim, prefetch, promote);
+        }
+
+        ASSERT(++redo < SIM_MAX_REDO);
+    } while (status == REDO);
+
+    ASSERT(status == SUCCESS);
+}
+
+//
+// An instance on the simulated platform, for anything that wants one
+// without running the workload on it
+//
+vmInstance* simCreate(const vmConfig* config, const simCosts* costs) {
+    simulator* sim = initialize(sizeof(simulator));
+
+    sim->costs = *costs;
+    sim->nextVa = SIM_VA_BASE;
+    sim->charge = &sim->background;
+
+    vmInstance* vm = vmCreateOn(config, &simPlatform, sim);
+    if (vm == NULL) {
+        free(sim);
+    }
+    return vm;
+}
+
+VOID simDestroy(vmInstance* vm) {
+    simulator* sim = vm->platformContext;
+
+    vmDestroy(vm);
+    free(sim);
+}
+
+//
+// Run the built-in test's workload, or a recorded trace, against the
+// configured pool with modeled costs.  The result is in simulated time;
+// the estimated latencies are in faultKinds, and the phases are left empty.
+//
+BOOL simulate(const vmConfig* config, const simCosts* costs, benchResult* result) {
+    accessReplay* replay = NULL;
+    ULONG threads = config->userThreads;
+
+    memset(result, 0, sizeof(benchResult));
+
+    vmInstance* vm = simCreate(config, costs);
+    if (vm == NULL) {
+        return FALSE;
+    }
+    simulator* sim = vm->platformContext;
+
+    if (config->replayPath != NULL) {
+        replay = accessReplayOpen(config->replayPath);
+        if (replay == NULL || replay->header.spaces > config->addressSpaces ||
+            replay->header.virtualAddressSize != config->virtualAddressSize) {
+            printf ("simulate : cannot replay %s on this configuration\n", config->replayPath);
+            if (replay != NULL) {
+                accessReplayClose(replay);
+            }
+            simDestroy(vm);
+            return FALSE;
+        }
+        threads = replay->header.threads;
+    }
+
+    BOOL b = trimmerInitialize(&sim->trim, vm) && writerInitialize(&sim->write, vm, NULL) &&
+             diskReservationInitialize(&sim->reserve, writeBatchLimit(vm));
+    ASSERT(b);
+    sim->worker = vmAttachThread(vm);
+
+    for (ULONG s = 0; s < config->addressSpaces; s++) {
+        addressSpace* space = vm->spaces[s];
+        PVOID region = vmReserve(space, space->vaStart, space->virtualAddressSize);
+        ASSERT(region == space->vaStart);
+        b = vmCommit(space, region, space->virtualAddressSize);
+        ASSERT(b);
+    }
+
+    simThread* thread = initialize(threads * sizeof(simThread));
+    faultLatency* latency = initialize(sizeof(faultLatency));
+    workloadShape shape;
+
+    workloadPrepare(&shape, &config->workload, vm->spaces[0]->numPtes);
+
+    for (ULONG i = 0; i < threads; i++) {
+        thread[i].info = vmAttachThread(vm);
+        thread[i].info->node = i % vm->nodeCount;
+        if (replay != NULL) {
+            thread[i].info->reader = accessReplayThread(replay, i);
+            thread[i].info->space = vm->spaces[thread[i].info->reader->space];
+        } else {
+            thread[i].info->space = vm->spaces[i % config->addressSpaces];
+            thread[i].info->stream = &thread[i].stream;
+            workloadStart(&thread[i].stream, &shape, i, threads);
+        }
+    }
+
+    ULONG64 wallStart = GetTickCount64();
+    ULONG64 issued = 0;
+
+    while (TRUE) {
+        simThread* next = NULL;
+        ULONG64 offset;
+        ULONG64 delay;
+        BOOL write;
+
+        for (ULONG i = 0; i < threads; i++) {
+            if (thread[i].done == FALSE && (next == NULL || thread[i].clock < next->clock)) {
+                next = &thread[i];
+            }
+        }
+        if (next == NULL) {
+            break;
+        }
+
+        threadInfo* info = next->info;
+        if (info->reader != NULL) {
+            if (accessReplayNext(info->reader, &offset, &write, &delay) == FALSE) {
+                next->done = TRUE;
+                continue;
+            }
+        } else {
+            if (next->stream.issued == config->accessesPerThread) {
+                next->done = TRUE;
+                continue;
+            }
+            // Each space is snapshotted once, on the time of whichever thread gets there
+            if (config->snapshotAt != 0 && issued == config->snapshotAt * threads) {
+                sim->charge = &next->clock;
+                for (ULONG s = 0; s < config->addressSpaces; s++) {
+                    vmSnapshot(vm->spaces[s]);
+                }
+            }
+            offset = workloadNext(&next->stream, &write);
+            issued++;
+        }
+
+        pte* x = &info->space->ptes[offset / PAGE_SIZE];
+        if (x->valid.valid != VALID) {
+            fault(vm, next, (PVOID) ((ULONG_PTR) info->space->vaStart + offset), latency);
+        } else {
+            // Faults are seen by the handler, here the curve gets the hits too
+            mrcReference(&vm->mrc, (ULONG_PTR) x / sizeof(pte));
+        }
+        next->clock += sim->costs.hitNs;
+
+        // Only the simulator sees every access, hits included
+        if (vm->nodeCount != 1 && frameNumber2pfn(vm, x->valid.frameNumber)->node != info->node) {
+            next->clock += sim->costs.remoteNs;
+            result->remoteAccesses++;
+        }
+    }
+
+    ULONG64 wallMs = GetTickCount64() - wallStart;
+    ULONG64 elapsedNs = 0;
+
+    for (ULONG i = 0; i < threads; i++) {
+        elapsedNs = max(elapsedNs, thread[i].clock);
+        if (replay != NULL) {
+            result->accesses += thread[i].info->reader->issued;
+            result->writes += thread[i].info->reader->writes;
+        } else {
+            result->accesses += thread[i].stream.issued;
+            result->writes += thread[i].stream.writes;
+        }
+    }
+    result->elapsedMs = elapsedNs / 1000000;
+    result->reads = result->accesses - result->writes;
+    result->hardFaults = statsRead(&vm->stats, STAT_HARD_FAULTS);
+    result->softFaults = statsRead(&vm->stats, STAT_MODIFIED_RESCUES) + statsRead(&vm->stats, STAT_STANDBY_RESCUES);
+    result->demandZeroFaults = statsRead(&vm->stats, STAT_DEMAND_ZERO_FAULTS);
+    result->largeFaults = statsRead(&vm->stats, STAT_LARGE_FAULTS);
+    result->largePromotions = statsRead(&vm->stats, STAT_LARGE_PROMOTIONS);
+    result->largeDemotions = statsRead(&vm->stats, STAT_LARGE_DEMOTIONS);
+    result->localFaults = statsRead(&vm->stats, STAT_LOCAL_FAULTS);
+    result->remoteFaults = statsRead(&vm->stats, STAT_REMOTE_FAULTS);
+    result->snapshotPages = statsRead(&vm->stats, STAT_SNAPSHOT_PAGES);
+    result->sharedFaults = statsRead(&vm->stats, STAT_SHARED_FAULTS);
+    result->sharedCopies = statsRead(&vm->stats, STAT_SHARED_COPIES);
+    for (ULONG k = 0; k < FAULT_KINDS; k++) {
+        // Modeled times are recorded in ns, not in performance counter ticks
+        latencySummarizeScaled(&latency->kinds[k], &result->faultKinds[k], 1.0);
+    }
+    result->mrcReferences = mrcCurve(&vm->mrc, vm->physicalPageCount, result->mrc);
+    result->startup = vm->startup;
+
+    for (ULONG k = 0; k < FAULT_KINDS; k++) {
+        latencySummary* summary = &result->faultKinds[k];
+        if (summary->count != 0) {
+            printf ("simulate : %-10s faults %10llu  p50 %8llu ns  p99 %8llu ns  p99.9 %8llu ns (modeled)\n",
+                    latencyKindName(k),
+                    summary->count,
+                    summary->p50,
+                    summary->p99,
+                    summary->p999);
+        }
+    }
+
+    printf ("simulate : %llu accesses in %llu ms simulated, %llu ms real (%.1fM accesses/s) - "
+            "%llu hard, %llu soft and %llu demand zero faults, background busy %llu%%\n",
+            result->accesses,
+            result->elapsedMs,
+            wallMs,
+            wallMs ? result->accesses / 1000.0 / wallMs : 0,
+            result->hardFaults,
+            result->softFaults,
+            result->demandZeroFaults,
+            elapsedNs ? sim->backgroundBusy * 100 / elapsedNs : 0);
+
+    if (result->snapshotPages != 0) {
+        printf ("simulate : snapshots shared %llu pages - %llu faults on them, %llu of which copied the page\n",
+                result->snapshotPages,
+                result->sharedFaults,
+                result->sharedCopies);
+    }
+
+    if (vm->largeCapacity != 0) {
+        printf ("simulate : %llu large frames - %llu taken by faults, %llu by promotions, %llu demoted\n",
+                vm->largeCapacity,
+                result->largeFaults,
+                result->largePromotions,
+                result->largeDemotions);
+    }
+
+    if (vm->nodeCount != 1) {
+        printf ("simulate : %u nodes - %llu local and %llu remote faults, %llu of %llu accesses remote (%llu%%)\n",
+                vm->nodeCount,
+                result->localFaults,
+                result->remoteFaults,
+                result->remoteAccesses,
+                result->accesses,
+                result->accesses ? result->remoteAccesses * 100 / result->accesses : 0);
+    }
+
+    // Every access reaches the curve here, hits included
+    mrcPrint("simulate", result->mrc, result->mrcReferences);
+
+    // Whatever tearing down maps or unmaps is charged to nobody in particular
+    sim->charge = &sim->background;
+
+    for (ULONG i = 0; i < threads; i++) {
+        vmDetachThread(thread[i].info);
+    }
+    vmDetachThread(sim->worker);
+    BOOL replayed = TRUE;
+    if (replay != NULL) {
+        if (accessReplayCorrupt(replay)) {
+            printf ("simulate : rejected %s, it is corrupt\n", config->replayPath);
+            replayed = FALSE;
+        }
+        accessReplayClose(replay);
+    }
+    trimmerFree(&sim->trim);
+    writerFree(&sim->write);
+    diskReservationFree(&sim->reserve);
+
+    simDestroy(vm);
+
+    free(latency);
+    free(thread);
+    return replayed;
+}
@@ -0,0 +1,46 @@
+//
+// sim.h
+// Discrete-event paging simulator
+//
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <windows.h>
+#include "../vm/vm.h"
+
+//
+// Modeled costs in nanoseconds.  The defaults are rough figures for a
+// current x64 machine with an NVMe pagefile - sweep them like anything else.
+//
+#define DEFAULT_SIM_HIT_NS          2       // An access to a resident page
+#define DEFAULT_SIM_REMOTE_NS       1       // Plus this when it is on another node
+#define DEFAULT_SIM_FAULT_NS        2500    // Exception dispatch and handler entry, every fault
+#define DEFAULT_SIM_MAP_CALL_NS     400     // Each map or unmap call
+#define DEFAULT_SIM_MAP_PAGE_NS     60      // Plus this per page in it
+#define DEFAULT_SIM_ZERO_NS         300
+#define DEFAULT_SIM_COPY_NS         500
+#define DEFAULT_SIM_DISK_READ_NS    80000
+#define DEFAULT_SIM_DISK_WRITE_NS   20000   // Per page
+
+typedef struct {
+    ULONG64 hitNs;
+    ULONG64 remoteNs;
+    ULONG64 faultNs;
+    ULONG64 mapCallNs;
+    ULONG64 mapPageNs;
+    ULONG64 zeroNs;
+    ULONG64 copyNs;
+    ULONG64 diskReadNs;
+    ULONG64 diskWriteNs;
+} simCosts;
+
+//
+// Function declarations
+//
+VOID simDefaultCosts(simCosts* costs);
+vmInstance* simCreate(const vmConfig* config, const simCosts* costs);
+VOID simDestroy(vmInstance* vm);
+BOOL simulate(const vmConfig* config, const simCosts* costs, benchResult* result);
+
+#endif // SIM_H
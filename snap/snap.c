@@ -0,0 +1,402 @@
+//
+// snap.c
+// Copy-on-write snapshots of an address space
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+#include "../util/util.h"
+#include "../vm/vm.h"
+#include "../vad/vad.h"
+#include "snap.h"
+#include "../pt/pt.h"
+#include "../list/list.h"
+#include "../disk/disk.h"
+#include "../large/large.h"
+#include "../trace/trace.h"
+#include "../platform/platform.h"
+
+#define SNAPSHOT_BATCH_SIZE         64
+
+// PTEs a snapshot walks between letting go of the PTE lock
+#define SNAPSHOT_WALK_PAGES         4096
+
+static BOOL isShared(pte* x) {
+    return x->valid.valid == INVALID && x->shared.shared;
+}
+
+//
+// The space holding the prototype PTEs, made the first time it is needed.
+// Every prototype holds a frame or a pagefile slot, so there never need be
+// more of them than the pool and the pagefile have between them.  It has
+// no VA and nothing active, so the trimmer and the fault path never see it.
+//
+static BOOL protoSpaceCreate(vmInstance* vm) {
+    ULONG64 capacity = max(vm->config.physicalPages, vm->config.poolMaximum) + vm->config.diskSizeInPages;
+    addressSpace* space;
+    ULONG index;
+
+#if VM_COMPACT_PFN
+    capacity = min(capacity, PFN_PTE_INDEX_LIMIT);
+#endif
+
+    acquireLock(&vm->lockSpaces, USER);
+
+    if (vm->protoSpace != NULL) {
+        releaseLock(&vm->lockSpaces, USER);
+        return TRUE;
+    }
+    for (index = 0; index < MAX_ADDRESS_SPACES; index++) {
+        if (vm->spaces[index] == NULL) {
+            break;
+        }
+    }
+    if (index == MAX_ADDRESS_SPACES) {
+        releaseLock(&vm->lockSpaces, USER);
+        printf ("vmSnapshot : no space left for the prototype PTEs\n");
+        return FALSE;
+    }
+
+    space = initialize(sizeof(addressSpace));
+    space->vm = vm;
+    space->index = index;
+    space->numPtes = capacity;
+    space->ptes = initializeLazy(capacity * sizeof(pte));
+
+    acquireLockPTE(vm, NULL, USER);
+    vm->protoRefs = initializeLazy(capacity * sizeof(LONG));
+    vm->protoFree = initializeLazy(capacity * sizeof(ULONG64));
+    vm->protoFreeCount = 0;
+    vm->protoNext = 0;
+    vm->spaces[index] = space;
+    vm->protoSpace = space;
+    releaseLock(&vm->lockPTE, USER);
+
+    releaseLock(&vm->lockSpaces, USER);
+    return TRUE;
+}
+
+// Only once every space that shared pages is gone
+VOID protoSpaceFree(vmInstance* vm) {
+    addressSpace* space = vm->protoSpace;
+
+    if (space == NULL) {
+        return;
+    }
+    ASSERT(vm->protoNext == vm->protoFreeCount);
+
+    acquireLock(&vm->lockSpaces, USER);
+    acquireLockPTE(vm, NULL, USER);
+    vm->spaces[space->index] = NULL;
+    vm->protoSpace = NULL;
+    releaseLock(&vm->lockPTE, USER);
+    releaseLock(&vm->lockSpaces, USER);
+
+    freeLazy(vm->protoRefs);
+    freeLazy(vm->protoFree);
+    freeLazy(space->ptes);
+    free(space);
+}
+
+static BOOL protoRoom(vmInstance* vm) {
+    return vm->protoNext < vm->protoSpace->numPtes || vm->protoFreeCount != 0;
+}
+
+static ULONG64 protoAllocate(vmInstance* vm) {
+    if (vm->protoFreeCount != 0) {
+        return vm->protoFree[--vm->protoFreeCount];
+    }
+    ASSERT(vm->protoNext < vm->protoSpace->numPtes);
+    return vm->protoNext++;
+}
+
+static VOID protoGiveBack(vmInstance* vm, ULONG64 index) {
+    ASSERT(vm->protoSpace->ptes[index].zero == 0);
+    vm->protoFree[vm->protoFreeCount++] = index;
+}
+
+pte* sharedProto(vmInstance* vm, pte* x) {
+    return vm->protoSpace->ptes + x->shared.protoIndex;
+}
+
+//
+// Move whatever is behind x, which is not shared yet, to a new prototype
+// and point x at it.  A mapped page is left to the caller to unmap, which
+// it does a batch at a time - it gets the page back.
+//
+static pfn* share(addressSpace* space, pte* x) {
+    vmInstance* vm = space->vm;
+    ULONG64 index = protoAllocate(vm);
+    pte* proto = vm->protoSpace->ptes + index;
+    pfn* page = NULL;
+    pte entry;
+
+    if (x->valid.valid == VALID) {
+        if (x->large.large) {
+            largeDemote(space, x);
+        }
+        page = frameNumber2pfn(vm, x->valid.frameNumber);
+        pfnSetPte(page, vm->protoSpace, proto);
+        proto->zero = 0;
+        proto->transition.transition = TRANSITION;
+        proto->transition.frameNumber = x->valid.frameNumber;
+    } else if (x->transition.transition == TRANSITION) {
+        pfn* reading = frameNumber2pfn(vm, x->transition.frameNumber);
+
+        //
+        // The fault reading it in frees the frame once it finds the PTE
+        // gone, and faults again on the shared one - the prototype gets
+        // the slot it is being read from.  A large frame being zeroed or
+        // copied into has its contents in the frame instead, and is handed
+        // on to the prototype once it is done, see large/large.c.
+        //
+        if (reading->status == READING && reading->diskIndex != 0) {
+            proto->zero = 0;
+            proto->disk.diskIndex = reading->diskIndex;
+            reading->diskIndex = 0;
+        } else {
+            pfnSetPte(reading, vm->protoSpace, proto);
+            *proto = *x;
+        }
+    } else {
+        *proto = *x;
+    }
+
+    vm->protoRefs[index] = 1;
+
+    entry.zero = 0;
+    entry.shared.shared = 1;
+    entry.shared.protoIndex = index;
+    *x = entry;
+    return page;
+}
+
+//
+// Pages that were mapped in the source go to the modified list, just as if
+// they had been trimmed, so the writer gets them out to the pagefile.  A
+// mapped page may have been written to since it came in - AWE keeps no
+// dirty bit, and the fault that mapped it gave up its slot - so none of
+// them can go to standby.  Pages already in transition keep their list.
+//
+static VOID unmapShared(addressSpace* space, PVOID* batch, pfn** pages, ULONG64 count) {
+    vmInstance* vm = space->vm;
+
+    BOOL b = vm->platform->mapScatter(vm, batch, count, NULL);
+    ASSERT(b);
+
+    acquireLock(&vm->lockModifiedList, USER);
+    for (ULONG64 j = 0; j < count; j++) {
+        InterlockedDecrement64(&space->activeCount);
+        largeResident(space, va2pte(space, batch[j]), -1);
+        pages[j]->priority = STANDBY_PRIORITY_NORMAL;
+        pageSetStatus(vm, pages[j], MODIFIED);
+        linkAdd(vm, pages[j], &vm->headModifiedList);
+    }
+    releaseLock(&vm->lockModifiedList, USER);
+}
+
+//
+// A new space with the same reservations and contents as source, sharing
+// every page source has with it.  Returns NULL if there is no room for
+// another space or the prototypes it needs - the pages shared by then stay
+// with prototypes of their own, and the first fault on one takes it back.
+// Reservation changes on the source wait for it, but the walk lets go of
+// the PTE lock every SNAPSHOT_WALK_PAGES PTEs, so faults go on meanwhile.
+// A page can be written to until the walk reaches it and unmaps it - such
+// writes may or may not make it into the snapshot.
+//
+addressSpace* vmSnapshot(addressSpace* source) {
+    vmInstance* vm = source->vm;
+    PVOID batch[SNAPSHOT_BATCH_SIZE];
+    pfn* pages[SNAPSHOT_BATCH_SIZE];
+    ULONG64 count = 0;
+    ULONG64 walked = 0;
+    ULONG64 shared = 0;
+    BOOL full = FALSE;
+    addressSpace* snapshot;
+    vad* node;
+
+    snapshot = vmCreateAddressSpace(vm, source->virtualAddressSize, source->wsMinimum, source->wsMaximum);
+    if (snapshot == NULL) {
+        return NULL;
+    }
+    if (protoSpaceCreate(vm) == FALSE) {
+        vmDestroyAddressSpace(snapshot);
+        return NULL;
+    }
+
+    TRACE_BEGIN("snapshot");
+    acquireLock(&source->lockVad, USER);
+    acquireLock(&snapshot->lockVad, USER);
+    acquireLockPTE(vm, NULL, USER);
+
+    for (node = vadFirstOverlap(source->vadRoot, 0, source->numPtes); node != NULL && full == FALSE; node = vadNext(source->vadRoot, node)) {
+        vad* copy = malloc(sizeof(vad));
+        ASSERT(copy);
+        *copy = *node;
+        vadInsert(&snapshot->vadRoot, copy);
+
+        // Only committed ranges have anything behind their PTEs
+        if (node->state != VAD_COMMITTED) {
+            continue;
+        }
+
+        for (ULONG64 index = node->startPage; index < node->endPage; index++) {
+            pte* x = source->ptes + index;
+
+            // The batch is unmapped first, so no shared PTE is left mapped
+            if (++walked % SNAPSHOT_WALK_PAGES == 0) {
+                if (count != 0) {
+                    unmapShared(source, batch, pages, count);
+                    count = 0;
+                }
+                releaseLock(&vm->lockPTE, USER);
+                acquireLockPTE(vm, NULL, USER);
+            }
+
+            if (x->zero == 0) {
+                continue;
+            }
+            if (isShared(x) == FALSE) {
+                if (protoRoom(vm) == FALSE) {
+                    full = TRUE;
+                    break;
+                }
+                pfn* page = share(source, x);
+                if (page != NULL) {
+                    pages[count] = page;
+                    batch[count] = pte2va(source, x);
+                    count++;
+                }
+            }
+            vm->protoRefs[x->shared.protoIndex]++;
+            snapshot->ptes[index] = *x;
+            shared++;
+
+            if (count == SNAPSHOT_BATCH_SIZE) {
+                unmapShared(source, batch, pages, count);
+                count = 0;
+            }
+        }
+    }
+    if (count != 0) {
+        unmapShared(source, batch, pages, count);
+    }
+
+    releaseLock(&vm->lockPTE, USER);
+    releaseLock(&snapshot->lockVad, USER);
+    releaseLock(&source->lockVad, USER);
+
+    // The trim task passes them on to the writer along with its own
+    taskSignal(&vm->sched, &vm->taskTrim);
+
+    if (full) {
+        TRACE_END("snapshot", "pages", 0);
+        printf ("vmSnapshot : no room for more shared pages after %llu\n", shared);
+        vmDestroyAddressSpace(snapshot);
+        return NULL;
+    }
+
+    statsAdd(&vm->stats, STAT_SNAPSHOT_PAGES, shared);
+    TRACE_END("snapshot", "pages", shared);
+    return snapshot;
+}
+
+//
+// The last PTE sharing a page takes the prototype's place - the page is
+// its own again, in transition or out on the pagefile, and the fault goes
+// on as it would have for any other PTE.  Returns FALSE if others still
+// share it.
+//
+BOOL sharedTakeBack(addressSpace* space, pte* x) {
+    vmInstance* vm = space->vm;
+    ULONG64 index = x->shared.protoIndex;
+    pte* proto = vm->protoSpace->ptes + index;
+
+    if (vm->protoRefs[index] != 1) {
+        return FALSE;
+    }
+
+    *x = *proto;
+    if (x->transition.transition == TRANSITION) {
+        pfn* page = frameNumber2pfn(vm, x->transition.frameNumber);
+
+        // The fault path waits out a read through the prototype first
+        ASSERT(page->status != READING);
+        pfnSetPte(page, space, x);
+    }
+    proto->zero = 0;
+    vm->protoRefs[index] = 0;
+    protoGiveBack(vm, index);
+    return TRUE;
+}
+
+//
+// Whether x's page is being read in from the prototype's slot by a fault
+// on another PTE sharing it, which this fault has to wait for
+//
+BOOL sharedReading(vmInstance* vm, pte* x) {
+    pte* proto = sharedProto(vm, x);
+
+    return proto->transition.transition == TRANSITION && frameNumber2pfn(vm, proto->transition.frameNumber)->status == READING;
+}
+
+// Whether x's page is out on the pagefile, for the fault path to read in
+BOOL sharedOnDisk(vmInstance* vm, pte* x) {
+    pte* proto = sharedProto(vm, x);
+
+    return proto->transition.transition != TRANSITION && proto->disk.diskIndex != 0;
+}
+
+//
+// Fill page with the contents x shares with others, from the prototype's
+// frame, or with zeroes if the prototype lost its frame without ever
+// getting a slot.  A prototype out on the pagefile is read in by the fault
+// path instead, with the PTE lock dropped.  The frame may be the
+// prototype's own, taken off standby for this very fault, in which case
+// the prototype has gone back to its slot.  Returns the kind of fault it
+// turned out to be.
+//
+ULONG sharedCopy(addressSpace* space, pte* x, pfn* page, threadInfo* info) {
+    vmInstance* vm = space->vm;
+    pte* proto = sharedProto(vm, x);
+    ULONG64 frameNumber = pfn2frameNumber(vm, page);
+    ULONG kind;
+
+    ASSERT(sharedOnDisk(vm, x) == FALSE);
+    if (proto->transition.transition == TRANSITION) {
+        vm->platform->copyPage(proto->transition.frameNumber, frameNumber, info);
+        kind = FAULT_RESCUE;
+    } else {
+        vm->platform->zeroPage(frameNumber, info);
+        statsAdd(&vm->stats, STAT_DEMAND_ZERO_FAULTS, 1);
+        kind = FAULT_DEMAND_ZERO;
+    }
+
+    sharedCopied(vm, x);
+    return kind;
+}
+
+//
+// x has a copy of its page in a frame of its own now, and nothing behind
+// it for the caller to map the frame at
+//
+VOID sharedCopied(vmInstance* vm, pte* x) {
+    sharedRelease(vm, x);
+    x->zero = 0;
+    statsAdd(&vm->stats, STAT_SHARED_COPIES, 1);
+}
+
+//
+// x no longer shares its page.  The last one out throws the page away.
+//
+VOID sharedRelease(vmInstance* vm, pte* x) {
+    ULONG64 index = x->shared.protoIndex;
+
+    ASSERT(vm->protoRefs[index] > 0);
+    if (--vm->protoRefs[index] == 0) {
+        decommitPtes(vm->protoSpace, index, index + 1);
+        protoGiveBack(vm, index);
+    }
+}
@@ -0,0 +1,52 @@
+//
+// snap.h
+// Copy-on-write snapshots of an address space
+//
+
+#ifndef SNAP_H
+#define SNAP_H
+
+#include <windows.h>
+#include "../vm/vm.h"
+
+//
+// A snapshot is a new space with the same reservations as its source, and
+// every page either of them has behind a PTE is shared between the two
+// rather than copied.  Each shared page moves to a prototype PTE, kept in a
+// space of its own that is never mapped, with a count of the PTEs pointing
+// at it.  Prototypes go through the lists like any other PTE - their
+// frames are written out, repurposed and rescued as usual.  Pages in
+// transition keep their list.  Pages mapped at the time are unmapped and
+// go to the modified list - with no dirty bit there is no telling which
+// of them are clean - so a snapshot of a large working set costs the
+// writer that much.
+//
+// AWE maps every page read-write, so a write to a mapped page cannot be
+// caught, and there is no mapping a shared frame for reads only.  Sharing
+// is broken by the first fault on a shared PTE instead, read or write,
+// which copies the page into a frame of its own.  The last PTE left
+// sharing a page just takes the prototype's frame over, or reads its slot
+// in, with no copy.  Taking a snapshot walks the committed PTEs - the
+// copying is paid for page by page, by the pages touched afterwards, reads
+// included.
+//
+// Everything here is done under the PTE lock, but a snapshot lets go of it
+// every SNAPSHOT_WALK_PAGES PTEs of the walk.  A shared page out on the
+// pagefile is read in with the lock dropped and its prototype in
+// transition, like any other page.
+//
+
+//
+// Function declarations
+//
+addressSpace* vmSnapshot(addressSpace* source);
+pte* sharedProto(vmInstance* vm, pte* x);
+BOOL sharedTakeBack(addressSpace* space, pte* x);
+BOOL sharedReading(vmInstance* vm, pte* x);
+BOOL sharedOnDisk(vmInstance* vm, pte* x);
+ULONG sharedCopy(addressSpace* space, pte* x, pfn* page, threadInfo* info);
+VOID sharedCopied(vmInstance* vm, pte* x);
+VOID sharedRelease(vmInstance* vm, pte* x);
+VOID protoSpaceFree(vmInstance* vm);
+
+#endif // SNAP_H
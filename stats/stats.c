@@ -0,0 +1,285 @@
+//
+// stats.c
+// Sharded statistics counters and the periodic sampler
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <windows.h>
+#include "../vm/vm.h"
+#include "../util/util.h"
+#include "stats.h"
+
+static const char* statNames[STAT_COUNTERS] = {
+    "hardFaults",
+    "demandZeroFaults",
+    "starvedFaults",
+    "modifiedRescues",
+    "standbyRescues",
+    "pagesActivated",
+    "pagesTrimmed",
+    "pagesWritten",
+    "pagesRepurposed",
+    "largeFaults",
+    "largePromotions",
+    "largeDemotions",
+    "localFaults",
+    "remoteFaults",
+    "sharedFaults",
+    "sharedCopies",
+    "snapshotPages",
+    "freePages",
+    "activePages",
+    "modifiedPages",
+    "standbyPages",
+    "readingPages",
+    "largeFreePages",
+};
+
+static const ULONG mrcEighths[MRC_POINTS] = MRC_POINT_EIGHTHS;
+
+static volatile LONG nextStatsId;
+
+//
+// The shards this thread has for the last few instances it touched.  Keyed
+// by id rather than address so a destroyed instance can't be mistaken for a
+// new one allocated in its place.
+//
+static __declspec(thread) struct {
+    LONG id;
+    statsShard* shard;
+} cache[STATS_THREAD_CACHE];
+static __declspec(thread) ULONG cacheNext;
+
+const char* statsName(ULONG counter) {
+    return counter < STAT_COUNTERS ? statNames[counter] : "?";
+}
+
+BOOL statsInitialize(vmStats* stats, ULONG intervalMs, const char* path) {
+    stats->id = InterlockedIncrement(&nextStatsId);
+    stats->startMs = GetTickCount64();
+    stats->intervalMs = intervalMs;
+
+    if (intervalMs == 0) {
+        return TRUE;
+    }
+
+    if (path != NULL) {
+        const char* dot = strrchr(path, '.');
+
+        stats->out = fopen(path, "w");
+        if (stats->out == NULL) {
+            printf ("statsInitialize : could not open %s\n", path);
+            return FALSE;
+        }
+        stats->csv = dot != NULL && _stricmp(dot, ".csv") == 0;
+    }
+
+    //
+    // Local\ keeps it to this session, the pid and id tell instances apart
+    //
+
+    sprintf(stats->pageName, "Local\\vmStats-%u-%d", GetCurrentProcessId(), stats->id);
+
+    stats->section = CreateFileMapping(INVALID_HANDLE_VALUE,
+                                       NULL,
+                                       PAGE_READWRITE,
+                                       0,
+                                       sizeof(statsPage),
+                                       stats->pageName);
+    if (stats->section == NULL) {
+        printf ("statsInitialize : could not create %s, error %#x\n", stats->pageName, GetLastError ());
+        return FALSE;
+    }
+
+    stats->page = MapViewOfFile(stats->section, FILE_MAP_WRITE, 0, 0, sizeof(statsPage));
+    if (stats->page == NULL) {
+        printf ("statsInitialize : could not map %s, error %#x\n", stats->pageName, GetLastError ());
+        return FALSE;
+    }
+
+    stats->page->magic = STATS_PAGE_MAGIC;
+    stats->page->version = STATS_PAGE_VERSION;
+    stats->page->counters = STAT_COUNTERS;
+    stats->page->intervalMs = intervalMs;
+
+    if (stats->out != NULL && stats->csv) {
+        fprintf(stats->out, "elapsedMs");
+        for (ULONG c = 0; c < STAT_COUNTERS; c++) {
+            fprintf(stats->out, ",%s", statNames[c]);
+        }
+        fprintf(stats->out, ",freeDiskSlots,mrcReferences");
+        for (ULONG p = 0; p < MRC_POINTS; p++) {
+            fprintf(stats->out, ",missRatio%gx", mrcEighths[p] / 8.0);
+        }
+        fprintf(stats->out, "\n");
+    }
+
+    return TRUE;
+}
+
+VOID statsDestroy(vmStats* stats) {
+    statsShard* shard = stats->shards;
+
+    while (shard != NULL) {
+        statsShard* next = shard->next;
+        _aligned_free(shard);
+        shard = next;
+    }
+    stats->shards = NULL;
+
+    if (stats->page != NULL) {
+        UnmapViewOfFile(stats->page);
+    }
+    if (stats->section != NULL) {
+        CloseHandle(stats->section);
+    }
+    if (stats->out != NULL) {
+        fclose(stats->out);
+    }
+}
+
+static statsShard* newShard(vmStats* stats) {
+    statsShard* shard = _aligned_malloc(sizeof(statsShard), STATS_CACHE_LINE);
+
+    if (shard == NULL) {
+        return NULL;
+    }
+    memset(shard, 0, sizeof(statsShard));
+
+    // Push onto the instance's shards for the readers, without a lock
+    do {
+        shard->next = stats->shards;
+    } while (InterlockedCompareExchangePointer((PVOID volatile*) &stats->shards, shard, shard->next) != shard->next);
+
+    return shard;
+}
+
+static statsShard* currentShard(vmStats* stats) {
+    for (ULONG i = 0; i < STATS_THREAD_CACHE; i++) {
+        if (cache[i].id == stats->id) {
+            return cache[i].shard;
+        }
+    }
+
+    //
+    // Evicting only loses the pointer, the counts stay in the instance's
+    // list and a thread coming back just starts another shard.
+    //
+
+    statsShard* shard = newShard(stats);
+    if (shard != NULL) {
+        ULONG slot = cacheNext++ % STATS_THREAD_CACHE;
+        cache[slot].id = stats->id;
+        cache[slot].shard = shard;
+    }
+    return shard;
+}
+
+VOID statsAdd(vmStats* stats, ULONG counter, LONG64 delta) {
+    statsShard* shard = currentShard(stats);
+
+    ASSERT(counter < STAT_COUNTERS);
+    if (shard != NULL) {
+        shard->values[counter] += delta;
+    }
+}
+
+//
+// Sums are only as consistent as the shards are with each other at the time
+// - good enough for watching, gauges can be off by the pages in flight.
+//
+LONG64 statsRead(vmStats* stats, ULONG counter) {
+    LONG64 sum = 0;
+
+    for (statsShard* shard = stats->shards; shard != NULL; shard = shard->next) {
+        sum += shard->values[counter];
+    }
+    return sum;
+}
+
+VOID statsSample(vmStats* stats, statsSnapshot* snapshot) {
+    memset(snapshot, 0, sizeof(statsSnapshot));
+    snapshot->elapsedMs = GetTickCount64() - stats->startMs;
+
+    for (statsShard* shard = stats->shards; shard != NULL; shard = shard->next) {
+        for (ULONG c = 0; c < STAT_COUNTERS; c++) {
+            snapshot->values[c] += shard->values[c];
+        }
+    }
+}
+
+VOID statsPublish(vmStats* stats, const statsSnapshot* snapshot) {
+    statsPage* page = stats->page;
+
+    if (page == NULL) {
+        return;
+    }
+
+    InterlockedIncrement64(&page->sequence);
+    page->snapshot = *snapshot;
+    InterlockedIncrement64(&page->sequence);
+}
+
+VOID statsWriteRow(vmStats* stats, const statsSnapshot* snapshot) {
+    FILE* out = stats->out;
+
+    if (out == NULL) {
+        return;
+    }
+
+    if (stats->csv) {
+        fprintf(out, "%llu", snapshot->elapsedMs);
+        for (ULONG c = 0; c < STAT_COUNTERS; c++) {
+            fprintf(out, ",%lld", snapshot->values[c]);
+        }
+        fprintf(out, ",%lld,%llu", snapshot->freeDiskSlots, snapshot->mrcReferences);
+        for (ULONG p = 0; p < MRC_POINTS; p++) {
+            fprintf(out, ",%.6f", snapshot->mrc[p].missRatio);
+        }
+        fprintf(out, "\n");
+    } else {
+        fprintf(out, "{\"elapsedMs\":%llu", snapshot->elapsedMs);
+        for (ULONG c = 0; c < STAT_COUNTERS; c++) {
+            fprintf(out, ",\"%s\":%lld", statNames[c], snapshot->values[c]);
+        }
+        fprintf(out, ",\"freeDiskSlots\":%lld,\"mrcReferences\":%llu,\"mrc\":[",
+                snapshot->freeDiskSlots,
+                snapshot->mrcReferences);
+        for (ULONG p = 0; p < MRC_POINTS; p++) {
+            fprintf(out, "%s{\"pages\":%llu,\"missRatio\":%.6f}",
+                    p ? "," : "",
+                    snapshot->mrc[p].pages,
+                    snapshot->mrc[p].missRatio);
+        }
+        fprintf(out, "]}\n");
+    }
+
+    // Someone tailing the file should see every row as it is written
+    fflush(out);
+}
+
+//
+// Wakes every interval to add up the shards, write a row and refresh the
+// shared page, and takes one last sample on the way out.
+//
+VOID threadStats(LPVOID lpParameter) {
+    vmInstance* vm = (vmInstance*) lpParameter;
+    vmStats* stats = &vm->stats;
+    statsSnapshot snapshot;
+    DWORD wait;
+
+    WaitForSingleObject(vm->eventSystemStart, INFINITE);
+
+    do {
+        wait = WaitForSingleObject(vm->eventSystemShutdown, stats->intervalMs);
+
+        statsSample(stats, &snapshot);
+        snapshot.freeDiskSlots = vm->numFreeDiskSlots;
+        snapshot.mrcReferences = mrcCurve(&vm->mrc, vm->physicalPageCount, snapshot.mrc);
+        statsPublish(stats, &snapshot);
+        statsWriteRow(stats, &snapshot);
+    } while (wait == WAIT_TIMEOUT);
+}
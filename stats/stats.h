@@ -0,0 +1,126 @@
+//
+// stats.h
+// Sharded statistics counters and the periodic sampler
+//
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <windows.h>
+#include "../mrc/mrc.h"
+
+//
+// Events, only ever going up
+//
+#define STAT_HARD_FAULTS            0
+#define STAT_DEMAND_ZERO_FAULTS     1
+#define STAT_STARVED_FAULTS         2   // No frames, the fault was retried
+#define STAT_MODIFIED_RESCUES       3   // Soft faults on a page still waiting for the writer
+#define STAT_STANDBY_RESCUES        4   // Soft faults on a page already written out
+#define STAT_PAGES_ACTIVATED        5
+#define STAT_PAGES_TRIMMED          6
+#define STAT_PAGES_WRITTEN          7
+#define STAT_PAGES_REPURPOSED       8   // Taken off standby for another page
+#define STAT_LARGE_FAULTS           9   // Demand zero faults that mapped a whole large frame
+#define STAT_LARGE_PROMOTIONS       10  // Full regions copied into a large frame
+#define STAT_LARGE_DEMOTIONS        11  // Large pages split back into small ones
+#define STAT_LOCAL_FAULTS           12  // Faults that mapped a frame on the faulting thread's node
+#define STAT_REMOTE_FAULTS          13  // And on another node
+#define STAT_SHARED_FAULTS          14  // Faults that gave a snapshot-shared PTE a page of its own
+#define STAT_SHARED_COPIES          15  // Of them, the ones that had to copy the page
+#define STAT_SNAPSHOT_PAGES         16  // Pages shared by taking snapshots
+
+//
+// Gauges - pages by PFN status.  Every status change adds one to the new
+// status and takes one from the old, so summed across the shards they are
+// the size of each list (pages on their way between lists count where they
+// came from until they arrive).
+//
+#define STAT_FREE_PAGES             17
+#define STAT_ACTIVE_PAGES           18
+#define STAT_MODIFIED_PAGES         19
+#define STAT_STANDBY_PAGES          20
+#define STAT_READING_PAGES          21  // Being read in for a fault
+#define STAT_LARGE_FREE_PAGES       22  // In free large frames, on no list
+
+#define STAT_COUNTERS               23
+
+#define STATS_CACHE_LINE            64
+
+// Instances a thread keeps its shards cached for
+#define STATS_THREAD_CACHE          4
+
+#define DEFAULT_STATS_INTERVAL_MS   1000
+
+//
+// One thread's counters for one instance.  Only that thread writes them,
+// so bumping one is a plain add on a cache line nobody else writes to.
+//
+typedef struct _statsShard {
+    volatile LONG64 values[STAT_COUNTERS];
+    struct _statsShard* next;
+    UCHAR pad[STATS_CACHE_LINE - (STAT_COUNTERS * sizeof(LONG64) + sizeof(PVOID)) % STATS_CACHE_LINE];
+} statsShard;
+
+typedef struct {
+    ULONG64 elapsedMs;              // Since the instance was created
+    LONG64 values[STAT_COUNTERS];
+    LONG64 freeDiskSlots;
+
+    //
+    // The miss ratio curve so far, at multiples of the pool, and roughly
+    // how many references it is built from
+    //
+    ULONG64 mrcReferences;
+    mrcPoint mrc[MRC_POINTS];
+} statsSnapshot;
+
+//
+// What the sampler publishes in a named section so another process can
+// watch a running instance - see statsPageName.  The sequence is odd while
+// the snapshot is being rewritten, readers copy it out and retry if the
+// sequence was odd or moved underneath them.
+//
+#define STATS_PAGE_MAGIC            0x54534D56  // 'VMST'
+#define STATS_PAGE_VERSION          2
+
+typedef struct {
+    ULONG magic;
+    ULONG version;
+    ULONG counters;                 // STAT_COUNTERS of the writer
+    ULONG intervalMs;
+    volatile LONG64 sequence;
+    statsSnapshot snapshot;
+} statsPage;
+
+typedef struct {
+    LONG id;                        // Never reused, keys the per thread shard cache
+    statsShard* volatile shards;
+    ULONG64 startMs;
+
+    //
+    // Sampler, only run when intervalMs is nonzero
+    //
+    ULONG intervalMs;
+    FILE* out;                      // Rows go here, NULL for none
+    BOOL csv;                       // Otherwise one JSON object per line
+    HANDLE section;
+    statsPage* page;
+    char pageName[64];
+} vmStats;
+
+//
+// Function declarations
+//
+BOOL statsInitialize(vmStats* stats, ULONG intervalMs, const char* path);
+VOID statsDestroy(vmStats* stats);
+VOID statsAdd(vmStats* stats, ULONG counter, LONG64 delta);
+LONG64 statsRead(vmStats* stats, ULONG counter);
+VOID statsSample(vmStats* stats, statsSnapshot* snapshot);
+VOID statsPublish(vmStats* stats, const statsSnapshot* snapshot);
+VOID statsWriteRow(vmStats* stats, const statsSnapshot* snapshot);
+const char* statsName(ULONG counter);
+VOID threadStats(LPVOID lpParameter);
+
+#endif // STATS_H
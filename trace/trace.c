@@ -0,0 +1,176 @@
+//
+// trace.c
+// Static tracepoints with Chrome trace export
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+#include "trace.h"
+
+volatile BOOL traceEnabled;
+
+static __declspec(thread) traceBuffer* current;
+
+// The track the thread's events go on, see TRACE_FIBER_TRACKS
+static __declspec(thread) USHORT currentTrack;
+
+static traceBuffer* volatile traceBuffers;
+
+static LONG64 traceStartTicks;
+
+static traceBuffer* currentBuffer(VOID) {
+    traceBuffer* buffer = current;
+
+    if (buffer != NULL) {
+        return buffer;
+    }
+
+    buffer = calloc(1, sizeof(traceBuffer));
+    if (buffer == NULL) {
+        return NULL;
+    }
+    buffer->threadId = GetCurrentThreadId();
+
+    // Push onto the list of buffers for the export, without a lock
+    do {
+        buffer->next = traceBuffers;
+    } while (InterlockedCompareExchangePointer((PVOID volatile*) &traceBuffers, buffer, buffer->next) != buffer->next);
+
+    current = buffer;
+    return buffer;
+}
+
+VOID traceStart(VOID) {
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+    traceStartTicks = now.QuadPart;
+    traceEnabled = TRUE;
+}
+
+VOID traceStop(VOID) {
+    traceEnabled = FALSE;
+}
+
+VOID traceRecord(const char* name, char phase, const char* argName, ULONG64 arg) {
+    LARGE_INTEGER now;
+    traceBuffer* buffer = currentBuffer();
+
+    if (buffer == NULL) {
+        return;
+    }
+
+    //
+    // Keep the start of the run rather than wrapping - a ring would leave
+    // end events behind whose begin was overwritten.
+    //
+
+    if (buffer->count == TRACE_BUFFER_EVENTS) {
+        buffer->dropped++;
+        return;
+    }
+
+    QueryPerformanceCounter(&now);
+
+    traceEvent* event = &buffer->events[buffer->count];
+    event->name = name;
+    event->argName = argName;
+    event->arg = arg;
+    event->timestamp = now.QuadPart;
+    event->track = currentTrack;
+    event->phase = phase;
+
+    buffer->count++;
+}
+
+//
+// Called by the fiber pool as it switches to a fiber, with its index + 1,
+// and with 0 once it is back on the thread's own fiber.  Set whether or
+// not tracing is on, so a trace started mid-run still lands on the right
+// track.
+//
+VOID traceFiber(ULONG track) {
+    currentTrack = (USHORT) track;
+}
+
+VOID traceThreadName(const char* name, ULONG index) {
+    traceBuffer* buffer = currentBuffer();
+
+    if (buffer != NULL) {
+        buffer->threadName = name;
+        buffer->threadIndex = index;
+    }
+}
+
+//
+// Write everything recorded so far in the Chrome trace event format, which
+// chrome://tracing and Perfetto (ui.perfetto.dev) both open.  Call it once
+// the threads being traced are done.
+//
+BOOL traceWriteChrome(const char* path) {
+    LARGE_INTEGER frequency;
+    DWORD pid = GetCurrentProcessId();
+    BOOL first = TRUE;
+    ULONG64 dropped = 0;
+
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+        return FALSE;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    double us = 1e6 / frequency.QuadPart;
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    for (traceBuffer* buffer = traceBuffers; buffer != NULL; buffer = buffer->next) {
+        ULONG64 tid = (ULONG64) buffer->threadId * TRACE_FIBER_TRACKS;
+        BOOL named[TRACE_FIBER_TRACKS] = { 0 };
+
+        for (ULONG64 e = 0; e < buffer->count; e++) {
+            traceEvent* event = &buffer->events[e];
+
+            // Name each track the first time it shows up
+            if (buffer->threadName != NULL && named[event->track] == FALSE) {
+                fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%llu,\"args\":{\"name\":\"%s %u",
+                        first ? "" : ",\n",
+                        pid,
+                        tid + event->track,
+                        buffer->threadName,
+                        buffer->threadIndex);
+                if (event->track != 0) {
+                    fprintf(out, " fiber %u", event->track - 1);
+                }
+                fprintf(out, "\"}}");
+                named[event->track] = TRUE;
+                first = FALSE;
+            }
+
+            fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%u,\"tid\":%llu",
+                    first ? "" : ",\n",
+                    event->name,
+                    event->phase,
+                    (LONG64) (event->timestamp - traceStartTicks) * us,
+                    pid,
+                    tid + event->track);
+            if (event->phase == 'i') {
+                fprintf(out, ",\"s\":\"t\"");
+            }
+            if (event->argName != NULL) {
+                fprintf(out, ",\"args\":{\"%s\":%llu}", event->argName, event->arg);
+            }
+            fprintf(out, "}");
+            first = FALSE;
+        }
+        dropped += buffer->dropped;
+    }
+
+    fprintf(out, "\n]}\n");
+    fclose(out);
+
+    if (dropped != 0) {
+        printf ("traceWriteChrome : %llu events did not fit in the per thread buffers\n", dropped);
+    }
+    return TRUE;
+}
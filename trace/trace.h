@@ -0,0 +1,88 @@
+//
+// trace.h
+// Static tracepoints with Chrome trace export
+//
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <windows.h>
+
+//
+// Tracepoints on the paging pipeline - faults, rescues, trim and write
+// batches, prefetches and the waits between them.  With VM_TRACE 0 they
+// compile to nothing; otherwise they cost a single test of traceEnabled
+// until traceStart is called.
+//
+#ifndef VM_TRACE
+#define VM_TRACE                    1
+#endif
+
+// Events kept per thread, anything past that is counted and dropped
+#define TRACE_BUFFER_EVENTS         (64 * 1024)
+
+//
+// Fibers interleave their faults on one thread, and begin/end pairs only
+// nest within a track, so each fiber's events go on a track of its own.
+// A thread's tracks are tids threadId * TRACE_FIBER_TRACKS onwards - the
+// thread itself first, then fiber n at n + 1.
+//
+#define TRACE_FIBER_TRACKS          2048
+
+typedef struct {
+    const char* name;
+    const char* argName;            // NULL when the event has no argument
+    ULONG64 arg;
+    ULONG64 timestamp;              // Performance counter ticks
+    USHORT track;                   // 0 for the thread, the fiber's index + 1 on a fiber
+    char phase;                     // Chrome trace phase - 'B'egin, 'E'nd or 'i'nstant
+} traceEvent;
+
+//
+// One per thread that recorded anything, only written by that thread
+//
+typedef struct _traceBuffer {
+    struct _traceBuffer* next;
+    DWORD threadId;
+    const char* threadName;
+    ULONG threadIndex;
+    ULONG64 count;
+    ULONG64 dropped;
+    traceEvent events[TRACE_BUFFER_EVENTS];
+} traceBuffer;
+
+extern volatile BOOL traceEnabled;
+
+#if VM_TRACE
+
+#define TRACE_BEGIN(name) \
+    do { if (traceEnabled) traceRecord((name), 'B', NULL, 0); } while (0)
+#define TRACE_END(name, argName, arg) \
+    do { if (traceEnabled) traceRecord((name), 'E', (argName), (arg)); } while (0)
+#define TRACE_INSTANT(name, argName, arg) \
+    do { if (traceEnabled) traceRecord((name), 'i', (argName), (arg)); } while (0)
+#define TRACE_THREAD_NAME(name, index) \
+    do { if (traceEnabled) traceThreadName((name), (index)); } while (0)
+#define TRACE_FIBER(track)                  traceFiber(track)
+
+#else
+
+#define TRACE_BEGIN(name)                   ((VOID) 0)
+#define TRACE_END(name, argName, arg)       ((VOID) 0)
+#define TRACE_INSTANT(name, argName, arg)   ((VOID) 0)
+#define TRACE_THREAD_NAME(name, index)      ((VOID) 0)
+#define TRACE_FIBER(track)                  ((VOID) 0)
+
+#endif
+
+//
+// Function declarations
+//
+VOID traceStart(VOID);
+VOID traceStop(VOID);
+VOID traceRecord(const char* name, char phase, const char* argName, ULONG64 arg);
+VOID traceThreadName(const char* name, ULONG index);
+VOID traceFiber(ULONG track);
+BOOL traceWriteChrome(const char* path);
+
+#endif // TRACE_H
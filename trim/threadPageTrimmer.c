@@ -8,96 +8,296 @@
 #include "../util/util.h"
 #include "../pt/pt.h"
 #include "../list/list.h"
+#include "../trace/trace.h"
 #include "trim.h"
 #include "../vm/vm.h"
-
-HANDLE eventStartTrim; // these need to be initialized already
-HANDLE eventSystemStart;
-HANDLE eventSystemShutdown;
+#include "../platform/platform.h"
+#include "../diskWrite/diskWrite.h"
+#include "../large/large.h"
 
 // user thread sets trim event, wait on WaitingForPagesEvent--> wakes up trimmer, trimmer does work, trimmer sets mod write event
 // --> mod writer wakes up, does work, sets waiting for pages event --> user thread wakes up
 
+//
+// Candidates are sorted by the advice on their range : sequential pages were
+// most likely consumed already so they go first, random ones go last.  The
+// scan ends as soon as it has a batch of non-random candidates, but will look
+// a few batches ahead before it settles for random ones.
+//
+#define TIER_SEQUENTIAL             0
+#define TIER_NORMAL                 1
+#define TIER_RANDOM                 2
+#define TIERS                       3
 
-void threadPageTrimmer(LPVOID lpParameter) {
+#define SCAN_WINDOW_BATCHES         8
 
-    // initialize whatever datastructures the thread needs
+//
+// Where each tier lands on standby once the writer is done with it
+//
+static const ULONG tierPriority[TIERS] = {
+    STANDBY_PRIORITY_SEQUENTIAL,
+    STANDBY_PRIORITY_NORMAL,
+    STANDBY_PRIORITY_NORMAL
+};
+
+static ULONG tierOf(vad* range) {
+    if (range->advice == VAD_ADVICE_SEQUENTIAL) {
+        return TIER_SEQUENTIAL;
+    }
+    if (range->advice == VAD_ADVICE_RANDOM) {
+        return TIER_RANDOM;
+    }
+    return TIER_NORMAL;
+}
 
-    pfn* pages[BATCH_SIZE];
-    PVOID batch[BATCH_SIZE];
+//
+// Fault rates are smoothed over samples at least this far apart
+//
+#define FAULT_SAMPLE_MS             10
+
+static VOID sampleFaultRates(vmInstance* vm, ULONG64* lastSample) {
+    ULONG64 now = vm->platform->tickCount(vm);
+    ULONG64 elapsed = now - *lastSample;
 
-    ULONG64 totalPtes = VIRTUAL_ADDRESS_SIZE / PAGE_SIZE;
+    if (elapsed < FAULT_SAMPLE_MS) {
+        return;
+    }
 
-    // no shutdown waiting, most basic (EITHER have this, or the WaitForMultipleObjects, not both!)
-    WaitForSingleObject(eventSystemStart, INFINITE);
+    for (ULONG s = 0; s < MAX_ADDRESS_SPACES; s++) {
+        addressSpace* space = vm->spaces[s];
+        if (space == NULL) {
+            continue;
+        }
 
-    // allows for clean shutdown of thread at the end of simulation
-    HANDLE events[2];
-    events[0] = eventStartTrim;
-    events[1] = eventSystemShutdown;
+        LONG64 faults = space->faults;
+        ULONG64 rate = (ULONG64) (faults - space->faultsAtLastSample) * 1000 / elapsed;
+        space->faultsAtLastSample = faults;
+        space->faultRate = (space->faultRate * 3 + rate) / 4;
+    }
 
-    while (TRUE) {
+    *lastSample = now;
+}
 
-        if (WaitForMultipleObjects(2, events, FALSE, INFINITE) == 1) {
-            // shutdown, free datastructures, return (killing the thread)
-            return;
+//
+// Pick the space to take the next batch from.  Anything over its maximum
+// goes first.  Otherwise take from whoever holds the most pages above its
+// minimum relative to how hard it is faulting, so a space that is thrashing
+// keeps its pages and one sitting on an idle working set gives them up.
+// Only when everyone is at their minimum does the largest working set pay.
+//
+// Called with lockPTE held, which keeps the space array stable.
+//
+static addressSpace* pickVictim(vmInstance* vm) {
+    addressSpace* over = NULL;
+    addressSpace* idle = NULL;
+    addressSpace* largest = NULL;
+    ULONG64 worstExcess = 0;
+    ULONG64 worstScore = 0;
+
+    for (ULONG s = 0; s < MAX_ADDRESS_SPACES; s++) {
+        addressSpace* space = vm->spaces[s];
+        if (space == NULL || space->activeCount <= 0) {
+            continue;
+        }
+
+        ULONG64 active = (ULONG64) space->activeCount;
+
+        if (active > space->wsMaximum && active - space->wsMaximum > worstExcess) {
+            worstExcess = active - space->wsMaximum;
+            over = space;
+        }
+
+        if (active > space->wsMinimum) {
+            ULONG64 score = ((active - space->wsMinimum) << 10) / (1 + space->faultRate);
+            if (idle == NULL || score > worstScore) {
+                worstScore = score;
+                idle = space;
+            }
+        }
+
+        if (largest == NULL || space->activeCount > largest->activeCount) {
+            largest = space;
         }
+    }
+
+    if (over) {
+        return over;
+    }
+    return idle ? idle : largest;
+}
+
+
+BOOL trimmerInitialize(trimmer* trim, vmInstance* vm) {
+    ULONG64 batchSize = vm->config.trimBatchSize;
+
+    trim->vm = vm;
+    trim->pages = malloc(batchSize * sizeof(pfn*));
+    trim->batch = malloc(batchSize * sizeof(PVOID));
+    trim->tierPages = malloc(TIERS * batchSize * sizeof(pfn*));
+    trim->tierVas = malloc(TIERS * batchSize * sizeof(PVOID));
+    trim->lastSample = vm->platform->tickCount(vm);
 
+    return trim->pages && trim->batch && trim->tierPages && trim->tierVas;
+}
+
+VOID trimmerFree(trimmer* trim) {
+    free(trim->pages);
+    free(trim->batch);
+    free(trim->tierPages);
+    free(trim->tierVas);
+}
 
-        // do your work
+//
+// Take one batch of active pages from the victim space and put them on the
+// modified list.  Returns how many pages it trimmed.
+//
+ULONG64 trimBatch(vmInstance* vm, trimmer* trim) {
+    ULONG64 batchSize = vm->config.trimBatchSize;
+
+    TRACE_BEGIN("trimBatch");
+    acquireLockPTE(vm, NULL, TRIMMER);
+
+    sampleFaultRates(vm, &trim->lastSample);
+
+    addressSpace* space = pickVictim(vm);
+    if (space == NULL) {
+        // Nothing resident anywhere, but the writer may still have work
+        releaseLock(&vm->lockPTE, TRIMMER);
+        TRACE_END("trimBatch", "pages", 0);
+        return 0;
+    }
 
-        acquireLockPTE(NULL, TRIMMER);
+    ULONG64 totalPtes = space->numPtes;
+    ULONG64 scanIndex = space->trimIndex;  // Remember where we left off
 
-        int i = 0;
-        ULONG64 scanIndex = 0;  // Remember where we left off
-        ULONG64 ptesScanned = 0;
+    ULONG64 i = 0;
+    ULONG64 ptesScanned = 0;
+    ULONG64 candidates = 0;
+    ULONG64 tierCount[TIERS] = { 0 };
+    vad* range = NULL;
+    ULONG64 largeSkipped = totalPtes;  // First large page passed over, if any
 
-        // Scan from where we left off last time
-        while (i < BATCH_SIZE && ptesScanned < totalPtes) {
-            pte* currentPte = &ptes[scanIndex];
+    // Scan from where we left off last time
+    while (tierCount[TIER_SEQUENTIAL] + tierCount[TIER_NORMAL] < batchSize && ptesScanned < totalPtes &&
+           (candidates < batchSize || ptesScanned < SCAN_WINDOW_BATCHES * batchSize)) {
+        pte* currentPte = &space->ptes[scanIndex];
 
+        // Large pages are passed over a whole region at a time
+        if (currentPte->valid.valid == VALID && currentPte->large.large) {
+            ULONG64 regionEnd = (scanIndex | (LARGE_PAGE_PAGES - 1)) + 1;
+
+            if (largeSkipped == totalPtes) {
+                largeSkipped = scanIndex & ~((ULONG64) LARGE_PAGE_PAGES - 1);
+            }
+            ptesScanned += regionEnd - 1 - scanIndex;
+            scanIndex = regionEnd - 1;
+        } else if (currentPte->valid.valid == VALID) {
             // Only process valid pages that are mapped to physical memory
-            if (currentPte->valid.valid == VALID) {
-                pfn* page = frameNumber2pfn(currentPte->valid.frameNumber);
-
-                ASSERT(page->status == ACTIVE);
-                ASSERT(page->pte == currentPte);
-                // Check if this page is active and can be trimmed
-                pages[i] = page;
-                batch[i] = pte2va(currentPte);
-                i++;
+            pfn* page = frameNumber2pfn(vm, currentPte->valid.frameNumber);
+
+            ASSERT(page->status == ACTIVE);
+            ASSERT(pfnPte(vm, page) == currentPte);
+
+            // Ranges are long, only go back to the tree when we leave one
+            if (range == NULL || scanIndex < range->startPage || scanIndex >= range->endPage) {
+                range = vadFind(space->vadRoot, scanIndex);
+                ASSERT(range);
             }
 
-            // Move to next page, wrap around if needed
-            scanIndex = (scanIndex + 1) % totalPtes;
-            ptesScanned++;
+            ULONG tier = tierOf(range);
+            if (tierCount[tier] < batchSize) {
+                trim->tierPages[tier * batchSize + tierCount[tier]] = page;
+                trim->tierVas[tier * batchSize + tierCount[tier]] = pte2va(space, currentPte);
+                tierCount[tier]++;
+                candidates++;
+            }
         }
 
-        if (i != 0) {
-            BOOL b = MapUserPhysicalPagesScatter(batch, i, NULL);
-            ASSERT(b);
+        // Move to next page, wrap around if needed (no divide on the scan path)
+        if (++scanIndex == totalPtes) {
+            scanIndex = 0;
         }
-
-        acquireLock(&lockModifiedList, TRIMMER);
-        for (int j = 0; j < i; j++) {
-            pages[j]->pte->transition.invalid = INVALID;
-            InterlockedDecrement64(&activeCount);
-            pages[j]->pte->transition.transition = TRANSITION;
-            pages[j]->status = MODIFIED;
-            linkAdd(pages[j], &headModifiedList);
+        ptesScanned++;
+
+        //
+        // Large pages are only split once there is nothing else to trim -
+        // then the first one passed over is, and its region scanned again
+        //
+        if (ptesScanned >= totalPtes && candidates < batchSize && largeSkipped != totalPtes) {
+            largeDemote(space, &space->ptes[largeSkipped]);
+            scanIndex = largeSkipped;
+            ptesScanned = totalPtes - LARGE_PAGE_PAGES;
+            largeSkipped = totalPtes;
+        }
+    }
+    space->trimIndex = scanIndex;
+
+    // Best tier first, whatever is left over stays active until next time
+    for (ULONG tier = 0; tier < TIERS; tier++) {
+        for (ULONG64 j = 0; j < tierCount[tier] && i < batchSize; j++) {
+            trim->pages[i] = trim->tierPages[tier * batchSize + j];
+            trim->pages[i]->priority = tierPriority[tier];
+            trim->batch[i] = trim->tierVas[tier * batchSize + j];
+            i++;
         }
-        releaseLock(&lockModifiedList, TRIMMER);
-        releaseLock(&lockPTE, TRIMMER);
+    }
 
+    if (i != 0) {
+        BOOL b = vm->platform->mapScatter(vm, trim->batch, i, NULL);
+        ASSERT(b);
+    }
 
-        // signal whoever is waiting on your work, if applicable
-        SetEvent(eventStartDiskWrite); // might be the trimmer setting the mod writer event, or the mod writer setting the waiting-for-pages event for the users
+    acquireLock(&vm->lockModifiedList, TRIMMER);
+    for (ULONG64 j = 0; j < i; j++) {
+        pte* x = pfnPte(vm, trim->pages[j]);
 
+        x->transition.invalid = INVALID;
+        InterlockedDecrement64(&space->activeCount);
+        largeResident(space, x, -1);
+        x->transition.transition = TRANSITION;
+        trim->pages[j]->status = MODIFIED;
+        linkAdd(vm, trim->pages[j], &vm->headModifiedList);
     }
+    releaseLock(&vm->lockModifiedList, TRIMMER);
+
+    // Every page in the batch was active, so the gauges move all at once
+    statsAdd(&vm->stats, STAT_ACTIVE_PAGES, -(LONG64) i);
+    statsAdd(&vm->stats, STAT_MODIFIED_PAGES, i);
+    statsAdd(&vm->stats, STAT_PAGES_TRIMMED, i);
+    releaseLock(&vm->lockPTE, TRIMMER);
+    TRACE_END("trimBatch", "pages", i);
+
+    return i;
+}
+
+//
+// One batch per signal, then it is the writer's turn
+//
+static VOID trimTask(task* work) {
+    trimmer* trim = (trimmer*) work->context;
+    vmInstance* vm = trim->vm;
+
+    trimBatch(vm, trim);
+
+    // signal whoever is waiting on your work, if applicable
+    writersSignal(vm);
+}
+
+VOID trimmerStart(vmInstance* vm) {
+    trimmer* trim = malloc(sizeof(trimmer));
+
+    BOOL b = trim != NULL && trimmerInitialize(trim, vm);
+    ASSERT(b);
+
+    taskInitialize(&vm->taskTrim, "trim", trimTask, trim, TASK_PRIORITY_HIGH, TASK_ANY_WORKER);
+}
+
+// Only once the workers are gone
+VOID trimmerStop(vmInstance* vm) {
+    trimmer* trim = (trimmer*) vm->taskTrim.context;
 
-    // We want the thread to run forever, so we should not exit the while loop
-    DebugBreak();
-    return;
+    trimmerFree(trim);
+    free(trim);
 }
 
 /*
@@ -5,6 +5,25 @@
 #ifndef TRIM_H
 #define TRIM_H
 
-VOID threadPageTrimmer(LPVOID lpParameter);
+#include <windows.h>
+#include "../vm/vm.h"
+
+//
+// Scratch space for building trim batches, one per thread that trims
+//
+typedef struct {
+    vmInstance* vm;
+    pfn** pages;
+    PVOID* batch;
+    pfn** tierPages;
+    PVOID* tierVas;
+    ULONG64 lastSample;             // When fault rates were last sampled
+} trimmer;
+
+BOOL trimmerInitialize(trimmer* trim, vmInstance* vm);
+VOID trimmerFree(trimmer* trim);
+ULONG64 trimBatch(vmInstance* vm, trimmer* trim);
+VOID trimmerStart(vmInstance* vm);
+VOID trimmerStop(vmInstance* vm);
 
 #endif //TRIM_H
@@ -4,9 +4,10 @@
 #include "user.h"
 #include "../pt/pt.h"
 #include "../vm/vm.h"
+#include "../util/util.h"
+#include "../trace/trace.h"
+#include "../latency/latency.h"
 
-HANDLE eventSystemStart; // these need to be initialized already
-HANDLE eventSystemShutdown;
 // user thread sets trim event, wait on WaitingForPagesEvent--> wakes up trimmer, trimmer does work, trimmer sets mod write event
 // --> mod writer wakes up, does work, sets waiting for pages event --> user thread wakes up
 
@@ -15,37 +16,59 @@ VOID threadUser(LPVOID lpParameter) {
 
     // initialize whatever datastructures the thread needs
 
-    PULONG_PTR arbitrary_va = vaStart;
+    threadInfo* info = (threadInfo *) lpParameter;
+    vmInstance* vm = info->vm;
+    addressSpace* space = info->space;
 
-    BOOL redo = FALSE;
-    BOOL trySameAddress = FALSE;
+    volatile ULONG_PTR* arbitrary_va = space->vaStart;
 
-    // no shutdown waiting, most basic (EITHER have this, or the WaitForMultipleObjects, not both!)
-    WaitForSingleObject(eventSystemStart, INFINITE);
+    TRACE_THREAD_NAME("user", info->index);
 
-    // allows for clean shutdown of thread at the end of simulation
-    HANDLE events[2];
-    events[0] = eventStartUser;
-    events[1] = eventSystemShutdown;
+    BOOL redo = FALSE;
+    BOOL trySameAddress = FALSE;
+    BOOL write = TRUE;
+    ULONG64 offset;
+    ULONG64 delay;
+    ULONG64 due = latencyNow();
 
     while (TRUE) {
 
-        for (int i = 0; i < MB(1); i += 1) {
+        //
+        // A replayed thread runs until its stream ends, everyone else for
+        // the configured number of accesses
+        //
+
+        for (ULONG64 i = 0; info->reader != NULL || i < vm->config.accessesPerThread; i += 1) {
 
             BOOL page_faulted = FALSE;
 
             if (!trySameAddress) {
-                unsigned random_number = (unsigned) (ReadTimeStampCounter() >> 4);
-                random_number %= VIRTUAL_ADDRESS_SIZE_IN_UNSIGNED_CHUNKS;
-
-                random_number &= ~0x7;
-                arbitrary_va = vaStart + random_number;
+                if (info->reader != NULL) {
+                    if (accessReplayNext(info->reader, &offset, &write, &delay) == FALSE) {
+                        break;
+                    }
+                    if (vm->config.replayPaced) {
+                        due += delay;
+                        while (latencyNow() < due) {
+                            YieldProcessor();
+                        }
+                    }
+                } else {
+                    offset = workloadNext(info->stream, &write);
+                }
+                if (info->recorder != NULL) {
+                    accessRecord(info->recorder, offset, write);
+                }
+                arbitrary_va = (volatile ULONG_PTR*) ((ULONG_PTR) space->vaStart + offset);
             }
 
             __try {
 
-                *arbitrary_va = (ULONG_PTR) arbitrary_va;
-                // printf("noah");
+                if (write) {
+                    *arbitrary_va = (ULONG_PTR) arbitrary_va;
+                } else {
+                    (VOID) *arbitrary_va;
+                }
 
             } __except (EXCEPTION_EXECUTE_HANDLER) {
 
@@ -54,8 +77,11 @@ VOID threadUser(LPVOID lpParameter) {
 
             if (page_faulted) {
                 do {
-                    redo = pageFaultHandler(arbitrary_va, (threadInfo *) lpParameter);
-                } while (redo);
+                    redo = pageFaultHandler(space, (PVOID) arbitrary_va, info);
+                } while (redo == REDO);
+
+                // vmRun committed the whole VA so every fault has to resolve
+                ASSERT(redo == SUCCESS);
 
                 trySameAddress = TRUE;
 
@@ -89,6 +115,18 @@ VOID threadUser(LPVOID lpParameter) {
     }
 }
 
+//
+// The fibers park on their reads and run the read task themselves when
+// every one of them is waiting
+//
+VOID threadUserFibers(LPVOID lpParameter) {
+    userFibers* group = (userFibers*) lpParameter;
+    vmInstance* vm = group->info[0]->vm;
+
+    BOOL b = fiberPoolRun(&group->pool, group->count, threadUser, (PVOID*) group->info, &vm->sched);
+    ASSERT(b);
+}
+
 /*
 // User thread needs to wait for pages!
 
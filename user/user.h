@@ -5,6 +5,20 @@
 #ifndef USER_H
 #define USER_H
 
+#include <windows.h>
+#include "../vm/vm.h"
+#include "../fiber/fiber.h"
+
+//
+// A vmRun thread that runs several users' accesses, one fiber each
+//
+typedef struct {
+    threadInfo** info;
+    ULONG count;
+    fiberPool pool;
+} userFibers;
+
 VOID threadUser(LPVOID lpParameter);
+VOID threadUserFibers(LPVOID lpParameter);
 
 #endif //USER_H
\ No newline at end of file
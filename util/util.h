@@ -7,10 +7,12 @@
 
 #include <windows.h>
 #include "../vm/vm.h"
+#include "../lockprof/lockprof.h"
 
 #define USER 1
 #define WRITER 2
 #define TRIMMER 3
+#define WORKER 4
 
 #define DBG 1
 #if DBG
@@ -19,41 +21,15 @@
 #define ASSERT(x)
 #endif
 
-#define BUFFER_SIZE 100
-#define MAX_STACK_DEPTH 10
-
-typedef enum {
-    LOCK_ACQUIRE,
-    LOCK_RELEASE
-} lock_event_type_t;
-
-typedef struct {
-    lock_event_type_t type;
-    int typeOfThread;
-    DWORD timestamp;
-    void* lock_addr;
-    void* stack[MAX_STACK_DEPTH];
-    int stack_size;
-} lock_event_t;
-
-typedef struct {
-    lock_event_t events[BUFFER_SIZE];
-    int head;
-    int count;
-} lock_debug_buffer_t;
-
-// Global debug buffer
-extern lock_debug_buffer_t g_lock_debug_buffer;
-
-// Log a lock event
-void log_lock_event(lock_event_type_t type, void* lock_addr, int typeOfThread);
+//
+// Every acquire is charged to the file and line it was made from
+//
+#define acquireLock(lock, typeOfThread)         acquireLockAt((lock), (typeOfThread), __FILE__, __LINE__)
+#define acquireLockPTE(vm, x, typeOfThread)     acquireLockAt(&(vm)->lockPTE, (typeOfThread), __FILE__, __LINE__)
+#define releaseLockPTE(vm, x, typeOfThread)     releaseLock(&(vm)->lockPTE, (typeOfThread))
 
-void acquireLock(CRITICAL_SECTION* lock, int typeOfThread);
+void acquireLockAt(CRITICAL_SECTION* lock, int typeOfThread, const char* file, ULONG line);
 
 void releaseLock(CRITICAL_SECTION* lock, int typeOfThread);
 
-void acquireLockPTE(pte* x, int typeOfThread);
-
-void releaseLockPTE(pte* x, int typeOfThread);
-
 #endif //UTIL_H
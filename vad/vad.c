@@ -0,0 +1,218 @@
+//
+// vad.c
+// Virtual address descriptor (VAD) tree implementation
+//
+
+#include <stdlib.h>
+#include <windows.h>
+#include "../util/util.h"
+#include "vad.h"
+
+static LONG height(vad* node) {
+    return node ? node->height : 0;
+}
+
+static VOID update(vad* node) {
+    node->height = 1 + max(height(node->left), height(node->right));
+
+    node->maxEnd = node->endPage;
+    if (node->left && node->left->maxEnd > node->maxEnd) {
+        node->maxEnd = node->left->maxEnd;
+    }
+    if (node->right && node->right->maxEnd > node->maxEnd) {
+        node->maxEnd = node->right->maxEnd;
+    }
+}
+
+static vad* rotateRight(vad* node) {
+    vad* pivot = node->left;
+    node->left = pivot->right;
+    pivot->right = node;
+    update(node);
+    update(pivot);
+    return pivot;
+}
+
+static vad* rotateLeft(vad* node) {
+    vad* pivot = node->right;
+    node->right = pivot->left;
+    pivot->left = node;
+    update(node);
+    update(pivot);
+    return pivot;
+}
+
+static vad* rebalance(vad* node) {
+    update(node);
+
+    LONG balance = height(node->left) - height(node->right);
+
+    if (balance > 1) {
+        if (height(node->left->left) < height(node->left->right)) {
+            node->left = rotateLeft(node->left);
+        }
+        return rotateRight(node);
+    }
+
+    if (balance < -1) {
+        if (height(node->right->right) < height(node->right->left)) {
+            node->right = rotateRight(node->right);
+        }
+        return rotateLeft(node);
+    }
+
+    return node;
+}
+
+static vad* insertNode(vad* root, vad* node) {
+    if (root == NULL) {
+        return node;
+    }
+
+    // Ranges never overlap so the start page alone orders them
+    ASSERT(node->startPage != root->startPage);
+    if (node->startPage < root->startPage) {
+        root->left = insertNode(root->left, node);
+    } else {
+        root->right = insertNode(root->right, node);
+    }
+    return rebalance(root);
+}
+
+static vad* removeMin(vad* root, vad** min) {
+    if (root->left == NULL) {
+        *min = root;
+        return root->right;
+    }
+    root->left = removeMin(root->left, min);
+    return rebalance(root);
+}
+
+static vad* removeNode(vad* root, vad* node) {
+    ASSERT(root);
+
+    if (node->startPage < root->startPage) {
+        root->left = removeNode(root->left, node);
+    } else if (node->startPage > root->startPage) {
+        root->right = removeNode(root->right, node);
+    } else {
+        ASSERT(root == node);
+
+        if (root->right == NULL) {
+            return root->left;
+        }
+
+        vad* successor;
+        vad* right = removeMin(root->right, &successor);
+        successor->left = root->left;
+        successor->right = right;
+        return rebalance(successor);
+    }
+    return rebalance(root);
+}
+
+VOID vadInsert(vad** root, vad* node) {
+    node->left = NULL;
+    node->right = NULL;
+    node->height = 1;
+    node->maxEnd = node->endPage;
+    *root = insertNode(*root, node);
+}
+
+VOID vadRemove(vad** root, vad* node) {
+    *root = removeNode(*root, node);
+}
+
+vad* vadFind(vad* root, ULONG64 page) {
+    while (root) {
+        if (page < root->startPage) {
+            root = root->left;
+        } else if (page >= root->endPage) {
+            root = root->right;
+        } else {
+            return root;
+        }
+    }
+    return NULL;
+}
+
+vad* vadFirstOverlap(vad* root, ULONG64 startPage, ULONG64 endPage) {
+    // Nothing in this subtree ends past the start of the range
+    if (root == NULL || root->maxEnd <= startPage) {
+        return NULL;
+    }
+
+    vad* found = vadFirstOverlap(root->left, startPage, endPage);
+    if (found) {
+        return found;
+    }
+
+    if (root->startPage >= endPage) {
+        return NULL;
+    }
+    if (root->endPage > startPage) {
+        return root;
+    }
+    return vadFirstOverlap(root->right, startPage, endPage);
+}
+
+vad* vadNext(vad* root, vad* node) {
+    vad* next = NULL;
+
+    while (root) {
+        if (root->startPage > node->startPage) {
+            next = root;
+            root = root->left;
+        } else {
+            root = root->right;
+        }
+    }
+    return next;
+}
+
+vad* vadSplit(vad** root, vad* node, ULONG64 page) {
+    ASSERT(page > node->startPage && page < node->endPage);
+
+    vad* tail = malloc(sizeof(vad));
+    ASSERT(tail);
+    *tail = *node;
+    tail->startPage = page;
+
+    // Shrinking the node changes the subtree maxima above it, so reinsert it
+    vadRemove(root, node);
+    node->endPage = page;
+    vadInsert(root, node);
+    vadInsert(root, tail);
+
+    return tail;
+}
+
+ULONG64 vadFindGap(vad* root, ULONG64 numPages, ULONG64 limit) {
+    ULONG64 previousEnd = 0;
+
+    for (vad* node = vadFirstOverlap(root, 0, limit); node != NULL; node = vadNext(root, node)) {
+        if (node->startPage - previousEnd >= numPages) {
+            return previousEnd;
+        }
+        previousEnd = node->endPage;
+    }
+
+    if (limit - previousEnd >= numPages) {
+        return previousEnd;
+    }
+
+    // No gap big enough - limit can never be a valid start
+    return limit;
+}
+
+VOID vadFreeAll(vad** root) {
+    vad* node = *root;
+
+    if (node == NULL) {
+        return;
+    }
+    vadFreeAll(&node->left);
+    vadFreeAll(&node->right);
+    free(node);
+    *root = NULL;
+}
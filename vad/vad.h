@@ -0,0 +1,58 @@
+//
+// vad.h
+// Virtual address descriptor (VAD) tree declarations
+//
+
+#ifndef VAD_H
+#define VAD_H
+
+#include <windows.h>
+
+#define VAD_UNCHANGED               0
+
+#define VAD_RESERVED                1
+#define VAD_COMMITTED               2
+
+//
+// Sticky access pattern hints, see vmAdvise
+//
+#define VAD_ADVICE_NORMAL           1
+#define VAD_ADVICE_SEQUENTIAL       2
+#define VAD_ADVICE_RANDOM           3
+
+//
+// One VAD describes a run of pages [startPage, endPage) that share a state
+// and access pattern advice.  A reservation starts out as a single VAD and
+// gets split as sub-ranges of it are committed, decommitted and advised, so
+// every piece remembers the page its reservation started at.  Pages are
+// indexes into the managed VA, not addresses, so the tree does not care
+// where the region was mapped.
+//
+// The tree is an AVL tree ordered by startPage and augmented with the largest
+// endPage in each subtree, which is what makes overlap queries logarithmic.
+//
+typedef struct _vad {
+    struct _vad* left;
+    struct _vad* right;
+    LONG height;
+    ULONG state;
+    ULONG advice;
+    ULONG64 startPage;
+    ULONG64 endPage;
+    ULONG64 maxEnd;
+    ULONG64 allocationBase;
+} vad;
+
+//
+// Function declarations
+//
+VOID vadInsert(vad** root, vad* node);
+VOID vadRemove(vad** root, vad* node);
+vad* vadFind(vad* root, ULONG64 page);
+vad* vadFirstOverlap(vad* root, ULONG64 startPage, ULONG64 endPage);
+vad* vadNext(vad* root, vad* node);
+vad* vadSplit(vad** root, vad* node, ULONG64 page);
+ULONG64 vadFindGap(vad* root, ULONG64 numPages, ULONG64 limit);
+VOID vadFreeAll(vad** root);
+
+#endif // VAD_H
@@ -13,6 +13,15 @@
 #include "../list/list.h"
 #include "../trim/trim.h"
 #include "../diskWrite/diskWrite.h"
+#include "../prefetch/prefetch.h"
+#include "../api/libvm.h"
+#include "../platform/platform.h"
+#include "../pool/pool.h"
+#include "../pagecopy/pagecopy.h"
+#include "../fiber/fiber.h"
+#include "../large/large.h"
+#include "../numa/numa.h"
+#include "../snap/snap.h"
 #include "vm.h"
 
 #pragma comment(lib, "advapi32.lib")
@@ -21,37 +30,10 @@
 #pragma comment(lib, "onecore.lib")
 #endif
 
-// Global variables
-pte* ptes;
-pfn* pfnStart;
-PULONG_PTR vaStart;
-PVOID transferVa;
-PVOID diskTransferVa;
-lock_debug_buffer_t g_lock_debug_buffer;
+PVOID reserveAweRegion(vmInstance* vm, ULONG64 numPages) {
 
+#if SUPPORT_MULTIPLE_VA_TO_SAME_PAGE
 
-LONG64 activeCount;
-LONG64 pagesActivated;
-
-HANDLE physical_page_handle;
-BOOL privilege;
-
-// Threads
-HANDLE threadTrim;
-HANDLE threadDiskWrite;
-HANDLE threadsUser[THREADS];
-
-// Thread info
-threadInfo info[THREADS];
-
-// Events
-HANDLE eventStartTrim;
-HANDLE eventStartDiskWrite;
-HANDLE eventRedoFault; // User threads have something to wait on while worker threads, well, work
-HANDLE eventSystemShutdown;
-HANDLE eventStartUser;
-
-VOID initializeThreads() {
     MEM_EXTENDED_PARAMETER parameter = { 0 };
 
     //
@@ -60,30 +42,56 @@ VOID initializeThreads() {
     //
 
     parameter.Type = MemExtendedParameterUserPhysicalHandle;
-    parameter.Handle = physical_page_handle;
-    for (int i = 0; i < THREADS; i++) {
-        info[i].index = i;
-        info[i].transferVa = VirtualAlloc2 (NULL,
+    parameter.Handle = vm->physical_page_handle;
+
+    return VirtualAlloc2 (NULL,
                        NULL,
-                       PAGE_SIZE,
+                       numPages * PAGE_SIZE,
                        MEM_RESERVE | MEM_PHYSICAL,
                        PAGE_READWRITE,
                        &parameter,
                        1);
 
-        threadsUser[i] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) threadUser, &info[i], 0, NULL);
+#else
+
+    return VirtualAlloc (NULL,
+                      numPages * PAGE_SIZE,
+                      MEM_RESERVE | MEM_PHYSICAL,
+                      PAGE_READWRITE);
+
+#endif
+
+}
+
+//
+// Charge the time since *since to a startup phase and start the next one
+//
+static VOID startupPhase(vmInstance* vm, ULONG phase, ULONG64* since) {
+    ULONG64 now = latencyNow();
+
+    vm->startup.us[phase] += latencyMicroseconds(now - *since);
+    *since = now;
+}
+
+VOID initializeThreads(vmInstance* vm) {
+    trimmerStart(vm);
+    writersStart(vm);
+    prefetchStart(vm);
+    readerStart(vm);
+    promoteStart(vm);
+    schedulerStart(&vm->sched, vm->config.workerThreads, vm->nodeCount);
+    if (vm->stats.intervalMs != 0) {
+        vm->threadStats = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) threadStats, vm, 0, NULL);
+    }
+    if (vm->config.poolMaximum != 0) {
+        vm->threadPool = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) threadPool, vm, 0, NULL);
     }
-    threadTrim = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) threadPageTrimmer, NULL, 0, NULL);
-    threadDiskWrite = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) threadWriteToDisk, NULL, 0, NULL);
 }
 
-VOID initializeEvents() {
-    eventStartUser = CreateEvent(NULL, AUTO, FALSE, NULL);
-    eventStartTrim = CreateEvent(NULL, AUTO, FALSE, NULL);
-    eventStartDiskWrite = CreateEvent(NULL, AUTO, FALSE, NULL);
-    eventRedoFault = CreateEvent(NULL, MANUAL, FALSE, NULL);
-    eventSystemStart = CreateEvent(NULL, MANUAL, FALSE, NULL);
-    eventSystemShutdown = CreateEvent(NULL, MANUAL, FALSE, NULL);
+VOID initializeEvents(vmInstance* vm) {
+    vm->eventRedoFault = CreateEvent(NULL, MANUAL, FALSE, NULL);
+    vm->eventSystemStart = CreateEvent(NULL, MANUAL, FALSE, NULL);
+    vm->eventSystemShutdown = CreateEvent(NULL, MANUAL, FALSE, NULL);
 }
 
 BOOL
@@ -212,118 +220,346 @@ PVOID initialize(ULONG64 numBytes) {
     return new;
 }
 
-VOID zeroAPage(ULONG64 frameNumber, threadInfo* info) {
-    BOOL b = MapUserPhysicalPages(info->transferVa, 1, &frameNumber);
-    ASSERT(b);
+//
+// Large zeroed tables come straight from the OS instead - its pages are
+// zeroed when first touched, so nothing is written up front and the parts
+// never used never cost anything
+//
+PVOID initializeLazy(ULONG64 numBytes) {
+    PVOID new;
+    new = VirtualAlloc(NULL, numBytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    ASSERT(new);
+    return new;
+}
+
+VOID freeLazy(PVOID p) {
+    if (p != NULL) {
+        VirtualFree(p, 0, MEM_RELEASE);
+    }
+}
+
+//
+// Map a frame at the next slot of the thread's transfer window and return
+// where.  Slots stay mapped after use - the frame may go on to be mapped
+// at a user VA as well, which is fine as both are the same page - until
+// the window fills up and all of it is unmapped at once.
+//
+PVOID transferMap(threadInfo* info, ULONG64 frameNumber) {
+    vmInstance* vm = info->vm;
+    BOOL b;
 
-    // Copy from mapped page to malloced disk
-    memset(info->transferVa, 0, PAGE_SIZE);
+    if (info->transferUsed == TRANSFER_WINDOW_PAGES) {
+        transferFlush(info);
+    }
 
-    b = MapUserPhysicalPages(info->transferVa, 1, NULL);
+    PVOID va = (PVOID) ((ULONG_PTR) info->transferVa + info->transferUsed * PAGE_SIZE);
+    b = vm->platform->map(vm, va, 1, (PULONG_PTR) &frameNumber);
     ASSERT(b);
+    info->transferUsed++;
+
+    return va;
 }
 
-ULONG64 getMaxFrameNumber(PULONG_PTR pages) {
-    ULONG64 maxFrameNumber = 0;
+VOID transferFlush(threadInfo* info) {
+    vmInstance* vm = info->vm;
 
-    for (int i = 0; i < NUMBER_OF_PHYSICAL_PAGES; ++i) {
-        maxFrameNumber = max(maxFrameNumber, pages[i]);
+    if (info->transferUsed != 0) {
+        BOOL b = vm->platform->map(vm, info->transferVa, info->transferUsed, NULL);
+        ASSERT(b);
+        info->transferUsed = 0;
     }
-    return maxFrameNumber;
 }
 
-VOID commitSparseArray(PULONG_PTR pages) {
-    ULONG64 max = getMaxFrameNumber(pages);
-    max += 1;
-    pfnStart = VirtualAlloc(NULL,sizeof(pfn) * max, MEM_RESERVE,PAGE_READWRITE);
-
-
-    for (int i = 0; i < NUMBER_OF_PHYSICAL_PAGES; i++) {
-        pfn* newpfn = (pfn*) (pfnStart + pages[i]);
-        // newpfn for address
-        if (PAGE_SIZE % sizeof(pfn) != 0) {
-            ULONG64 x = (ULONG64) newpfn / PAGE_SIZE;
-            ULONG64 y = ((ULONG64) newpfn + sizeof(pfn)) / PAGE_SIZE;
-            if (x != y) {
-                VirtualAlloc((PVOID) newpfn,sizeof(pfn),MEM_COMMIT,PAGE_READWRITE);
-                VirtualAlloc((PVOID) ((ULONG64) newpfn + PAGE_SIZE),sizeof(pfn),MEM_COMMIT,PAGE_READWRITE);
-            }
-        }
-        else {
-            PVOID z = VirtualAlloc((PVOID) newpfn,sizeof(pfn),MEM_COMMIT,PAGE_READWRITE);
-            ASSERT(z);
-            ULONG64 frameNumberCheck = pfn2frameNumber(newpfn);
-            ASSERT(frameNumberCheck == pages[i]);
-            pfn* pfnCheck = frameNumber2pfn(pages[i]);
-            ASSERT(pfnCheck == newpfn);
-        }
+VOID zeroAPage(ULONG64 frameNumber, threadInfo* info) {
+    pageZero(transferMap(info, frameNumber));
+}
+
+VOID copyAPage(ULONG64 fromFrame, ULONG64 toFrame, threadInfo* info) {
+
+    // Both have to be mapped at once, so the second must not be the one that flushes
+    if (info->transferUsed + 2 > TRANSFER_WINDOW_PAGES) {
+        transferFlush(info);
     }
+
+    PVOID to = transferMap(info, toFrame);
+    pageCopy(to, transferMap(info, fromFrame));
 }
 
-VOID
-full_virtual_memory_test (
-    VOID
-    )
-{
-    BOOL allocated;
-    ULONG_PTR physical_page_count;
-    PULONG_PTR physical_page_numbers;
-    //
-    // Allocate the physical pages that we will be managing.
+VOID vmDefaultConfig(vmConfig* config) {
+    config->virtualAddressSize = DEFAULT_VIRTUAL_ADDRESS_SIZE;
+    config->physicalPages = DEFAULT_NUMBER_OF_PHYSICAL_PAGES;
+    config->diskSizeInPages = DEFAULT_DISK_SIZE_IN_PAGES;
+    config->trimBatchSize = DEFAULT_BATCH_SIZE;
+    config->writeBatchSize = DEFAULT_BATCH_SIZE;
+    config->writerThreads = DEFAULT_WRITER_THREADS;
+    config->workerThreads = DEFAULT_WORKER_THREADS;
+    config->fibersPerThread = DEFAULT_FIBERS_PER_THREAD;
+    config->largePages = 0;
+    config->numaNodes = 0;
+    config->addressSpaces = DEFAULT_ADDRESS_SPACES;
+    config->userThreads = DEFAULT_USER_THREADS;
+    config->accessesPerThread = DEFAULT_ACCESSES_PER_THREAD;
+    workloadDefaultConfig(&config->workload);
+    config->statsIntervalMs = DEFAULT_STATS_INTERVAL_MS;
+    config->statsPath = NULL;
+    config->recordPath = NULL;
+    config->replayPath = NULL;
+    config->replayPaced = FALSE;
+    config->mrcSamples = DEFAULT_MRC_SAMPLES;
+    config->poolMinimum = 0;
+    config->poolMaximum = 0;
+    config->snapshotAt = 0;
+}
+
+BOOL validateConfig(const vmConfig* config) {
+    if (config->virtualAddressSize == 0 || config->virtualAddressSize % PAGE_SIZE != 0) {
+        printf ("vmCreate : virtual address size %llu is not a multiple of %u\n",
+                config->virtualAddressSize,
+                PAGE_SIZE);
+        return FALSE;
+    }
+
+    if (config->physicalPages == 0 || config->trimBatchSize == 0 ||
+        config->writeBatchSize == 0 || config->userThreads == 0) {
+        printf ("vmCreate : page, batch and thread counts must all be nonzero\n");
+        return FALSE;
+    }
+
+    if (config->workload.pattern >= WORKLOAD_PATTERNS ||
+        config->workload.zipfSkew < 0 || config->workload.zipfSkew >= 1 ||
+        config->workload.stridePages == 0 || config->workload.hotSetPages == 0 ||
+        config->workload.phaseAccesses == 0 || config->workload.writePercent > 100) {
+        printf ("vmCreate : bad workload - skew must be in [0, 1), writes at most 100%%, the rest nonzero\n");
+        return FALSE;
+    }
+
+    if (config->poolMaximum != 0 &&
+        (config->poolMinimum > config->physicalPages || config->poolMaximum < config->physicalPages)) {
+        printf ("vmCreate : the pool has to start between its minimum and maximum\n");
+        return FALSE;
+    }
+
+    if (config->writerThreads == 0 || config->writerThreads > MAX_WRITER_THREADS) {
+        printf ("vmCreate : between 1 and %u writers\n", MAX_WRITER_THREADS);
+        return FALSE;
+    }
+
+    if (config->workerThreads > MAX_WORKER_THREADS) {
+        printf ("vmCreate : at most %u worker threads\n", MAX_WORKER_THREADS);
+        return FALSE;
+    }
+
+    if (config->fibersPerThread > MAX_FIBERS_PER_THREAD) {
+        printf ("vmCreate : at most %u fibers per thread\n", MAX_FIBERS_PER_THREAD);
+        return FALSE;
+    }
+
+    if (config->largePages > config->physicalPages / LARGE_PAGE_PAGES) {
+        printf ("vmCreate : %llu frames only make %llu large frames\n",
+                config->physicalPages,
+                config->physicalPages / LARGE_PAGE_PAGES);
+        return FALSE;
+    }
+
+    if (config->numaNodes > MAX_NUMA_NODES) {
+        printf ("vmCreate : at most %lu NUMA nodes\n", MAX_NUMA_NODES);
+        return FALSE;
+    }
+
+    if (config->addressSpaces > MAX_ADDRESS_SPACES) {
+        printf ("vmCreate : at most %u address spaces\n", MAX_ADDRESS_SPACES);
+        return FALSE;
+    }
+
+    // A snapshot of each space, and the space their shared pages are kept in
+    if (config->snapshotAt != 0 &&
+        (config->snapshotAt >= config->accessesPerThread || config->addressSpaces * 2 + 1 > MAX_ADDRESS_SPACES)) {
+        printf ("vmCreate : snapshots come before the last access and need room for %u more spaces\n",
+                config->addressSpaces + 1);
+        return FALSE;
+    }
+
     //
-    // First acquire privilege to do this since physical page control
-    // is typically something the operating system reserves the sole
-    // right to do.
+    // Every virtual page has to live somewhere - either in a frame or in
+    // a pagefile slot (slot 0 is reserved) - or the writer can wedge.
+    // Snapshots have as many pages as their sources.
     //
 
-    privilege = GetPrivilege();
+    ULONG64 virtualPages = config->addressSpaces * (config->virtualAddressSize / PAGE_SIZE);
+    if (config->snapshotAt != 0) {
+        virtualPages *= 2;
+    }
 
-    if (privilege == FALSE) {
-        printf ("full_virtual_memory_test : could not get privilege\n");
-        return;
+    if (config->diskSizeInPages < 2 ||
+        config->physicalPages + config->diskSizeInPages - 1 < virtualPages) {
+        printf ("vmCreate : %llu frames plus %llu pagefile slots cannot back %llu virtual pages\n",
+                config->physicalPages,
+                config->diskSizeInPages,
+                virtualPages);
+        return FALSE;
     }
 
-#if SUPPORT_MULTIPLE_VA_TO_SAME_PAGE
+#if VM_COMPACT_PFN
+    if (config->virtualAddressSize / PAGE_SIZE > PFN_PTE_INDEX_LIMIT || config->diskSizeInPages > PFN_DISK_INDEX_LIMIT) {
+        printf ("vmCreate : the compact PFN layout takes at most %lu pages per space and %lu pagefile slots\n",
+                PFN_PTE_INDEX_LIMIT,
+                PFN_DISK_INDEX_LIMIT);
+        return FALSE;
+    }
+#endif
+
+    return TRUE;
+}
+
+vmInstance*
+vmCreate (
+    const vmConfig* config
+    )
+{
+    return vmCreateOn(config, &awePlatform, NULL);
+}
+
+//
+// Build an instance on any platform - the real one, or a simulated one that
+// only models what mapping and I/O would cost.
+//
+vmInstance* vmCreateOn(const vmConfig* config, const vmPlatform* platform, PVOID platformContext) {
+    vmInstance* vm;
+
+    if (validateConfig(config) == FALSE) {
+        return NULL;
+    }
 
-    physical_page_handle = CreateSharedMemorySection();
+    pageKernelInitialize();
 
-    if (physical_page_handle == NULL) {
-        printf ("CreateFileMapping2 failed, error %#x\n", GetLastError ());
-        return;
+    vm = initialize(sizeof(vmInstance));
+    vm->config = *config;
+    vm->platform = platform;
+    vm->platformContext = platformContext;
+
+    if (statsInitialize(&vm->stats, config->statsIntervalMs, config->statsPath) == FALSE) {
+        statsDestroy(&vm->stats);
+        free(vm);
+        return NULL;
     }
 
-#else
+    if (vm->stats.page != NULL) {
+        printf ("vmCreate : statistics every %u ms in %s\n", config->statsIntervalMs, vm->stats.pageName);
+    }
 
-    physical_page_handle = GetCurrentProcess ();
+    ULONG64 created = latencyNow();
+    ULONG64 phase = created;
 
+    if (mrcInitialize(&vm->mrc, config->mrcSamples, config->addressSpaces * (config->virtualAddressSize / PAGE_SIZE)) == FALSE ||
+        platform->allocateFrames(vm) == FALSE) {
+        mrcFree(&vm->mrc);
+        statsDestroy(&vm->stats);
+        free(vm);
+        return NULL;
+    }
+
+#if VM_COMPACT_PFN
+    // Links are 32 bit frame numbers
+    if (vm->pfnLimit > PFN_LINK_NONE) {
+        printf ("vmCreate : frame numbers reach %llu, past what the compact PFN layout can link\n", vm->pfnLimit);
+        platform->freeFrames(vm);
+        mrcFree(&vm->mrc);
+        statsDestroy(&vm->stats);
+        free(vm);
+        return NULL;
+    }
 #endif
 
-    physical_page_count = NUMBER_OF_PHYSICAL_PAGES;
+    // The platform timed its PFN commit, the rest was getting the frames
+    startupPhase(vm, STARTUP_FRAMES, &phase);
+    vm->startup.us[STARTUP_FRAMES] -= min(vm->startup.us[STARTUP_FRAMES], vm->startup.us[STARTUP_PFN]);
+
+    initializeListHeads(vm);
+    initializeListLocks(vm);
+    InitializeCriticalSection(&vm->lockSpaces);
+    InitializeCriticalSection(&vm->lockPrefetch);
+    InitializeCriticalSection(&vm->lockLatency);
+    InitializeCriticalSection(&vm->lockPool);
+    vm->writesInFlight = 0;
+    vm->writesHeld = FALSE;
+    lockProfileName(&vm->lockSpaces, "lockSpaces");
+    lockProfileName(&vm->lockPrefetch, "lockPrefetch");
+    lockProfileName(&vm->lockLatency, "lockLatency");
+    lockProfileName(&vm->lockPool, "lockPool");
+    initializeListHead(&vm->headLatency);
+    vm->retiredLatency = initialize(sizeof(faultLatency));
+    initializeDisk(vm);
+    startupPhase(vm, STARTUP_DISK, &phase);
+
+    buildFreeList(vm);
+    largeFramesInitialize(vm);
+    startupPhase(vm, STARTUP_FREE_LIST, &phase);
+
+    initializeEvents(vm);
+    if (platform->simulated == FALSE) {
+        initializeThreads(vm);
+    }
+    startupPhase(vm, STARTUP_THREADS, &phase);
+
+    SetEvent(vm->eventSystemStart);
+
+    for (ULONG s = 0; s < config->addressSpaces; s++) {
+        if (vmCreateAddressSpace(vm, config->virtualAddressSize, 0, vm->physicalPageCount) == NULL) {
+            vmDestroy(vm);
+            return NULL;
+        }
+    }
+    startupPhase(vm, STARTUP_SPACES, &phase);
 
-    physical_page_numbers = malloc(physical_page_count * sizeof (ULONG_PTR));
-    memset(physical_page_numbers, 0, physical_page_count * sizeof (ULONG_PTR));
+    vm->startup.totalUs = latencyMicroseconds(latencyNow() - created);
+    return vm;
+}
 
-    if (physical_page_numbers == NULL) {
-        printf ("full_virtual_memory_test : could not allocate array to hold physical page numbers\n");
-        return;
+addressSpace*
+vmCreateAddressSpace (
+    vmInstance* vm,
+    ULONG64 virtualAddressSize,
+    ULONG64 wsMinimum,
+    ULONG64 wsMaximum
+    )
+{
+    addressSpace* space;
+    ULONG64 numPtes = virtualAddressSize / PAGE_SIZE;
+    ULONG index;
+
+    if (virtualAddressSize == 0 || virtualAddressSize % PAGE_SIZE != 0 || wsMinimum > wsMaximum ||
+        (VM_COMPACT_PFN && numPtes > PFN_PTE_INDEX_LIMIT)) {
+        printf ("vmCreateAddressSpace : bad size %llu or working set limits\n", virtualAddressSize);
+        return NULL;
     }
 
-    allocated = AllocateUserPhysicalPages (physical_page_handle,
-                                           &physical_page_count,
-                                           physical_page_numbers);
+    acquireLock(&vm->lockSpaces, USER);
 
-    if (allocated == FALSE) {
-        printf ("full_virtual_memory_test : could not allocate physical pages\n");
-        return;
+    for (index = 0; index < MAX_ADDRESS_SPACES; index++) {
+        if (vm->spaces[index] == NULL) {
+            break;
+        }
     }
 
-    if (physical_page_count != NUMBER_OF_PHYSICAL_PAGES) {
+    //
+    // Same rule as validateConfig, across every space the pool backs
+    //
 
-        printf ("full_virtual_memory_test : allocated only %llu pages out of %u pages requested\n",
-                physical_page_count,
-                NUMBER_OF_PHYSICAL_PAGES);
+    if (index == MAX_ADDRESS_SPACES ||
+        vm->totalPtes + numPtes > vm->physicalPageCount + vm->config.diskSizeInPages - 1) {
+        releaseLock(&vm->lockSpaces, USER);
+        printf ("vmCreateAddressSpace : the pool cannot back another %llu virtual pages\n", numPtes);
+        return NULL;
     }
 
+    space = initialize(sizeof(addressSpace));
+    space->vm = vm;
+    space->index = index;
+    space->virtualAddressSize = virtualAddressSize;
+    space->numPtes = numPtes;
+    space->wsMinimum = wsMinimum;
+    space->wsMaximum = wsMaximum;
+
     //
     // Reserve a user address space region using the Windows kernel
     // AWE (address windowing extensions) APIs.
@@ -335,109 +571,445 @@ full_virtual_memory_test (
     // to illustrate how we can manage the illusion.
     //
 
+    space->vaStart = vm->platform->reserve(vm, numPtes);
 
-#if SUPPORT_MULTIPLE_VA_TO_SAME_PAGE
+    if (space->vaStart == NULL) {
+        releaseLock(&vm->lockSpaces, USER);
+        printf ("vmCreateAddressSpace : could not reserve memory %x\n", GetLastError ());
+        free(space);
+        return NULL;
+    }
 
-    MEM_EXTENDED_PARAMETER parameter = { 0 };
+    space->ptes = initializeLazy(numPtes * sizeof(pte));
+    if (vm->largeCapacity != 0) {
+        space->regionActive = initialize((numPtes + LARGE_PAGE_PAGES - 1) / LARGE_PAGE_PAGES * sizeof(USHORT));
+    }
+    InitializeCriticalSection(&space->lockVad);
+    lockProfileName(&space->lockVad, "lockVad");
+
+    acquireLockPTE(vm, NULL, USER);
+    vm->spaces[index] = space;
+    vm->totalPtes += numPtes;
+    releaseLock(&vm->lockPTE, USER);
+
+    releaseLock(&vm->lockSpaces, USER);
+
+    return space;
+}
+
+//
+// Tear down a space and give everything it held back to the pool.  Nobody
+// may be touching it any more.
+//
+VOID vmDestroyAddressSpace(addressSpace* space) {
+    vmInstance* vm = space->vm;
+
+    acquireLock(&vm->lockSpaces, USER);
+
+    cancelPrefetch(space);
+    cancelPromote(space);
+
+    acquireLockPTE(vm, NULL, USER);
+    decommitPtes(space, 0, space->numPtes);
+    vm->spaces[space->index] = NULL;
+    vm->totalPtes -= space->numPtes;
+    releaseLock(&vm->lockPTE, USER);
+
+    releaseLock(&vm->lockSpaces, USER);
+
+    SetEvent(vm->eventRedoFault);
+
+    vm->platform->release(vm, space->vaStart);
+    vadFreeAll(&space->vadRoot);
+    lockProfileForget(&space->lockVad);
+    DeleteCriticalSection(&space->lockVad);
+    freeLazy(space->ptes);
+    free(space->regionActive);
+    free(space);
+}
+
+addressSpace* vmFindAddressSpace(vmInstance* vm, PVOID va) {
+    for (ULONG s = 0; s < MAX_ADDRESS_SPACES; s++) {
+        addressSpace* space = vm->spaces[s];
+
+        if (space != NULL && (ULONG_PTR) va >= (ULONG_PTR) space->vaStart &&
+            (ULONG_PTR) va < (ULONG_PTR) space->vaStart + space->virtualAddressSize) {
+            return space;
+        }
+    }
+    return NULL;
+}
+
+//
+// The built-in test - commit every address space in full and let the user
+// threads loose on them, spread round robin across the spaces.  Each thread
+// runs its own stream of the configured workload, or replays what a thread
+// of a recorded run did on the same space.  Returns FALSE when the trace
+// does not fit this configuration or turns out to be corrupt, or there is
+// nowhere to record to.
+//
+BOOL vmRun(vmInstance* vm, benchResult* result) {
+    ULONG fibers = vm->config.fibersPerThread;
+    ULONG perThread = max(fibers, 1);
+    ULONG threads = vm->config.userThreads * perThread;
+    ULONG spaces = vm->config.addressSpaces;
+    accessRecording* recording = NULL;
+    accessReplay* replay = NULL;
+
+    memset(result, 0, sizeof(benchResult));
+
+    if (vm->config.replayPath != NULL) {
+        replay = accessReplayOpen(vm->config.replayPath);
+        if (replay == NULL) {
+            return FALSE;
+        }
+        if (replay->header.spaces > spaces || replay->header.virtualAddressSize != vm->config.virtualAddressSize) {
+            printf ("vmRun : %s was recorded on %u spaces of %llu bytes\n",
+                    vm->config.replayPath,
+                    replay->header.spaces,
+                    replay->header.virtualAddressSize);
+            accessReplayClose(replay);
+            return FALSE;
+        }
+        threads = replay->header.threads;
+    } else if (vm->config.recordPath != NULL) {
+        recording = accessRecordOpen(vm->config.recordPath, threads, spaces, vm->config.virtualAddressSize);
+        if (recording == NULL) {
+            printf ("vmRun : could not record to %s\n", vm->config.recordPath);
+            return FALSE;
+        }
+    }
 
     //
-    // Allocate a MEM_PHYSICAL region that is "connected" to the AWE section
-    // created above.
+    // With fibers a thread runs fibersPerThread users' accesses instead of
+    // one, so there are that many times as many of them
     //
+    ULONG osThreads = (threads + perThread - 1) / perThread;
+    HANDLE* threadsUser = initialize(osThreads * sizeof(HANDLE));
+    userFibers* groups = initialize(osThreads * sizeof(userFibers));
+    threadInfo** info = initialize(threads * sizeof(threadInfo*));
+    workloadStream* streams = initialize(threads * sizeof(workloadStream));
+    workloadShape shape;
+
+    for (ULONG s = 0; s < spaces; s++) {
+        addressSpace* space = vm->spaces[s];
+        PVOID region = vmReserve(space, space->vaStart, space->virtualAddressSize);
+        ASSERT(region == space->vaStart);
+        BOOL b = vmCommit(space, region, space->virtualAddressSize);
+        ASSERT(b);
+    }
 
-    parameter.Type = MemExtendedParameterUserPhysicalHandle;
-    parameter.Handle = physical_page_handle;
+    // Every space is the same size, so the threads share one shape
+    workloadPrepare(&shape, &vm->config.workload, vm->spaces[0]->numPtes);
 
-    activeCount = 0;
+    //
+    // Each OS thread goes on a node in turn, with all of its fibers, and
+    // takes its frames from there
+    //
+    for (ULONG i = 0; i < threads; i++) {
+        info[i] = vmAttachThread(vm);
+        info[i]->node = (i / perThread) % vm->nodeCount;
+        if (replay != NULL) {
+            info[i]->reader = accessReplayThread(replay, i);
+            info[i]->space = vm->spaces[info[i]->reader->space];
+            continue;
+        }
+        info[i]->space = vm->spaces[i % spaces];
+        info[i]->stream = &streams[i];
+        workloadStart(&streams[i], &shape, i, threads);
+        if (recording != NULL) {
+            info[i]->recorder = accessRecordThread(recording, i, i % spaces);
+        }
+    }
 
-    diskTransferVa = VirtualAlloc2 (NULL,
-                       NULL,
-                       BATCH_SIZE * PAGE_SIZE,
-                       MEM_RESERVE | MEM_PHYSICAL,
-                       PAGE_READWRITE,
-                       &parameter,
-                       1);
+    ULONG64 start = GetTickCount64();
 
-    vaStart = VirtualAlloc2 (NULL,
-                       NULL,
-                       VIRTUAL_ADDRESS_SIZE,
-                       MEM_RESERVE | MEM_PHYSICAL,
-                       PAGE_READWRITE,
-                       &parameter,
-                       1);
+    for (ULONG t = 0; t < osThreads; t++) {
+        if (fibers == 0) {
+            threadsUser[t] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) threadUser, info[t], 0, NULL);
+        } else {
+            groups[t].info = info + t * fibers;
+            groups[t].count = min(fibers, threads - t * fibers);
+            threadsUser[t] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) threadUserFibers, &groups[t], 0, NULL);
+        }
+        if (vm->nodeCount != 1) {
+            numaPinThread(threadsUser[t], t % vm->nodeCount);
+        }
+    }
 
+    //
+    // Snapshot every space once the threads are snapshotAt accesses in on
+    // average, and let them carry on past it
+    //
+    addressSpace** snapshots = initialize(spaces * sizeof(addressSpace*));
+    if (vm->config.snapshotAt != 0 && replay == NULL) {
+        ULONG64 issued;
+
+        do {
+            Sleep(1);
+            issued = 0;
+            // Written by the user threads as they go, so each one is read afresh
+            for (ULONG i = 0; i < threads; i++) {
+                issued += (ULONG64) InterlockedOr64((volatile LONG64*) &streams[i].issued, 0);
+            }
+        } while (issued < vm->config.snapshotAt * threads);
 
-#else
+        for (ULONG s = 0; s < spaces; s++) {
+            snapshots[s] = vmSnapshot(vm->spaces[s]);
+        }
+    }
 
-    vaStart = VirtualAlloc (NULL,
-                      virtual_address_size,
-                      MEM_RESERVE | MEM_PHYSICAL,
-                      PAGE_READWRITE);
+    for (ULONG j = 0; j < osThreads; j++) {
+        WaitForSingleObject (threadsUser[j], INFINITE);
+        CloseHandle (threadsUser[j]);
+    }
+    for (ULONG i = 0; i < threads; i++) {
+        vmDetachThread(info[i]);
+    }
 
-#endif
+    result->elapsedMs = GetTickCount64() - start;
+    if (fibers != 0) {
+        for (ULONG t = 0; t < osThreads; t++) {
+            result->fiberSwitches += groups[t].pool.switches;
+            result->fiberParks += groups[t].pool.parks;
+        }
+    }
+    for (ULONG i = 0; i < threads; i++) {
+        if (replay != NULL) {
+            result->accesses += replay->threads[i].issued;
+            result->writes += replay->threads[i].writes;
+        } else {
+            result->accesses += streams[i].issued;
+            result->writes += streams[i].writes;
+        }
+    }
+    result->reads = result->accesses - result->writes;
+    result->hardFaults = statsRead(&vm->stats, STAT_HARD_FAULTS);
+    result->softFaults = statsRead(&vm->stats, STAT_MODIFIED_RESCUES) + statsRead(&vm->stats, STAT_STANDBY_RESCUES);
+    result->demandZeroFaults = statsRead(&vm->stats, STAT_DEMAND_ZERO_FAULTS);
+    result->largeFaults = statsRead(&vm->stats, STAT_LARGE_FAULTS);
+    result->largePromotions = statsRead(&vm->stats, STAT_LARGE_PROMOTIONS);
+    result->largeDemotions = statsRead(&vm->stats, STAT_LARGE_DEMOTIONS);
+    result->localFaults = statsRead(&vm->stats, STAT_LOCAL_FAULTS);
+    result->remoteFaults = statsRead(&vm->stats, STAT_REMOTE_FAULTS);
+    result->snapshotPages = statsRead(&vm->stats, STAT_SNAPSHOT_PAGES);
+    result->sharedFaults = statsRead(&vm->stats, STAT_SHARED_FAULTS);
+    result->sharedCopies = statsRead(&vm->stats, STAT_SHARED_COPIES);
+
+    faultLatency* latency = initialize(sizeof(faultLatency));
+    vmGetFaultLatency(vm, latency);
+    for (ULONG k = 0; k < FAULT_KINDS; k++) {
+        latencySummarize(&latency->kinds[k], &result->faultKinds[k]);
+    }
+    for (ULONG p = 0; p < FAULT_PHASES; p++) {
+        latencySummarize(&latency->phases[p], &result->faultPhases[p]);
+    }
+    free(latency);
+    result->mrcReferences = mrcCurve(&vm->mrc, vm->physicalPageCount, result->mrc);
+    result->startup = vm->startup;
+
+    for (ULONG k = 0; k < FAULT_KINDS; k++) {
+        latencySummary* summary = &result->faultKinds[k];
+        if (summary->count != 0) {
+            printf ("vmRun : %-10s faults %10llu  p50 %8llu ns  p99 %8llu ns  p99.9 %8llu ns\n",
+                    latencyKindName(k),
+                    summary->count,
+                    summary->p50,
+                    summary->p99,
+                    summary->p999);
+        }
+    }
 
-    if (vaStart == NULL) {
+    printf ("vmRun : finished %llu %s accesses in %llu ms - %llu hard, %llu soft and %llu demand zero faults\n",
+            result->accesses,
+            replay != NULL ? "replayed" : workloadPatternName(vm->config.workload.pattern),
+            result->elapsedMs,
+            result->hardFaults,
+            result->softFaults,
+            result->demandZeroFaults);
 
-        printf ("full_virtual_memory_test : could not reserve memory %x\n",
-                GetLastError ());
+    //
+    // Only faults reach the curve here, and pages that stay resident
+    // between trims are missed in between, so it errs on the low side
+    //
+    mrcPrint("vmRun", result->mrc, result->mrcReferences);
 
-        return;
+    for (ULONG s = 0; s < spaces; s++) {
+        addressSpace* space = vm->spaces[s];
+        printf ("vmRun : space %u ended with %lld resident pages\n", s, space->activeCount);
+        vmRelease(space, space->vaStart);
     }
 
-    ULONG64 numBytes = VIRTUAL_ADDRESS_SIZE / PAGE_SIZE * sizeof(pte);
+    // What the sources gave up is the snapshots' alone now
+    for (ULONG s = 0; s < spaces; s++) {
+        if (snapshots[s] != NULL) {
+            vmDestroyAddressSpace(snapshots[s]);
+        }
+    }
 
-    ptes = initialize(numBytes);
+    for (ULONG p = 0; p < STANDBY_PRIORITIES; p++) {
+        if (vm->standbyAdded[p] == 0) {
+            continue;
+        }
+        printf ("vmRun : standby priority %u - %lld added, %lld rescued (%llu%%), %lld repurposed\n",
+                p,
+                vm->standbyAdded[p],
+                vm->standbyRescued[p],
+                (ULONG64) vm->standbyRescued[p] * 100 / vm->standbyAdded[p],
+                vm->standbyRepurposed[p]);
+    }
 
-    initializeListHeads();
-    initializeListLocks();
-    commitSparseArray(physical_page_numbers);
-    initializeDisk();
+    if (vm->nodeCount != 1) {
+        printf ("vmRun : %u nodes - %llu local and %llu remote faults\n",
+                vm->nodeCount,
+                result->localFaults,
+                result->remoteFaults);
+    }
+
+    if (result->snapshotPages != 0) {
+        printf ("vmRun : snapshots shared %llu pages - %llu faults on them, %llu of which copied the page\n",
+                result->snapshotPages,
+                result->sharedFaults,
+                result->sharedCopies);
+    }
 
-    initializeThreads();
-    initializeEvents();
+    if (vm->largeCapacity != 0) {
+        printf ("vmRun : %llu large frames - %llu taken by faults, %llu by promotions, %llu demoted\n",
+                vm->largeCapacity,
+                result->largeFaults,
+                result->largePromotions,
+                result->largeDemotions);
+    }
 
-    // Initialize free list with all pages
-    for (int j = 0; j < NUMBER_OF_PHYSICAL_PAGES; j++) {
-        pfn* free = pfnStart + physical_page_numbers[j];
-        linkAdd(free, &headFreeList);
-        free->pte = 0;
-        free->diskIndex = 0;
-        free->status = 0;
+    if (fibers != 0) {
+        printf ("vmRun : %u fibers on %u threads parked %llu times on reads and were switched to %llu times\n",
+                threads,
+                osThreads,
+                result->fiberParks,
+                result->fiberSwitches);
     }
 
-    g_lock_debug_buffer.head = 0;
-    g_lock_debug_buffer.count = 0;
+    if (vm->sched.count != 0) {
+        ULONG64 run;
+        ULONG64 stolen;
+        ULONG64 helped;
+
+        schedulerCounts(&vm->sched, &run, &stolen, &helped);
+        printf ("vmRun : %u workers ran %llu background tasks, %llu of them stolen, and faulting threads ran %llu\n",
+                vm->sched.count,
+                run,
+                stolen,
+                helped);
+    }
+
+    BOOL replayed = TRUE;
+    if (replay != NULL) {
+        if (accessReplayCorrupt(replay)) {
+            printf ("vmRun : rejected %s, it is corrupt\n", vm->config.replayPath);
+            replayed = FALSE;
+        }
+        accessReplayClose(replay);
+    }
+    if (recording != NULL && accessRecordClose(recording)) {
+        printf ("vmRun : recorded the accesses to %s\n", vm->config.recordPath);
+    }
 
-    SetEvent(eventSystemStart);
+    free(snapshots);
+    free(threadsUser);
+    free(groups);
+    free(info);
+    free(streams);
+    return replayed;
+}
 
-    SetEvent(eventStartUser);
+VOID vmDestroy(vmInstance* vm) {
 
-    for (int j = 0; j < THREADS; j++) {
-        WaitForSingleObject (threadsUser[j], INFINITE);
+    // The prototypes go last, once nobody shares them
+    for (ULONG s = 0; s < MAX_ADDRESS_SPACES; s++) {
+        if (vm->spaces[s] != NULL && vm->spaces[s] != vm->protoSpace) {
+            vmDestroyAddressSpace(vm->spaces[s]);
+        }
     }
+    protoSpaceFree(vm);
+
+    SetEvent(vm->eventSystemShutdown);
 
-    SetEvent(eventSystemShutdown);
+    if (vm->threadStats != NULL) {
+        WaitForSingleObject (vm->threadStats, INFINITE);
+        CloseHandle (vm->threadStats);
+    }
 
-    WaitForSingleObject (threadTrim, INFINITE);
+    // The pool thread signals the trimmer, so it goes before the workers
+    if (vm->threadPool != NULL) {
+        WaitForSingleObject (vm->threadPool, INFINITE);
+        CloseHandle (vm->threadPool);
+    }
 
-    WaitForSingleObject (threadDiskWrite, INFINITE);
+    if (vm->platform->simulated == FALSE) {
+        schedulerStop(&vm->sched);
+        trimmerStop(vm);
+        writersStop(vm);
+        prefetchStop(vm);
+        readerStop(vm);
+        promoteStop(vm);
+    }
 
-    printf ("full_virtual_memory_test : finished accessing %llu random virtual addresses\n", pagesActivated);
+    CloseHandle (vm->eventRedoFault);
+    CloseHandle (vm->eventSystemStart);
+    CloseHandle (vm->eventSystemShutdown);
 
     //
     // Now that we're done with our memory we can be a good
     // citizen and free it.
     //
 
-    VirtualFree (vaStart, 0, MEM_RELEASE);
-    for (int i = 0; i < THREADS; i++) {
-        VirtualFree (info[i].transferVa, 0, MEM_RELEASE);
+    vm->platform->freeFrames(vm);
+    largeFramesFree(vm);
+
+    lockProfileForget(&vm->lockFreeList);
+    lockProfileForget(&vm->lockModifiedList);
+    lockProfileForget(&vm->lockStandbyList);
+    lockProfileForget(&vm->lockPTE);
+    lockProfileForget(&vm->lockSpaces);
+    lockProfileForget(&vm->lockPrefetch);
+    lockProfileForget(&vm->lockLatency);
+    lockProfileForget(&vm->lockPool);
+
+    DeleteCriticalSection(&vm->lockFreeList);
+    DeleteCriticalSection(&vm->lockModifiedList);
+    DeleteCriticalSection(&vm->lockStandbyList);
+    DeleteCriticalSection(&vm->lockPTE);
+    DeleteCriticalSection(&vm->lockSpaces);
+    DeleteCriticalSection(&vm->lockPrefetch);
+    DeleteCriticalSection(&vm->lockLatency);
+    DeleteCriticalSection(&vm->lockPool);
+
+    freeLazy(vm->disk);
+    freeLazy(vm->isFull);
+    free(vm->retiredLatency);
+    statsDestroy(&vm->stats);
+    mrcFree(&vm->mrc);
+    free(vm);
+}
+
+BOOL
+full_virtual_memory_test (
+    const vmConfig* config,
+    benchResult* result
+    )
+{
+    vmInstance* vm;
+
+    vm = vmCreate(config);
+
+    if (vm == NULL) {
+        printf ("full_virtual_memory_test : could not create the instance\n");
+        return FALSE;
     }
-    VirtualFree (diskTransferVa, 0, MEM_RELEASE);
-    VirtualFree (pfnStart, 0, MEM_RELEASE);
 
-    free(disk);
-    free(isFull);
-    free(ptes);
-    return;
-}
\ No newline at end of file
+    BOOL ran = vmRun(vm, result);
+
+    vmDestroy(vm);
+
+    return ran;
+}
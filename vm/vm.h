@@ -11,6 +11,13 @@
 #define VM_H
 
 #include <windows.h>
+#include "../vad/vad.h"
+#include "../latency/latency.h"
+#include "../bench/workload.h"
+#include "../stats/stats.h"
+#include "../replay/accessTrace.h"
+#include "../mrc/mrc.h"
+#include "../sched/sched.h"
 
 //
 // This define enables code that lets us create multiple virtual address
@@ -31,36 +38,140 @@
 #define MB(x)                       ((x) * 1024 * 1024)
 
 //
-// This is intentionally a power of two so we can use masking to stay
-// within bounds.
+// VM_COMPACT_PFN 1 packs a PFN entry into 16 bytes instead of 32 - list
+// links are 32 bit frame numbers rather than a LIST_ENTRY, the PTE is a
+// space and index rather than a pointer and the pagefile slot is narrower.
+// Half the PFN database then fits in the cache, at the cost of limits :
+// frame numbers below 2^32, PFN_PTE_INDEX_LIMIT virtual pages per space
+// and PFN_DISK_INDEX_LIMIT pagefile slots.
 //
+#ifndef VM_COMPACT_PFN
+#define VM_COMPACT_PFN              0
+#endif
 
- #define VIRTUAL_ADDRESS_SIZE        MB(16)
-// #define VIRTUAL_ADDRESS_SIZE          16 * PAGE_SIZE
+#define PFN_LINK_NONE               0xFFFFFFFF
+#define PFN_PTE_INDEX_BITS          26
+#define PFN_PTE_INDEX_LIMIT         ((1UL << PFN_PTE_INDEX_BITS) - 1)
+#define PFN_PTE_NONE                0xFFFFFFFF
+#define PFN_DISK_INDEX_BITS         23
+#define PFN_DISK_INDEX_LIMIT        (1UL << PFN_DISK_INDEX_BITS)
 
-#define VIRTUAL_ADDRESS_SIZE_IN_UNSIGNED_CHUNKS        (VIRTUAL_ADDRESS_SIZE / sizeof (ULONG_PTR))
+//
+// Frames are spread over up to MAX_NUMA_NODES nodes, each with its own free
+// and standby lists, and every PFN entry says which node its frame is on.
+// Hosts with more nodes than that only use the first MAX_NUMA_NODES.
+//
+#define PFN_NODE_BITS               2
+#define MAX_NUMA_NODES              (1UL << PFN_NODE_BITS)
 
 //
-// Deliberately use a physical page pool that is approximately 1% of the
+// Everything below is only a default - the real sizes come from the
+// vmConfig handed to vmCreate so one binary can run (and host) any number
+// of differently sized instances.
+//
+// The virtual address size is intentionally a power of two by default so
+// the hot paths can use masking to stay within bounds.
+//
+
+#define DEFAULT_VIRTUAL_ADDRESS_SIZE        MB(16)
+
+//
+// Deliberately use a physical page pool that is a small fraction of the
 // virtual address space !
 //
 
-#define NUMBER_OF_PHYSICAL_PAGES   (VIRTUAL_ADDRESS_SIZE / (2 * PAGE_SIZE))
+#define DEFAULT_PHYSICAL_TO_VIRTUAL_RATIO   2
+#define DEFAULT_NUMBER_OF_PHYSICAL_PAGES    (DEFAULT_VIRTUAL_ADDRESS_SIZE / (DEFAULT_PHYSICAL_TO_VIRTUAL_RATIO * PAGE_SIZE))
+
+// The pagefile defaults to one slot per virtual page so it can never fill up
+#define DEFAULT_DISK_SIZE_IN_PAGES          (DEFAULT_VIRTUAL_ADDRESS_SIZE / PAGE_SIZE)
+
+#define DEFAULT_BATCH_SIZE                  10
+
+//
+// Each thread zeroes and reads pages through a window of this many pages.
+// A frame is mapped into the next free slot and left there, and only when
+// the window is full is all of it unmapped with one call - so filling a
+// page costs one mapping call instead of a map and an unmap.
+//
+#define TRANSFER_WINDOW_PAGES               64
+
+//
+// The modified writer is a pipeline of three stages - one claims pages
+// and maps them, one copies them to their slots and one puts them on
+// standby - passing batches along in this many transfer buffers, so
+// mapping one batch overlaps copying the one before it.  A batch is the
+// modified list spread over the buffers, between writeBatchSize and
+// WRITE_BATCH_SCALE times that.
+//
+#define WRITE_BUFFERS                       4
+#define WRITE_BATCH_SCALE                   8
+
+//
+// Up to writerThreads of those pipelines run at once.  The first is always
+// there, each one after it wakes once the backlog is another WRITE_BUFFERS
+// batches deep and the one before has every buffer in flight, and goes
+// back to sleep once the backlog is shallower again.
+//
+#define DEFAULT_WRITER_THREADS              4
+#define MAX_WRITER_THREADS                  16
 
-#define DISK_DIVISIONS              8
+//
+// A large frame is LARGE_PAGE_PAGES frames with consecutive numbers, the
+// first a multiple of LARGE_PAGE_PAGES, mapped at one 2MB region of a
+// space - LARGE_PAGE_PAGES PTEs whose first index is a multiple of it.
+// Regions that fill up wait in a queue of this many to be promoted.
+//
+#define LARGE_PAGE_PAGES                    512
+#define LARGE_PAGE_SIZE                     (LARGE_PAGE_PAGES * PAGE_SIZE)
+#define PROMOTE_QUEUE_SIZE                  64
 
-// For 8 disk divisions, each division is 504
-#define DISK_SIZE_IN_BYTES          (VIRTUAL_ADDRESS_SIZE - PAGE_SIZE * NUMBER_OF_PHYSICAL_PAGES + PAGE_SIZE)
-#define DISK_SIZE_IN_PAGES          (DISK_SIZE_IN_BYTES / PAGE_SIZE)
-#define DISK_DIVISION_SIZE_IN_PAGES (DISK_SIZE_IN_PAGES / DISK_DIVISIONS)
+#define DEFAULT_USER_THREADS                8
+#define DEFAULT_ACCESSES_PER_THREAD         MB(1)
+#define DEFAULT_ADDRESS_SPACES              1
 
-#define BATCH_SIZE                  10
+// Tenants that can share one physical pool
+#define MAX_ADDRESS_SPACES                  64
 
 #define FREE                        1
 #define ACTIVE                      2
 #define MODIFIED                    3
 #define STANDBY                     4
 
+//
+// On no list while a fault reads it in with the PTE lock dropped - the PTE
+// is already in transition pointing at it.  See readInFlight in pt/pt.c.
+// A large frame being zeroed or copied into is the same, with no slot.
+//
+#define READING                     5
+
+//
+// A frame of a free large frame, on no list.  See large/large.h.
+//
+#define LARGE_FREE                  6
+
+//
+// Standby priorities, after Windows' eight standby lists.  Repurposing takes
+// from the lowest non-empty list first, so the pages least likely to be
+// wanted again go first.  Priorities 0 and 7 are left unused.
+//
+#define STANDBY_PRIORITIES          8
+
+#define STANDBY_PRIORITY_DISCARDED  1   // VM_ADVISE_FREE
+#define STANDBY_PRIORITY_READ_AHEAD 2   // Speculative sequential read-ahead
+#define STANDBY_PRIORITY_SEQUENTIAL 3   // Trimmed from a sequential range
+#define STANDBY_PRIORITY_NORMAL     5   // Trimmed
+#define STANDBY_PRIORITY_WILLNEED   6   // Prefetched for VM_ADVISE_WILLNEED
+
+//
+// Prefetching - a hard fault in a sequential range queues this many pages
+// past it to be read ahead, and WILLNEED and read-ahead requests wait in a
+// ring of PREFETCH_QUEUE_SIZE for the prefetch task.  Anything beyond that
+// is dropped.
+//
+#define READ_AHEAD_PAGES            8
+#define PREFETCH_QUEUE_SIZE         64
+
 #define TRANSITION                  1
 #define DISK                        0
 
@@ -72,8 +183,7 @@
 
 #define REDO                        1
 #define SUCCESS                     0
-
-#define THREADS                     8
+#define ACCESS_VIOLATION            2
 
 //
 // PTE structures
@@ -96,69 +206,356 @@ typedef struct {
     ULONG64 diskIndex: FRAME_NUMBER_SIZE;
 } diskPTE;
 
+//
+// Every PTE of a region mapped by a large frame.  Each is still a valid PTE
+// with a frame number of its own, the large frame's first plus its index
+// in the region, so code that looks at one PTE at a time carries on as
+// before - the large bit says the region is mapped, trimmed and split as
+// one, see large/large.h.
+//
+typedef struct {
+    ULONG64 valid: 1;
+    ULONG64 zero: 1;
+    ULONG64 frameNumber: FRAME_NUMBER_SIZE;
+    ULONG64 large: 1;
+} largePTE;
+
+//
+// A PTE sharing its page with a snapshot's or its source's.  Whatever is
+// behind the page - a frame in transition or a pagefile slot - is kept by
+// the prototype PTE at protoIndex, see snap/snap.h.
+//
+typedef struct {
+    ULONG64 invalid: 1;             // Always 0
+    ULONG64 disk: 1;                // Always 0
+    ULONG64 protoIndex: FRAME_NUMBER_SIZE;
+    ULONG64 shared: 1;
+} sharedPTE;
+
 typedef struct {
     union {
         validPTE valid;
+        largePTE large;
+        sharedPTE shared;
         transitionPTE transition;
         diskPTE disk;
         ULONG64 zero;
     };
 } pte;
 
+//
+// The free list of a new instance is built by up to STARTUP_MAX_THREADS
+// threads, each given at least STARTUP_SEGMENT_PAGES frames
+//
+#define STARTUP_SEGMENT_PAGES       65536
+#define STARTUP_MAX_THREADS         64
+
+typedef struct _vmInstance vmInstance;
+typedef struct _addressSpace addressSpace;
+typedef struct _vmPlatform vmPlatform;
+typedef struct _writePipeline writePipeline;
+typedef struct _pageRead pageRead;
+
+typedef struct {
+    addressSpace* space;
+    ULONG64 startPage;
+    ULONG64 endPage;
+    ULONG priority;                 // Standby priority the pages are read in at
+} pageRange;
+
 typedef struct {
     ULONG index;
-    PVOID transferVa;
+    PVOID transferVa;               // TRANSFER_WINDOW_PAGES long
+    ULONG transferUsed;             // Slots mapped since the window was last unmapped
+    vmInstance* vm;
+    addressSpace* space;            // The space the built-in test thread works on
+    workloadStream* stream;         // And the accesses it makes there
+    accessRecorder* recorder;       // Where they are recorded, if anywhere
+    accessReader* reader;           // Or where they come from instead of the stream
+    faultLatency* latency;
+    ULONG node;                     // Frames come from this NUMA node first
 } threadInfo;
 
 //
 // PFN structure
 //
+#if VM_COMPACT_PFN
+
+typedef struct {
+    ULONG flink;                    // Frame numbers, PFN_LINK_NONE at either end
+    ULONG blink;
+    ULONG pte;                      // Space index above PFN_PTE_INDEX_BITS, PFN_PTE_NONE for none
+    ULONG diskIndex: PFN_DISK_INDEX_BITS;
+    ULONG status: 3;
+    ULONG priority: 3;
+    ULONG writing: 1;               // Claimed by the writer, off the modified list
+    ULONG node: PFN_NODE_BITS;
+} pfn;
+
+// Lists run from first to last, the list a page is on follows from its status
+typedef struct {
+    ULONG first;
+    ULONG last;
+} pfnListHead;
+
+C_ASSERT(sizeof(pfn) == 16);
+
+#else
+
 typedef struct {
     LIST_ENTRY entry;
     pte* pte;
     ULONG64 diskIndex: FRAME_NUMBER_SIZE;
     ULONG64 status: 3; // Modified is 0; Standby is 1
+    ULONG64 priority: 3; // Standby list the page goes on, set on the way to standby
+    ULONG64 writing: 1; // Claimed by the writer and off the modified list, still MODIFIED
+    ULONG64 node: PFN_NODE_BITS; // NUMA node the frame is on, it never changes
 } pfn;
 
-//
-// Global variables (extern declarations)
-//
-extern pte* ptes;
-extern pfn* pfnStart;
-extern PULONG_PTR vaStart;
-extern PVOID transferVa;
-extern PVOID diskTransferVa;
+typedef LIST_ENTRY pfnListHead;
 
-extern LONG64 activeCount;
-extern LONG64 pagesActivated;
+#endif
 
-extern HANDLE physical_page_handle;
-extern BOOL privilege;
+//
+// Runtime configuration of a single instance
+//
+typedef struct {
+    ULONG64 virtualAddressSize;     // In bytes, a multiple of PAGE_SIZE, per address space
+    ULONG64 physicalPages;
+    ULONG64 diskSizeInPages;        // Slot 0 is reserved so usable slots are one less
+    ULONG64 trimBatchSize;
+    ULONG64 writeBatchSize;
+    ULONG writerThreads;            // Most modified writers running at once
+    ULONG workerThreads;            // Run the background tasks, 0 for one per processor
+    ULONG fibersPerThread;          // Fibers each vmRun thread runs its accesses on, 0 for none
+    ULONG64 largePages;             // Large frames set aside at startup, 0 for none
+    ULONG numaNodes;                // Nodes to spread the pool over, 0 for all the host has
+    ULONG addressSpaces;            // Created up front by vmCreate, more can be added later
+    ULONG userThreads;              // Only used by the built-in test (vmRun)
+    ULONG64 accessesPerThread;
+    workloadConfig workload;
+    ULONG statsIntervalMs;          // Sampler period, 0 turns it off
+    const char* statsPath;          // Sampler rows, CSV if it ends in .csv, otherwise JSON lines
+    const char* recordPath;         // Access trace of the built-in test, see replay/accessTrace.h
+    const char* replayPath;         // Run a recorded trace instead of the workload
+    BOOL replayPaced;               // Keep the recorded gaps between accesses
+    ULONG mrcSamples;               // Pages the miss ratio curve tracks at most, 0 turns it off
+    ULONG64 poolMinimum;            // Frames the pool can be shrunk to under host memory pressure
+    ULONG64 poolMaximum;            // And grown to without it, 0 leaves the pool alone
+    ULONG64 snapshotAt;             // Accesses per thread before vmRun snapshots each space, 0 for never
+} vmConfig;
 
 //
-// Threads
+// One tenant - its own VA region, page table and reservations, plus the
+// working set limits the trimmer enforces against the shared pool.
 //
-extern HANDLE threadTrim;
-extern HANDLE threadDiskWrite;
-extern HANDLE threadsUser[THREADS];
+struct _addressSpace {
+    vmInstance* vm;
+    ULONG index;
+
+    ULONG64 virtualAddressSize;
+    ULONG64 numPtes;
+
+    pte* ptes;
+    PULONG_PTR vaStart;
+
+    //
+    // Reservations.  The tree is only changed while holding both lockVad
+    // and the pool's lockPTE, so the fault path can read it under lockPTE
+    // alone.
+    //
+    vad* vadRoot;
+    CRITICAL_SECTION lockVad;
+
+    //
+    // Working set.  Spaces are never trimmed below wsMinimum while another
+    // space is above its own, and anything over wsMaximum goes first.
+    //
+    ULONG64 wsMinimum;
+    ULONG64 wsMaximum;
+    LONG64 activeCount;
+
+    //
+    // Fault rate, sampled by the trimmer (which owns everything below)
+    //
+    volatile LONG64 faults;
+    LONG64 faultsAtLastSample;
+    ULONG64 faultRate;              // Faults per second, smoothed
+    ULONG64 trimIndex;              // Where the trimmer's scan left off
+
+    // Valid PTEs in each region, NULL when the pool has no large frames
+    USHORT* regionActive;
+};
 
 //
-// Events
+// Everything one virtual memory instance owns - the physical pool and the
+// address spaces backed by it.  Nothing in here is shared between instances
+// so a process can host as many of them as it likes.
 //
-extern HANDLE eventStartTrim;
-extern HANDLE eventStartDiskWrite;
-extern HANDLE eventRedoFault;
-extern HANDLE eventSystemStart;
-extern HANDLE eventSystemShutdown;
-extern HANDLE eventStartUser;
+struct _vmInstance {
+    vmConfig config;
+    startupTimes startup;
+
+    const vmPlatform* platform;
+    PVOID platformContext;          // Owned by the platform
+
+    pfn* pfnStart;
+    ULONG64 pfnLimit;               // Frame numbers the PFN database has room for
+    PVOID diskTransferVa;           // The writer's WRITE_BUFFERS transfer buffers
+
+    //
+    // The frames in the pool.  Only resizing changes them, under lockPool.
+    //
+    HANDLE physical_page_handle;
+    PULONG_PTR physicalPageNumbers;
+    ULONG64 physicalPageCount;
+    CRITICAL_SECTION lockPool;
+
+    //
+    // Batches the writers have claimed and not yet published.  A frame in
+    // one can be rescued, freed and taken for the host before its copy has
+    // run, so giving frames back holds off new batches (writesHeld, set
+    // under lockPTE) and waits for this to drain.
+    //
+    volatile LONG writesInFlight;
+    volatile BOOL writesHeld;
+
+    //
+    // Fault, list and writer counters, sharded per thread
+    //
+    vmStats stats;
+
+    //
+    // Miss ratio curve of the faults, see mrc/mrc.h
+    //
+    mrcTracker mrc;
+
+    //
+    // Fault latency of attached threads, and what detached ones left behind
+    //
+    LIST_ENTRY headLatency;
+    faultLatency* retiredLatency;
+    CRITICAL_SECTION lockLatency;
+    volatile LONG nextThreadIndex;
+
+    //
+    // Address spaces, only added or removed with lockSpaces and lockPTE
+    // held so the trimmer can walk them under lockPTE
+    //
+    addressSpace* spaces[MAX_ADDRESS_SPACES];
+    ULONG64 totalPtes;              // Virtual pages across all spaces
+    CRITICAL_SECTION lockSpaces;
+
+    //
+    // Lists and their locks
+    //
+    pfnListHead headFreeList[MAX_NUMA_NODES];
+    pfnListHead headModifiedList;
+    pfnListHead headStandbyList[MAX_NUMA_NODES][STANDBY_PRIORITIES];
+    ULONG nodeCount;                // NUMA nodes the frames came from, set by allocateFrames
+
+    CRITICAL_SECTION lockFreeList;
+    CRITICAL_SECTION lockModifiedList;
+    CRITICAL_SECTION lockStandbyList;
+    CRITICAL_SECTION lockPTE;
+
+    //
+    // How standby pages of each priority ended up - rescued by a fault or
+    // repurposed for another page
+    //
+    volatile LONG64 standbyAdded[STANDBY_PRIORITIES];
+    volatile LONG64 standbyRescued[STANDBY_PRIORITIES];
+    volatile LONG64 standbyRepurposed[STANDBY_PRIORITIES];
+
+    //
+    // Backing store
+    //
+    PVOID disk;
+    boolean* isFull;
+    ULONG64 diskIndex;
+    volatile LONG64 numFreeDiskSlots;
+
+    //
+    // Background work - trimming, writing and prefetching are tasks on
+    // the scheduler's workers, see sched/sched.h
+    //
+    scheduler sched;
+    task taskTrim;
+    task taskPrefetch;
+    task taskRead;                  // Reads pages in for faulting fibers, see disk/disk.h
+    pageRead* volatile reads;
+    writePipeline* writers;         // config.writerThreads of them
+    volatile LONG writersActive;
+    HANDLE threadStats;             // NULL when the sampler is off
+    HANDLE threadPool;              // NULL unless the pool follows memory pressure
+
+    //
+    // Asynchronous page-in requests, a ring drained by the prefetch task
+    //
+    pageRange prefetchQueue[PREFETCH_QUEUE_SIZE];
+    ULONG64 prefetchHead;
+    ULONG64 prefetchTail;
+    addressSpace* prefetchSpace;    // The space a dequeued request is being read into
+    CRITICAL_SECTION lockPrefetch;
+
+    //
+    // Large frames, all taken out of the pool at startup.  The frames of a
+    // free one are LARGE_FREE and on no list.  The free ones, the split
+    // ones and the regions queued to be promoted are under the PTE lock.
+    //
+    ULONG64* largeFrames;           // First frame of each free one
+    ULONG64 largeFree;
+    ULONG64* largeSplit;            // First frame of each one split into small pages
+    ULONG64 largeSplitCount;
+    BOOL largeWanted;               // A large fault found none free
+    ULONG64 largeCapacity;
+    task taskPromote;
+    pageRange promoteQueue[PROMOTE_QUEUE_SIZE];
+    ULONG64 promoteHead;
+    ULONG64 promoteTail;
+    addressSpace* promoteSpace;     // The space a dequeued region is being copied in
+
+    //
+    // Prototype PTEs of the pages snapshots share, in a space of their own
+    // that is never mapped - created by the first snapshot.  Under the PTE
+    // lock.
+    //
+    addressSpace* protoSpace;
+    LONG* protoRefs;                // PTEs sharing each one
+    ULONG64* protoFree;             // Indexes given back, a stack
+    ULONG64 protoFreeCount;
+    ULONG64 protoNext;              // None above this was ever used
+
+    //
+    // Events
+    //
+    HANDLE eventRedoFault;
+    HANDLE eventSystemStart;
+    HANDLE eventSystemShutdown;
+};
 
 //
 // Function declarations
 //
 BOOL GetPrivilege(VOID);
 PVOID initialize(ULONG64 numBytes);
+PVOID initializeLazy(ULONG64 numBytes);
+VOID freeLazy(PVOID p);
+PVOID reserveAweRegion(vmInstance* vm, ULONG64 numPages);
 VOID zeroAPage(ULONG64 frameNumber, threadInfo* info);
-VOID full_virtual_memory_test(VOID);
+VOID copyAPage(ULONG64 fromFrame, ULONG64 toFrame, threadInfo* info);
+PVOID transferMap(threadInfo* info, ULONG64 frameNumber);
+VOID transferFlush(threadInfo* info);
+
+VOID vmDefaultConfig(vmConfig* config);
+vmInstance* vmCreate(const vmConfig* config);
+vmInstance* vmCreateOn(const vmConfig* config, const vmPlatform* platform, PVOID platformContext);
+addressSpace* vmCreateAddressSpace(vmInstance* vm, ULONG64 virtualAddressSize, ULONG64 wsMinimum, ULONG64 wsMaximum);
+VOID vmDestroyAddressSpace(addressSpace* space);
+addressSpace* vmFindAddressSpace(vmInstance* vm, PVOID va);
+BOOL vmRun(vmInstance* vm, benchResult* result);
+VOID vmDestroy(vmInstance* vm);
+BOOL full_virtual_memory_test(const vmConfig* config, benchResult* result);
 
 #if SUPPORT_MULTIPLE_VA_TO_SAME_PAGE
 HANDLE CreateSharedMemorySection(VOID);